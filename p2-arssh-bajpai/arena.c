@@ -0,0 +1,96 @@
+#include "arena.h"
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Alignment of every allocation, enough for any type
+#define ARENA_ALIGN alignof(max_align_t)
+
+// Allocate from the current chunk, moving on to the next one (or a new one) when it is full
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_chunk_t *chunk = arena->current;
+    if (chunk && chunk->size - arena->used >= size) {
+        void *p = chunk->data + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    // Reuse the chunk after this one, kept from before the last release, if it is big enough
+    arena_chunk_t *next = chunk ? chunk->next : arena->first;
+    if (!next || next->size < size) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        arena_chunk_t *fresh = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!fresh) return NULL;
+        fresh->size = chunk_size;
+        fresh->next = next;
+        if (chunk) {
+            chunk->next = fresh;
+        } else {
+            arena->first = fresh;
+        }
+        next = fresh;
+    }
+    arena->current = next;
+    arena->used = size;
+    return next->data;
+}
+
+// Copy a string of known length into the arena
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Remember where the arena stands
+arena_mark_t arena_mark(arena_t *arena) {
+    return (arena_mark_t){arena->current, arena->used};
+}
+
+// Go back to a mark; chunks past it stay linked for reuse
+void arena_release(arena_t *arena, arena_mark_t mark) {
+    arena->current = mark.chunk;
+    arena->used = mark.used;
+}
+
+// Free every chunk
+void arena_free(arena_t *arena) {
+    arena_chunk_t *chunk = arena->first;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = (arena_t){0};
+}
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+// Free a thread's arena when the thread exits
+static void thread_arena_destroy(void *arena) {
+    arena_free(arena);
+    free(arena);
+}
+
+static void thread_key_create() {
+    pthread_key_create(&thread_key, thread_arena_destroy);
+}
+
+// The calling thread's arena, created on first use
+arena_t *arena_thread() {
+    pthread_once(&thread_key_once, thread_key_create);
+    arena_t *arena = pthread_getspecific(thread_key);
+    if (!arena) {
+        arena = calloc(1, sizeof(arena_t));
+        if (arena && pthread_setspecific(thread_key, arena) != 0) {
+            free(arena);
+            arena = NULL;
+        }
+    }
+    return arena;
+}
@@ -0,0 +1,98 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK (64 * 1024)  /**< Default size of the chunks an arena carves allocations from. */
+
+/**
+ * @brief One chunk of memory owned by an arena.
+ */
+typedef struct arena_chunk {
+    struct arena_chunk *next;  /**< The next chunk (after a release, chunks past the current one are kept for reuse). */
+    size_t size;               /**< Bytes available in `data`. */
+    char data[];               /**< The memory handed out by arena_alloc(). */
+} arena_chunk_t;
+
+/**
+ * @brief A bump allocator for short-lived memory, such as what one request builds.
+ *
+ * Allocations are carved one after another from large chunks and are never freed one by one:
+ * everything allocated since a mark (see arena_mark()) is released at once. Chunks are kept
+ * across releases, so once an arena has grown to what its requests need, allocating from it
+ * costs a pointer bump and no call to malloc(). A zeroed arena_t is a valid, empty arena.
+ */
+typedef struct arena {
+    arena_chunk_t *first;    /**< The first chunk, or NULL if nothing was ever allocated. */
+    arena_chunk_t *current;  /**< The chunk allocations are carved from, or NULL before the first. */
+    size_t used;             /**< Bytes of `current` already handed out. */
+} arena_t;
+
+/**
+ * @brief A position in an arena, to release back to.
+ */
+typedef struct arena_mark {
+    arena_chunk_t *chunk;  /**< The arena's current chunk when the mark was taken. */
+    size_t used;           /**< Bytes of that chunk in use when the mark was taken. */
+} arena_mark_t;
+
+/**
+ * @brief Allocates memory from an arena.
+ *
+ * The memory is aligned for any type and is not zeroed. It stays valid until the arena is
+ * released to a mark taken before this call, or freed.
+ *
+ * @param arena The arena.
+ * @param size The number of bytes wanted.
+ * @return A pointer to the memory, or NULL if a new chunk was needed and could not be allocated.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Copies `len` bytes of a string into an arena, adding a NUL terminator.
+ *
+ * @param arena The arena.
+ * @param str The string (need not be NUL-terminated).
+ * @param len The number of bytes to copy.
+ * @return The copy, or NULL if memory ran out.
+ */
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+/**
+ * @brief Remembers the arena's current position.
+ *
+ * @param arena The arena.
+ * @return A mark to pass to arena_release().
+ */
+arena_mark_t arena_mark(arena_t *arena);
+
+/**
+ * @brief Releases everything allocated from an arena since a mark was taken.
+ *
+ * Marks nest: releasing to a mark also discards any mark taken after it. The memory is kept
+ * for later allocations.
+ *
+ * @param arena The arena.
+ * @param mark A mark returned by arena_mark() on this arena.
+ */
+void arena_release(arena_t *arena, arena_mark_t mark);
+
+/**
+ * @brief Returns all of an arena's memory to the system, leaving it empty.
+ *
+ * @param arena The arena.
+ */
+void arena_free(arena_t *arena);
+
+/**
+ * @brief Returns the calling thread's arena.
+ *
+ * Each thread (e.g., each FUSE worker) has its own, created on first use and freed when the
+ * thread exits, so request handlers can build temporary results without locking or malloc().
+ * Whoever takes memory from it releases it (see arena_mark()) before the request ends.
+ *
+ * @return The thread's arena, or NULL if it could not be created.
+ */
+arena_t *arena_thread();
+
+#endif
@@ -1,7 +1,13 @@
 #include "bitmap.h"
 #include <stdint.h>
+#include <string.h>
 #include <stdio.h> // For printf
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+#endif
+
 // Get the value of a specific bit in the bitmap
 int bitmap_get(void *bm, int i) {
     uint8_t *base = (uint8_t *)bm;
@@ -23,14 +29,87 @@ void bitmap_put(void *bm, int i, int v) {
 
 // Find the first unused (0) bit in the bitmap
 int bitmap_first_unused(void *bm, int size) {
-    for (int i = 0; i < size; i++) {
+    return bitmap_next_unused(bm, 0, size);
+}
+
+// Find the first unused (0) bit at or after 'start', skipping full bytes at a time
+int bitmap_next_unused(void *bm, int start, int size) {
+    uint8_t *base = (uint8_t *)bm;
+    int i = start < 0 ? 0 : start;
+    while (i < size) {
+        if (i % 8 == 0 && base[i / 8] == 0xff) {
+            i += 8; // Whole byte in use
+            continue;
+        }
         if (!bitmap_get(bm, i)) {
-            return i; // Return index of first free bit
+            return i;
         }
+        i++;
     }
     return -1; // No free bits
 }
 
+#ifdef BITMAP_HAVE_AVX2
+// Count the bits set in 'len' bytes, 32 at a time: each nibble is looked up in a table
+// of bit counts with a shuffle, and the byte counts are summed with a SAD against zero
+__attribute__((target("avx2")))
+static long count_bytes_avx2(const uint8_t *p, size_t len) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                         _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    long n = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+             _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    for (; i < len; i++) {
+        n += __builtin_popcount(p[i]);
+    }
+    return n;
+}
+#endif
+
+// Count the bits set in 'len' bytes, 8 at a time
+static long count_bytes(const uint8_t *p, size_t len) {
+    long n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        n += __builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        n += __builtin_popcount(p[i]);
+    }
+    return n;
+}
+
+// Count the set bits among the first 'size'
+long bitmap_count(void *bm, int size) {
+    const uint8_t *base = (const uint8_t *)bm;
+    size_t bytes = size / 8;
+    long n;
+#ifdef BITMAP_HAVE_AVX2
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) {
+        __builtin_cpu_init();
+        use_avx2 = __builtin_cpu_supports("avx2");
+    }
+    n = use_avx2 ? count_bytes_avx2(base, bytes) : count_bytes(base, bytes);
+#else
+    n = count_bytes(base, bytes);
+#endif
+    if (size % 8) {
+        n += __builtin_popcount(base[bytes] & ((1 << (size % 8)) - 1)); // Bits of the last, partial byte
+    }
+    return n;
+}
+
 // Print the bitmap bits for debugging
 void bitmap_print(void *bm, int size) {
     for (int i = 0; i < size; i++) {
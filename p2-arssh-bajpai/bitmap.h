@@ -36,6 +36,29 @@ void bitmap_put(void *bm, int i, int v);
  */
 int bitmap_first_unused(void *bm, int size);
 
+/**
+ * @brief Finds the first unused (clear) bit at or after a given index.
+ *
+ * Fully used bytes are skipped whole, so scanning a mostly full bitmap is fast.
+ *
+ * @param bm A pointer to the bitmap array.
+ * @param start The index to start searching from.
+ * @param size The number of bits in the bitmap.
+ * @return The index of the first unused bit at or after `start`, or a negative value if none is.
+ */
+int bitmap_next_unused(void *bm, int start, int size);
+
+/**
+ * @brief Counts the set bits in the first `size` bits of the bitmap.
+ *
+ * Uses AVX2 where the CPU has it (32 bytes per step), and 64-bit popcounts otherwise.
+ *
+ * @param bm A pointer to the bitmap array.
+ * @param size The number of bits to count.
+ * @return The number of bits set.
+ */
+long bitmap_count(void *bm, int size);
+
 /**
  * @brief Prints the bitmap to standard output.
  *
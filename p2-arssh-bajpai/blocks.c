@@ -1,43 +1,302 @@
 #include "blocks.h"
 #include "bitmap.h"
+#include "crc32c.h"
+#include "inode.h"
+#include "journal.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "ioengine.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 
-// Global pointers to in-memory block data and bitmap
+// Number of blocks needed to hold `bytes` bytes
+#define BLOCKS_FOR(bytes) (((bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// Entries per block of the reference count and checksum tables
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE / (int)sizeof(uint32_t))
+
+// The resident area of the image (superblock, bitmap, inode table and journal),
+// held in memory for as long as the image is open. Everything past it is cached.
 static void *block_data = NULL;
+static size_t resident_len = 0;
 static void *block_bitmap = NULL;
 
-// Set up in-memory storage for all blocks and the block bitmap
-void blocks_init(const char *path) {
-    (void)path; // The path is not used in this simple implementation
+// In-memory bitmap of blocks whose stored checksum does not describe their on-disk
+// contents: blocks allocated in this session are stale until they are first written.
+static uint8_t *csum_stale = NULL;
+
+// In-memory bitmap of blocks freed by the running transaction, which alloc_block()
+// leaves alone until the transaction commits (see blocks_committed()). The bits
+// set all lie in [freed_lo, freed_hi); freed_count of them are set.
+static uint8_t *freed_pending = NULL;
+static int freed_lo = INT_MAX, freed_hi = 0;
+static int freed_count = 0;
+
+// The data area is split into allocation groups of ALLOC_GROUP_BLOCKS blocks (by block
+// number, so group 0 also holds the metadata area), each with its own search cursor and free
+// count. The counts are taken from the bitmap on first use, after the journal is replayed.
+typedef struct alloc_group {
+    int cursor;    // Where the next search in the group starts
+    int free;      // Blocks clear in the bitmap (including ones freed by the running transaction)
+    int trimmed;   // No block freed since blocks_trim_group() last released the free ones
+} alloc_group_t;
+static alloc_group_t *groups = NULL;
+static int group_count = 0;
+
+// The group of the last allocation (see blocks_alloc_cursor())
+static int last_group = 0;
 
-    // Allocate memory for all blocks and the bitmap
-    block_data = malloc(BLOCK_COUNT * BLOCK_SIZE);
-    block_bitmap = malloc(BLOCK_COUNT / 8); // One bit per block
+// Each thread's home group, where blocks without a goal go, handed out round-robin
+static __thread int home_group = -1;
+static atomic_int homes_given = 0;
 
-    if (!block_data || !block_bitmap) {
-        perror("Failed to allocate block data or bitmap");
+// When freed blocks are released from the image file, and what has been released
+static discard_mode_t discard_mode = DISCARD_OFF;
+static blocks_discard_stats_t discard_stats;
+static int (*discard_io)(io_request_t *reqs, int count) = NULL; // See blocks_set_discard_submit()
+
+// Runs of free blocks gathered to be released with one submission
+typedef struct discard_batch {
+    io_request_t reqs[IOENGINE_DEPTH];
+    int count;
+} discard_batch_t;
+
+// Number of checksum mismatches seen since startup
+static atomic_long csum_errors = 0;
+
+// Compute where each metadata region starts for an image of 'count' blocks
+void blocks_layout(superblock_t *sb, uint32_t count) {
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->block_count = count;
+    uint32_t inodes = count / INODE_RATIO; // One inode per INODE_RATIO blocks, within limits
+    sb->inode_count = inodes < INODE_COUNT ? INODE_COUNT : inodes > INODE_MAX ? INODE_MAX : inodes;
+    sb->bitmap_start = 1;
+    sb->inode_start = sb->bitmap_start + BLOCKS_FOR((count + 7) / 8);
+    sb->journal_start = sb->inode_start + inode_table_blocks(sb->inode_count);
+    uint32_t journal = count / 64; // 1/64 of the image, within limits
+    journal = journal < JOURNAL_MIN_BLOCKS ? JOURNAL_MIN_BLOCKS : journal > JOURNAL_BLOCKS ? JOURNAL_BLOCKS : journal;
+    sb->refs_start = sb->journal_start + journal;
+    sb->csum_start = sb->refs_start + BLOCKS_FOR((size_t)count * sizeof(uint32_t));
+    sb->data_start = sb->csum_start + BLOCKS_FOR((size_t)count * sizeof(uint32_t));
+    sb->free_blocks = count > sb->data_start ? count - sb->data_start : 0;
+    sb->free_inodes = sb->inode_count;
+}
+
+// Set up the block cache; the resident area is allocated once the image size is known
+void blocks_init(size_t cache_size) {
+    if (cache_init(cache_size ? cache_size : CACHE_SIZE) < 0) {
+        fprintf(stderr, "Failed to allocate block cache\n");
         exit(1);
     }
+}
+
+// Allocate the resident area and the stale and freed bitmaps for an image described by 'sb'.
+// The resident area is aligned for O_DIRECT and starts out zeroed.
+static int blocks_alloc_resident(const superblock_t *sb) {
+    resident_len = (size_t)sb->refs_start * BLOCK_SIZE;
+    block_data = bufpool_alloc_region(resident_len);
+    csum_stale = calloc((sb->block_count + 7) / 8, 1);
+    freed_pending = calloc((sb->block_count + 7) / 8, 1);
+    freed_lo = INT_MAX;
+    freed_hi = 0;
+    freed_count = 0;
+    if (!block_data || !csum_stale || !freed_pending) {
+        blocks_free();
+        return -ENOMEM;
+    }
+    block_bitmap = (char *)block_data + (size_t)sb->bitmap_start * BLOCK_SIZE;
+    return 0;
+}
+
+// Read the superblock and, if it is ours, the rest of the resident area
+int blocks_load() {
+    superblock_t *sb = bufpool_get();
+    if (!sb) return -ENOMEM;
+    ssize_t got = ioengine_pread(sb, BLOCK_SIZE, 0);
+
+    superblock_t expected;
+    blocks_layout(&expected, sb->block_count);
+    int ours = got == BLOCK_SIZE && sb->magic == NUFS_MAGIC;
+    int valid = ours && sb->block_count > expected.data_start && sb->block_count <= INT_MAX &&
+                memcmp(sb, &expected, offsetof(superblock_t, free_blocks)) == 0;
+    uint32_t version = sb->version;
+    size_t unit;
+    int files = ioengine_stripe(&unit);
+    uint32_t stripe_count = sb->stripe_count, stripe_unit = sb->stripe_unit;
+    bufpool_put(sb);
+    if (!ours) {
+        printf("[INFO] No nufs superblock found\n");
+        return 0;
+    }
+    if (!valid) {
+        // A damaged (or newer) image: formatting it would lose everything on it
+        fprintf(stderr, "[ERROR] The superblock (version %u) does not match the version %d layout; "
+                        "check the image with fsck.nufs\n", version, NUFS_VERSION);
+        return -EUCLEAN;
+    }
+    if (stripe_count != (uint32_t)files || stripe_unit == 0) {
+        fprintf(stderr, "[ERROR] The image is striped across %u files, not %d\n", stripe_count, files);
+        return -EINVAL;
+    }
+    if ((size_t)stripe_unit * BLOCK_SIZE != unit) {
+        ioengine_set_stripe_unit((size_t)stripe_unit * BLOCK_SIZE);
+    }
+
+    if (blocks_alloc_resident(&expected) < 0) return -ENOMEM;
+    if (ioengine_pread(block_data, resident_len, 0) != (ssize_t)resident_len) {
+        blocks_free();
+        return -EIO;
+    }
+    printf("[INFO] Loaded image of %u blocks (%zu KiB resident)\n", expected.block_count, resident_len >> 10);
+    return 1;
+}
+
+// Lay out a new image of 'block_count' blocks and mark the metadata area as in use
+int blocks_format(uint32_t block_count) {
+    superblock_t layout;
+    blocks_layout(&layout, block_count);
+    if (block_count <= layout.data_start || block_count > INT_MAX) {
+        return -EINVAL;
+    }
+
+    blocks_free();
+    if (blocks_alloc_resident(&layout) < 0) return -ENOMEM;
+    cache_reset(); // Nothing cached describes the new image
 
-    // Initialize blocks and bitmap to zero
-    memset(block_data, 0, BLOCK_COUNT * BLOCK_SIZE);
-    memset(block_bitmap, 0, BLOCK_COUNT / 8);
+    size_t unit;
+    layout.stripe_count = ioengine_stripe(&unit);
+    layout.stripe_unit = unit / BLOCK_SIZE;
+    layout.tier_id = 0; // No fast tier until storage_init() attaches one
+    *get_superblock() = layout;
+    for (uint32_t i = 0; i < layout.data_start; i++) {
+        bitmap_put(block_bitmap, i, 1);
+    }
+    printf("[INFO] Formatted image of %u blocks\n", block_count);
+    return 0;
+}
+
+// Number of blocks in the resident area
+int blocks_resident_count() {
+    return resident_len / BLOCK_SIZE;
+}
+
+// Return the superblock at the start of block 0
+superblock_t *get_superblock() {
+    return (superblock_t *)block_data;
+}
+
+// Verify a data block that has just been read from the image, if its checksum is meaningful.
+// A block that fails is not handed out: its pin is taken back, the cache forgets it, and the
+// caller gets NULL.
+static void *verify_loaded(int block_num, void *data, int loaded, int op_pin) {
+    if (loaded && block_num >= (int)get_superblock()->data_start &&
+        bitmap_get(block_bitmap, block_num) && blocks_csum_tracked(block_num) &&
+        blocks_csum_verify(block_num, data) < 0) {
+        cache_forget(block_num, op_pin);
+        return NULL;
+    }
+    return data;
+}
+
+// Whether a block number is within the open image
+static int in_image(int block_num) {
+    return block_data && block_num >= 0 && block_num < (int)get_superblock()->block_count;
+}
+
+// Whether a block number is past the resident area but within the image
+static int is_cached(int block_num) {
+    return in_image(block_num) && block_num >= (int)(resident_len / BLOCK_SIZE);
 }
 
 // Return a pointer to the start of the given block number
 void *blocks_get_block(int block_num) {
-    if (block_num < 0 || block_num >= BLOCK_COUNT) {
+    if (!in_image(block_num)) {
         return NULL; // Invalid block number
     }
-    return (char *)block_data + block_num * BLOCK_SIZE;
+    if (!is_cached(block_num)) {
+        return (char *)block_data + (size_t)block_num * BLOCK_SIZE;
+    }
+    int loaded;
+    void *data = cache_pin_op(block_num, &loaded);
+    return verify_loaded(block_num, data, loaded, 1);
+}
+
+// Return a block that is about to be overwritten, without verifying what it held
+void *blocks_overwrite(int block_num) {
+    if (!in_image(block_num)) {
+        return NULL;
+    }
+    if (!is_cached(block_num)) {
+        return (char *)block_data + (size_t)block_num * BLOCK_SIZE;
+    }
+    return cache_pin_op_new(block_num);
 }
 
-// Free the in-memory blocks and bitmap
+// Pin a block until blocks_unpin()
+void *blocks_pin(int block_num) {
+    if (!in_image(block_num)) {
+        return NULL;
+    }
+    if (!is_cached(block_num)) {
+        return (char *)block_data + (size_t)block_num * BLOCK_SIZE;
+    }
+    int loaded;
+    void *data = cache_pin(block_num, &loaded);
+    return verify_loaded(block_num, data, loaded, 0);
+}
+
+// Release a pin taken with blocks_pin()
+void blocks_unpin(int block_num) {
+    if (is_cached(block_num)) {
+        cache_unpin(block_num);
+    }
+}
+
+// Release the pins taken by blocks_get_block() during the current operation
+void blocks_release() {
+    cache_release_op();
+}
+
+// Read the cached blocks among 'block_nums' ahead of use
+void blocks_prefetch(const int *block_nums, int count) {
+    int wanted[IOENGINE_DEPTH];
+    int n = 0;
+    for (int i = 0; i < count && n < IOENGINE_DEPTH; i++) {
+        if (is_cached(block_nums[i])) {
+            wanted[n++] = block_nums[i];
+        }
+    }
+    cache_prefetch(wanted, n);
+}
+
+// Return the block number holding the given address
+int blocks_block_of(const void *ptr) {
+    ptrdiff_t off = (const char *)ptr - (const char *)block_data;
+    if (block_data && off >= 0 && off < (ptrdiff_t)resident_len) {
+        return off / BLOCK_SIZE;
+    }
+    return cache_block_of(ptr);
+}
+
+// Free the resident area and the stale and freed bitmaps
 void blocks_free() {
-    free(block_data);
-    free(block_bitmap);
+    bufpool_free_region(block_data, resident_len);
+    free(csum_stale);
+    free(freed_pending);
+    free(groups);
+    freed_pending = NULL;
+    groups = NULL;
+    group_count = 0;
+    memset(&discard_stats, 0, sizeof(discard_stats));
+    block_data = NULL;
+    resident_len = 0;
+    block_bitmap = NULL;
+    csum_stale = NULL;
 }
 
 // Get the block allocation bitmap
@@ -45,12 +304,337 @@ void *get_blocks_bitmap() {
     return block_bitmap;
 }
 
-// Allocate a free block by finding the first unused bit in the bitmap
-int alloc_block() {
-    int block_num = bitmap_first_unused(block_bitmap, BLOCK_COUNT);
+// Pin the table block holding entry 'block_num' of the uint32_t table starting at
+// 'table_start', and return a pointer to the entry. The caller unpins *table_block.
+static uint32_t *table_entry(uint32_t table_start, int block_num, int *table_block) {
+    *table_block = table_start + block_num / ENTRIES_PER_BLOCK;
+    uint32_t *entries = blocks_pin(*table_block);
+    return &entries[block_num % ENTRIES_PER_BLOCK];
+}
+
+// Add the bitmap and reference count blocks describing block_num to the running transaction
+static void blocks_journal_entry(int block_num) {
+    superblock_t *sb = get_superblock();
+    journal_dirty(sb->bitmap_start + block_num / 8 / BLOCK_SIZE);
+    journal_dirty(sb->refs_start + block_num / ENTRIES_PER_BLOCK);
+}
+
+// Whether block_num is a data block of the open image
+static int is_data_block(int block_num) {
+    superblock_t *sb = get_superblock();
+    return block_num >= (int)sb->data_start && block_num < (int)sb->block_count;
+}
+
+// First block in [start, end) that is free and was not freed by the running transaction
+static int next_allocatable(int start, int end) {
+    while (start < end) {
+        int block_num = bitmap_next_unused(block_bitmap, start, end);
+        if (block_num < 0 || !bitmap_get(freed_pending, block_num)) return block_num;
+        start = block_num + 1;
+    }
+    return -1;
+}
+
+// Count the free blocks of each allocation group, if that hasn't been done for this image
+static int groups_ready() {
+    if (groups) return 1;
+    superblock_t *sb = get_superblock();
+    int n = (sb->block_count + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    groups = calloc(n, sizeof(alloc_group_t));
+    if (!groups) return 0;
+    for (int g = 0; g < n; g++) {
+        int first = g * ALLOC_GROUP_BLOCKS;
+        int size = (int)sb->block_count - first;
+        if (size > ALLOC_GROUP_BLOCKS) size = ALLOC_GROUP_BLOCKS;
+        groups[g].free = size - bitmap_count((uint8_t *)block_bitmap + first / 8, size);
+        groups[g].cursor = first > (int)sb->data_start ? first : (int)sb->data_start;
+    }
+    group_count = n;
+    last_group = 0;
+    return 1;
+}
+
+// First allocatable block of group g, searching from 'from' to the group's end and then
+// from its start
+static int group_search(int g, int from) {
+    superblock_t *sb = get_superblock();
+    int first = g * ALLOC_GROUP_BLOCKS, end = first + ALLOC_GROUP_BLOCKS;
+    if (first < (int)sb->data_start) first = sb->data_start;
+    if (end > (int)sb->block_count) end = sb->block_count;
+    if (from < first || from >= end) from = first;
+    int block_num = next_allocatable(from, end);
+    return block_num >= 0 ? block_num : next_allocatable(first, from);
+}
+
+// Search every group with free blocks, starting with g at 'from'
+static int groups_search(int g, int from) {
+    for (int i = 0; i < group_count; i++) {
+        int gg = (g + i) % group_count;
+        if (groups[gg].free == 0) continue; // Full: not even a bitmap word to look at
+        int block_num = group_search(gg, i == 0 ? from : groups[gg].cursor);
+        if (block_num >= 0) return block_num;
+    }
+    return -1;
+}
+
+// Allocate a free block near 'goal', or in the calling thread's home group
+int alloc_block_near(int goal) {
+    superblock_t *sb = get_superblock();
+    if (!groups_ready()) return -1;
+    int g, from;
+    if (is_data_block(goal)) {
+        g = goal / ALLOC_GROUP_BLOCKS;
+        from = goal;
+    } else {
+        if (home_group < 0 || home_group >= group_count) {
+            home_group = atomic_fetch_add(&homes_given, 1) % group_count;
+        }
+        g = home_group;
+        from = groups[g].cursor;
+    }
+    int block_num = groups_search(g, from);
     if (block_num < 0) {
         return -1; // No free blocks available
     }
+    g = block_num / ALLOC_GROUP_BLOCKS;
+    if (!is_data_block(goal)) home_group = g; // Moves on once its group has filled up
+    groups[g].cursor = block_num + 1;
+    groups[g].free--;
+    last_group = g;
+
+    blocks_journal_entry(block_num); // Pins the reference count block until the commit
     bitmap_put(block_bitmap, block_num, 1); // Mark block as allocated
+    bitmap_put(csum_stale, block_num, 1);   // Nothing on disk for it yet
+    blocks_adjust_free(-1, 0);
+    int refs_block;
+    *table_entry(sb->refs_start, block_num, &refs_block) = 1; // Owned by the caller alone
+    blocks_unpin(refs_block);
     return block_num;
 }
+
+// Allocate a free block in the calling thread's home group
+int alloc_block() {
+    return alloc_block_near(0);
+}
+
+// Where the next search in the group of the last allocation starts
+int blocks_alloc_cursor() {
+    return groups ? groups[last_group].cursor : (int)get_superblock()->data_start;
+}
+
+// Whether no block in [first, first + count) holds data anyone still needs
+int blocks_range_free(int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        if (bitmap_get(block_bitmap, i) || bitmap_get(freed_pending, i)) return 0;
+    }
+    return 1;
+}
+
+// Adjust the free counts in the superblock, which goes into the running transaction with them
+void blocks_adjust_free(int blocks, int inodes) {
+    superblock_t *sb = get_superblock();
+    journal_dirty(0);
+    sb->free_blocks += blocks;
+    sb->free_inodes += inodes;
+}
+
+// Share an allocated block with one more owner
+void ref_block(int block_num) {
+    if (!is_data_block(block_num)) return;
+    blocks_journal_entry(block_num);
+    int refs_block;
+    (*table_entry(get_superblock()->refs_start, block_num, &refs_block))++;
+    blocks_unpin(refs_block);
+}
+
+// Drop one owner of a block, returning it to the free pool after the last one
+void free_block(int block_num) {
+    if (!is_data_block(block_num)) return;
+    int refs_block;
+    uint32_t *refs = table_entry(get_superblock()->refs_start, block_num, &refs_block);
+    if (*refs > 0) {
+        blocks_journal_entry(block_num);
+        if (--*refs == 0) {
+            if (groups_ready()) groups[block_num / ALLOC_GROUP_BLOCKS].free++; // Counted before the bit clears
+            bitmap_put(block_bitmap, block_num, 0);
+            bitmap_put(freed_pending, block_num, 1);
+            freed_count++;
+            blocks_adjust_free(1, 0);
+            if (block_num < freed_lo) freed_lo = block_num;
+            if (block_num >= freed_hi) freed_hi = block_num + 1;
+        }
+    }
+    blocks_unpin(refs_block);
+}
+
+// Release the runs gathered so far from the image file. A file system that can't punch holes
+// turns discarding off rather than failing every commit.
+static void discard_submit(discard_batch_t *batch) {
+    if (batch->count == 0 || discard_mode == DISCARD_OFF) {
+        batch->count = 0;
+        return;
+    }
+    int rv = discard_io ? discard_io(batch->reqs, batch->count)
+                        : ioengine_submit_routed(batch->reqs, batch->count, IO_ROUTE_UNTRACKED);
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->reqs[i].result < 0) {
+            discard_stats.errors++;
+        } else {
+            discard_stats.extents++;
+            discard_stats.blocks += batch->reqs[i].len / BLOCK_SIZE;
+        }
+    }
+    if (rv == -EOPNOTSUPP || rv == -EINVAL) {
+        fprintf(stderr, "[ERROR] Can't punch holes in the image (%s); freed blocks are no longer discarded\n",
+                strerror(-rv));
+        discard_mode = DISCARD_OFF;
+    }
+    batch->count = 0;
+}
+
+// Add blocks [first, first + count) to a batch, extending the last run if they follow it
+static void discard_add(discard_batch_t *batch, int first, int count) {
+    off_t offset = (off_t)first * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    if (batch->count > 0) {
+        io_request_t *last = &batch->reqs[batch->count - 1];
+        if (last->offset + (off_t)last->len == offset) {
+            last->len += len;
+            return;
+        }
+    }
+    if (batch->count == IOENGINE_DEPTH) discard_submit(batch);
+    batch->reqs[batch->count++] = (io_request_t){IO_DISCARD, NULL, len, offset, 0};
+}
+
+// Choose when freed blocks are released from the image file
+void blocks_set_discard(discard_mode_t mode) {
+    discard_mode = mode;
+}
+
+// Choose what sends discard batches to the I/O engine
+void blocks_set_discard_submit(int (*submit)(io_request_t *reqs, int count)) {
+    discard_io = submit;
+}
+
+// Number of allocation groups in the open image
+int blocks_group_count() {
+    return groups_ready() ? group_count : 0;
+}
+
+// Release the free blocks of a group from the image file, unless none was freed since the last time
+long blocks_trim_group(int group) {
+    if (discard_mode == DISCARD_OFF || !groups_ready() || group < 0 || group >= group_count) return 0;
+    if (groups[group].trimmed) return 0;
+    superblock_t *sb = get_superblock();
+    int first = group * ALLOC_GROUP_BLOCKS, end = first + ALLOC_GROUP_BLOCKS;
+    if (first < (int)sb->data_start) first = sb->data_start;
+    if (end > (int)sb->block_count) end = sb->block_count;
+
+    // Blocks freed by the running transaction still hold committed data; their commit marks
+    // the group again
+    discard_batch_t batch = {.count = 0};
+    long before = discard_stats.blocks;
+    for (int i = first; (i = next_allocatable(i, end)) >= 0;) {
+        int run = i;
+        while (i < end && !bitmap_get(block_bitmap, i) && !bitmap_get(freed_pending, i)) i++;
+        discard_add(&batch, run, i - run);
+    }
+    discard_submit(&batch);
+    groups[group].trimmed = 1;
+    discard_stats.groups++;
+    return discard_stats.blocks - before;
+}
+
+// Copy out what has been released so far
+void blocks_get_discard_stats(blocks_discard_stats_t *stats) {
+    *stats = discard_stats;
+}
+
+// The blocks freed so far are free on disk too, so they may be handed out again. With
+// DISCARD_ON_FREE they are released from the image file first (nothing can reuse them before
+// this returns); otherwise their groups are left for the next trim.
+void blocks_committed() {
+    if (!freed_pending || freed_lo >= freed_hi) return;
+    discard_batch_t batch = {.count = 0};
+    for (int i = freed_lo; i < freed_hi;) {
+        if (freed_pending[i / 8] == 0) {
+            i = (i / 8 + 1) * 8; // Nothing freed in this byte
+            continue;
+        }
+        if (!bitmap_get(freed_pending, i)) {
+            i++;
+            continue;
+        }
+        int run = i;
+        while (i < freed_hi && bitmap_get(freed_pending, i)) i++;
+        if (discard_mode == DISCARD_ON_FREE) {
+            discard_add(&batch, run, i - run);
+        } else if (groups) {
+            for (int g = run / ALLOC_GROUP_BLOCKS; g <= (i - 1) / ALLOC_GROUP_BLOCKS; g++) groups[g].trimmed = 0;
+        }
+    }
+    discard_submit(&batch);
+
+    int first = freed_lo / 8, last = (freed_hi - 1) / 8;
+    memset(freed_pending + first, 0, last - first + 1);
+    freed_lo = INT_MAX;
+    freed_hi = 0;
+    freed_count = 0;
+}
+
+// Free blocks not waiting for the running transaction to commit
+int blocks_allocatable() {
+    return (int)get_superblock()->free_blocks - freed_count;
+}
+
+// Number of owners of a block (metadata blocks have exactly one, the file system)
+int block_refs(int block_num) {
+    if (!in_image(block_num)) return 0;
+    if (!is_data_block(block_num)) return 1;
+    int refs_block;
+    int refs = *table_entry(get_superblock()->refs_start, block_num, &refs_block);
+    blocks_unpin(refs_block);
+    return refs;
+}
+
+// Record the checksum of a block's current in-memory contents
+void blocks_csum_update(int block_num) {
+    int csum_block;
+    uint32_t *csum = table_entry(get_superblock()->csum_start, block_num, &csum_block);
+    *csum = crc32c(0, blocks_pin(block_num), BLOCK_SIZE);
+    blocks_unpin(block_num);
+    blocks_unpin(csum_block);
+    bitmap_put(csum_stale, block_num, 0);
+}
+
+// Compare a copy of a block against its stored checksum
+int blocks_csum_verify(int block_num, const void *data) {
+    int csum_block;
+    uint32_t stored = *table_entry(get_superblock()->csum_start, block_num, &csum_block);
+    blocks_unpin(csum_block);
+
+    uint32_t actual = crc32c(0, data, BLOCK_SIZE);
+    if (actual != stored) {
+        long total = atomic_fetch_add(&csum_errors, 1) + 1;
+        printf("[ERROR] Checksum mismatch on block %d: stored=%08x actual=%08x (%ld total)\n",
+               block_num, stored, actual, total);
+        return -EIO;
+    }
+    return 0;
+}
+
+// Whether the stored checksum describes what is on disk for block_num
+int blocks_csum_tracked(int block_num) {
+    return !bitmap_get(csum_stale, block_num);
+}
+
+// Find the checksum-table block holding the entry for block_num
+int blocks_csum_block(int block_num) {
+    return get_superblock()->csum_start + block_num / ENTRIES_PER_BLOCK;
+}
+
+// Number of checksum mismatches seen so far
+long blocks_csum_errors() {
+    return atomic_load(&csum_errors);
+}
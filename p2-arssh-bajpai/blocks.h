@@ -2,38 +2,216 @@
 #define BLOCKS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "ioengine.h"
 
 #define BLOCK_SIZE 4096  /**< The size of each block in bytes. */
-#define BLOCK_COUNT 256  /**< The total number of blocks available. */
+#define BLOCK_COUNT 256  /**< The number of blocks in a newly created image, unless another size is asked for. */
+
+#define NUFS_MAGIC 0x5346554e  /**< "NUFS" in little-endian byte order; marks a formatted image. */
+#define NUFS_VERSION 14         /**< The on-disk format version written by blocks_format(). */
+#define ALLOC_GROUP_BLOCKS 8192 /**< Blocks per allocation group (32 MiB, a quarter of a bitmap block); see alloc_block_near(). */
+
+/**
+ * @brief Describes the layout of the disk image. Stored at the start of block 0.
+ *
+ * The image begins with a metadata area followed by the data blocks. The first part of the
+ * metadata area (superblock, block bitmap, inode table and journal) is small and held in memory
+ * for as long as the image is open; the rest (block reference counts and checksum table) grows
+ * with the image and, like the data blocks, is read through the block cache (see cache.h).
+ * All positions are block numbers. The free counts follow the layout fields; they change with
+ * every allocation and are journaled with the bitmap, so reporting them is O(1) (see
+ * storage_statfs()). An image may be striped across several files (see ioengine_open_striped())
+ * and may keep some of its data blocks on a fast tier (see tier.h); the superblock records both,
+ * and is always at the start of the first file.
+ */
+typedef struct superblock {
+    uint32_t magic;        /**< NUFS_MAGIC once the image has been formatted. */
+    uint32_t version;      /**< On-disk format version (NUFS_VERSION). */
+    uint32_t block_count;  /**< Total number of blocks in the image. */
+    uint32_t inode_count;  /**< Number of inodes in the inode table. */
+    uint32_t bitmap_start; /**< First block of the block allocation bitmap. */
+    uint32_t inode_start;  /**< First block of the inode table. */
+    uint32_t journal_start; /**< First block of the metadata journal (JOURNAL_MIN_BLOCKS to JOURNAL_BLOCKS long). */
+    uint32_t refs_start;   /**< First block of the per-block reference count table (and the end of the resident area). */
+    uint32_t csum_start;   /**< First block of the per-block CRC32C table. */
+    uint32_t data_start;   /**< First block available for file and directory data. */
+    uint32_t free_blocks;  /**< Number of free blocks, kept up to date by alloc_block() and free_block(). */
+    uint32_t free_inodes;  /**< Number of free inodes, kept up to date by alloc_inode() and free_inode(). */
+    uint32_t stripe_count; /**< Number of files the image is striped across (1 if it is a single file). */
+    uint32_t stripe_unit;  /**< Blocks stored in one file before moving on to the next. */
+    uint32_t tier_id;      /**< Identifies the fast tier holding some of the data blocks (see tier.h), or 0. */
+} superblock_t;
+
+/**
+ * @brief When blocks freed in the bitmap are also released from the image file (see blocks_set_discard()).
+ */
+typedef enum discard_mode {
+    DISCARD_OFF,      /**< Never: the image file keeps what free blocks held. */
+    DISCARD_ON_FREE,  /**< As soon as the transaction freeing them commits (see blocks_committed()). */
+    DISCARD_PERIODIC, /**< When a background pass trims their allocation group (see blocks_trim_group()). */
+} discard_mode_t;
+
+/**
+ * @brief What has been released from the image file since it was opened.
+ */
+typedef struct blocks_discard_stats {
+    long extents;  /**< Runs of free blocks released, each with one IO_DISCARD request. */
+    long blocks;   /**< Blocks released. */
+    long groups;   /**< Allocation groups trimmed by blocks_trim_group(). */
+    long errors;   /**< Requests that failed. */
+} blocks_discard_stats_t;
 
 /**
  * @brief Initializes the block layer for the file system.
  *
- * This function sets up internal data structures for managing blocks and may load block 
- * allocation information from the given disk image file if the file system state is 
- * persisted between runs.
+ * This function sets up the block cache that holds the non-resident part of the image. The
+ * image itself is opened by the caller, who then calls either blocks_load() for an existing
+ * image or blocks_format() for a new one. All image I/O goes through the I/O engine (see ioengine.h).
+ *
+ * @param cache_size The memory budget for cached blocks in bytes, or 0 for CACHE_SIZE.
+ */
+void blocks_init(size_t cache_size);
+
+/**
+ * @brief Reads the superblock and the resident metadata area of an existing image.
+ *
+ * The I/O engine takes the stripe unit recorded in the superblock. An image striped across a
+ * different number of files than the engine was given is refused.
  *
- * @param path The path to the disk image file that stores the block data.
+ * @return 1 if block 0 holds a valid nufs superblock and the metadata area was read, 0 if
+ *         block 0 is not a nufs superblock at all (no NUFS_MAGIC), -EUCLEAN if it is one that
+ *         does not match this version's layout (a damaged or foreign image, which must not be
+ *         formatted over; see fsck.nufs), -EINVAL if the image was striped across a different
+ *         number of files, or another negative error code if the image could not be read.
  */
-void blocks_init(const char *path);
+int blocks_load();
 
 /**
- * @brief Retrieves a pointer to the in-memory representation of the specified block.
+ * @brief Computes the layout of an image: where each metadata region starts, and the free
+ * counts of a newly formatted image. Only `block_count` decides it.
  *
- * After initialization, the file system holds all blocks in memory. This function returns 
- * a pointer to the start of the requested block number, allowing read/write operations 
- * directly in memory.
+ * @param sb The superblock to fill in (magic, version, layout fields and free counts; the
+ *           stripe and tier fields are left alone).
+ * @param block_count The size of the image in blocks.
+ */
+void blocks_layout(superblock_t *sb, uint32_t block_count);
+
+/**
+ * @brief Formats a new image in memory: writes the superblock, clears the bitmap and
+ * marks the metadata area as allocated.
+ *
+ * Only the resident area is prepared; the caller writes it to the image (see
+ * blocks_resident_count()). The reference count and checksum tables are expected to read as
+ * zeros, as they do in a freshly truncated image file. The superblock records the stripe set
+ * the I/O engine was opened with.
+ *
+ * @param block_count The size of the image in blocks.
+ * @return 0 on success, -EINVAL if the image is too small (or too large) to format, or -ENOMEM.
+ */
+int blocks_format(uint32_t block_count);
+
+/**
+ * @brief Returns the number of blocks, starting at block 0, that are held in memory while the
+ * image is open (the superblock, bitmap, inode table and journal).
+ *
+ * @return The size of the resident area in blocks.
+ */
+int blocks_resident_count();
+
+/**
+ * @brief Retrieves a pointer to the superblock (the start of block 0).
+ *
+ * @return A pointer to the in-memory superblock.
+ */
+superblock_t *get_superblock();
+
+/**
+ * @brief Retrieves a pointer to the in-memory copy of the specified block.
+ *
+ * Blocks in the resident area are always in memory. Any other block is looked up in the block
+ * cache (and read from the image if needed) and stays pinned until the next blocks_release(),
+ * so the pointer can be used for the rest of the current file system operation. A data block
+ * read from the image is verified against its checksum on the way in; one that fails is not
+ * kept in the cache, and is read (and verified) again on its next use.
+ *
+ * Changes made through the pointer are not written back by the cache: the caller writes or
+ * journals every block it modifies.
  *
  * @param block_num The block number to retrieve (0-based index).
- * @return A pointer to the start of the requested block.
+ * @return A pointer to the start of the requested block, or NULL if block_num is out of range
+ *         or the block failed its checksum (which the caller reports as -EIO).
  */
 void *blocks_get_block(int block_num);
 
+/**
+ * @brief Like blocks_get_block(), for a block whose contents are about to be replaced in full.
+ *
+ * The block's current contents are neither read from the image nor verified against its
+ * checksum: a block that is not cached comes back zeroed. Used for newly allocated blocks,
+ * copy-on-write destinations and whole-block writes, and when the journal restores a block
+ * whose home copy was torn by a crash.
+ *
+ * @param block_num The block number to retrieve.
+ * @return A pointer to the start of the block, or NULL if block_num is out of range.
+ */
+void *blocks_overwrite(int block_num);
+
+/**
+ * @brief Pins a block in memory until the matching blocks_unpin().
+ *
+ * Like blocks_get_block(), but the pin is released explicitly. Used by code that walks many
+ * blocks in one operation (or outside of one, like the scrubber), so they don't all stay pinned.
+ * Pins nest. Thread-safe.
+ *
+ * @param block_num The block number to pin.
+ * @return A pointer to the start of the block, or NULL (with no pin held) if block_num is out
+ *         of range or the block failed its checksum.
+ */
+void *blocks_pin(int block_num);
+
+/**
+ * @brief Releases a pin taken with blocks_pin().
+ *
+ * @param block_num The block number to unpin.
+ */
+void blocks_unpin(int block_num);
+
+/**
+ * @brief Releases every block pinned by blocks_get_block() since the last call.
+ *
+ * Called at the end of each file system operation; pointers returned by blocks_get_block()
+ * must not be used afterwards.
+ */
+void blocks_release();
+
+/**
+ * @brief Reads blocks into the cache ahead of use, as one batch of I/O requests.
+ *
+ * Only the first blocks are read if the cache is small (see cache_prefetch()).
+ *
+ * @param block_nums The block numbers (resident blocks and zeros are ignored).
+ * @param count The number of blocks.
+ */
+void blocks_prefetch(const int *block_nums, int count);
+
+/**
+ * @brief Finds the block that holds a location in memory.
+ *
+ * The inverse of blocks_get_block(): used to find which blocks a change to a structure
+ * stored inside the image (an inode, a block pointer) has to be journaled under.
+ *
+ * @param ptr A pointer into the resident area or into a cached block.
+ * @return The number of the block containing `ptr`, or -1 if it is not part of the image.
+ */
+int blocks_block_of(const void *ptr);
+
 /**
  * @brief Cleans up and frees any resources allocated by the block management system.
  *
- * This function is typically called during shutdown or unmount. It ensures that all 
- * necessary data is persisted to disk before freeing memory.
+ * This function is typically called during shutdown or unmount, after the resident area
+ * has been written to the image.
  */
 void blocks_free();
 
@@ -48,14 +226,217 @@ void blocks_free();
 void *get_blocks_bitmap();
 
 /**
- * @brief Allocates a free block and returns its block number.
+ * @brief Adds to the free block and inode counts in the superblock.
+ *
+ * The superblock joins the running journal transaction, so the counts always match the bitmap
+ * and inode table they describe. Called by the allocation functions; nothing else needs to.
+ *
+ * @param blocks The change in the number of free blocks.
+ * @param inodes The change in the number of free inodes.
+ */
+void blocks_adjust_free(int blocks, int inodes);
+
+/**
+ * @brief Allocates a free block near a goal block and returns its block number.
  *
- * This function searches the bitmap for a free block. If found, it marks the block as 
- * allocated and returns its block number. If no free blocks are available, it returns a 
- * negative error code.
+ * The image is divided into allocation groups of ALLOC_GROUP_BLOCKS blocks, each with its own
+ * free count and search cursor, kept in memory (the bitmap remains the only on-disk record).
+ * The search starts at the goal and covers the goal's group first, wrapping around within it,
+ * then moves on to the following groups, skipping full ones without reading their bitmap. Given
+ * no goal, it starts at the cursor of the calling thread's home group: threads are given home
+ * groups round-robin, so threads creating directories at once spread them over the image, and a
+ * thread whose group fills up makes the group it found room in its new home. Callers pass the
+ * block before the one they are about to fill, or the first block of the directory a new file is
+ * in (see inode_set_goal()), so files stay contiguous and near their directory.
+ *
+ * The block is marked allocated with a reference count of 1. Blocks freed by the running
+ * transaction are skipped (see blocks_committed()), even if nothing else is free: the caller is
+ * in the middle of an operation, so committing is up to it (see blocks_allocatable()). The
+ * caller holds storage's lock, as for every change to the bitmap.
+ *
+ * @param goal A block to allocate at or after, or 0 (any block outside the data area) for none.
+ * @return The allocated block number on success, or a negative value (e.g., -1) if none are free.
+ */
+int alloc_block_near(int goal);
+
+/**
+ * @brief Allocates a free block in the calling thread's home group (alloc_block_near(0)).
  *
  * @return The allocated block number on success, or a negative value (e.g., -1) if none are free.
  */
 int alloc_block();
 
+/**
+ * @brief Returns where the allocation group of the last allocation continues its search.
+ *
+ * @return A block number in the data area.
+ */
+int blocks_alloc_cursor();
+
+/**
+ * @brief Reports whether a range of blocks is free both in memory and on disk.
+ *
+ * True if no block in the range is allocated or was freed by the running transaction, so
+ * nothing in the range holds data that the image (as committed) or the running transaction
+ * still needs.
+ *
+ * @param first The first block of the range.
+ * @param count The number of blocks.
+ * @return 1 if every block in the range is free, 0 otherwise.
+ */
+int blocks_range_free(int first, int count);
+
+/**
+ * @brief Lets alloc_block() hand out the blocks freed since the last commit.
+ *
+ * Until the transaction that frees a block is durable, the image still gives the block to its
+ * old owner, so alloc_block() passes over it: new data written into it could otherwise show up
+ * in the old file after a crash. Called by journal_commit() once a transaction is durable; with
+ * DISCARD_ON_FREE, the blocks are released from the image file first (see blocks_set_discard()).
+ */
+void blocks_committed();
+
+/**
+ * @brief Returns the number of blocks alloc_block() can hand out before the next commit.
+ *
+ * That is the free count less the blocks freed by the running transaction. Where it falls short
+ * of what an operation needs while the free count does not, committing first (between
+ * operations, or between the steps of a long one) makes the difference allocatable.
+ *
+ * @return The number of free blocks not waiting for blocks_committed().
+ */
+int blocks_allocatable();
+
+/**
+ * @brief Chooses when freed blocks are released from the image file.
+ *
+ * An image file is usually sparse, so the host only stores the blocks ever written; releasing
+ * (punching a hole for, see IO_DISCARD) a run of freed blocks gives its space back to the host,
+ * and the image file shrinks to the data still in use. Blocks are only released once the
+ * transaction freeing them has committed, as the image still needed them until then. Released
+ * blocks read as zeros, which nothing reads: they are rewritten before they are used again.
+ *
+ * With DISCARD_ON_FREE, blocks_committed() releases the runs freed by each transaction, adjacent
+ * ones merged, in one batch. With DISCARD_PERIODIC, nothing happens at commit beyond noting which
+ * allocation groups had blocks freed, and a background pass calls blocks_trim_group() on every
+ * group, releasing all of their free blocks; so freeing costs nothing extra, and blocks freed
+ * before a crash (or by a file system that wasn't discarding) are released too. If the host file
+ * system can't punch holes, discarding turns itself off.
+ *
+ * @param mode The discard_mode_t to use from now on (DISCARD_OFF until this is called).
+ */
+void blocks_set_discard(discard_mode_t mode);
+
+/**
+ * @brief Sets the function that sends batches of discards to the I/O engine.
+ *
+ * Storage passes one that holds its I/O lock, so that releasing blocks is serialized with its
+ * own writes to the image, as in flush_blocks(). Until this is called (e.g., in the helper
+ * tools), batches go straight to ioengine_submit_routed() with IO_ROUTE_UNTRACKED.
+ *
+ * @param submit Called with each batch of IO_DISCARD requests; returns as ioengine_submit().
+ */
+void blocks_set_discard_submit(int (*submit)(io_request_t *reqs, int count));
+
+/**
+ * @brief Returns the number of allocation groups in the open image (see alloc_block_near()).
+ *
+ * @return The number of groups, numbered from 0.
+ */
+int blocks_group_count();
+
+/**
+ * @brief Releases every free block of an allocation group from the image file.
+ *
+ * Does nothing for a group none of whose blocks were freed since it was last trimmed (every group
+ * counts as untrimmed when the image is opened), or with DISCARD_OFF. Blocks freed by the running
+ * transaction are skipped until it commits. The caller holds storage's lock.
+ *
+ * @param group The group's number.
+ * @return The number of blocks released (0 if the group was skipped).
+ */
+long blocks_trim_group(int group);
+
+/**
+ * @brief Reports what has been released from the image file since it was opened.
+ *
+ * @param stats The structure to fill in.
+ */
+void blocks_get_discard_stats(blocks_discard_stats_t *stats);
+
+/**
+ * @brief Adds a reference to an allocated block.
+ *
+ * Used when a block is shared between files (e.g., by a reflink clone) instead of copied.
+ *
+ * @param block_num The block number to reference.
+ */
+void ref_block(int block_num);
+
+/**
+ * @brief Drops a reference to a block, freeing it once no references remain.
+ *
+ * @param block_num The block number to release.
+ */
+void free_block(int block_num);
+
+/**
+ * @brief Returns the number of references to a block.
+ *
+ * A block with more than one reference is shared and must be copied before it is written.
+ *
+ * @param block_num The block number to query.
+ * @return The reference count, or 0 if the block is free.
+ */
+int block_refs(int block_num);
+
+/**
+ * @brief Recomputes and stores the checksum of a block from its in-memory contents.
+ *
+ * Called whenever a block is written to the disk image, so that the checksum table always
+ * describes what is on disk.
+ *
+ * @param block_num The block number whose checksum should be updated.
+ */
+void blocks_csum_update(int block_num);
+
+/**
+ * @brief Verifies a copy of a block against its stored checksum.
+ *
+ * Mismatches are logged and added to the running error count reported by blocks_csum_errors().
+ * Whether the block is tracked is left alone: only blocks_csum_update(), when the block is
+ * flushed, decides that the stored checksum describes what is on disk.
+ *
+ * @param block_num The block number the data belongs to.
+ * @param data A pointer to BLOCK_SIZE bytes of block contents (e.g., as read from disk).
+ * @return 0 if the checksum matches, or -EIO on a mismatch.
+ */
+int blocks_csum_verify(int block_num, const void *data);
+
+/**
+ * @brief Reports whether a block's stored checksum describes its on-disk contents.
+ *
+ * Blocks allocated since startup are untracked until they are first written to the image.
+ * Tracked data blocks are verified whenever they are read into the cache.
+ *
+ * @param block_num The block number to check.
+ * @return 1 if the block's checksum can be verified against the image, 0 otherwise.
+ */
+int blocks_csum_tracked(int block_num);
+
+/**
+ * @brief Returns the number of the checksum-table block that holds the entry for a block.
+ *
+ * @param block_num The block number whose checksum entry is wanted.
+ * @return The block number within the checksum table.
+ */
+int blocks_csum_block(int block_num);
+
+/**
+ * @brief Returns the number of checksum mismatches detected since startup.
+ *
+ * @return The total count of failed verifications.
+ */
+long blocks_csum_errors();
+
 #endif
@@ -0,0 +1,86 @@
+#include "bufpool.h"
+#include "blocks.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Round a size up to whole huge pages
+#define REGION_SIZE(size) (((size) + BUFPOOL_ALIGN - 1) & ~(BUFPOOL_ALIGN - 1))
+
+// The pool of single-block buffers: one region and a stack of the free ones
+static char *pool = NULL;
+static void *free_bufs[BUFPOOL_BUFFERS];
+static int free_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocate a zeroed, huge-page aligned region
+void *bufpool_alloc_region(size_t size) {
+    size_t len = REGION_SIZE(size);
+
+    // mmap() only promises page alignment: over-allocate and trim to a huge page boundary
+    char *raw = mmap(NULL, len + BUFPOOL_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("[ERROR] Failed to allocate buffer region");
+        return NULL;
+    }
+    char *region = (char *)(((uintptr_t)raw + BUFPOOL_ALIGN - 1) & ~(BUFPOOL_ALIGN - 1));
+    if (region > raw) {
+        munmap(raw, region - raw);
+    }
+    munmap(region + len, raw + BUFPOOL_ALIGN - region);
+
+#ifdef MADV_HUGEPAGE
+    madvise(region, len, MADV_HUGEPAGE); // Advisory: THP may be disabled
+#endif
+    return region;
+}
+
+// Release a region
+void bufpool_free_region(void *region, size_t size) {
+    if (region) {
+        munmap(region, REGION_SIZE(size));
+    }
+}
+
+// Carve the pool region into buffers (called with pool_lock held)
+static void pool_setup() {
+    pool = bufpool_alloc_region((size_t)BUFPOOL_BUFFERS * BLOCK_SIZE);
+    if (!pool) return;
+    for (int i = 0; i < BUFPOOL_BUFFERS; i++) {
+        free_bufs[free_count++] = pool + (size_t)i * BLOCK_SIZE;
+    }
+}
+
+// Take an aligned single-block buffer
+void *bufpool_get() {
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (!pool) pool_setup();
+    if (free_count > 0) {
+        buf = free_bufs[--free_count];
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!buf && posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+        return NULL; // Pool exhausted and no memory for an extra buffer
+    }
+    return buf;
+}
+
+// Give a buffer back to the pool (or free it, if it came from outside the pool)
+void bufpool_put(void *buf) {
+    if (!buf) return;
+
+    char *p = buf;
+    if (pool && p >= pool && p < pool + (size_t)BUFPOOL_BUFFERS * BLOCK_SIZE) {
+        pthread_mutex_lock(&pool_lock);
+        free_bufs[free_count++] = buf;
+        pthread_mutex_unlock(&pool_lock);
+    } else {
+        free(buf);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#define BUFPOOL_ALIGN (2UL << 20)  /**< Regions are aligned to (and sized in) 2 MiB huge pages. */
+#define BUFPOOL_BUFFERS 64         /**< Number of single-block buffers kept in the pool. */
+
+/**
+ * @brief Allocates a large, zeroed memory region suitable for O_DIRECT I/O.
+ *
+ * The region is aligned to BUFPOOL_ALIGN and the kernel is asked to back it with
+ * transparent huge pages, which keeps TLB pressure low for big block caches. Any offset that
+ * is a multiple of BLOCK_SIZE is therefore a valid O_DIRECT buffer address.
+ *
+ * @param size The number of bytes needed (rounded up to a multiple of BUFPOOL_ALIGN).
+ * @return A pointer to the region, or NULL if it could not be allocated.
+ */
+void *bufpool_alloc_region(size_t size);
+
+/**
+ * @brief Releases a region returned by bufpool_alloc_region().
+ *
+ * @param region The region to release (NULL is ignored).
+ * @param size The size passed to bufpool_alloc_region().
+ */
+void bufpool_free_region(void *region, size_t size);
+
+/**
+ * @brief Takes a BLOCK_SIZE-aligned, BLOCK_SIZE-long buffer from the pool.
+ *
+ * Used for transient I/O buffers (e.g., scrubbing) that must meet O_DIRECT alignment rules.
+ * The pool is created on first use; if all BUFPOOL_BUFFERS buffers are taken, an aligned
+ * buffer is allocated separately. Thread-safe.
+ *
+ * @return A pointer to the buffer, or NULL if memory ran out.
+ */
+void *bufpool_get();
+
+/**
+ * @brief Returns a buffer taken with bufpool_get().
+ *
+ * @param buf The buffer to return (NULL is ignored).
+ */
+void bufpool_put(void *buf);
+
+#endif
@@ -0,0 +1,512 @@
+#include "cache.h"
+#include "blocks.h"
+#include "bufpool.h"
+#include "ioengine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// ARC keeps four lists. T1 holds blocks seen once recently, T2 blocks seen at
+// least twice; B1 and B2 are "ghosts" remembering blocks recently evicted from
+// T1 and T2 (no data, just the block number). A hit on a ghost tells us which
+// side of the cache deserved more room, and 'target' (the desired size of T1)
+// moves accordingly.
+enum { T1, T2, B1, B2, LISTS };
+
+typedef struct cache_entry {
+    int block;                        // Block number
+    int list;                         // Which ARC list the entry is on
+    int pins;                         // Pins held; a pinned entry is never evicted
+    int op_pinned;                    // Pinned by cache_pin_op() in the current operation
+    int fresh;                        // Read from the image and not yet handed out
+    char *frame;                      // The block's data (NULL for ghosts)
+    struct cache_entry *prev, *next;  // Position in its list (next is towards the LRU end)
+    struct cache_entry *hnext;        // Hash chain
+} cache_entry_t;
+
+typedef struct cache_list {
+    cache_entry_t head;  // Sentinel: head.next is the MRU end, head.prev the LRU end
+    long size;
+} cache_list_t;
+
+static cache_list_t lists[LISTS];
+static long capacity = 0;  // c in the ARC paper: the number of frames in the budget
+static long target = 0;    // p in the ARC paper: the desired size of T1
+
+// Hash table from block number to entry
+static cache_entry_t **buckets = NULL;
+static unsigned long bucket_mask = 0;
+
+// Frames not holding a block, and entries not in use. Frames beyond the budget
+// ("overflow" frames, see take_frame()) are never on the free list: they are
+// freed as soon as the block in them can be evicted.
+static char *frame_region = NULL;
+static size_t region_len = 0;
+static char **free_frames = NULL;
+static long free_frame_count = 0;
+static long frame_total = 0;
+static cache_entry_t **frame_owner = NULL;  // Entry holding each budgeted frame
+static cache_entry_t *free_entries = NULL;
+
+// Blocks pinned by cache_pin_op() since the last cache_release_op()
+static int *op_pins = NULL;
+static long op_pin_count = 0, op_pin_cap = 0;
+
+static cache_stats_t stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hash_block(int block_num) {
+    return ((unsigned long)block_num * 2654435761UL) & bucket_mask;
+}
+
+static cache_entry_t *lookup(int block_num) {
+    for (cache_entry_t *e = buckets[hash_block(block_num)]; e; e = e->hnext) {
+        if (e->block == block_num) return e;
+    }
+    return NULL;
+}
+
+static void list_remove(cache_entry_t *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    lists[e->list].size--;
+}
+
+static void list_push_mru(int list, cache_entry_t *e) {
+    cache_entry_t *head = &lists[list].head;
+    e->list = list;
+    e->prev = head;
+    e->next = head->next;
+    head->next->prev = e;
+    head->next = e;
+    lists[list].size++;
+}
+
+static void move_mru(int list, cache_entry_t *e) {
+    list_remove(e);
+    list_push_mru(list, e);
+}
+
+// Forget an entry entirely (it must not hold a frame)
+static void drop_entry(cache_entry_t *e) {
+    list_remove(e);
+    cache_entry_t **p = &buckets[hash_block(e->block)];
+    while (*p != e) p = &(*p)->hnext;
+    *p = e->hnext;
+    e->hnext = free_entries;
+    free_entries = e;
+}
+
+// Whether a frame was allocated beyond the budget
+static int is_overflow(const char *frame) {
+    return frame < frame_region || frame >= frame_region + region_len;
+}
+
+// Give up an entry's frame: back to the free list, or back to the system if it is an overflow frame
+static void release_frame(cache_entry_t *e) {
+    if (is_overflow(e->frame)) {
+        free(e->frame);
+        frame_total--;
+    } else {
+        frame_owner[(e->frame - frame_region) / BLOCK_SIZE] = NULL;
+        free_frames[free_frame_count++] = e->frame;
+    }
+    e->frame = NULL;
+}
+
+// Drop the least recently used ghost on a ghost list
+static void drop_ghost_lru(int list) {
+    if (lists[list].size > 0) {
+        drop_entry(lists[list].head.prev);
+    }
+}
+
+// Give up the frame of the least recently used unpinned entry of T1 or T2,
+// turning it into a ghost on B1 or B2 (or dropping it altogether if asked).
+// Returns 0 if every entry on the list is pinned.
+static int evict_lru(int list, int keep_ghost) {
+    cache_entry_t *head = &lists[list].head;
+    for (cache_entry_t *e = head->prev; e != head; e = e->prev) {
+        if (e->pins > 0) continue;
+
+        release_frame(e);
+        e->fresh = 0;
+        stats.evictions++;
+        if (keep_ghost) {
+            move_mru(list == T1 ? B1 : B2, e);
+        } else {
+            drop_entry(e);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// ARC's REPLACE: free a frame from T1 or T2, depending on how T1 compares to its target
+static void replace(int ghost_in_b2) {
+    long t1 = lists[T1].size;
+    int from = (t1 > 0 && (t1 > target || (ghost_in_b2 && t1 == target))) ? T1 : T2;
+    if (!evict_lru(from, 1)) {
+        evict_lru(from == T1 ? T2 : T1, 1);
+    }
+}
+
+// Give an entry a free frame, allocating one beyond the budget if every frame is pinned
+static void take_frame(cache_entry_t *e) {
+    if (free_frame_count > 0) {
+        e->frame = free_frames[--free_frame_count];
+        frame_owner[(e->frame - frame_region) / BLOCK_SIZE] = e;
+        return;
+    }
+
+    if (posix_memalign((void **)&e->frame, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "[ERROR] Out of memory for block cache frame\n");
+        exit(1);
+    }
+    frame_total++;
+    if (stats.overflows++ == 0) {
+        printf("[INFO] Block cache: all %ld frames pinned, growing beyond the budget\n", capacity);
+    }
+}
+
+// Once an entry in an overflow frame is unpinned, evict it to bring the cache back within budget
+static void shed_overflow(cache_entry_t *e) {
+    if (e->pins == 0 && e->frame && is_overflow(e->frame)) {
+        release_frame(e);
+        e->fresh = 0;
+        stats.evictions++;
+        move_mru(e->list == T1 ? B1 : B2, e);
+    }
+}
+
+// Make sure 'block_num' has an entry with a frame, following ARC's rules for
+// where the entry goes. Returns the entry and sets *miss if the block was not
+// in memory, in which case the frame's contents are the caller's to fill.
+static cache_entry_t *admit(int block_num, int *miss) {
+    cache_entry_t *e = lookup(block_num);
+    *miss = 0;
+
+    if (e && (e->list == T1 || e->list == T2)) {
+        // Seen again: frequently used. The first use of a prefetched block
+        // is its first real reference, though, so it stays where it is.
+        stats.hits++;
+        move_mru(e->fresh ? e->list : T2, e);
+        return e;
+    }
+
+    *miss = 1; // Counted as a miss by whoever reads it in (see load())
+    if (e) {
+        // Ghost hit: the list it was evicted from should have been bigger
+        stats.ghost_hits++;
+        long b1 = lists[B1].size, b2 = lists[B2].size;
+        if (e->list == B1) {
+            long delta = b1 >= b2 ? 1 : b2 / b1;
+            target = target + delta < capacity ? target + delta : capacity;
+        } else {
+            long delta = b2 >= b1 ? 1 : b1 / b2;
+            target = target - delta > 0 ? target - delta : 0;
+        }
+        if (free_frame_count == 0) replace(e->list == B2);
+        take_frame(e);
+        move_mru(T2, e);
+        return e;
+    }
+
+    // Not seen recently at all
+    long l1 = lists[T1].size + lists[B1].size;
+    long total = l1 + lists[T2].size + lists[B2].size;
+    if (l1 >= capacity) {
+        if (lists[T1].size < capacity) {
+            drop_ghost_lru(B1);
+            if (free_frame_count == 0) replace(0);
+        } else if (free_frame_count == 0 && !evict_lru(T1, 0)) {
+            replace(0);
+        }
+    } else if (total >= capacity) {
+        if (total >= 2 * capacity) drop_ghost_lru(B2);
+        if (free_frame_count == 0) replace(0);
+    }
+
+    e = free_entries;
+    if (e) {
+        free_entries = e->hnext;
+    } else if (!(e = malloc(sizeof(cache_entry_t)))) {
+        fprintf(stderr, "[ERROR] Out of memory for block cache entry\n");
+        exit(1);
+    }
+    memset(e, 0, sizeof(*e));
+    e->block = block_num;
+    take_frame(e);
+    unsigned long h = hash_block(block_num);
+    e->hnext = buckets[h];
+    buckets[h] = e;
+    list_push_mru(T1, e);
+    return e;
+}
+
+// Read a block into its frame; anything past the end of the image reads as zeros
+static void load(cache_entry_t *e) {
+    stats.misses++;
+    ssize_t got = ioengine_pread(e->frame, BLOCK_SIZE, (off_t)e->block * BLOCK_SIZE);
+    if (got < 0) {
+        fprintf(stderr, "[ERROR] Failed to read block %d: %s\n", e->block, strerror(-got));
+        got = 0;
+    }
+    if (got < BLOCK_SIZE) {
+        memset(e->frame + got, 0, BLOCK_SIZE - got);
+    }
+    e->fresh = 1;
+}
+
+// Set up the cache with room for 'bytes' worth of blocks
+int cache_init(size_t bytes) {
+    cache_free();
+
+    capacity = bytes / BLOCK_SIZE;
+    if (capacity < CACHE_MIN_FRAMES) capacity = CACHE_MIN_FRAMES;
+    target = 0;
+
+    region_len = (size_t)capacity * BLOCK_SIZE;
+    frame_region = bufpool_alloc_region(region_len);
+    free_frames = malloc(capacity * sizeof(char *));
+    frame_owner = calloc(capacity, sizeof(cache_entry_t *));
+    unsigned long nbuckets = 1;
+    while (nbuckets < 2UL * capacity) nbuckets <<= 1;
+    buckets = calloc(nbuckets, sizeof(cache_entry_t *));
+    if (!frame_region || !free_frames || !frame_owner || !buckets) {
+        cache_free();
+        return -ENOMEM;
+    }
+    bucket_mask = nbuckets - 1;
+
+    for (long i = 0; i < capacity; i++) {
+        free_frames[i] = frame_region + (size_t)i * BLOCK_SIZE;
+    }
+    free_frame_count = frame_total = capacity;
+    for (int l = 0; l < LISTS; l++) {
+        lists[l].head.prev = lists[l].head.next = &lists[l].head;
+        lists[l].size = 0;
+    }
+    memset(&stats, 0, sizeof(stats));
+
+    printf("[INFO] Block cache: %ld frames (%zu MiB)\n", capacity, region_len >> 20);
+    return 0;
+}
+
+// Return every frame to the free list and every entry to the free pool
+void cache_reset() {
+    pthread_mutex_lock(&cache_lock);
+    for (int l = 0; l < LISTS; l++) {
+        while (lists[l].size > 0) {
+            cache_entry_t *e = lists[l].head.next;
+            if (e->frame) release_frame(e);
+            drop_entry(e);
+        }
+    }
+    target = 0;
+    op_pin_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Release all of the cache's memory
+void cache_free() {
+    if (buckets) {
+        cache_reset();
+    }
+    free_frame_count = 0;
+    while (free_entries) {
+        cache_entry_t *e = free_entries;
+        free_entries = e->hnext;
+        free(e);
+    }
+    bufpool_free_region(frame_region, region_len);
+    free(free_frames);
+    free(frame_owner);
+    free(buckets);
+    free(op_pins);
+    frame_region = NULL;
+    free_frames = NULL;
+    frame_owner = NULL;
+    buckets = NULL;
+    op_pins = NULL;
+    op_pin_cap = op_pin_count = 0;
+    capacity = frame_total = 0;
+}
+
+// Look up (or load) a block and pin it
+void *cache_pin(int block_num, int *loaded) {
+    pthread_mutex_lock(&cache_lock);
+    int miss;
+    cache_entry_t *e = admit(block_num, &miss);
+    e->pins++;
+    if (miss) load(e);
+    if (loaded) *loaded = e->fresh;
+    e->fresh = 0;
+    void *frame = e->frame;
+    pthread_mutex_unlock(&cache_lock);
+    return frame;
+}
+
+// Drop a pin
+void cache_unpin(int block_num) {
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = lookup(block_num);
+    if (e && e->pins > 0) {
+        e->pins--;
+        shed_overflow(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Pin a block until cache_release_op(); on a miss, read it from the image only if 'read' is set
+static void *pin_op(int block_num, int *loaded, int read) {
+    pthread_mutex_lock(&cache_lock);
+    int miss;
+    cache_entry_t *e = admit(block_num, &miss);
+    if (!e->op_pinned) {
+        if (op_pin_count == op_pin_cap) {
+            op_pin_cap = op_pin_cap ? op_pin_cap * 2 : 64;
+            op_pins = realloc(op_pins, op_pin_cap * sizeof(int));
+            if (!op_pins) {
+                fprintf(stderr, "[ERROR] Out of memory for block pins\n");
+                exit(1);
+            }
+        }
+        op_pins[op_pin_count++] = block_num;
+        e->op_pinned = 1;
+        e->pins++;
+    }
+    if (miss && read) {
+        load(e);
+    } else if (miss) {
+        memset(e->frame, 0, BLOCK_SIZE);
+    }
+    if (loaded) *loaded = e->fresh;
+    e->fresh = 0;
+    void *frame = e->frame;
+    pthread_mutex_unlock(&cache_lock);
+    return frame;
+}
+
+// Pin a block until cache_release_op()
+void *cache_pin_op(int block_num, int *loaded) {
+    return pin_op(block_num, loaded, 1);
+}
+
+// Pin a block until cache_release_op(), without reading it: the caller replaces all of it
+void *cache_pin_op_new(int block_num) {
+    return pin_op(block_num, NULL, 0);
+}
+
+// Take back the pin just taken on a block whose contents turned out to be bad, and forget them
+void cache_forget(int block_num, int op_pin) {
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *e = lookup(block_num);
+    if (e && e->frame) {
+        if (op_pin && e->op_pinned) {
+            e->op_pinned = 0; // Left in op_pins; cache_release_op() skips it
+            e->pins--;
+        } else if (!op_pin && e->pins > 0) {
+            e->pins--;
+        }
+        if (e->pins == 0) {
+            release_frame(e);
+            drop_entry(e);
+        } else {
+            e->fresh = 1; // Still pinned elsewhere: the next user verifies it again
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Release the current operation's pins
+void cache_release_op() {
+    pthread_mutex_lock(&cache_lock);
+    for (long i = 0; i < op_pin_count; i++) {
+        cache_entry_t *e = lookup(op_pins[i]);
+        if (e && e->op_pinned) {
+            e->op_pinned = 0;
+            e->pins--;
+            shed_overflow(e);
+        }
+    }
+    op_pin_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Load the uncached blocks among 'block_nums' with one batch of reads
+void cache_prefetch(const int *block_nums, int count) {
+    // At most a quarter of the cache, so the batch can't evict blocks before they are used
+    int batch_max = capacity / 4 < IOENGINE_DEPTH ? capacity / 4 : IOENGINE_DEPTH;
+    io_request_t reqs[IOENGINE_DEPTH];
+    cache_entry_t *loading[IOENGINE_DEPTH];
+    int n = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count && n < batch_max; i++) {
+        cache_entry_t *e = lookup(block_nums[i]);
+        if (e && (e->list == T1 || e->list == T2)) continue;
+
+        int miss;
+        e = admit(block_nums[i], &miss);
+        stats.misses++;
+        e->pins++; // Keep the frame while the batch is in flight
+        loading[n] = e;
+        reqs[n++] = (io_request_t){IO_READ, e->frame, BLOCK_SIZE, (off_t)e->block * BLOCK_SIZE, 0};
+    }
+    if (n > 0) {
+        ioengine_submit(reqs, n);
+    }
+    for (int i = 0; i < n; i++) {
+        ssize_t got = reqs[i].result < 0 ? 0 : reqs[i].result;
+        if (got < BLOCK_SIZE) {
+            memset(loading[i]->frame + got, 0, BLOCK_SIZE - got);
+        }
+        loading[i]->fresh = 1;
+        loading[i]->pins--;
+        shed_overflow(loading[i]);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Find the block whose frame contains 'ptr'
+int cache_block_of(const void *ptr) {
+    const char *p = ptr;
+    int block_num = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (frame_region && !is_overflow(p)) {
+        cache_entry_t *e = frame_owner[(p - frame_region) / BLOCK_SIZE];
+        if (e) block_num = e->block;
+    } else {
+        // Overflow frames are rare and short-lived: look through the resident entries
+        for (int l = T1; l <= T2 && block_num < 0; l++) {
+            for (cache_entry_t *e = lists[l].head.next; e != &lists[l].head; e = e->next) {
+                if (p >= e->frame && p < e->frame + BLOCK_SIZE) {
+                    block_num = e->block;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return block_num;
+}
+
+// The memory holding the budgeted frames
+void cache_region(void **base, size_t *len) {
+    *base = frame_region;
+    *len = region_len;
+}
+
+// Snapshot of the counters
+cache_stats_t cache_get_stats() {
+    pthread_mutex_lock(&cache_lock);
+    cache_stats_t s = stats;
+    s.frames = frame_total;
+    s.cached = lists[T1].size + lists[T2].size;
+    pthread_mutex_unlock(&cache_lock);
+    return s;
+}
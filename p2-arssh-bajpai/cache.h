@@ -0,0 +1,149 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_SIZE (32UL << 20)  /**< Default memory budget for cached blocks, in bytes. */
+#define CACHE_MIN_FRAMES 64      /**< Smallest number of blocks the cache will hold. */
+
+/**
+ * @brief Counters describing how well the block cache is doing.
+ */
+typedef struct cache_stats {
+    long hits;        /**< Lookups served from memory. */
+    long misses;      /**< Lookups that had to read the block from the image. */
+    long ghost_hits;  /**< Misses on recently evicted blocks (these steer the eviction policy). */
+    long evictions;   /**< Blocks dropped to make room. */
+    long overflows;   /**< Frames allocated beyond the budget because every frame was pinned. */
+    long frames;      /**< Number of block frames (the budget divided by BLOCK_SIZE, plus overflows). */
+    long cached;      /**< Number of blocks currently in memory. */
+} cache_stats_t;
+
+/**
+ * @brief Sets up the block cache with a fixed memory budget.
+ *
+ * The cache holds image blocks in frames carved from one aligned region (see bufpool.h) and
+ * replaces them with ARC (Adaptive Replacement Cache): recently used and frequently used blocks
+ * are kept in separate lists, and the split between them adapts to the workload using the
+ * history of recently evicted blocks. A single sequential scan can therefore only displace the
+ * "recent" side of the cache, not the blocks that are used over and over.
+ *
+ * Blocks are read through the I/O engine (see ioengine.h). The cache never writes blocks back:
+ * callers write every block they modify through to the image before releasing it.
+ *
+ * @param bytes The memory budget for block frames (at least CACHE_MIN_FRAMES blocks).
+ * @return 0 on success, or -ENOMEM if the frames could not be allocated.
+ */
+int cache_init(size_t bytes);
+
+/**
+ * @brief Drops every cached block and frees the cache's memory.
+ *
+ * No block may be pinned.
+ */
+void cache_free();
+
+/**
+ * @brief Forgets every cached block (e.g., after the image has been reformatted).
+ *
+ * No block may be pinned.
+ */
+void cache_reset();
+
+/**
+ * @brief Returns a block pinned in memory, reading it from the image if needed.
+ *
+ * A pinned block is never evicted, so the pointer stays valid until the matching
+ * cache_unpin(). Pins nest. Thread-safe.
+ *
+ * @param block_num The block number.
+ * @param loaded Set to 1 if the block was read from the image since it was last returned by this
+ *               function (so the caller can verify it), 0 otherwise. May be NULL.
+ * @return A pointer to the block's BLOCK_SIZE bytes.
+ */
+void *cache_pin(int block_num, int *loaded);
+
+/**
+ * @brief Releases a pin taken with cache_pin().
+ *
+ * @param block_num The block number.
+ */
+void cache_unpin(int block_num);
+
+/**
+ * @brief Pins a block until the end of the current operation.
+ *
+ * Like cache_pin(), but the pin is released by cache_release_op() instead of by the caller,
+ * and taking it again in the same operation costs nothing. This is how the file system's
+ * operations (which run one at a time) hold on to the blocks they look at. Not thread-safe
+ * with respect to other operation pins.
+ *
+ * @param block_num The block number.
+ * @param loaded As for cache_pin().
+ * @return A pointer to the block's BLOCK_SIZE bytes.
+ */
+void *cache_pin_op(int block_num, int *loaded);
+
+/**
+ * @brief Like cache_pin_op(), for a block whose contents the caller is about to replace in full.
+ *
+ * A block that is not cached is not read from the image: it gets a zeroed frame instead.
+ *
+ * @param block_num The block number.
+ * @return A pointer to the block's BLOCK_SIZE bytes.
+ */
+void *cache_pin_op_new(int block_num);
+
+/**
+ * @brief Releases every pin taken with cache_pin_op() since the last call.
+ */
+void cache_release_op();
+
+/**
+ * @brief Takes back the pin just taken on a block whose contents failed verification, and
+ * drops them from the cache, so the next use reads the block from the image again.
+ *
+ * If the block is still pinned elsewhere its frame stays, but it is reported as loaded again
+ * (see cache_pin()), so its next user verifies it too.
+ *
+ * @param block_num The block number.
+ * @param op_pin 1 if the pin was taken with cache_pin_op(), 0 if with cache_pin().
+ */
+void cache_forget(int block_num, int op_pin);
+
+/**
+ * @brief Reads a set of blocks into the cache ahead of use, as one batch of I/O requests.
+ *
+ * Blocks already cached are skipped. At most IOENGINE_DEPTH blocks, and no more than a quarter
+ * of the cache, are read per call, so prefetched blocks are still cached when they are used;
+ * the rest are left to be read on demand. Does not pin anything.
+ *
+ * @param block_nums The block numbers.
+ * @param count The number of blocks.
+ */
+void cache_prefetch(const int *block_nums, int count);
+
+/**
+ * @brief Finds the block cached in the frame that contains a given address.
+ *
+ * @param ptr A pointer into a cached block.
+ * @return The block number, or -1 if `ptr` is not inside a cached block.
+ */
+int cache_block_of(const void *ptr);
+
+/**
+ * @brief Reports the memory that holds cache frames, so it can be registered with the I/O engine.
+ *
+ * @param base Set to the start of the frame region.
+ * @param len Set to its length in bytes.
+ */
+void cache_region(void **base, size_t *len);
+
+/**
+ * @brief Retrieves the cache's counters.
+ *
+ * @return A snapshot of the counters.
+ */
+cache_stats_t cache_get_stats();
+
+#endif
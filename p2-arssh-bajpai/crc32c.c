@@ -0,0 +1,130 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Castagnoli polynomial, bit-reflected
+
+// Slicing-by-8 lookup tables for the portable implementation
+static uint32_t crc32c_table[8][256];
+static int crc32c_use_hw = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Build the lookup tables and pick the implementation for this CPU
+static void crc32c_setup() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = crc32c_table[0][i];
+        for (int t = 1; t < 8; t++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[t][i] = crc;
+        }
+    }
+
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    crc32c_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Portable slicing-by-8 CRC32C
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_setup);
+
+    const uint8_t *p = buf;
+    crc = ~crc;
+
+    // Consume bytes until the pointer is 8-byte aligned
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    // Process 8 bytes per step using the slicing tables
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    // Tail bytes
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// Hardware CRC32C using the SSE4.2 crc32 instruction
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    crc = ~crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+#endif
+
+// Compute a CRC32C with the fastest implementation available
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_setup);
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_use_hw) {
+        return crc32c_hw(crc, buf, len);
+    }
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+// Report which implementation crc32c() dispatches to
+int crc32c_hw_enabled() {
+    pthread_once(&crc32c_once, crc32c_setup);
+    return crc32c_use_hw;
+}
@@ -0,0 +1,40 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Computes (or continues) a CRC32C (Castagnoli) checksum over a buffer.
+ *
+ * On x86 CPUs that support SSE4.2 the hardware `crc32` instruction is used; otherwise a
+ * portable slicing-by-8 table implementation is used. Both produce identical results.
+ * Pass 0 as `crc` to start a new checksum, or a previous result to extend it.
+ *
+ * @param crc The checksum of the preceding data, or 0 to start a new checksum.
+ * @param buf A pointer to the data to checksum.
+ * @param len The number of bytes in `buf`.
+ * @return The updated CRC32C value.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Computes a CRC32C checksum using only the portable table implementation.
+ *
+ * Exposed so the hardware path can be checked against it and benchmarked.
+ *
+ * @param crc The checksum of the preceding data, or 0 to start a new checksum.
+ * @param buf A pointer to the data to checksum.
+ * @param len The number of bytes in `buf`.
+ * @return The updated CRC32C value.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief Reports whether crc32c() is using the hardware instruction.
+ *
+ * @return 1 if the SSE4.2 implementation is in use, 0 if the portable fallback is.
+ */
+int crc32c_hw_enabled();
+
+#endif
@@ -0,0 +1,83 @@
+#include "dcache.h"
+#include "crc32c.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+// One slot: a name in a directory and the inode it leads to, under a sequence count
+// that is odd while the slot is being changed. A slot with no name is empty.
+typedef struct dcache_entry {
+    _Atomic uint32_t seq;
+    int dir;
+    int dir_generation;
+    int inum;
+    int generation;
+    uint8_t len;
+    char name[DCACHE_NAME_MAX];
+} __attribute__((aligned(64))) dcache_entry_t;
+
+_Static_assert(sizeof(dcache_entry_t) == 64, "a name cache slot must fill one cache line");
+
+static dcache_entry_t entries[DCACHE_ENTRIES];
+
+// The slot a name in a directory can be cached in
+static dcache_entry_t *slot(int dir, int dir_generation, const char *name, size_t len) {
+    uint32_t seed = (uint32_t)dir * 0x9e3779b9u ^ (uint32_t)dir_generation;
+    return &entries[crc32c(seed, name, len) & (DCACHE_ENTRIES - 1)];
+}
+
+static int matches(const dcache_entry_t *e, int dir, int dir_generation, const char *name, size_t len) {
+    return e->len == len && e->dir == dir && e->dir_generation == dir_generation && memcmp(e->name, name, len) == 0;
+}
+
+// Change a slot: odd count, new contents, even count
+static void write_slot(dcache_entry_t *e, int dir, int dir_generation, const char *name, size_t len, int inum,
+                       int generation) {
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->dir = dir;
+    e->dir_generation = dir_generation;
+    e->inum = inum;
+    e->generation = generation;
+    e->len = len;
+    memcpy(e->name, name, len);
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+void dcache_clear() {
+    memset(entries, 0, sizeof(entries));
+}
+
+// Copy the slot between two reads of its count, retrying while a writer is at it
+int dcache_lookup(int dir, int dir_generation, const char *name, size_t len, int *generation) {
+    if (len == 0 || len > DCACHE_NAME_MAX) return -1;
+    dcache_entry_t *e = slot(dir, dir_generation, name, len);
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq & 1) continue; // A writer is changing it: a few stores, never I/O
+        int match = matches(e, dir, dir_generation, name, len);
+        int inum = e->inum, found = e->generation;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq) continue;
+        if (!match) return -1;
+        *generation = found;
+        return inum;
+    }
+}
+
+void dcache_insert(int dir, int dir_generation, const char *name, size_t len, int inum, int generation) {
+    if (len == 0 || len > DCACHE_NAME_MAX) return;
+    dcache_entry_t *e = slot(dir, dir_generation, name, len);
+    if (matches(e, dir, dir_generation, name, len) && e->inum == inum && e->generation == generation) return;
+    write_slot(e, dir, dir_generation, name, len, inum, generation);
+}
+
+void dcache_forget(int dir, int dir_generation, const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > DCACHE_NAME_MAX) return;
+    dcache_entry_t *e = slot(dir, dir_generation, name, len);
+    if (matches(e, dir, dir_generation, name, len)) {
+        write_slot(e, 0, 0, "", 0, 0, 0);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+
+#define DCACHE_ENTRIES 16384  /**< Slots in the name cache (a power of two). */
+#define DCACHE_NAME_MAX 39    /**< Longest name the cache holds; longer ones are always looked up. */
+
+/**
+ * @brief A cache of directory entries that can be read without any lock.
+ *
+ * Maps a directory (its inode number and generation) and a name to the inode the name leads to
+ * and that inode's generation. It is filled by path lookups made under storage's lock (see
+ * tree_lookup_n()) and read by tree_lookup_cached(), which stat() uses so that it never waits
+ * for an operation in progress.
+ *
+ * Each slot is a small seqlock: the writer (always holding storage's lock) makes the slot's
+ * sequence count odd, changes it, and makes it even again; a reader copies the slot and retries
+ * if the count was odd or changed meanwhile. Slots are overwritten in place and never freed, so
+ * readers need no reclamation scheme. Because entries carry generations, an entry for a
+ * directory or file whose inode number has been reused simply stops matching.
+ *
+ * The cache only ever answers "the name leads to this inode" or "don't know": names that don't
+ * exist are not cached.
+ */
+
+/**
+ * @brief Empties the cache, e.g. when another image is loaded.
+ */
+void dcache_clear();
+
+/**
+ * @brief Looks up a name in a directory without taking any lock.
+ *
+ * Retries only while a writer is changing the very slot the name maps to, which takes a few stores.
+ *
+ * @param dir The directory's inode number.
+ * @param dir_generation The generation the directory's inode had when it was reached.
+ * @param name The name (not NUL-terminated).
+ * @param len The name's length.
+ * @param generation Set to the generation of the inode found.
+ * @return The inode number the name leads to, or -1 if the cache doesn't know.
+ */
+int dcache_lookup(int dir, int dir_generation, const char *name, size_t len, int *generation);
+
+/**
+ * @brief Records that a name leads to an inode. Caller holds storage's lock.
+ *
+ * Does nothing if the name is longer than DCACHE_NAME_MAX, or if the slot already says so (so
+ * repeated lookups don't keep invalidating the cache line readers share).
+ *
+ * @param dir The directory's inode number.
+ * @param dir_generation Its generation.
+ * @param name The name (not NUL-terminated).
+ * @param len The name's length.
+ * @param inum The inode the name leads to.
+ * @param generation That inode's generation.
+ */
+void dcache_insert(int dir, int dir_generation, const char *name, size_t len, int inum, int generation);
+
+/**
+ * @brief Forgets a name, before it is removed from its directory or replaced. Caller holds
+ * storage's lock.
+ *
+ * @param dir The directory's inode number.
+ * @param dir_generation Its generation.
+ * @param name The name (NUL-terminated).
+ */
+void dcache_forget(int dir, int dir_generation, const char *name);
+
+#endif
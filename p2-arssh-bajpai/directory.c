@@ -4,62 +4,150 @@
 #include <errno.h>
 #include "slist.h"
 
-// Set the directory to empty
+_Static_assert(sizeof(directory_t) == BLOCK_SIZE, "a directory fills one block");
+_Static_assert(DIRECTORY_SPACE <= UINT16_MAX, "rec_len must be able to span the record area");
+
+// The record at byte 'pos' of the record area
+static directory_entry_t *record_at(const directory_t *dir, int pos) {
+    return (directory_entry_t *)(dir->records + pos);
+}
+
+// Bytes of a record taken by its entry (none if it holds no entry)
+static int record_used(const directory_entry_t *rec) {
+    return rec->name_len ? DIRECTORY_RECORD_SIZE(rec->name_len) : 0;
+}
+
+// Set the directory to empty: one record, holding no entry, spanning the record area
 void directory_init(directory_t *dir) {
-    dir->entry_count = 0;
-    memset(dir->entries, 0, sizeof(dir->entries));
+    memset(dir, 0, sizeof(directory_t));
+    record_at(dir, 0)->rec_len = DIRECTORY_SPACE;
 }
 
-// Add a new entry (name -> inum) if there's space and it doesn't already exist
-int directory_put(directory_t *dir, const char *name, int inum) {
-    if (dir->entry_count >= MAX_ENTRIES) {
-        return -ENOSPC;
+// Find the entry named 'name' (of 'len' characters). If 'prev' isn't NULL, it is set to the
+// position of the record before it (-1 if it is the first).
+static int find_record(const directory_t *dir, const char *name, size_t len, int *prev) {
+    int last = -1;
+    for (int pos = 0; pos < DIRECTORY_SPACE; pos += record_at(dir, pos)->rec_len) {
+        const directory_entry_t *rec = record_at(dir, pos);
+        if (rec->name_len == len && memcmp(rec->name, name, len) == 0) {
+            if (prev) *prev = last;
+            return pos;
+        }
+        last = pos;
     }
+    return -1;
+}
 
-    // Check for duplicate names
-    for (int i = 0; i < dir->entry_count; i++) {
-        if (strcmp(dir->entries[i].name, name) == 0) {
-            return -EEXIST;
+// Position of the first record with room for an entry of 'need' bytes after its own, or -1
+static int find_room(const directory_t *dir, int need) {
+    for (int pos = 0; pos < DIRECTORY_SPACE; pos += record_at(dir, pos)->rec_len) {
+        const directory_entry_t *rec = record_at(dir, pos);
+        if (rec->rec_len - record_used(rec) >= need) {
+            return pos;
         }
     }
+    return -1;
+}
+
+// Add a new entry (name -> inum) if there's space and it doesn't already exist
+int directory_put(directory_t *dir, const char *name, int inum) {
+    size_t len = strlen(name);
+    if (len == 0) return -EINVAL;
+    if (len > MAX_NAME_LEN) return -ENAMETOOLONG;
+    if (find_record(dir, name, len, NULL) >= 0) return -EEXIST;
+
+    int need = DIRECTORY_RECORD_SIZE(len);
+    int pos = find_room(dir, need);
+    if (pos < 0) return -ENOSPC;
 
-    // Insert the new entry
-    strncpy(dir->entries[dir->entry_count].name, name, MAX_NAME_LEN);
-    dir->entries[dir->entry_count].inum = inum;
+    // Split the unused end of the record off into a record for the new entry
+    directory_entry_t *rec = record_at(dir, pos);
+    int used = record_used(rec);
+    directory_entry_t *entry = record_at(dir, pos + used);
+    if (used > 0) {
+        entry->rec_len = rec->rec_len - used;
+        rec->rec_len = used;
+    }
+    entry->inum = inum;
+    entry->name_len = len;
+    entry->reserved = 0;
+    memcpy(entry->name, name, len);
     dir->entry_count++;
     return 0;
 }
 
-// Remove an entry by name if it exists
+// Remove an entry by name if it exists, giving its space to the record before it
 int directory_delete(directory_t *dir, const char *name) {
-    for (int i = 0; i < dir->entry_count; i++) {
-        if (strcmp(dir->entries[i].name, name) == 0) {
-            // Shift entries down
-            for (int j = i; j < dir->entry_count - 1; j++) {
-                dir->entries[j] = dir->entries[j + 1];
-            }
-            dir->entry_count--;
-            return 0;
-        }
+    size_t len = strlen(name);
+    int prev;
+    int pos = len ? find_record(dir, name, len, &prev) : -1;
+    if (pos < 0) return -ENOENT;
+
+    directory_entry_t *rec = record_at(dir, pos);
+    if (prev >= 0) {
+        record_at(dir, prev)->rec_len += rec->rec_len;
+    } else {
+        rec->name_len = 0; // The first record stays, holding only space
+        rec->inum = 0;
     }
-    return -ENOENT;
+    dir->entry_count--;
+    return 0;
 }
 
 // Find the inode number for a given name
 int directory_lookup(directory_t *dir, const char *name) {
-    for (int i = 0; i < dir->entry_count; i++) {
-        if (strcmp(dir->entries[i].name, name) == 0) {
-            return dir->entries[i].inum;
-        }
-    }
-    return -ENOENT;
+    return directory_lookup_n(dir, name, strlen(name));
 }
 
-// Return a list of all entry names in the directory
-slist_t *directory_list(const directory_t *dir) {
+// Find the inode number for a name given by pointer and length
+int directory_lookup_n(directory_t *dir, const char *name, size_t len) {
+    if (len == 0 || len > MAX_NAME_LEN) return -ENOENT;
+    int pos = find_record(dir, name, len, NULL);
+    return pos < 0 ? -ENOENT : record_at(dir, pos)->inum;
+}
+
+// Return a list of all entry names in the directory, built in 'arena'
+slist_t *directory_list(const directory_t *dir, arena_t *arena) {
     slist_t *list = NULL;
-    for (int i = 0; i < dir->entry_count; i++) {
-        list = s_cons(dir->entries[i].name, list);
+    int pos = 0;
+    const directory_entry_t *entry;
+    while ((entry = directory_next(dir, &pos))) {
+        list = s_cons_arena(arena, entry->name, entry->name_len, list);
+        if (!list) return NULL;
     }
     return list;
 }
+
+// Whether directory_put() would find room for 'name'
+int directory_fits(const directory_t *dir, const char *name) {
+    size_t len = strlen(name);
+    return len <= MAX_NAME_LEN && find_room(dir, DIRECTORY_RECORD_SIZE(len)) >= 0;
+}
+
+// The next entry at or after record position *pos
+const directory_entry_t *directory_next(const directory_t *dir, int *pos) {
+    while (*pos < DIRECTORY_SPACE) {
+        const directory_entry_t *rec = record_at(dir, *pos);
+        *pos += rec->rec_len;
+        if (rec->name_len) return rec;
+    }
+    return NULL;
+}
+
+// Check that the records chain across the record area and describe valid entries
+int directory_check(const directory_t *dir) {
+    int pos = 0, count = 0;
+    while (pos < DIRECTORY_SPACE) {
+        const directory_entry_t *rec = record_at(dir, pos);
+        if (rec->rec_len % 4 || rec->rec_len < DIRECTORY_RECORD_SIZE(0) || rec->rec_len > DIRECTORY_SPACE - pos ||
+            record_used(rec) > rec->rec_len) {
+            return -EIO;
+        }
+        if (rec->name_len) {
+            if (memchr(rec->name, '/', rec->name_len) || memchr(rec->name, '\0', rec->name_len)) return -EIO;
+            count++;
+        }
+        pos += rec->rec_len;
+    }
+    return count == dir->entry_count ? 0 : -EIO;
+}
@@ -1,32 +1,46 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
+#include <stdint.h>
+#include "blocks.h"
 #include "slist.h"
 
-#define MAX_ENTRIES 32    /**< The maximum number of directory entries allowed in a single directory. */
-#define MAX_NAME_LEN 27   /**< The maximum length of a directory entry name (excluding null terminator). */
+#define MAX_NAME_LEN 255  /**< The maximum length of a directory entry name (excluding null terminator). */
+#define DIRECTORY_SPACE (BLOCK_SIZE - 2 * (int)sizeof(int)) /**< Bytes of entry records in a directory block. */
+
+/** @brief Bytes a record for a name of `len` characters takes at least (header and name, 4-byte aligned). */
+#define DIRECTORY_RECORD_SIZE(len) ((int)((offsetof(directory_entry_t, name) + (len) + 3) & ~3u))
 
 /**
- * @brief Represents a single entry within a directory.
+ * @brief A directory entry record.
  *
- * Each directory entry contains:
- * - A file or directory name (up to MAX_NAME_LEN characters, not including a null terminator).
- * - An inode number (inum) that points to the file or directory’s inode.
+ * Records are packed one after another in the directory's record area, each followed directly
+ * by the next one `rec_len` bytes on; together they cover the whole area. A record holds an
+ * entry (a name of `name_len` characters and the inode number it refers to) and the unused
+ * space after it, into which later entries are put. A record with `name_len` 0 holds no
+ * entry, only space; only the first record can be one, since removing any other entry hands
+ * its space to the record before it (see directory_delete()).
  */
 typedef struct directory_entry {
-    char name[MAX_NAME_LEN]; /**< The name of the file or directory. */
-    int inum;                /**< The inode number associated with this entry. */
+    int inum;          /**< The inode number associated with this entry. */
+    uint16_t rec_len;  /**< Bytes from this record to the next (a multiple of 4). */
+    uint8_t name_len;  /**< Length of the name, or 0 if the record holds no entry. */
+    uint8_t reserved;  /**< Zero. */
+    char name[];       /**< The name of the file or directory (not NUL-terminated). */
 } directory_entry_t;
 
 /**
  * @brief Represents a directory structure that holds multiple directory entries.
  *
- * A directory is essentially a special type of file that maps names to inode numbers.
- * In this simplistic file system, a directory can hold up to MAX_ENTRIES entries.
+ * A directory is essentially a special type of file that maps names to inode numbers. It
+ * occupies one block: a small header and DIRECTORY_SPACE bytes of variable-length entry
+ * records (see directory_entry_t), so it holds as many entries as their names leave room for
+ * (about 250 names of 8 characters, or 15 of 255).
  */
 typedef struct directory {
-    int entry_count;                           /**< The current number of valid entries in this directory. */
-    directory_entry_t entries[MAX_ENTRIES];    /**< An array of directory entries. */
+    int entry_count;                 /**< The current number of valid entries in this directory. */
+    int reserved;                    /**< Zero. */
+    char records[DIRECTORY_SPACE];   /**< The entry records (see directory_entry_t). */
 } directory_t;
 
 /**
@@ -42,13 +56,14 @@ void directory_init(directory_t *dir);
 /**
  * @brief Adds a new entry (name -> inum mapping) to the directory.
  *
- * If the directory is not full, this function will create a new directory entry with the given name
- * and inode number, incrementing the entry count.
+ * The entry goes into the unused space of the first record that has enough, which is split
+ * off into a record of its own, and the entry count is incremented.
  *
  * @param dir  A pointer to the directory.
  * @param name The name of the new file or directory entry (null-terminated).
  * @param inum The inode number associated with the entry.
- * @return 0 on success, or a negative value if the directory is full or the entry already exists.
+ * @return 0 on success, -EEXIST if the entry already exists, -ENAMETOOLONG if the name is longer
+ *         than MAX_NAME_LEN, or -ENOSPC if no record has room for it.
  */
 int directory_put(directory_t *dir, const char *name, int inum);
 
@@ -56,7 +71,9 @@ int directory_put(directory_t *dir, const char *name, int inum);
  * @brief Removes an entry from the directory by name.
  *
  * This function searches the directory for an entry matching the specified name.
- * If found, it removes the entry and decrements the entry count.
+ * If found, it removes the entry and decrements the entry count. The record's space joins the
+ * unused space of the record before it, so free space never fragments into records too small to
+ * use; other records do not move.
  *
  * @param dir  A pointer to the directory.
  * @param name The name of the entry to remove (null-terminated).
@@ -77,16 +94,63 @@ int directory_delete(directory_t *dir, const char *name);
  */
 int directory_lookup(directory_t *dir, const char *name);
 
+/**
+ * @brief Like directory_lookup(), for a name given by pointer and length.
+ *
+ * Used to look up a component of a path in place, without copying it out.
+ *
+ * @param dir  A pointer to the directory.
+ * @param name The name to search for (need not be NUL-terminated).
+ * @param len  The length of the name.
+ * @return The inode number of the matched entry, or -ENOENT if not found.
+ */
+int directory_lookup_n(directory_t *dir, const char *name, size_t len);
+
 /**
  * @brief Lists all entries in the directory.
  *
  * This function creates a singly linked list (slist_t) of the entry names in the given directory.
- * Each node in the returned list corresponds to a directory entry. 
- * The caller is responsible for freeing this list using s_free().
+ * Each node in the returned list corresponds to a directory entry. The list is built in
+ * `arena` (see s_cons_arena()) and released with it, so listing allocates nothing once the
+ * arena has grown to size.
  *
  * @param dir A pointer to the directory from which to list entries.
- * @return A singly linked list (slist_t) of entry names. Returns NULL if the directory is empty.
+ * @param arena The arena to build the list in.
+ * @return A singly linked list (slist_t) of entry names. Returns NULL if the directory is empty
+ *         (or the arena ran out of memory).
+ */
+slist_t *directory_list(const directory_t *dir, arena_t *arena);
+
+/**
+ * @brief Reports whether an entry with the given name would fit in the directory.
+ *
+ * @param dir  A pointer to the directory.
+ * @param name The name (null-terminated).
+ * @return 1 if directory_put() would find room for it, 0 otherwise.
+ */
+int directory_fits(const directory_t *dir, const char *name);
+
+/**
+ * @brief Steps through the entries of a directory.
+ *
+ * Start with `*pos` 0. Entries may be removed with directory_delete() between calls.
+ *
+ * @param dir A pointer to the directory.
+ * @param pos Where to continue from; advanced past the entry returned.
+ * @return The next entry, or NULL once there are no more.
+ */
+const directory_entry_t *directory_next(const directory_t *dir, int *pos);
+
+/**
+ * @brief Checks that a directory block is well formed.
+ *
+ * The records must chain across the whole record area without overlapping, each entry's name
+ * must fit in its record and contain no '/' or NUL, and the entry count must match. Used on
+ * blocks read from an image that may be damaged (see fsck.nufs).
+ *
+ * @param dir A pointer to the directory.
+ * @return 0 if it is, -EIO if it isn't.
  */
-slist_t *directory_list(const directory_t *dir);
+int directory_check(const directory_t *dir);
 
 #endif
@@ -0,0 +1,101 @@
+#include "flusher.h"
+#include "storage.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake;
+static int flusher_running = 0;
+static int flusher_kicked = 0;
+static int flush_interval = FLUSH_INTERVAL;
+static flusher_stats_t stats;
+
+// Sleep until 'deadline', a kick, or flusher_stop().
+// Returns 0 if the thread should stop, 1 to commit, 2 to commit early.
+static int flusher_wait(const struct timespec *deadline) {
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running && !flusher_kicked) {
+        if (pthread_cond_timedwait(&flusher_wake, &flusher_lock, deadline) != 0) {
+            break; // Deadline reached
+        }
+    }
+    int rv = !flusher_running ? 0 : flusher_kicked ? 2 : 1;
+    flusher_kicked = 0;
+    pthread_mutex_unlock(&flusher_lock);
+    return rv;
+}
+
+// Writeback thread: commit every flush_interval seconds, or when kicked
+static void *flusher_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += flush_interval;
+        int why = flusher_wait(&next);
+        if (!why) break;
+
+        int rv = storage_checkpoint();
+        pthread_mutex_lock(&flusher_lock);
+        stats.commits++;
+        if (why == 2) stats.early++;
+        if (rv < 0) stats.errors++;
+        pthread_mutex_unlock(&flusher_lock);
+    }
+    return NULL;
+}
+
+// Start the writeback thread and hand commits over to it
+void flusher_start(int interval) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    flush_interval = interval > 0 ? interval : FLUSH_INTERVAL;
+    flusher_running = 1;
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+        perror("[ERROR] Failed to start writeback thread");
+        flusher_running = 0;
+        return;
+    }
+    storage_set_writeback(flusher_kick);
+    printf("[INFO] Writeback thread started, committing every %d s\n", flush_interval);
+}
+
+// Take commits back from the writeback thread, then stop it
+void flusher_stop() {
+    pthread_mutex_lock(&flusher_lock);
+    int was_running = flusher_running;
+    pthread_mutex_unlock(&flusher_lock);
+    if (!was_running) return;
+
+    storage_set_writeback(NULL); // Commits whatever is outstanding
+
+    pthread_mutex_lock(&flusher_lock);
+    flusher_running = 0;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+
+    pthread_join(flusher_thread, NULL);
+    printf("[INFO] Writeback thread stopped: %ld commits (%ld early), %ld errors\n",
+           stats.commits, stats.early, stats.errors);
+}
+
+// Wake the writeback thread for an early commit
+void flusher_kick() {
+    pthread_mutex_lock(&flusher_lock);
+    flusher_kicked = 1;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+// Copy out the writeback thread's counters
+void flusher_get_stats(flusher_stats_t *out) {
+    pthread_mutex_lock(&flusher_lock);
+    *out = stats;
+    pthread_mutex_unlock(&flusher_lock);
+}
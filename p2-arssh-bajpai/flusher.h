@@ -0,0 +1,53 @@
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#define FLUSH_INTERVAL 5  /**< Default number of seconds between commits. */
+
+/**
+ * @brief Counters describing the writeback thread's work.
+ */
+typedef struct flusher_stats {
+    long commits;  /**< Number of checkpoints taken. */
+    long early;    /**< Checkpoints taken before the interval ran out, because changes piled up. */
+    long errors;   /**< Checkpoints that failed to write the image. */
+} flusher_stats_t;
+
+/**
+ * @brief Starts the background writeback thread.
+ *
+ * From then on, file system operations return without committing their changes; the thread
+ * commits them every `interval` seconds with storage_checkpoint(), or sooner when the running
+ * transaction or the deferred file data grows large (see storage_set_writeback()). Many small
+ * operations then share one journal write and one pair of syncs, and the final flush at unmount
+ * only has to commit the last few seconds of changes.
+ *
+ * Must be called after storage_init(), from the process that serves requests (i.e., after
+ * FUSE has daemonized).
+ *
+ * @param interval The longest time changes may wait to be committed, in seconds.
+ */
+void flusher_start(int interval);
+
+/**
+ * @brief Stops the writeback thread, committing what it has not.
+ *
+ * Operations commit their own changes again afterwards. Safe to call if the thread was never
+ * started. Must be called before storage_shutdown().
+ */
+void flusher_stop();
+
+/**
+ * @brief Asks the writeback thread to commit now rather than at the end of the interval.
+ *
+ * Does not wait, so it may be called with storage's lock held.
+ */
+void flusher_kick();
+
+/**
+ * @brief Retrieves a snapshot of the writeback thread's counters.
+ *
+ * @param stats A pointer to the structure to fill in.
+ */
+void flusher_get_stats(flusher_stats_t *stats);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "nufs_ioctl.h"
+
+// Creates small files in a mounted nufs twice: once with open/write/close/stat per
+// file, and once with NUFS_IOC_BATCH on the control file, then compares the times.
+// Usage: batch_import <mount-point> [count]
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Append an item to a batch; returns 0 if it doesn't fit
+static int add_item(struct nufs_batch *batch, size_t *pos, int op, const char *path, const char *data) {
+  size_t path_len = strlen(path) + 1;
+  size_t data_len = data ? strlen(data) : 0;
+  size_t len = NUFS_BATCH_ITEM_SIZE(path_len, data_len);
+  if (*pos + len > NUFS_BATCH_BYTES) return 0;
+
+  struct nufs_batch_item *item = (struct nufs_batch_item *)(batch->items + *pos);
+  memset(item, 0, len);
+  item->op = op;
+  item->path_len = path_len;
+  item->data_len = data_len;
+  item->mode = op == NUFS_BATCH_MKDIR ? 0755 : 0644;
+  memcpy(item + 1, path, path_len);
+  if (data_len) memcpy((char *)(item + 1) + path_len, data, data_len);
+
+  *pos += len;
+  batch->count++;
+  return 1;
+}
+
+// Send a batch and start a new one
+static void flush(int ctl, struct nufs_batch *batch, size_t *pos) {
+  if (batch->count && ioctl(ctl, NUFS_IOC_BATCH, batch) < 0) {
+    perror("NUFS_IOC_BATCH");
+    exit(1);
+  }
+  memset(batch, 0, sizeof(*batch));
+  *pos = 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <mount-point> [count]\n", argv[0]);
+    return 1;
+  }
+  const char *mnt = argv[1];
+  int count = argc > 2 ? atoi(argv[2]) : 30;
+  char path[512], data[64];
+
+  // One file at a time
+  snprintf(path, sizeof(path), "%s/single", mnt);
+  mkdir(path, 0755);
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/single/f%05d", mnt, i);
+    snprintf(data, sizeof(data), "contents of file %d\n", i);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    write(fd, data, strlen(data));
+    close(fd);
+    struct stat st;
+    stat(path, &st);
+  }
+  double single = now() - start;
+
+  // Batched: paths are relative to the mount point
+  snprintf(path, sizeof(path), "%s%s", mnt, NUFS_CONTROL_PATH);
+  int ctl = open(path, O_RDONLY);
+  if (ctl < 0) {
+    perror(path);
+    return 1;
+  }
+  struct nufs_batch *batch = calloc(1, sizeof(*batch));
+  size_t pos = 0;
+  start = now();
+  add_item(batch, &pos, NUFS_BATCH_MKDIR, "/batched", NULL);
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "/batched/f%05d", i);
+    snprintf(data, sizeof(data), "contents of file %d\n", i);
+    if (!add_item(batch, &pos, NUFS_BATCH_CREATE, path, data)) {
+      flush(ctl, batch, &pos);
+      add_item(batch, &pos, NUFS_BATCH_CREATE, path, data);
+    }
+  }
+  flush(ctl, batch, &pos);
+  double batched = now() - start;
+
+  printf("%d files: %.1f ms one at a time, %.1f ms batched (%.1fx)\n", count, single * 1e3, batched * 1e3,
+         single / batched);
+  close(ctl);
+  free(batch);
+  return 0;
+}
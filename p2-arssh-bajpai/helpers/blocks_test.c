@@ -1,12 +1,20 @@
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "ioengine.h"
 
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
-  blocks_init(TEST_NAME);
+  // Blocks past the metadata area are read through the cache, so an image is needed
+  int fd = open(TEST_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ftruncate(fd, (off_t)BLOCK_COUNT * BLOCK_SIZE);
+  ioengine_open(IOENGINE_PREAD, fd, NULL, 0);
+  blocks_init(0);
+  blocks_format(BLOCK_COUNT);
 
   printf("Block bitmap at the beginning:\n");
   bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
@@ -30,7 +38,11 @@ int main(int argc, char **argv) {
   }
   putchar('\n');
 
+  blocks_release();
   blocks_free();
+  ioengine_close();
+  close(fd);
+  unlink(TEST_NAME);
 
   return 0;
 }
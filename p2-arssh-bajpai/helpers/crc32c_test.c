@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "crc32c.h"
+
+#define ROUNDS 65536
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  const char *check = "123456789";
+  printf("Hardware CRC32C: %s\n", crc32c_hw_enabled() ? "yes" : "no");
+  printf("crc32c(\"%s\")    = %08x (expected e3069283)\n", check, crc32c(0, check, 9));
+  printf("crc32c_sw(\"%s\") = %08x (expected e3069283)\n", check, crc32c_sw(0, check, 9));
+
+  static char block[BLOCK_SIZE];
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    block[i] = (char)(i * 31 + 7);
+  }
+
+  double start = now();
+  unsigned sum = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    sum ^= crc32c(0, block, BLOCK_SIZE);
+  }
+  double hw = now() - start;
+
+  start = now();
+  for (int i = 0; i < ROUNDS; i++) {
+    sum ^= crc32c_sw(0, block, BLOCK_SIZE);
+  }
+  double sw = now() - start;
+
+  double mb = (double)ROUNDS * BLOCK_SIZE / (1024 * 1024);
+  printf("crc32c:    %.0f MB/s\n", mb / hw);
+  printf("crc32c_sw: %.0f MB/s\n", mb / sw);
+  printf("(%08x)\n", sum);
+  return 0;
+}
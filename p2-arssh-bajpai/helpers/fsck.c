@@ -0,0 +1,782 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "crc32c.h"
+#include "directory.h"
+#include "inode.h"
+#include "ioengine.h"
+#include "journal.h"
+#include "xattr.h"
+#include "tier.h"
+
+// fsck.nufs: checks (and with -y, repairs) a nufs disk image that is not mounted.
+//
+// Usage: fsck.nufs [-y] [-c] [-j threads] [-t fast-tier] <disk-image> [<disk-image>...]
+//   (several images: the files of an image striped across them, in stripe order)
+//   -t  the image's fast tier, if it has one (see tier.h)
+//   -y  repair what can be repaired (otherwise the image is only read)
+//   -c  also verify every data block against its checksum
+//   -j  number of worker threads (default: one per CPU)
+//
+// Before the phases, the superblock's layout is compared with the one its block count gives
+// (blocks_layout()); the image is only loaded once they agree, which -y arranges by rewriting
+// the layout fields.
+//
+// The check runs in phases. Each phase splits its work (ranges of the inode table or of
+// the block space) into chunks that worker threads take in turn, and each worker keeps
+// its own results; they are merged once the phase is over.
+//   1. Inodes: walk every block map, claiming each block it references (a bit per block,
+//      set atomically; blocks claimed more than once are listed per worker) and comparing
+//      the number found with the count the inode records, and note the parent of every
+//      directory.
+//   2. Directories: find which directories are reachable from the root, then count the
+//      links to every inode from reachable directories.
+//   3. Blocks: compare the bitmap and the reference count table with the claims (and,
+//      with -c, each data block with its checksum), then the superblock's free counts with
+//      the bitmap and inode table.
+//
+// Exit status: 0 if the image is clean, 1 if errors were found and all were repaired,
+// 4 if errors remain, 8 if the image could not be checked.
+
+#define PTRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+#define INODE_CHUNK 16                   // Inodes a worker takes at a time
+#define BLOCK_CHUNK (PTRS_PER_BLOCK * 64) // Blocks a worker takes at a time (64 table blocks)
+#define CSUM_RUN 64                      // Most data blocks read with one request by -c
+#define MAX_THREADS 256
+
+static int fds[IOENGINE_MAX_DEVICES];
+static int nfds = 0;
+static int repair = 0;
+static int verify_data = 0;
+static int nthreads = 1;
+static superblock_t *sb;
+static inode_t *inodes;
+static int ninodes_total;
+
+// Blocks replayed from the journal. When only checking, they are not written back, so
+// reads of those blocks are served from these copies instead of from the image.
+static int replayed[JOURNAL_BLOCKS];
+static char *replayed_data[JOURNAL_BLOCKS];
+static int replayed_count = 0;
+
+// One bit per block: referenced by some inode, and referenced more than once
+static _Atomic uint64_t *claimed;
+static _Atomic uint64_t *multi;
+
+// Parent directory of every directory (-1: none seen), and what phase 2 made of it
+static _Atomic int *parent;
+static int *reachable;
+
+// Repairs that write to the image are serialized (they may share checksum-table blocks)
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hands out chunks of work to the workers
+static atomic_long next_chunk;
+
+// What one worker found
+typedef struct worker {
+  long errors;
+  long fixed;
+  long inodes, dirs, blocks;
+  int *extra;      // Second and later claims of shared blocks
+  long extra_count, extra_cap;
+  int *links;
+  char buf[CSUM_RUN * BLOCK_SIZE];
+  char tables[2][BLOCK_CHUNK / PTRS_PER_BLOCK * BLOCK_SIZE];
+} worker_t;
+
+static worker_t *workers;
+
+// Sorted extra claims of all workers, merged after phase 1
+static int *extras;
+static long extras_count;
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Problems found in the superblock's layout, before there are workers to count them
+static long sb_errors = 0, sb_fixed = 0;
+
+// Report a problem; 'fixable' says whether -y repairs it
+static void problem(worker_t *w, int fixable, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void problem(worker_t *w, int fixable, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&print_lock);
+  vprintf(fmt, ap);
+  printf(repair && fixable ? " (fixed)\n" : "\n");
+  pthread_mutex_unlock(&print_lock);
+  va_end(ap);
+  w->errors++;
+  if (repair && fixable) w->fixed++;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read 'count' consecutive blocks, seeing blocks replayed from the journal as replayed
+static int read_blocks(void *buf, uint32_t first, int count) {
+  size_t len = (size_t)count * BLOCK_SIZE;
+  if (ioengine_pread(buf, len, (off_t)first * BLOCK_SIZE) != (ssize_t)len) {
+    return -EIO;
+  }
+  for (int i = 0; i < replayed_count; i++) {
+    if (replayed[i] >= (int)first && replayed[i] < (int)first + count) {
+      memcpy((char *)buf + (size_t)(replayed[i] - first) * BLOCK_SIZE, replayed_data[i], BLOCK_SIZE);
+    }
+  }
+  return 0;
+}
+
+// Write a block to the image, keeping the checksum of a data block current
+static int write_block(uint32_t bnum, const void *data) {
+  int rv = 0;
+  pthread_mutex_lock(&write_lock);
+  if (ioengine_pwrite(data, BLOCK_SIZE, (off_t)bnum * BLOCK_SIZE) != BLOCK_SIZE) rv = -EIO;
+  if (rv == 0 && bnum >= sb->data_start) {
+    uint32_t table[PTRS_PER_BLOCK];
+    uint32_t tnum = sb->csum_start + bnum / PTRS_PER_BLOCK;
+    if (read_blocks(table, tnum, 1) < 0) {
+      rv = -EIO;
+    } else {
+      table[bnum % PTRS_PER_BLOCK] = crc32c(0, data, BLOCK_SIZE);
+      if (ioengine_pwrite(table, BLOCK_SIZE, (off_t)tnum * BLOCK_SIZE) != BLOCK_SIZE) rv = -EIO;
+    }
+  }
+  pthread_mutex_unlock(&write_lock);
+  return rv;
+}
+
+// Compare the layout fields of a nufs superblock with the layout of an image of its block
+// count, rewriting them when repairing. The block count itself is trusted only if the image
+// files have the sizes it gives. Returns 0 if the image can be loaded, -1 if not.
+static int check_superblock(const char *path) {
+  char block[BLOCK_SIZE];
+  superblock_t found, expected;
+  if (ioengine_pread(block, BLOCK_SIZE, 0) != BLOCK_SIZE) return 0; // blocks_load() reports it
+  memcpy(&found, block, sizeof(found));
+  if (found.magic != NUFS_MAGIC) return 0;
+  expected = found;
+  blocks_layout(&expected, found.block_count);
+  if (memcmp(&found, &expected, offsetof(superblock_t, free_blocks)) == 0) return 0;
+
+  sb_errors++;
+  int trusted = found.block_count > expected.data_start && found.block_count <= INT_MAX &&
+                found.stripe_count == (uint32_t)nfds && found.stripe_unit > 0;
+  if (trusted) ioengine_set_stripe_unit((size_t)found.stripe_unit * BLOCK_SIZE);
+  for (int i = 0; trusted && i < nfds; i++) {
+    trusted = lseek(fds[i], 0, SEEK_END) == ioengine_device_size(i, (off_t)found.block_count * BLOCK_SIZE);
+  }
+  if (!trusted) {
+    printf("Superblock: version %u layout of %u blocks does not match the image files; cannot repair\n",
+           found.version, found.block_count);
+    return -1;
+  }
+  printf("Superblock: layout (version %u) does not match a version %d image of %u blocks%s\n", found.version,
+         NUFS_VERSION, found.block_count, repair ? " (fixed)" : "");
+  if (!repair) return -1;
+  memcpy(block, &expected, sizeof(expected));
+  if (ioengine_pwrite(block, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+    perror("Failed to write the superblock");
+    return -1;
+  }
+  sb_fixed++;
+  return 0;
+}
+
+// Journal replay: keep copies of the replayed blocks, and write them home when repairing
+static int replay_blocks(const int *block_nums, int count) {
+  for (int i = 0; i < count && replayed_count < JOURNAL_BLOCKS; i++) {
+    char *copy = malloc(BLOCK_SIZE);
+    memcpy(copy, blocks_pin(block_nums[i]), BLOCK_SIZE);
+    blocks_unpin(block_nums[i]);
+    if (repair && write_block(block_nums[i], copy) < 0) {
+      fprintf(stderr, "Failed to write replayed block %d\n", block_nums[i]);
+    }
+    if (repair) {
+      free(copy); // Now on disk
+    } else {
+      replayed[replayed_count] = block_nums[i];
+      replayed_data[replayed_count++] = copy;
+    }
+  }
+  return 0;
+}
+
+static int is_data_block(int bnum) {
+  return bnum >= (int)sb->data_start && bnum < (int)sb->block_count;
+}
+
+static int test_bit(_Atomic uint64_t *bits, int bnum) {
+  return (atomic_load_explicit(&bits[bnum / 64], memory_order_relaxed) >> (bnum % 64)) & 1;
+}
+
+// Record that a block is referenced; second and later claims are listed too
+static void claim(worker_t *w, int bnum) {
+  uint64_t bit = 1ULL << (bnum % 64);
+  if (!(atomic_fetch_or(&claimed[bnum / 64], bit) & bit)) return;
+
+  atomic_fetch_or(&multi[bnum / 64], bit);
+  if (w->extra_count == w->extra_cap) {
+    w->extra_cap = w->extra_cap ? w->extra_cap * 2 : 1024;
+    w->extra = realloc(w->extra, w->extra_cap * sizeof(int));
+    if (!w->extra) {
+      fprintf(stderr, "Out of memory\n");
+      exit(8);
+    }
+  }
+  w->extra[w->extra_count++] = bnum;
+}
+
+// Check one pointer of inode 'inum' to file block 'fbn' (for a pointer block, the first
+// file block it maps). Returns 1 if it may be followed; otherwise it is cleared when repairing.
+static int check_pointer(worker_t *w, int inum, int *slot, long fbn, long nblocks) {
+  if (*slot == 0) return 0;
+  if (!is_data_block(*slot)) {
+    problem(w, 1, "Inode %d: pointer to block %d outside the data area", inum, *slot);
+  } else if (fbn >= nblocks) {
+    problem(w, 1, "Inode %d: block %d mapped past the end of the file (file block %ld)", inum, *slot, fbn);
+  } else {
+    return 1;
+  }
+  if (repair) *slot = 0;
+  return 0;
+}
+
+// Walk a pointer block of inode 'inum' covering file blocks from 'first' on.
+// 'depth' is 1 for a block of data pointers, 2 for a block of pointer blocks.
+static void walk_pointers(worker_t *w, int inum, int *slot, long first, int depth, long nblocks) {
+  if (!check_pointer(w, inum, slot, first, nblocks)) return;
+  claim(w, *slot);
+  w->blocks++;
+
+  int ptrs[PTRS_PER_BLOCK];
+  if (read_blocks(ptrs, *slot, 1) < 0) {
+    problem(w, 0, "Inode %d: cannot read pointer block %d", inum, *slot);
+    return;
+  }
+  int changed = 0;
+  long span = depth == 1 ? 1 : PTRS_PER_BLOCK;
+  for (int i = 0; i < PTRS_PER_BLOCK; i++) {
+    int before = ptrs[i];
+    if (depth == 1) {
+      if (check_pointer(w, inum, &ptrs[i], first + i, nblocks)) {
+        claim(w, ptrs[i]);
+        w->blocks++;
+      }
+    } else {
+      walk_pointers(w, inum, &ptrs[i], first + i * span, 1, nblocks);
+    }
+    changed |= ptrs[i] != before;
+  }
+  if (changed && write_block(*slot, ptrs) < 0) {
+    fprintf(stderr, "Failed to write pointer block %d\n", *slot);
+  }
+}
+
+// Phase 1 for one inode: claim its blocks and note the parent of each subdirectory
+static void check_inode(worker_t *w, int inum) {
+  inode_t *node = &inodes[inum];
+  inode_map_t *map = inode_map(node);
+  if (node->refs <= 0) return;
+  w->inodes++;
+
+  if (!S_ISREG(node->mode) && !S_ISDIR(node->mode) && !S_ISLNK(node->mode)) {
+    problem(w, 0, "Inode %d: unknown file type (mode %o)", inum, node->mode);
+    return;
+  }
+  if (node->size < 0) {
+    problem(w, 0, "Inode %d: negative size %d", inum, node->size);
+    return;
+  }
+
+  if (node->xattr_block) {
+    xattr_block_t header;
+    char block[BLOCK_SIZE];
+    if (!is_data_block(node->xattr_block) || read_blocks(block, node->xattr_block, 1) < 0 ||
+        (memcpy(&header, block, sizeof(header)), header.magic != XATTR_MAGIC)) {
+      problem(w, 1, "Inode %d: bad extended attribute block %d", inum, node->xattr_block);
+      if (repair) node->xattr_block = 0;
+    } else {
+      claim(w, node->xattr_block);
+      w->blocks++;
+    }
+  }
+  // The second byte of the inline area is the first entry's name length: 0 if there are none
+  if (!(node->flags & INODE_XATTRS) && (node->xattr_block || inode_xattrs(node)[1])) {
+    problem(w, 1, "Inode %d: extended attributes present but not flagged", inum);
+    if (repair) node->flags |= INODE_XATTRS;
+  }
+
+  // Directories keep their entries in block[0] whatever their size; a short symlink has no block map
+  long first = w->blocks, errors = w->errors;
+  long nblocks = S_ISDIR(node->mode) ? 1 : ((long)node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (int i = 0; i < INODE_DIRECT && !inode_is_inline(node); i++) {
+    if (check_pointer(w, inum, &map->block[i], i, nblocks)) {
+      claim(w, map->block[i]);
+      w->blocks++;
+    }
+  }
+  if (!inode_is_inline(node)) {
+    walk_pointers(w, inum, &map->indirect, INODE_DIRECT, 1, nblocks);
+    walk_pointers(w, inum, &map->dindirect, INODE_DIRECT + PTRS_PER_BLOCK, 2, nblocks);
+  }
+
+  // The count in the record is journaled with the size, the map with the pointers: a size
+  // change that missed the journal shows up as a map that disagrees with its count
+  long mapped = w->blocks - first;
+  if (node->blocks != mapped) {
+    // Pointers found bad above were already reported, and the count follows their repair
+    if (w->errors == errors) {
+      problem(w, 1, "Inode %d: block map holds %ld blocks, the inode records %d", inum, mapped, node->blocks);
+    }
+    if (repair) node->blocks = mapped;
+  }
+
+  if (!S_ISDIR(node->mode) || inode_is_inline(node)) return;
+  w->dirs++;
+  if (map->block[0] == 0) {
+    problem(w, 0, "Directory %d has no entry block", inum);
+    return;
+  }
+
+  directory_t *dir = (directory_t *)w->buf;
+  if (read_blocks(dir, map->block[0], 1) < 0 || directory_check(dir) < 0) {
+    problem(w, 0, "Directory %d: unreadable entry block %d", inum, map->block[0]);
+    return;
+  }
+  int pos = 0;
+  const directory_entry_t *entry;
+  while ((entry = directory_next(dir, &pos))) {
+    int child = entry->inum;
+    if (child <= 0 || child >= ninodes_total || !S_ISDIR(inodes[child].mode) || inodes[child].refs <= 0) {
+      continue; // Not a directory; phase 2 checks every entry
+    }
+    int none = -1;
+    atomic_compare_exchange_strong(&parent[child], &none, inum); // Phase 2 flags the others
+  }
+}
+
+// Phase 2 for one directory: check its entries and count the links they make
+static void check_entries(worker_t *w, int inum) {
+  inode_t *node = &inodes[inum];
+  int bnum = inode_map(node)->block[0];
+  if (node->refs <= 0 || !S_ISDIR(node->mode) || !reachable[inum] || !is_data_block(bnum)) return;
+
+  directory_t *dir = (directory_t *)w->buf;
+  if (read_blocks(dir, bnum, 1) < 0 || directory_check(dir) < 0) {
+    return; // Reported in phase 1
+  }
+
+  int changed = 0;
+  int pos = 0;
+  const directory_entry_t *entry;
+  while ((entry = directory_next(dir, &pos))) {
+    char name[MAX_NAME_LEN + 1];
+    memcpy(name, entry->name, entry->name_len);
+    name[entry->name_len] = '\0';
+    int child = entry->inum;
+
+    const char *bad = NULL;
+    if (child <= 0 || child >= ninodes_total) {
+      bad = "refers to an invalid inode";
+    } else if (inodes[child].refs <= 0) {
+      bad = "refers to a free inode";
+    } else if (S_ISDIR(inodes[child].mode) && parent[child] != inum) {
+      bad = "is an extra link to a directory";
+    }
+    if (bad) {
+      problem(w, 1, "Directory %d: entry '%s' (inode %d) %s", inum, name, child, bad);
+      if (repair) {
+        directory_delete(dir, name); // Later records stay where they are
+        changed = 1;
+      }
+      continue;
+    }
+    w->links[child]++;
+  }
+  if (changed && write_block(bnum, dir) < 0) {
+    fprintf(stderr, "Failed to write directory block %d\n", bnum);
+  }
+}
+
+// Number of claims on a block (0 if none)
+static long claims(int bnum) {
+  if (!test_bit(claimed, bnum)) return 0;
+  if (!test_bit(multi, bnum)) return 1;
+
+  // First entry >= bnum, then count the run
+  long lo = 0, hi = extras_count;
+  while (lo < hi) {
+    long mid = (lo + hi) / 2;
+    if (extras[mid] < bnum) lo = mid + 1; else hi = mid;
+  }
+  long n = 1;
+  while (lo < extras_count && extras[lo++] == bnum) n++;
+  return n;
+}
+
+// Phase 3 for one chunk of the block space: bitmap and reference counts against claims
+static void check_blocks(worker_t *w, int start, int end) {
+  void *bitmap = get_blocks_bitmap();
+
+  // Metadata blocks are always allocated and never referenced by inodes
+  for (int b = start; b < end && b < (int)sb->data_start; b++) {
+    if (!bitmap_get(bitmap, b)) {
+      problem(w, 1, "Metadata block %d is marked free", b);
+      if (repair) bitmap_put(bitmap, b, 1);
+    }
+  }
+  if (end <= (int)sb->data_start) return;
+
+  // Chunks start on a table block boundary, so each chunk's entries are contiguous
+  int tables = (end - start + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+  uint32_t *refs = (uint32_t *)w->tables[0];
+  uint32_t *csums = (uint32_t *)w->tables[1];
+  if (read_blocks(refs, sb->refs_start + start / PTRS_PER_BLOCK, tables) < 0 ||
+      (verify_data && read_blocks(csums, sb->csum_start + start / PTRS_PER_BLOCK, tables) < 0)) {
+    problem(w, 0, "Cannot read the tables for blocks %d-%d", start, end - 1);
+    return;
+  }
+
+  int changed = 0;
+  for (int b = start > (int)sb->data_start ? start : (int)sb->data_start; b < end; b++) {
+    long expected = claims(b);
+    int used = bitmap_get(bitmap, b);
+    uint32_t *count = &refs[b - start];
+    if (expected && !used) {
+      problem(w, 1, "Block %d is in use but marked free", b);
+      if (repair) bitmap_put(bitmap, b, 1);
+    } else if (!expected && used) {
+      problem(w, 1, "Block %d is marked in use but nothing refers to it", b);
+      if (repair) bitmap_put(bitmap, b, 0);
+    } else if (*count != expected && used) {
+      problem(w, 1, "Block %d has %u references, expected %ld", b, *count, expected);
+    }
+    if (*count != expected && repair) {
+      *count = expected; // Stale counts of free blocks are cleared quietly
+      changed = 1;
+    }
+  }
+  if (changed) {
+    pthread_mutex_lock(&write_lock);
+    size_t len = (size_t)tables * BLOCK_SIZE;
+    if (ioengine_pwrite(refs, len, (off_t)(sb->refs_start + start / PTRS_PER_BLOCK) * BLOCK_SIZE) != (ssize_t)len) {
+      fprintf(stderr, "Failed to write reference counts for blocks %d-%d\n", start, end - 1);
+    }
+    pthread_mutex_unlock(&write_lock);
+  }
+
+  // With -c, read runs of referenced data blocks and compare them with their checksums
+  for (int b = start > (int)sb->data_start ? start : (int)sb->data_start; verify_data && b < end;) {
+    if (!test_bit(claimed, b)) {
+      b++;
+      continue;
+    }
+    int run = 1;
+    while (run < CSUM_RUN && b + run < end && test_bit(claimed, b + run)) run++;
+    if (read_blocks(w->buf, b, run) < 0) {
+      problem(w, 0, "Cannot read blocks %d-%d", b, b + run - 1);
+    } else {
+      for (int i = 0; i < run; i++) {
+        uint32_t actual = crc32c(0, w->buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        if (actual != csums[b + i - start]) {
+          problem(w, 0, "Block %d does not match its checksum (stored %08x, actual %08x)", b + i,
+                  csums[b + i - start], actual);
+        }
+      }
+    }
+    b += run;
+  }
+}
+
+// Worker bodies: take chunks until none are left
+static void *phase1_worker(void *arg) {
+  worker_t *w = arg;
+  long chunk;
+  while ((chunk = atomic_fetch_add(&next_chunk, 1)) * INODE_CHUNK < ninodes_total) {
+    for (int i = chunk * INODE_CHUNK; i < (chunk + 1) * INODE_CHUNK && i < ninodes_total; i++) {
+      check_inode(w, i);
+    }
+  }
+  return NULL;
+}
+
+static void *phase2_worker(void *arg) {
+  worker_t *w = arg;
+  long chunk;
+  while ((chunk = atomic_fetch_add(&next_chunk, 1)) * INODE_CHUNK < ninodes_total) {
+    for (int i = chunk * INODE_CHUNK; i < (chunk + 1) * INODE_CHUNK && i < ninodes_total; i++) {
+      check_entries(w, i);
+    }
+  }
+  return NULL;
+}
+
+static void *phase3_worker(void *arg) {
+  worker_t *w = arg;
+  long chunk;
+  while ((chunk = atomic_fetch_add(&next_chunk, 1)) * BLOCK_CHUNK < (long)sb->block_count) {
+    long end = (chunk + 1) * BLOCK_CHUNK;
+    check_blocks(w, chunk * BLOCK_CHUNK, end < (long)sb->block_count ? end : (long)sb->block_count);
+  }
+  return NULL;
+}
+
+// Run one phase on all workers
+static void run_phase(void *(*body)(void *)) {
+  pthread_t threads[MAX_THREADS];
+  atomic_store(&next_chunk, 0);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, body, &workers[i]);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static int by_block(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// Merge the workers' extra claims into one sorted list
+static void merge_claims() {
+  extras_count = 0;
+  for (int i = 0; i < nthreads; i++) extras_count += workers[i].extra_count;
+  extras = malloc((extras_count + 1) * sizeof(int));
+  long n = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(extras + n, workers[i].extra, workers[i].extra_count * sizeof(int));
+    n += workers[i].extra_count;
+  }
+  qsort(extras, extras_count, sizeof(int), by_block);
+}
+
+// Follow a directory's parents up. Returns 0 if they lead to the root, the first directory
+// without a parent if they stop short of it, or -1 if they go round in a cycle.
+static int top_dir(int inum) {
+  for (int steps = 0; steps <= ninodes_total; steps++) {
+    if (inum == 0) return 0;
+    if (parent[inum] < 0) return inum;
+    inum = parent[inum];
+  }
+  return -1;
+}
+
+// Work out which directories can be reached from the root
+static void find_reachable() {
+  for (int i = 0; i < ninodes_total; i++) {
+    reachable[i] = inodes[i].refs > 0 && S_ISDIR(inodes[i].mode) && top_dir(i) == 0;
+  }
+}
+
+// Give an unreachable inode a name in the root directory, if there is room
+static int reconnect(worker_t *w, int inum) {
+  directory_t *root = (directory_t *)w->buf;
+  char name[16];
+  snprintf(name, sizeof(name), "#%d", inum);
+  int bnum = inode_map(&inodes[0])->block[0];
+  if (read_blocks(root, bnum, 1) < 0 || directory_put(root, name, inum) < 0) return -1;
+  if (write_block(bnum, root) < 0) return -1;
+  if (S_ISDIR(inodes[inum].mode)) parent[inum] = 0;
+  return 0;
+}
+
+// Attach the fast tier the superblock names
+static int attach_tier(const char *path, const char *tier_path, int *tier_fd) {
+  if (!tier_path) {
+    fprintf(stderr, "%s: part of the image is on a fast tier; give it with -t\n", path);
+    return -1;
+  }
+  *tier_fd = open(tier_path, repair ? O_RDWR : O_RDONLY);
+  uint32_t id = sb->tier_id;
+  int rv = *tier_fd < 0 ? -errno : tier_attach(*tier_fd, &id);
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s\n", tier_path, strerror(-rv));
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-y] [-c] [-j threads] [-t fast-tier] <disk-image> [<disk-image>...]\n", prog);
+  fprintf(stderr, "  (for a striped image, give all of its files in stripe order)\n");
+  fprintf(stderr, "  -t fast-tier  the file holding the image's fast tier (mounted with -o tier=)\n");
+  fprintf(stderr, "  -y          repair the errors found (otherwise the image is not modified)\n");
+  fprintf(stderr, "  -c          verify every data block against its checksum\n");
+  fprintf(stderr, "  -j threads  number of worker threads (default: one per CPU)\n");
+  exit(8);
+}
+
+int main(int argc, char **argv) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  const char *tier_path = NULL;
+  while ((opt = getopt(argc, argv, "ycj:t:")) != -1) {
+    switch (opt) {
+    case 'y': repair = 1; break;
+    case 'c': verify_data = 1; break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 't': tier_path = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind == argc || argc - optind > IOENGINE_MAX_DEVICES) usage(argv[0]);
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+  const char *path = argv[optind];
+  for (int i = optind; i < argc; i++) {
+    fds[nfds] = open(argv[i], repair ? O_RDWR : O_RDONLY);
+    if (fds[nfds++] < 0) {
+      perror(argv[i]);
+      return 8;
+    }
+  }
+
+  double start = now();
+  ioengine_open_striped(IOENGINE_PREAD, fds, nfds, IOENGINE_STRIPE_UNIT, NULL, 0);
+  blocks_init(0);
+  journal_init(replay_blocks, NULL);
+  if (check_superblock(path) < 0) {
+    printf("%s: %ld errors found, %ld fixed; the rest of the image cannot be checked without a valid superblock\n",
+           path, sb_errors, sb_fixed);
+    return 4;
+  }
+  if (blocks_load() <= 0) {
+    fprintf(stderr, "%s: not a nufs image (version %d)\n", path, NUFS_VERSION);
+    return 8;
+  }
+  sb = get_superblock();
+
+  // Extents on the fast tier (the journal's blocks among them) are read from there
+  int tier_fd = -1;
+  if (sb->tier_id != 0 && attach_tier(path, tier_path, &tier_fd) < 0) return 8;
+  int replay = journal_recover();
+  if (replay > 0) {
+    printf("Journal: %s a transaction of %d blocks\n", repair ? "replayed" : "would replay", replay);
+  }
+  if (sb->tier_id != 0 && tier_fd < 0 && attach_tier(path, tier_path, &tier_fd) < 0) return 8;
+  blocks_release();
+  inode_load();
+  inodes = get_inode(0);
+  ninodes_total = inode_count();
+  if (!inodes[0].refs || !S_ISDIR(inodes[0].mode)) {
+    fprintf(stderr, "%s: the root directory is missing\n", path);
+    return 8;
+  }
+
+  size_t words = (sb->block_count + 63) / 64;
+  claimed = calloc(words, sizeof(uint64_t));
+  multi = calloc(words, sizeof(uint64_t));
+  workers = calloc(nthreads, sizeof(worker_t));
+  parent = malloc(ninodes_total * sizeof(*parent));
+  reachable = calloc(ninodes_total, sizeof(*reachable));
+  int ok = claimed && multi && workers && parent && reachable;
+  for (int t = 0; ok && t < nthreads; t++) {
+    workers[t].links = calloc(ninodes_total, sizeof(int));
+    ok = workers[t].links != NULL;
+  }
+  if (!ok) {
+    fprintf(stderr, "Out of memory\n");
+    return 8;
+  }
+  for (int i = 0; i < ninodes_total; i++) parent[i] = -1;
+
+  // Phase 1: inodes and block maps
+  run_phase(phase1_worker);
+  merge_claims();
+
+  // Phase 2: directory tree and link counts
+  worker_t *main_w = &workers[0];
+  find_reachable();
+  for (int i = 1; i < ninodes_total; i++) {
+    if (inodes[i].refs <= 0 || !S_ISDIR(inodes[i].mode) || reachable[i]) continue;
+    // Only the top of a detached subtree (or one directory of a cycle) is reported
+    int top = top_dir(i);
+    if (top == i || top == -1) {
+      problem(main_w, 1, "Directory %d is not reachable from the root", i);
+      if (repair && reconnect(main_w, i) == 0) find_reachable();
+    }
+  }
+  run_phase(phase2_worker);
+  for (int i = 1; i < ninodes_total; i++) {
+    if (inodes[i].refs <= 0) continue;
+    if (S_ISDIR(inodes[i].mode)) {
+      if (repair && reachable[i]) inodes[i].refs = 1;
+      continue;
+    }
+
+    int links = 0;
+    for (int t = 0; t < nthreads; t++) links += workers[t].links[i];
+    if (links == 0) {
+      problem(main_w, 1, "Inode %d is not reachable from the root", i);
+      if (repair && reconnect(main_w, i) == 0) links = 1;
+    } else if (inodes[i].refs != links) {
+      problem(main_w, 1, "Inode %d has %d links, expected %d", i, inodes[i].refs, links);
+    }
+    if (repair && links > 0) inodes[i].refs = links;
+  }
+
+  // Phase 3: bitmap, reference counts and (with -c) checksums
+  run_phase(phase3_worker);
+
+  // The superblock's free counts, against the (repaired) bitmap and inode table
+  uint32_t free_blocks = sb->block_count - bitmap_count(get_blocks_bitmap(), sb->block_count);
+  uint32_t free_inodes = 0;
+  for (int i = 0; i < ninodes_total; i++) {
+    if (inodes[i].refs <= 0) free_inodes++;
+  }
+  if (sb->free_blocks != free_blocks || sb->free_inodes != free_inodes) {
+    problem(main_w, 1, "Superblock: %u free blocks and %u free inodes recorded, %u and %u found", sb->free_blocks,
+            sb->free_inodes, free_blocks, free_inodes);
+    if (repair) {
+      sb->free_blocks = free_blocks;
+      sb->free_inodes = free_inodes;
+    }
+  }
+
+  long errors = sb_errors, fixed = sb_fixed, ninodes = 0, ndirs = 0, nblocks = 0;
+  for (int i = 0; i < nthreads; i++) {
+    errors += workers[i].errors;
+    fixed += workers[i].fixed;
+    ninodes += workers[i].inodes;
+    ndirs += workers[i].dirs;
+    nblocks += workers[i].blocks;
+  }
+
+  // The bitmap and inode table were repaired in memory; the journal is emptied with them
+  if (repair) {
+    memset(blocks_get_block(sb->journal_start), 0, (size_t)(sb->refs_start - sb->journal_start) * BLOCK_SIZE);
+    size_t len = (size_t)blocks_resident_count() * BLOCK_SIZE;
+    if (ioengine_pwrite(get_superblock(), len, 0) != (ssize_t)len || ioengine_sync() < 0) {
+      perror("Failed to write the repaired metadata");
+      return 8;
+    }
+  }
+
+  tier_detach();
+  printf("%s: %ld inodes (%ld directories), %ld block references (%ld to shared blocks), %u blocks\n", path,
+         ninodes, ndirs, nblocks, extras_count, sb->block_count);
+  printf("%s: %ld errors found, %ld fixed, %.2fs with %d thread%s\n", path, errors, fixed, now() - start, nthreads,
+         nthreads == 1 ? "" : "s");
+  ioengine_close();
+  if (tier_fd >= 0) close(tier_fd);
+  while (nfds > 0) close(fds[--nfds]);
+  return errors == 0 ? 0 : errors == fixed ? 1 : 4;
+}
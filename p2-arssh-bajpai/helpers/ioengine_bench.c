@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "ioengine.h"
+
+// Random 4 KiB reads against a scratch file, in batches of `depth` requests,
+// to compare the I/O engines at different queue depths. The file is opened with
+// O_DIRECT where possible, so the reads reach the device instead of the page cache.
+#define TEST_NAME "ioengine_bench.img"
+#define FILE_SIZE (256L << 20)
+#define READS 16384
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(const char *engine, int fd, char *bufs, int depth) {
+  ioengine_open(engine, fd, bufs, (size_t)IOENGINE_DEPTH * BLOCK_SIZE);
+  io_request_t reqs[IOENGINE_DEPTH];
+
+  srand(1);
+  double start = now();
+  for (int done = 0; done < READS; done += depth) {
+    for (int i = 0; i < depth; i++) {
+      off_t block = rand() % (FILE_SIZE / BLOCK_SIZE);
+      reqs[i] = (io_request_t){IO_READ, bufs + i * BLOCK_SIZE, BLOCK_SIZE, block * BLOCK_SIZE, 0};
+    }
+    if (ioengine_submit(reqs, depth) < 0) {
+      fprintf(stderr, "read failed\n");
+      exit(1);
+    }
+  }
+  double secs = now() - start;
+  ioengine_close();
+  return (double)READS * BLOCK_SIZE / secs / (1 << 20);
+}
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : TEST_NAME;
+
+  // Fill the scratch file so every read hits allocated blocks
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  char *chunk = calloc(1, 1 << 20);
+  memset(chunk, 0x5a, 1 << 20);
+  for (long off = 0; off < FILE_SIZE; off += 1 << 20) {
+    pwrite(fd, chunk, 1 << 20, off);
+  }
+  fsync(fd);
+  close(fd);
+  free(chunk);
+
+  fd = open(path, O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    printf("O_DIRECT not supported here; results include page cache hits\n");
+    fd = open(path, O_RDONLY);
+  }
+
+  char *bufs;
+  posix_memalign((void **)&bufs, BLOCK_SIZE, (size_t)IOENGINE_DEPTH * BLOCK_SIZE);
+
+  int depths[] = {1, 4, 16, IOENGINE_DEPTH};
+  printf("%-6s %12s %12s\n", "depth", "pread MB/s", "uring MB/s");
+  for (int i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); i++) {
+    double sync_rate = run(IOENGINE_PREAD, fd, bufs, depths[i]);
+    double uring_rate = run(IOENGINE_URING, fd, bufs, depths[i]);
+    printf("%-6d %12.1f %12.1f\n", depths[i], sync_rate, uring_rate);
+  }
+
+  close(fd);
+  free(bufs);
+  unlink(path);
+  return 0;
+}
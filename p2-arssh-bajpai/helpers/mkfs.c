@@ -0,0 +1,681 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "crc32c.h"
+#include "directory.h"
+#include "inode.h"
+
+// mkfs.nufs: formats a nufs disk image, optionally filled with a copy of a host directory.
+//
+// Usage: mkfs.nufs [-d dir] [-s size] [-j threads] <disk-image>
+//   -d  copy the tree under 'dir' into the new image (otherwise it is empty)
+//   -s  size of the image, e.g. 512M or 20G (default: the copy plus ~10%, at least 256
+//       blocks and INODE_RATIO blocks per inode; the file is sparse, so unused space is free)
+//   -j  number of worker threads (default: one per CPU)
+//
+// The image is built directly in the on-disk format, without the journal or the block
+// cache, in three steps:
+//   1. Walk: worker threads take directories from a shared stack, list them and stat
+//      their entries. Every entry becomes a node; subdirectories go back on the stack.
+//   2. Layout (one thread): number the inodes (hard links share one), then give each
+//      directory, long symlink and file a contiguous run of blocks: the file's data,
+//      followed by the indirect blocks that map it. Only then is the image formatted, so
+//      its size can follow from what it has to hold.
+//   3. Copy: workers take runs of consecutive nodes, whose blocks are consecutive too, and
+//      stage their blocks (file contents, directory entries, pointer blocks) in a buffer
+//      that is written with one large pwrite() whenever the next block doesn't follow on.
+// Finally the metadata area and the reference count and checksum tables are written.
+//
+// Entries nufs cannot hold (names over MAX_NAME_LEN, entries that don't fit in their
+// directory's block, devices, files too large for the block map) are reported and left out. Exit status: 0 if everything was copied,
+// 1 if some entries were left out, 8 if no image could be made.
+
+#define PTRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+#define MAX_FILE_BLOCKS (INODE_DIRECT + PTRS_PER_BLOCK + (long)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define NODE_CHUNK 64      // Nodes a worker copies at a time
+#define STAGE_BLOCKS 1024  // Blocks staged per write (4 MiB)
+#define MAX_THREADS 256
+
+// An entry of the host tree
+typedef struct node {
+  char *path;         // Host path
+  int name;           // Offset of the name in 'path'
+  int parent;         // Node of the parent directory (-1 for the root)
+  int link;           // Node this one is a hard link to, or -1
+  mode_t mode;
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  nlink_t nlink;
+  int64_t atime;      // Host access and modification times, in nanoseconds (0: when the image is made)
+  int64_t mtime;
+  int inum;           // Inode (shared by hard links)
+  int refs;           // Links to the inode, counted on the node that owns it
+  int first_block;    // First of the node's blocks (-1: none)
+  int data_blocks;    // Blocks of file contents; the pointer blocks follow them
+  int first_child;    // Children of a directory: children[first_child ...]
+  int child_count;
+} node_t;
+
+static int fd = -1;
+static int64_t made_at; // When the image is made, in nanoseconds since the epoch
+static int nthreads;
+static superblock_t *sb;
+
+static node_t *nodes;
+static int node_count, node_cap;
+static int *children;
+static atomic_int skipped;
+
+// Directories waiting to be listed, and how many are waiting or being listed
+static int *dir_stack;
+static int dir_stack_len, dir_stack_cap, dirs_pending;
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+// Reference count and checksum tables of the new image, written at the end
+static uint32_t *refs_table;
+static uint32_t *csum_table;
+
+static atomic_long next_chunk;
+static atomic_long bytes_copied;
+static atomic_int write_errors;
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void warn_skip(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void warn_skip(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&print_lock);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  pthread_mutex_unlock(&print_lock);
+  va_end(ap);
+  atomic_fetch_add(&skipped, 1);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse a size such as "4096", "512M" or "2G" (binary K/M/G/T suffixes); -1 if it isn't one
+static long long parse_size(const char *text) {
+  char *end;
+  long long size = strtoll(text, &end, 10);
+  if (end == text || size < 0) return -1;
+  switch (*end) {
+  case 'T': case 't': size <<= 10; // Fall through
+  case 'G': case 'g': size <<= 10; // Fall through
+  case 'M': case 'm': size <<= 10; // Fall through
+  case 'K': case 'k': size <<= 10; end++; break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "Out of memory\n");
+    exit(8);
+  }
+  return p;
+}
+
+// Blocks of pointers needed to map 'n' file blocks
+static int pointer_blocks(long n) {
+  if (n <= INODE_DIRECT) return 0;
+  n -= INODE_DIRECT + PTRS_PER_BLOCK;
+  return 1 + (n > 0 ? 1 + (int)((n + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK) : 0);
+}
+
+// Step 1 ------------------------------------------------------------------------------
+
+// Whether nufs can hold the entry 'name' (with attributes 'st') under 'dir'
+static int accept_entry(const char *dir, const char *name, const struct stat *st) {
+  if (strlen(name) > MAX_NAME_LEN) {
+    warn_skip("%s/%s: name longer than %d characters, left out", dir, name, MAX_NAME_LEN);
+    return 0;
+  }
+  if (S_ISREG(st->st_mode)) {
+    if (st->st_size > INT_MAX || (st->st_size + BLOCK_SIZE - 1) / BLOCK_SIZE > MAX_FILE_BLOCKS) {
+      warn_skip("%s/%s: too large for a nufs file, left out", dir, name);
+      return 0;
+    }
+  } else if (S_ISLNK(st->st_mode)) {
+    if (st->st_size >= BLOCK_SIZE) {
+      warn_skip("%s/%s: symlink target too long, left out", dir, name);
+      return 0;
+    }
+  } else if (!S_ISDIR(st->st_mode)) {
+    warn_skip("%s/%s: not a file, directory or symlink, left out", dir, name);
+    return 0;
+  }
+  return 1;
+}
+
+// List directory node 'd', adding its entries as nodes and its subdirectories to the stack
+static void walk_dir(int d) {
+  pthread_mutex_lock(&walk_lock);
+  char *path = strdup(nodes[d].path);
+  pthread_mutex_unlock(&walk_lock);
+
+  node_t *found = NULL;
+  int count = 0, cap = 0;
+  int space = DIRECTORY_SPACE; // Entries are packed back to back, as directory_put() does
+  DIR *dir = opendir(path);
+  if (!dir) {
+    warn_skip("%s: %s, contents left out", path, strerror(errno));
+  }
+  struct dirent *ent;
+  while (dir && (ent = readdir(dir))) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    struct stat st;
+    if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      warn_skip("%s/%s: %s, left out", path, ent->d_name, strerror(errno));
+      continue;
+    }
+    if (!accept_entry(path, ent->d_name, &st)) continue;
+    int size = DIRECTORY_RECORD_SIZE(strlen(ent->d_name));
+    if (size > space) {
+      warn_skip("%s/%s: directory block full, left out", path, ent->d_name);
+      continue;
+    }
+    space -= size;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 16;
+      found = xrealloc(found, cap * sizeof(node_t));
+    }
+    node_t *n = &found[count++];
+    memset(n, 0, sizeof(node_t));
+    if (asprintf(&n->path, "%s/%s", path, ent->d_name) < 0) {
+      fprintf(stderr, "Out of memory\n");
+      exit(8);
+    }
+    n->name = strlen(path) + 1;
+    n->parent = d;
+    n->link = -1;
+    n->mode = st.st_mode;
+    n->size = st.st_size;
+    n->dev = st.st_dev;
+    n->ino = st.st_ino;
+    n->nlink = st.st_nlink;
+    n->atime = st.st_atim.tv_sec * NSEC_PER_SEC + st.st_atim.tv_nsec;
+    n->mtime = st.st_mtim.tv_sec * NSEC_PER_SEC + st.st_mtim.tv_nsec;
+  }
+  if (dir) closedir(dir);
+  free(path);
+
+  pthread_mutex_lock(&walk_lock);
+  if (node_count + count > node_cap) {
+    node_cap = (node_count + count) * 2;
+    nodes = xrealloc(nodes, node_cap * sizeof(node_t));
+  }
+  for (int i = 0; i < count; i++) {
+    int index = node_count++;
+    nodes[index] = found[i];
+    if (S_ISDIR(found[i].mode)) {
+      if (dir_stack_len == dir_stack_cap) {
+        dir_stack_cap = dir_stack_cap ? dir_stack_cap * 2 : 64;
+        dir_stack = xrealloc(dir_stack, dir_stack_cap * sizeof(int));
+      }
+      dir_stack[dir_stack_len++] = index;
+      dirs_pending++;
+    }
+  }
+  dirs_pending--;
+  pthread_cond_broadcast(&walk_cond);
+  pthread_mutex_unlock(&walk_lock);
+  free(found);
+}
+
+static void *walk_worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&walk_lock);
+    while (dir_stack_len == 0 && dirs_pending > 0) {
+      pthread_cond_wait(&walk_cond, &walk_lock);
+    }
+    if (dir_stack_len == 0) {
+      pthread_mutex_unlock(&walk_lock);
+      return NULL; // Every directory has been listed
+    }
+    int d = dir_stack[--dir_stack_len];
+    pthread_mutex_unlock(&walk_lock);
+    walk_dir(d);
+  }
+}
+
+static void run_workers(void *(*body)(void *)) {
+  pthread_t threads[MAX_THREADS];
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, body, NULL);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Step 2 ------------------------------------------------------------------------------
+
+static int by_host_inode(const void *a, const void *b) {
+  const node_t *x = &nodes[*(const int *)a], *y = &nodes[*(const int *)b];
+  if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+  if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+  return *(const int *)a - *(const int *)b;
+}
+
+// Point every extra hard link at the first node with the same host inode
+static void find_links() {
+  int *multi = malloc(node_count * sizeof(int));
+  int n = 0;
+  for (int i = 1; i < node_count; i++) {
+    if (!S_ISDIR(nodes[i].mode) && nodes[i].nlink > 1) multi[n++] = i;
+  }
+  qsort(multi, n, sizeof(int), by_host_inode);
+  for (int i = 1; i < n; i++) {
+    node_t *prev = &nodes[multi[i - 1]], *cur = &nodes[multi[i]];
+    if (cur->dev == prev->dev && cur->ino == prev->ino) {
+      cur->link = prev->link >= 0 ? prev->link : multi[i - 1];
+    }
+  }
+  free(multi);
+}
+
+// Number the inodes and list each directory's children; returns the number of inodes
+static int number_inodes() {
+  int inodes = 0;
+  for (int i = 0; i < node_count; i++) {
+    if (nodes[i].link < 0) {
+      nodes[i].inum = inodes++;
+      nodes[i].refs = 1;
+    }
+  }
+  for (int i = 0; i < node_count; i++) {
+    if (nodes[i].link >= 0) {
+      nodes[i].inum = nodes[nodes[i].link].inum;
+      nodes[nodes[i].link].refs++;
+    }
+  }
+
+  // Counting sort of the nodes by parent
+  for (int i = 1; i < node_count; i++) nodes[nodes[i].parent].child_count++;
+  int next = 0;
+  for (int i = 0; i < node_count; i++) {
+    nodes[i].first_child = next;
+    next += nodes[i].child_count;
+    nodes[i].child_count = 0;
+  }
+  children = malloc((node_count + 1) * sizeof(int));
+  for (int i = 1; i < node_count; i++) {
+    node_t *p = &nodes[nodes[i].parent];
+    children[p->first_child + p->child_count++] = i;
+  }
+  return inodes;
+}
+
+// Give each node its blocks, relative to the first data block; returns the number used
+static long plan_blocks() {
+  long next = 0;
+  for (int i = 0; i < node_count; i++) {
+    node_t *n = &nodes[i];
+    long count = 0;
+    if (n->link >= 0) {
+      continue; // The inode's contents belong to the node it links to
+    } else if (S_ISDIR(n->mode)) {
+      count = 1;
+    } else if (S_ISLNK(n->mode)) {
+      count = n->size > INODE_INLINE_MAX ? 1 : 0;
+      n->data_blocks = count;
+    } else {
+      n->data_blocks = (n->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      count = n->data_blocks + pointer_blocks(n->data_blocks);
+    }
+    n->first_block = count ? next : -1;
+    next += count;
+  }
+  return next;
+}
+
+// Format an image with room for 'blocks' data blocks and 'inodes' inodes. With 'size' 0
+// the image is sized to fit; otherwise it must.
+static int format_image(long long size, long blocks, int inodes) {
+  long count = size / BLOCK_SIZE;
+  if (size == 0) {
+    // Leave ~10% free, and grow until the metadata area fits in front of the data
+    count = blocks + blocks / 10 + 64;
+    if (count < BLOCK_COUNT) count = BLOCK_COUNT;
+    if (count < (long)inodes * INODE_RATIO) count = (long)inodes * INODE_RATIO;
+  }
+  for (;;) {
+    if (count > INT_MAX || blocks_format(count) < 0) {
+      fprintf(stderr, "Cannot format an image of %ld blocks\n", count);
+      return -1;
+    }
+    sb = get_superblock();
+    int fits = sb->data_start + blocks <= sb->block_count && (uint32_t)inodes <= sb->inode_count;
+    if (fits) return 0;
+    if (size) {
+      fprintf(stderr, "The image is too small: %ld data blocks and %d inodes needed, %u and %u available\n",
+              blocks, inodes, sb->block_count - sb->data_start, sb->inode_count);
+      return -1;
+    }
+    count += count / 8 + 1;
+  }
+}
+
+// Step 3 ------------------------------------------------------------------------------
+
+// A worker's run of consecutive blocks waiting to be written
+typedef struct stage {
+  long first;  // Block number of buf[0]
+  int count;   // Blocks staged
+  char *buf;
+} stage_t;
+
+// Write the staged blocks with one request, recording their checksums
+static void stage_flush(stage_t *s) {
+  if (s->count == 0) return;
+  for (int i = 0; i < s->count; i++) {
+    csum_table[s->first + i] = crc32c(0, s->buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  size_t len = (size_t)s->count * BLOCK_SIZE;
+  if (pwrite(fd, s->buf, len, (off_t)s->first * BLOCK_SIZE) != (ssize_t)len) {
+    perror("Failed to write to the image");
+    atomic_fetch_add(&write_errors, 1);
+  }
+  s->count = 0;
+}
+
+// Room in the stage for up to 'want' blocks starting at block 'bnum', zeroed; '*got' is
+// set to how many fit (at least one)
+static char *stage_reserve(stage_t *s, long bnum, long want, int *got) {
+  if (s->count == STAGE_BLOCKS || (s->count > 0 && bnum != s->first + s->count)) {
+    stage_flush(s);
+  }
+  if (s->count == 0) s->first = bnum;
+  int room = STAGE_BLOCKS - s->count;
+  *got = want < room ? want : room;
+  char *p = s->buf + (size_t)s->count * BLOCK_SIZE;
+  memset(p, 0, (size_t)*got * BLOCK_SIZE);
+  s->count += *got;
+  return p;
+}
+
+// Stage the directory entries of node 'n'
+static void copy_dir(stage_t *s, node_t *n) {
+  int got;
+  directory_t *dir = (directory_t *)stage_reserve(s, n->first_block, 1, &got);
+  directory_init(dir);
+  for (int i = 0; i < n->child_count; i++) {
+    node_t *child = &nodes[children[n->first_child + i]];
+    directory_put(dir, child->path + child->name, child->inum);
+  }
+  inode_map(get_inode(n->inum))->block[0] = n->first_block;
+}
+
+// Stage the contents of regular file 'n', then the pointer blocks that map them
+static void copy_file(stage_t *s, node_t *n) {
+  inode_map_t *map = inode_map(get_inode(n->inum));
+  int in = n->data_blocks ? open(n->path, O_RDONLY) : -1;
+  if (n->data_blocks && in < 0) {
+    warn_skip("%s: %s, contents left as zeros", n->path, strerror(errno));
+  }
+
+  long bnum = n->first_block, end = n->first_block + n->data_blocks;
+  off_t offset = 0;
+  int short_read = 0;
+  while (bnum < end) {
+    int got;
+    char *p = stage_reserve(s, bnum, end - bnum, &got);
+    size_t want = (size_t)got * BLOCK_SIZE;
+    if (offset + (off_t)want > n->size) want = n->size - offset;
+    ssize_t rv = in < 0 || short_read ? 0 : pread(in, p, want, offset);
+    if (in >= 0 && !short_read && rv != (ssize_t)want) {
+      warn_skip("%s: changed while being copied, the rest is left as zeros", n->path);
+      short_read = 1;
+    }
+    if (rv > 0) atomic_fetch_add(&bytes_copied, rv);
+    offset += (off_t)got * BLOCK_SIZE;
+    bnum += got;
+  }
+  if (in >= 0) close(in);
+
+  // Block map: direct pointers, then the pointer blocks staged after the data
+  long first = n->first_block;
+  for (int i = 0; i < n->data_blocks && i < INODE_DIRECT; i++) {
+    map->block[i] = first + i;
+  }
+  if (n->data_blocks <= INODE_DIRECT) return;
+
+  int got;
+  long next = end;
+  map->indirect = next++;
+  int *ptrs = (int *)stage_reserve(s, map->indirect, 1, &got);
+  for (int i = 0; i < PTRS_PER_BLOCK && INODE_DIRECT + i < n->data_blocks; i++) {
+    ptrs[i] = first + INODE_DIRECT + i;
+  }
+  long rest = n->data_blocks - INODE_DIRECT - PTRS_PER_BLOCK;
+  if (rest <= 0) return;
+
+  map->dindirect = next++;
+  int tables = (rest + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+  int *outer = (int *)stage_reserve(s, map->dindirect, 1, &got);
+  for (int t = 0; t < tables; t++) {
+    outer[t] = next + t;
+  }
+  for (int t = 0; t < tables; t++) {
+    int *inner = (int *)stage_reserve(s, next + t, 1, &got);
+    for (int i = 0; i < PTRS_PER_BLOCK && (long)t * PTRS_PER_BLOCK + i < rest; i++) {
+      inner[i] = first + INODE_DIRECT + PTRS_PER_BLOCK + (long)t * PTRS_PER_BLOCK + i;
+    }
+  }
+}
+
+// Store the target of symlink 'n', in the inode itself if it fits
+static void copy_symlink(stage_t *s, node_t *n) {
+  inode_map_t *map = inode_map(get_inode(n->inum));
+  char target[BLOCK_SIZE];
+  ssize_t len = readlink(n->path, target, sizeof(target));
+  if (len != n->size) {
+    warn_skip("%s: changed while being copied, target left empty", n->path);
+    len = 0;
+  }
+  if (n->data_blocks == 0) {
+    memcpy(map->symlink, target, len);
+    return;
+  }
+  int got;
+  memcpy(stage_reserve(s, n->first_block, 1, &got), target, len);
+  map->block[0] = n->first_block;
+}
+
+// Fill in the inode of node 'n' and stage its blocks
+static void copy_node(stage_t *s, node_t *n) {
+  if (n->link >= 0) return; // Filled in through the node it links to
+
+  inode_t *node = get_inode(n->inum);
+  node->refs = n->refs;
+  node->mode = n->mode;
+  node->size = S_ISDIR(n->mode) ? 0 : n->size;
+  node->generation = 1; // As alloc_inode() gives a never-used inode
+  // Accessed and modified when the host's copy was; changed (here) now
+  *inode_times(node) = (inode_times_t){n->atime ? n->atime : made_at, n->mtime ? n->mtime : made_at, made_at, 0};
+
+  if (n->first_block >= 0) {
+    n->first_block += sb->data_start;
+  }
+  if (S_ISDIR(n->mode)) {
+    node->blocks = 1;
+    copy_dir(s, n);
+  } else if (S_ISLNK(n->mode)) {
+    node->blocks = n->data_blocks;
+    copy_symlink(s, n);
+  } else {
+    node->blocks = n->data_blocks + pointer_blocks(n->data_blocks);
+    copy_file(s, n);
+  }
+}
+
+static void *copy_worker(void *arg) {
+  (void)arg;
+  stage_t stage = {0, 0, NULL};
+  if (posix_memalign((void **)&stage.buf, BLOCK_SIZE, (size_t)STAGE_BLOCKS * BLOCK_SIZE) != 0) {
+    fprintf(stderr, "Out of memory\n");
+    exit(8);
+  }
+  long chunk;
+  while ((chunk = atomic_fetch_add(&next_chunk, 1)) * NODE_CHUNK < node_count) {
+    for (long i = chunk * NODE_CHUNK; i < (chunk + 1) * NODE_CHUNK && i < node_count; i++) {
+      copy_node(&stage, &nodes[i]);
+    }
+  }
+  stage_flush(&stage);
+  free(stage.buf);
+  return NULL;
+}
+
+// Write 'len' bytes at block 'bnum'
+static int write_region(const void *data, size_t len, uint32_t bnum) {
+  if (pwrite(fd, data, len, (off_t)bnum * BLOCK_SIZE) != (ssize_t)len) {
+    perror("Failed to write to the image");
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-d dir] [-s size] [-j threads] <disk-image>\n", prog);
+  fprintf(stderr, "  -d dir      copy the tree under dir into the image\n");
+  fprintf(stderr, "  -s size     size of the image, e.g. 512M (default: what the copy needs plus ~10%%)\n");
+  fprintf(stderr, "  -j threads  number of worker threads (default: one per CPU)\n");
+  exit(8);
+}
+
+int main(int argc, char **argv) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *source = NULL;
+  long long size = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:j:")) != -1) {
+    switch (opt) {
+    case 'd': source = optarg; break;
+    case 's': size = parse_size(optarg); if (size <= 0) usage(argv[0]); break;
+    case 'j': nthreads = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) usage(argv[0]);
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+  double start = now();
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  made_at = wall.tv_sec * NSEC_PER_SEC + wall.tv_nsec;
+
+  // Step 1: the root, then everything under it
+  node_cap = 1024;
+  nodes = xrealloc(NULL, node_cap * sizeof(node_t));
+  memset(&nodes[0], 0, sizeof(node_t));
+  nodes[0].parent = -1;
+  nodes[0].link = -1;
+  nodes[0].mode = S_IFDIR | 0755;
+  node_count = 1;
+  if (source) {
+    struct stat st;
+    if (stat(source, &st) < 0) {
+      perror(source);
+      return 8;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      fprintf(stderr, "%s: not a directory\n", source);
+      return 8;
+    }
+    nodes[0].path = strdup(source);
+    nodes[0].mode = st.st_mode;
+    nodes[0].atime = st.st_atim.tv_sec * NSEC_PER_SEC + st.st_atim.tv_nsec;
+    nodes[0].mtime = st.st_mtim.tv_sec * NSEC_PER_SEC + st.st_mtim.tv_nsec;
+    dir_stack = xrealloc(NULL, 64 * sizeof(int));
+    dir_stack_cap = 64;
+    dir_stack[dir_stack_len++] = 0;
+    dirs_pending = 1;
+    run_workers(walk_worker);
+  }
+  double walked = now();
+
+  // Step 2
+  find_links();
+  int inodes = number_inodes();
+  long blocks = plan_blocks();
+
+  const char *path = argv[optind];
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    perror(path);
+    return 8;
+  }
+  blocks_init(0);
+  if (format_image(size, blocks, inodes) < 0) return 8;
+  if (ftruncate(fd, (off_t)sb->block_count * BLOCK_SIZE) < 0) {
+    perror(path);
+    return 8;
+  }
+  inode_load();
+  refs_table = calloc(sb->block_count, sizeof(uint32_t));
+  csum_table = calloc(sb->block_count, sizeof(uint32_t));
+  if (!refs_table || !csum_table) {
+    fprintf(stderr, "Out of memory\n");
+    return 8;
+  }
+  void *bitmap = get_blocks_bitmap();
+  for (long b = sb->data_start; b < sb->data_start + blocks; b++) {
+    bitmap_put(bitmap, b, 1);
+    refs_table[b] = 1;
+  }
+  sb->free_blocks -= blocks;
+  sb->free_inodes -= inodes;
+
+  // Step 3
+  run_workers(copy_worker);
+
+  // The metadata area and the tables, then everything is made durable
+  int rv = write_region(sb, (size_t)blocks_resident_count() * BLOCK_SIZE, 0);
+  if (rv == 0) rv = write_region(refs_table, (size_t)sb->block_count * sizeof(uint32_t), sb->refs_start);
+  if (rv == 0) rv = write_region(csum_table, (size_t)sb->block_count * sizeof(uint32_t), sb->csum_start);
+  if (rv == 0 && fsync(fd) < 0) {
+    perror(path);
+    rv = -1;
+  }
+  if (rv < 0 || atomic_load(&write_errors) > 0) return 8;
+  close(fd);
+
+  double elapsed = now() - start;
+  long mib = atomic_load(&bytes_copied) >> 20;
+  printf("%s: %d inodes (%d entries), %ld MiB of data in %ld blocks, %u blocks in all\n", path, inodes,
+         node_count - 1, mib, blocks, sb->block_count);
+  printf("%s: built in %.2fs (walk %.2fs) with %d thread%s, %.0f MiB/s\n", path, elapsed, walked - start, nthreads,
+         nthreads == 1 ? "" : "s", elapsed > 0 ? mib / elapsed : 0.0);
+  int left_out = atomic_load(&skipped);
+  if (left_out) {
+    printf("%s: %d entr%s left out\n", path, left_out, left_out == 1 ? "y" : "ies");
+  }
+  return left_out ? 1 : 0;
+}
@@ -26,6 +26,26 @@ int main(int argc, char **argv) {
 
   print_list(list2);
 
+  // Tokenize a path in place: empty segments are skipped, nothing is copied
+  const char *path = "//usr/local//bin/";
+  printf("\nTokens of \"%s\":\n", path);
+  s_view_t token;
+  for (const char *cursor = path; s_next_token(&cursor, '/', &token);) {
+    printf("%.*s\n", (int)token.len, token.data);
+  }
+
+  // Build a list in an arena, release it, and build it again in the same memory
+  arena_t arena = {0};
+  arena_mark_t mark = arena_mark(&arena);
+  slist_t *last = s_cons_arena(&arena, "backed", 6, NULL);
+  slist_t *list3 = s_cons_arena(&arena, "arena", 5, last);
+  printf("\nArena list:\n");
+  print_list(list3);
+  arena_release(&arena, mark);
+  slist_t *again = s_cons_arena(&arena, "reused", 6, NULL);
+  printf("Same memory after release: %s\n", again == last ? "yes" : "no");
+  arena_free(&arena);
+
   s_free(list1);
   s_free(list2);
   return 0;
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ioengine.h"
+
+// Sequential throughput of an image striped across 1 to N files. Give one directory
+// per device (e.g. a mount point on each NVMe drive); a scratch file is made in each.
+// For each stripe count the same amount of data is written in order (then synced) and
+// read back, in batches of BATCH requests of REQUEST_SIZE bytes. Files are opened with
+// O_DIRECT where possible, so the transfers reach the devices instead of the page cache.
+//
+// Usage: stripe_bench [-e pread|uring] [-u stripe-unit-KiB] [dir...]   (default: 4 files in .)
+#define TEST_NAME "stripe_bench.img"
+#define TOTAL_SIZE (512L << 20)
+#define REQUEST_SIZE (1 << 20)
+#define BATCH 16
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write or read TOTAL_SIZE bytes in order; returns MB/s
+static double run(io_op_t op, char *bufs) {
+  io_request_t reqs[BATCH];
+  double start = now();
+  for (off_t done = 0; done < TOTAL_SIZE; done += (off_t)BATCH * REQUEST_SIZE) {
+    int n = 0;
+    for (; n < BATCH; n++) {
+      reqs[n] = (io_request_t){op, bufs + (size_t)n * REQUEST_SIZE, REQUEST_SIZE, done + (off_t)n * REQUEST_SIZE, 0};
+    }
+    if (ioengine_submit(reqs, n) < 0) {
+      fprintf(stderr, "%s failed\n", op == IO_READ ? "read" : "write");
+      exit(1);
+    }
+  }
+  if (op == IO_WRITE && ioengine_sync() < 0) {
+    fprintf(stderr, "sync failed\n");
+    exit(1);
+  }
+  return (double)TOTAL_SIZE / (now() - start) / (1 << 20);
+}
+
+int main(int argc, char **argv) {
+  const char *engine = IOENGINE_PREAD;
+  size_t unit = IOENGINE_STRIPE_UNIT;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:u:")) != -1) {
+    switch (opt) {
+    case 'e': engine = optarg; break;
+    case 'u': unit = (size_t)atol(optarg) << 10; break;
+    default:
+      fprintf(stderr, "Usage: %s [-e pread|uring] [-u stripe-unit-KiB] [dir...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  int count = argc - optind ? argc - optind : 4;
+  if (count > IOENGINE_MAX_DEVICES) count = IOENGINE_MAX_DEVICES;
+  char paths[IOENGINE_MAX_DEVICES][4096];
+  int fds[IOENGINE_MAX_DEVICES];
+  int direct = 1;
+  for (int i = 0; i < count; i++) {
+    if (argc - optind) {
+      snprintf(paths[i], sizeof(paths[i]), "%s/%s", argv[optind + i], TEST_NAME);
+    } else {
+      snprintf(paths[i], sizeof(paths[i]), "%s.%d", TEST_NAME, i);
+    }
+    fds[i] = open(paths[i], O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fds[i] < 0) {
+      direct = 0;
+      fds[i] = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fds[i] < 0) {
+      perror(paths[i]);
+      return 1;
+    }
+  }
+  if (!direct) {
+    printf("O_DIRECT not supported here; results include page cache effects\n");
+  }
+
+  char *bufs;
+  if (posix_memalign((void **)&bufs, 4096, (size_t)BATCH * REQUEST_SIZE) != 0) return 1;
+  memset(bufs, 0x5a, (size_t)BATCH * REQUEST_SIZE);
+
+  printf("%s engine, %zu KiB stripe unit, %ld MiB in %d KiB requests\n", engine, unit >> 10, TOTAL_SIZE >> 20,
+         REQUEST_SIZE >> 10);
+  printf("%-6s %12s %12s\n", "files", "write MB/s", "read MB/s");
+  for (int n = 1; n <= count; n++) {
+    // Files are sized up front, as nufs does, so writes never extend them
+    ioengine_open_striped(engine, fds, n, unit, bufs, (size_t)BATCH * REQUEST_SIZE);
+    for (int i = 0; i < n; i++) {
+      if (ftruncate(fds[i], 0) < 0 || ftruncate(fds[i], ioengine_device_size(i, TOTAL_SIZE)) < 0) perror(paths[i]);
+    }
+    double write_rate = run(IO_WRITE, bufs);
+    double read_rate = run(IO_READ, bufs);
+    ioengine_close();
+    printf("%-6d %12.1f %12.1f\n", n, write_rate, read_rate);
+  }
+
+  for (int i = 0; i < count; i++) {
+    close(fds[i]);
+    unlink(paths[i]);
+  }
+  free(bufs);
+  return 0;
+}
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "arena.h"
+#include "flusher.h"
+#include "ioengine.h"
+#include "nufs_ioctl.h"
+#include "slist.h"
+#include "storage.h"
+#include "trace.h"
+
+// trace_replay: prints or replays a trace recorded by `nufs -o trace=PATH`.
+//
+// Usage: trace_replay [-d] [-r] [-m mount-point] [-c seconds] [-t fast-tier] <trace> [<disk-image>...]
+//   -d  print the trace, one operation per line, instead of replaying it
+//   -r  keep the recorded pace: each operation starts as long after the first as it did
+//       when recorded (default: each starts as soon as the one before it returns)
+//   -m  replay through a mounted file system, with system calls, instead of on a disk image
+//   -c  for a disk image, commit as nufs's `-o commit=SECONDS` does (default: 5)
+//   -t  the file holding the image's fast tier, as nufs's `-o tier=PATH`
+//
+// Without -m, the operations are replayed on the disk image (the files of a striped one in
+// stripe order) through storage.c, calling what nufs would, so a change to storage.c can be
+// measured without FUSE and the kernel in the way. The image should be a copy of the one the
+// trace was recorded on, taken before it was mounted: the results are then expected to match
+// the recorded ones, and those that don't are counted.
+//
+// Operations are replayed one at a time, in the order they started, so a replay is
+// deterministic even when the trace was recorded from several threads. Writes and attribute
+// values are filled with a pattern; ioctls are not replayed, nor (without -m) operations on
+// NUFS_CONTROL_PATH, which nufs answers itself. The report gives each operation's latency
+// against what was recorded.
+
+#define FD_CACHE 64             // Files kept open between operations with -m
+#define NOT_REPLAYED LONG_MIN   // What replay_live() and replay_storage() return for an operation they skip
+
+// Latencies of one kind of operation
+typedef struct op_stats {
+  uint64_t *latency;  // Nanoseconds, one per operation replayed
+  long count, cap;
+  uint64_t recorded;  // Sum of the recorded durations
+  long mismatched;    // Results that differ from the recorded ones
+} op_stats_t;
+
+static const char *mount_point;
+static op_stats_t stats[TRACE_OP_COUNT];
+static char *buf;
+static size_t buf_size;
+
+// With -m, files opened by earlier operations
+static struct {
+  char *path;
+  int fd;
+} fd_cache[FD_CACHE];
+static int fd_next;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A buffer of at least 'size' bytes, its first 'fill' bytes holding a pattern that depends on
+// where in the file they go
+static char *get_buffer(size_t size, size_t fill, uint64_t offset) {
+  if (size + 1 > buf_size) {
+    buf_size = size + 1;
+    buf = realloc(buf, buf_size);
+    if (!buf) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < fill; i++) buf[i] = (char)((offset + i) % 251);
+  return buf;
+}
+
+// Decode a utimens time recorded in a trace
+static struct timespec replay_time(uint64_t t) {
+  if (t == TRACE_TIME_NOW) return (struct timespec){0, UTIME_NOW};
+  if (t == TRACE_TIME_OMIT) return (struct timespec){0, UTIME_OMIT};
+  return (struct timespec){(int64_t)t / 1000000000, (int64_t)t % 1000000000};
+}
+
+static int by_latency(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Copy a record's name to 'out', prefixed by the mount point with -m
+static const char *record_path(char *out, const char *name, int len) {
+  snprintf(out, PATH_MAX, "%s%.*s", mount_point ? mount_point : "", len, name);
+  return out;
+}
+
+// Forget any open file for 'path' (after it was removed or replaced)
+static void fd_forget(const char *path) {
+  for (int i = 0; i < FD_CACHE; i++) {
+    if (fd_cache[i].path && strcmp(fd_cache[i].path, path) == 0) {
+      close(fd_cache[i].fd);
+      free(fd_cache[i].path);
+      fd_cache[i].path = NULL;
+    }
+  }
+}
+
+// An open file for 'path', opened now unless an earlier operation left one open
+static int fd_get(const char *path, int reopen) {
+  for (int i = 0; i < FD_CACHE; i++) {
+    if (fd_cache[i].path && strcmp(fd_cache[i].path, path) == 0) {
+      if (!reopen) return fd_cache[i].fd;
+      fd_forget(path);
+      break;
+    }
+  }
+  int fd = open(path, O_RDWR);
+  if (fd < 0 && (errno == EISDIR || errno == EACCES)) fd = open(path, O_RDONLY);
+  if (fd < 0) return -errno;
+  int i = fd_next++ % FD_CACHE;
+  if (fd_cache[i].path) {
+    close(fd_cache[i].fd);
+    free(fd_cache[i].path);
+  }
+  fd_cache[i].path = strdup(path);
+  fd_cache[i].fd = fd;
+  return fd;
+}
+
+// Replay one operation with system calls on the mounted file system
+static long replay_live(const trace_record_t *r) {
+  char path[PATH_MAX], path2[PATH_MAX];
+  record_path(path, TRACE_NAME(r), r->name_len);
+  record_path(path2, TRACE_NAME2(r), r->name2_len);
+  char target[PATH_MAX];
+  snprintf(target, sizeof(target), "%.*s", r->name2_len, TRACE_NAME2(r));
+  char attr[XATTR_NAME_MAX + 1];
+  snprintf(attr, sizeof(attr), "%.*s", r->name2_len, TRACE_NAME2(r));
+  struct stat st;
+  struct statvfs sv;
+  long rv;
+  int fd, fd2;
+
+  switch (r->op) {
+  case TRACE_ACCESS: rv = access(path, r->arg); break;
+  case TRACE_GETATTR: rv = lstat(path, &st); break;
+  case TRACE_STATFS: rv = statvfs(path, &sv); break;
+  case TRACE_READDIR: {
+    DIR *dir = opendir(path);
+    if (!dir) return -errno;
+    while (readdir(dir)) {
+    }
+    closedir(dir);
+    return 0;
+  }
+  case TRACE_MKNOD: fd_forget(path); rv = mknod(path, r->arg, 0); break;
+  case TRACE_UNLINK: fd_forget(path); rv = unlink(path); break;
+  case TRACE_LINK: rv = link(path, path2); break;
+  case TRACE_SYMLINK: rv = symlink(target, path); break;
+  case TRACE_READLINK:
+    rv = readlink(path, get_buffer(r->size, 0, 0), r->size);
+    return rv < 0 ? -errno : 0;
+  case TRACE_GETXATTR: rv = lgetxattr(path, attr, get_buffer(r->size, 0, 0), r->size); break;
+  case TRACE_SETXATTR: rv = lsetxattr(path, attr, get_buffer(r->size, r->size, 0), r->size, r->arg); break;
+  case TRACE_LISTXATTR: rv = llistxattr(path, get_buffer(r->size, 0, 0), r->size); break;
+  case TRACE_REMOVEXATTR: rv = lremovexattr(path, attr); break;
+  case TRACE_OPEN: fd = fd_get(path, 1); return fd < 0 ? fd : 0;
+  case TRACE_READ:
+    if ((fd = fd_get(path, 0)) < 0) return fd;
+    rv = pread(fd, get_buffer(r->size, 0, 0), r->size, r->offset);
+    break;
+  case TRACE_WRITE:
+    if ((fd = fd_get(path, 0)) < 0) return fd;
+    rv = pwrite(fd, get_buffer(r->size, r->size, r->offset), r->size, r->offset);
+    break;
+  case TRACE_TRUNCATE: rv = truncate(path, r->size); break;
+  case TRACE_COPY_RANGE: {
+    if ((fd = fd_get(path, 0)) < 0) return fd;
+    if ((fd2 = fd_get(path2, 0)) < 0) return fd2;
+    loff_t in = r->offset, out = r->arg;
+    rv = copy_file_range(fd, &in, fd2, &out, r->size, 0);
+    break;
+  }
+  case TRACE_MKDIR: rv = mkdir(path, r->arg); break;
+  case TRACE_RMDIR: fd_forget(path); rv = rmdir(path); break;
+  case TRACE_RENAME:
+    fd_forget(path);
+    fd_forget(path2);
+    rv = renameat2(AT_FDCWD, path, AT_FDCWD, path2, r->arg);
+    break;
+  case TRACE_UTIMENS: {
+    struct timespec ts[2] = {replay_time(r->size), replay_time(r->arg)};
+    rv = utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+    break;
+  }
+  case TRACE_FSYNC:
+    if ((fd = fd_get(path, 0)) < 0) return fd;
+    rv = r->arg ? fdatasync(fd) : fsync(fd);
+    break;
+  case TRACE_FLUSH:
+    if ((fd = fd_get(path, 0)) < 0) return fd;
+    rv = close(dup(fd)); // Closing a duplicate flushes the file and keeps it open
+    break;
+  default: return NOT_REPLAYED;
+  }
+  return rv < 0 ? -errno : rv;
+}
+
+// Replay one operation on the disk image, calling storage.c as nufs.c does
+static long replay_storage(const trace_record_t *r) {
+  char path[PATH_MAX], name2[PATH_MAX];
+  record_path(path, TRACE_NAME(r), r->name_len);
+  snprintf(name2, sizeof(name2), "%.*s", r->name2_len, TRACE_NAME2(r));
+  if (strcmp(path, NUFS_CONTROL_PATH) == 0) return NOT_REPLAYED;
+  struct stat st;
+  struct statvfs sv;
+  uint64_t version;
+  long rv;
+
+  switch (r->op) {
+  case TRACE_ACCESS: rv = storage_stat(path, &st); return rv < 0 ? rv : 0;
+  case TRACE_GETATTR: return storage_stat(path, &st);
+  case TRACE_STATFS: return storage_statfs(&sv);
+  case TRACE_READDIR: {
+    arena_t *arena = arena_thread();
+    arena_mark_t mark = arena_mark(arena);
+    slist_t *entries;
+    rv = storage_list(path, &entries);
+    for (slist_t *curr = entries; curr; curr = curr->next) storage_stat(curr->data, &st);
+    arena_release(arena, mark);
+    return rv;
+  }
+  case TRACE_MKNOD: return storage_mknod(path, r->arg);
+  case TRACE_UNLINK: return storage_unlink(path);
+  case TRACE_LINK: return storage_link(path, name2);
+  case TRACE_SYMLINK: return storage_symlink(name2, path);
+  case TRACE_READLINK: return storage_readlink(path, get_buffer(r->size, 0, 0), r->size);
+  case TRACE_GETXATTR: return storage_getxattr(path, name2, get_buffer(r->size, 0, 0), r->size);
+  case TRACE_SETXATTR: return storage_setxattr(path, name2, get_buffer(r->size, r->size, 0), r->size, r->arg);
+  case TRACE_LISTXATTR: return storage_listxattr(path, get_buffer(r->size, 0, 0), r->size);
+  case TRACE_REMOVEXATTR: return storage_removexattr(path, name2);
+  case TRACE_OPEN: return storage_data_version(path, &version);
+  case TRACE_READ: return storage_read(path, get_buffer(r->size, 0, 0), r->size, r->offset);
+  case TRACE_WRITE: return storage_write(path, get_buffer(r->size, r->size, r->offset), r->size, r->offset);
+  case TRACE_TRUNCATE: return storage_truncate(path, r->size);
+  case TRACE_COPY_RANGE: return storage_clone_range(path, r->offset, name2, r->arg, r->size);
+  case TRACE_MKDIR: return storage_mkdir(path, r->arg);
+  case TRACE_RMDIR: return storage_rmdir(path);
+  case TRACE_RENAME: return storage_rename(path, name2, r->arg);
+  case TRACE_UTIMENS: {
+    struct timespec ts[2] = {replay_time(r->size), replay_time(r->arg)};
+    return storage_utimens(path, ts);
+  }
+  case TRACE_FSYNC: return storage_fsync(path, r->arg);
+  case TRACE_FLUSH: return storage_flush(path);
+  default: return NOT_REPLAYED;
+  }
+}
+
+static void add_latency(int op, uint64_t ns, uint64_t recorded, int mismatched) {
+  op_stats_t *s = &stats[op];
+  if (s->count == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->latency = realloc(s->latency, s->cap * sizeof(uint64_t));
+    if (!s->latency) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  s->latency[s->count++] = ns;
+  s->recorded += recorded;
+  s->mismatched += mismatched;
+}
+
+// Print one line per operation: when it started (seconds), its thread, what it was and what it returned
+static void dump(const trace_t *trace) {
+  for (long i = 0; i < trace->count; i++) {
+    const trace_record_t *r = trace->records[i];
+    printf("%12.6f %7u %-11s %.*s", r->start / 1e9, r->thread, trace_op_name(r->op), r->name_len, TRACE_NAME(r));
+    if (r->name2_len) printf(" %.*s", r->name2_len, TRACE_NAME2(r));
+    printf(" size=%llu offset=%llu arg=%#llx -> %d (%.1f us)\n", (unsigned long long)r->size,
+           (unsigned long long)r->offset, (unsigned long long)r->arg, r->result, r->duration / 1e3);
+  }
+}
+
+static void report(double seconds, long replayed, long skipped, long lost) {
+  printf("%-11s %8s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "mean(us)", "p50(us)", "p99(us)",
+         "max(us)", "recorded", "mismatched");
+  for (int op = 0; op < TRACE_OP_COUNT; op++) {
+    op_stats_t *s = &stats[op];
+    if (s->count == 0) continue;
+    qsort(s->latency, s->count, sizeof(uint64_t), by_latency);
+    uint64_t sum = 0;
+    for (long i = 0; i < s->count; i++) sum += s->latency[i];
+    printf("%-11s %8ld %10.1f %10.1f %10.1f %10.1f %10.1f %10ld\n", trace_op_name(op), s->count,
+           sum / 1e3 / s->count, s->latency[s->count / 2] / 1e3, s->latency[s->count * 99 / 100] / 1e3,
+           s->latency[s->count - 1] / 1e3, s->recorded / 1e3 / s->count, s->mismatched);
+  }
+  printf("Replayed %ld operations in %.3f s (%.0f ops/s); %ld not replayed, %ld lost while recording\n", replayed,
+         seconds, seconds > 0 ? replayed / seconds : 0, skipped, lost);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-d] [-r] [-m mount-point] [-c seconds] [-t fast-tier] <trace> [<disk-image>...]\n",
+          prog);
+  fprintf(stderr, "  -d             print the trace instead of replaying it\n");
+  fprintf(stderr, "  -r             keep the recorded pace (default: as fast as possible)\n");
+  fprintf(stderr, "  -m mount-point replay through a mounted file system instead of a disk image\n");
+  fprintf(stderr, "  -c seconds     commit interval on a disk image, 0 to commit every operation (default: %d)\n",
+          FLUSH_INTERVAL);
+  fprintf(stderr, "  -t fast-tier   the file holding the image's fast tier\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int dump_only = 0, paced = 0, commit = FLUSH_INTERVAL;
+  const char *tier_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "drm:c:t:")) != -1) {
+    switch (opt) {
+    case 'd': dump_only = 1; break;
+    case 'r': paced = 1; break;
+    case 'm': mount_point = optarg; break;
+    case 'c': commit = atoi(optarg); break;
+    case 't': tier_path = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind == argc) usage(argv[0]);
+  int images = argc - optind - 1;
+  if (!dump_only && (mount_point ? images != 0 : images < 1 || images > IOENGINE_MAX_DEVICES)) usage(argv[0]);
+
+  trace_t trace;
+  int rv = trace_load(argv[optind], &trace);
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s\n", argv[optind], rv == -EINVAL ? "not a nufs trace" : strerror(-rv));
+    return 1;
+  }
+  if (dump_only) {
+    dump(&trace);
+    printf("%ld operations, %ld lost while recording\n", trace.count, trace.lost);
+    trace_unload(&trace);
+    return 0;
+  }
+
+  // storage.c logs every operation; keep that out of the report
+  int saved_stdout = -1;
+  if (!mount_point) {
+    const char *stripes[IOENGINE_MAX_DEVICES] = {0};
+    for (int i = 1; i < images; i++) stripes[i - 1] = argv[optind + 1 + i];
+    storage_options_t opts = {.stripe_images = stripes, .tier_path = tier_path};
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    uint64_t t = now_ns();
+    storage_init(argv[optind + 1], &opts);
+    add_latency(TRACE_MOUNT, now_ns() - t, 0, 0);
+    if (commit > 0) flusher_start(commit);
+  }
+
+  long replayed = 0, skipped = 0;
+  uint64_t first = trace.count ? trace.records[0]->start : 0;
+  uint64_t begin = now_ns();
+  for (long i = 0; i < trace.count; i++) {
+    const trace_record_t *r = trace.records[i];
+    if (r->op == TRACE_MOUNT) {
+      // Without -m, storage_init() above stands for it
+      if (mount_point) skipped++;
+      else stats[TRACE_MOUNT].recorded += r->duration;
+      continue;
+    }
+    if (paced) {
+      uint64_t due = begin + (r->start - first), now = now_ns();
+      if (due > now) {
+        struct timespec ts = {(due - now) / 1000000000, (due - now) % 1000000000};
+        nanosleep(&ts, NULL);
+      }
+    }
+    uint64_t t = now_ns();
+    long result = mount_point ? replay_live(r) : replay_storage(r);
+    uint64_t ns = now_ns() - t;
+    if (result == NOT_REPLAYED) {
+      skipped++;
+      continue;
+    }
+    add_latency(r->op, ns, r->duration, result != r->result);
+    replayed++;
+  }
+  double seconds = (now_ns() - begin) / 1e9;
+
+  if (!mount_point) {
+    flusher_stop();
+    storage_shutdown();
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+  }
+  for (int i = 0; i < FD_CACHE; i++) {
+    if (fd_cache[i].path) close(fd_cache[i].fd);
+  }
+  report(seconds, replayed, skipped, trace.lost);
+  trace_unload(&trace);
+  return 0;
+}
@@ -1,49 +1,544 @@
 #include "inode.h"
+#include "bitmap.h"
 #include "blocks.h"
+#include "directory.h"
+#include "slist.h"
+#include "journal.h"
+#include "xattr.h"
+#include "dcache.h"
+#include <stdatomic.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
-static inode_t inodes[INODE_COUNT];
+// Number of block pointers that fit in an indirect block
+#define PTRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+
+// Largest number of file blocks the block map can address
+#define MAX_FILE_BLOCKS (INODE_DIRECT + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+
+_Static_assert(sizeof(inode_t) == 32 && BLOCK_SIZE % sizeof(inode_t) == 0, "inode_t must pack evenly into blocks");
+_Static_assert(sizeof(inode_map_t) == 64 && BLOCK_SIZE % sizeof(inode_map_t) == 0, "inode_map_t must fill a cache line");
+_Static_assert(sizeof(inode_times_t) == 32 && BLOCK_SIZE % sizeof(inode_times_t) == 0, "inode_times_t must pack evenly into blocks");
+
+#define RELATIME_LIMIT (24 * 3600 * NSEC_PER_SEC) // An access time older than this is always updated
+
+// Blocks taken by 'count' records of 'size' bytes
+#define TABLE_BLOCKS(count, size) (int)(((size_t)(count) * (size) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// The inode table lives in the metadata area of the image (see superblock_t), as four
+// arrays: the inode_t records, then the block maps, the inline attributes and the timestamps
+static inode_t *inodes = NULL;
+static inode_map_t *maps = NULL;
+static char *xattrs = NULL;
+static inode_times_t *times = NULL;
+static int count = 0;
 static int root_inum = 0;
 
-// Initialize the inode table
+// Blocks of the times array changed by inode_touch() and not yet journaled, one bit
+// per block, and when (monotonic nanoseconds) the oldest of those changes was made
+static uint8_t *times_pending = NULL;
+static int times_pending_count = 0;
+static int64_t times_pending_since = 0;
+
+// Per inode, the last journal transaction (see journal_tid(), truncated) that changed
+// it, and the last one that changed its size or block map (see inode_sync_pending())
+typedef struct inode_tids {
+    uint32_t sync;
+    uint32_t datasync;
+} inode_tids_t;
+static inode_tids_t *tids = NULL;
+
+// Per inode, a sequence count that is odd while an operation changes its inode_t record
+// or timestamps (see inode_snapshot()), and the inodes the running operation made odd
+static _Atomic uint32_t *seqs = NULL;
+static int *writing = NULL;
+static int writing_count = 0;
+
+// Per inode, the block its first blocks are allocated near until it has one of its own: the
+// first block of the directory it was created in (see inode_set_goal()), or 0 if not known
+static int *goals = NULL;
+
+// Times inode_snapshot() copies an inode that keeps changing before giving up
+#define SNAPSHOT_TRIES 4
+
+// In-memory bitmap of the inodes in use, and where the next search for a free one starts
+static uint8_t *inode_bitmap = NULL;
+static int inode_cursor = 0;
+
+// The current time, as the timestamps store it
+static int64_t inode_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Size of the inode table for 'n' inodes
+int inode_table_blocks(uint32_t n) {
+    return TABLE_BLOCKS(n, sizeof(inode_t)) + TABLE_BLOCKS(n, sizeof(inode_map_t)) +
+           TABLE_BLOCKS(n, INODE_XATTR_INLINE) + TABLE_BLOCKS(n, sizeof(inode_times_t));
+}
+
+// Find the inode table's arrays and note which inodes are in use
+void inode_load() {
+    superblock_t *sb = get_superblock();
+    count = sb->inode_count;
+    inodes = blocks_get_block(sb->inode_start);
+    maps = (inode_map_t *)((char *)inodes + (size_t)TABLE_BLOCKS(count, sizeof(inode_t)) * BLOCK_SIZE);
+    xattrs = (char *)maps + (size_t)TABLE_BLOCKS(count, sizeof(inode_map_t)) * BLOCK_SIZE;
+    times = (inode_times_t *)(xattrs + (size_t)TABLE_BLOCKS(count, INODE_XATTR_INLINE) * BLOCK_SIZE);
+
+    free(inode_bitmap);
+    free(times_pending);
+    free(tids);
+    free(seqs);
+    free(writing);
+    free(goals);
+    inode_bitmap = calloc((count + 7) / 8, 1);
+    times_pending = calloc((TABLE_BLOCKS(count, sizeof(inode_times_t)) + 7) / 8, 1);
+    tids = calloc(count, sizeof(inode_tids_t));
+    seqs = calloc(count, sizeof(*seqs));
+    writing = calloc(count, sizeof(int));
+    goals = calloc(count, sizeof(int));
+    times_pending_count = 0;
+    writing_count = 0;
+    dcache_clear();
+    if (!inode_bitmap || !times_pending || !tids || !seqs || !writing || !goals) {
+        fprintf(stderr, "[ERROR] Failed to allocate the inode bitmap\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (inodes[i].refs > 0) bitmap_put(inode_bitmap, i, 1);
+    }
+    inode_cursor = 0;
+}
+
+// Initialize the inode table, creating the root directory on a fresh image
 void inode_init() {
-    memset(inodes, 0, sizeof(inodes));
+    inode_load();
+    if (inodes[root_inum].refs > 0) {
+        return; // Existing image: the table was loaded with the blocks
+    }
+
+    // A fresh image: the root goes to disk with the caller's first journal commit
+    inode_dirty(&inodes[root_inum]);
+    inode_map_dirty(&inodes[root_inum]);
+    inode_times_dirty(&inodes[root_inum]);
+    int64_t now = inode_now();
+    times[root_inum] = (inode_times_t){now, now, now, 0};
     inodes[root_inum].refs = 1;      // Root directory exists
     inodes[root_inum].mode = 040755; // Directory with default permissions
     inodes[root_inum].size = 0;
+    bitmap_put(inode_bitmap, root_inum, 1);
+    blocks_adjust_free(0, -1);
+    maps[root_inum].block[0] = alloc_block(); // Block holding the root's entries
+    inodes[root_inum].blocks = 1;
+    journal_dirty(maps[root_inum].block[0]);
+    directory_init(blocks_overwrite(maps[root_inum].block[0]));
+}
+
+// Number of inodes in the table
+int inode_count() {
+    return count;
+}
+
+// The block map and inline attributes of an inode, found by its index
+inode_map_t *inode_map(inode_t *node) {
+    return &maps[node - inodes];
+}
+
+char *inode_xattrs(inode_t *node) {
+    return xattrs + (size_t)(node - inodes) * INODE_XATTR_INLINE;
+}
+
+inode_times_t *inode_times(inode_t *node) {
+    return &times[node - inodes];
+}
+
+// Journal the block(s) holding 'len' bytes at 'ptr' in the in-memory image
+static void dirty_range(const void *ptr, size_t len) {
+    int first = blocks_block_of(ptr);
+    int last = blocks_block_of((const char *)ptr + len - 1);
+    for (int b = first; b >= 0 && b <= last; b++) {
+        journal_dirty(b);
+    }
+}
+
+// Make an inode's sequence count odd, if this operation hasn't already, before its
+// record or timestamps change; inode_write_end() makes it even again
+static void write_begin(inode_t *node) {
+    _Atomic uint32_t *seq = &seqs[node - inodes];
+    uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    if (s & 1) return;
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    writing[writing_count++] = node - inodes;
+}
+
+void inode_write_end() {
+    for (int i = 0; i < writing_count; i++) {
+        atomic_fetch_add_explicit(&seqs[writing[i]], 1, memory_order_release);
+    }
+    writing_count = 0;
+}
+
+// Copy an inode between two reads of its sequence count
+int inode_snapshot(int inum, inode_t *node, inode_times_t *t) {
+    if (inum < 0 || inum >= count) return -ENOENT;
+    for (int tries = 0; tries < SNAPSHOT_TRIES; tries++) {
+        uint32_t s = atomic_load_explicit(&seqs[inum], memory_order_acquire);
+        if (s & 1) return -EAGAIN; // Changing until its operation ends, which may take I/O
+        *node = inodes[inum];
+        *t = times[inum];
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&seqs[inum], memory_order_relaxed) == s) return 0;
+    }
+    return -EAGAIN;
+}
+
+// Note that the running transaction changes an inode, and whether the change is to its
+// size or block map. Called after journal_dirty().
+static void changed(inode_t *node, int data) {
+    uint32_t tid = journal_tid();
+    tids[node - inodes].sync = tid;
+    if (data) tids[node - inodes].datasync = tid;
+}
+
+// Journal the inode table block an inode's record is stored in
+void inode_dirty(inode_t *node) {
+    write_begin(node);
+    dirty_range(node, sizeof(inode_t));
+    changed(node, 0);
+}
+
+// Journal the block holding an inode's block map
+void inode_map_dirty(inode_t *node) {
+    dirty_range(inode_map(node), sizeof(inode_map_t));
+    changed(node, 1);
+}
+
+// Journal the block holding an inode's inline attributes
+void inode_xattrs_dirty(inode_t *node) {
+    dirty_range(inode_xattrs(node), INODE_XATTR_INLINE);
+    changed(node, 0);
+}
+
+// Journal the block holding an inode's timestamps
+void inode_times_dirty(inode_t *node) {
+    write_begin(node);
+    dirty_range(inode_times(node), sizeof(inode_times_t));
+    changed(node, 0);
+}
+
+// Set timestamps to the current time in memory, noting their block for inode_times_flush()
+void inode_touch(inode_t *node, int which) {
+    inode_times_t *t = inode_times(node);
+    int64_t now = inode_now();
+    if ((which & INODE_ATIME) && t->atime > t->mtime && t->atime > t->ctime && now - t->atime < RELATIME_LIMIT) {
+        which &= ~INODE_ATIME; // relatime: the access time already says it was read since it changed
+    }
+    if (!which) return;
+    write_begin(node);
+    if (which & INODE_ATIME) t->atime = now;
+    if (which & INODE_MTIME) t->mtime = now;
+    if (which & INODE_CTIME) t->ctime = now;
+
+    int block = (node - inodes) / (BLOCK_SIZE / sizeof(inode_times_t));
+    if (!bitmap_get(times_pending, block)) {
+        bitmap_put(times_pending, block, 1);
+        if (times_pending_count++ == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            times_pending_since = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+        }
+    }
+}
+
+// Journal the blocks inode_touch() noted, once they are old enough or if asked to
+int inode_times_flush(int now) {
+    if (times_pending_count == 0) return 0;
+    if (!now) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec - times_pending_since < INODE_TIMES_AGE * NSEC_PER_SEC) return 0;
+    }
+    int flushed = 0;
+    int blocks = TABLE_BLOCKS(count, sizeof(inode_times_t));
+    for (int b = 0; b < blocks; b++) {
+        if (!bitmap_get(times_pending, b)) continue;
+        bitmap_put(times_pending, b, 0);
+        dirty_range((char *)times + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+        flushed++;
+    }
+    times_pending_count = 0;
+    return flushed;
 }
 
 // Retrieve an inode by its index
 inode_t *get_inode(int inum) {
-    if (inum < 0 || inum >= INODE_COUNT) return NULL;
+    if (inum < 0 || inum >= count) return NULL;
     return &inodes[inum];
 }
 
-// Allocate a new inode
+int inode_num(inode_t *node) {
+    return node - inodes;
+}
+
+// Clear every part of an inode except its generation, which outlives it
+static void clear_inode(inode_t *node) {
+    inode_dirty(node);
+    inode_map_dirty(node);
+    inode_xattrs_dirty(node);
+    inode_times_dirty(node);
+    int generation = node->generation;
+    memset(node, 0, sizeof(inode_t));
+    memset(inode_map(node), 0, sizeof(inode_map_t));
+    memset(inode_xattrs(node), 0, INODE_XATTR_INLINE);
+    memset(inode_times(node), 0, sizeof(inode_times_t));
+    node->generation = generation;
+}
+
+// Allocate a new inode, searching the bitmap from where the last search stopped
 int alloc_inode() {
-    for (int i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].refs == 0) {
-            inodes[i].refs = 1;
-            return i;
-        }
+    int i = bitmap_next_unused(inode_bitmap, inode_cursor, count);
+    if (i < 0) {
+        i = bitmap_next_unused(inode_bitmap, 0, inode_cursor);
+    }
+    if (i < 0) {
+        return -ENOSPC; // No space left on device
     }
-    return -ENOSPC; // No space left on device
+    inode_cursor = i + 1;
+
+    clear_inode(&inodes[i]);
+    int64_t now = inode_now();
+    times[i] = (inode_times_t){now, now, now, 0};
+    inodes[i].refs = 1;
+    inodes[i].generation++;
+    goals[i] = 0;
+    bitmap_put(inode_bitmap, i, 1);
+    blocks_adjust_free(0, -1);
+    return i;
 }
 
-// Free an existing inode
+// Free an existing inode, dropping its references to data blocks
 void free_inode(int inum) {
-    if (inum < 0 || inum >= INODE_COUNT) return;
-    memset(&inodes[inum], 0, sizeof(inode_t));
+    if (inum < 0 || inum >= count) return;
+    if (!inode_is_inline(&inodes[inum])) {
+        // All in the running transaction: a caller that may commit empties the file first
+        while (shrink_inode(&inodes[inum], 0) > 0) continue;
+    }
+    xattr_free(&inodes[inum]);
+    clear_inode(&inodes[inum]);
+    bitmap_put(inode_bitmap, inum, 0);
+    blocks_adjust_free(0, 1);
+}
+
+// Drop one link to an inode; its data goes once the last link does
+int inode_unlink(int inum) {
+    inode_t *node = get_inode(inum);
+    if (!node || node->refs <= 0) return 0;
+
+    if (node->refs == 1) {
+        free_inode(inum);
+        return 0;
+    }
+    inode_dirty(node);
+    return --node->refs;
+}
+
+// The inode's generation and version, for telling cached data from current data
+uint64_t inode_version(inode_t *node) {
+    return (uint64_t)(uint32_t)node->generation << 32 | (uint32_t)node->version;
+}
+
+// Whether the running transaction holds a change to an inode, or inode_touch() one
+int inode_sync_pending(inode_t *node, int datasync) {
+    inode_tids_t *t = &tids[node - inodes];
+    uint32_t tid = journal_tid();
+    if (journal_pending() > 0 && (datasync ? t->datasync : t->sync) == tid) return 1;
+    return !datasync && bitmap_get(times_pending, (node - inodes) / (BLOCK_SIZE / sizeof(inode_times_t)));
+}
+
+// Whether an inode holds its contents (a short symlink target) in place of a block map
+int inode_is_inline(inode_t *node) {
+    return S_ISLNK(node->mode) && node->size <= INODE_INLINE_MAX;
 }
 
 // Lookup a path in the file system and return its inode number
 int tree_lookup(const char *path) {
-    if (strcmp(path, "/") == 0) {
-        return root_inum; // Return the root inode number
+    return tree_lookup_n(path, strlen(path));
+}
+
+// Lookup the first 'len' characters of a path, walking its components in place
+int tree_lookup_n(const char *path, size_t len) {
+    int inum = root_inum;
+    s_view_t part;
+
+    // Walk the path one component at a time, starting at the root; leading,
+    // trailing and doubled slashes yield no component
+    while (s_next_token_n(&path, &len, '/', &part)) {
+        if (!S_ISDIR(inodes[inum].mode)) {
+            return -ENOTDIR;
+        }
+        int dir = inum;
+        directory_t *entries = blocks_get_block(maps[inum].block[0]);
+        if (!entries) {
+            return -EIO;
+        }
+        inum = directory_lookup_n(entries, part.data, part.len);
+        if (inum < 0) {
+            break; // Not found
+        }
+        dcache_insert(dir, inodes[dir].generation, part.data, part.len, inum, inodes[inum].generation);
+    }
+    return inum;
+}
+
+// Lookup a path in the name cache alone, without taking any lock
+int tree_lookup_cached(const char *path, int *generation) {
+    int inum = root_inum;
+    int gen = inodes[root_inum].generation; // Never changes once the image is loaded
+    size_t len = strlen(path);
+    s_view_t part;
+    while (inum >= 0 && s_next_token_n(&path, &len, '/', &part)) {
+        inum = dcache_lookup(inum, gen, part.data, part.len, &gen);
+    }
+    *generation = gen;
+    return inum < 0 ? -EAGAIN : inum;
+}
+
+// Allocate new blocks of this inode near the directory it was created in
+void inode_set_goal(inode_t *node, inode_t *dir) {
+    goals[node - inodes] = inode_map(dir)->block[0];
+}
+
+// Where a block of the inode that isn't the next one after another goes: near its first block
+static int home_goal(inode_t *node) {
+    int first = inode_map(node)->block[0];
+    return first > 0 ? first : goals[node - inodes];
+}
+
+// Find the pointer block of a node referenced by *slot, allocating a zeroed one near 'goal'
+// if asked to. Sets *ptrs to it, or to NULL if it is missing (and not created).
+// Returns 0, -ENOSPC, or -EIO if the block failed its checksum.
+static int pointer_block(inode_t *node, int *slot, int create, int goal, int **ptrs) {
+    *ptrs = NULL;
+    if (*slot == 0) {
+        if (!create) return 0;
+        int bnum = alloc_block_near(goal);
+        if (bnum < 0) return -ENOSPC;
+        memset(blocks_overwrite(bnum), 0, BLOCK_SIZE);
+        journal_dirty(bnum);
+        dirty_range(slot, sizeof(int));
+        *slot = bnum;
+        inode_dirty(node);
+        node->blocks++;
+    }
+    *ptrs = blocks_get_block(*slot);
+    return *ptrs ? 0 : -EIO;
+}
+
+// Find where the block map stores the pointer for a file block. Sets *slot to it, or to
+// NULL if an indirect block on the way is missing (and not created).
+// Returns 0, or the error of a pointer block that could not be had (see pointer_block()).
+static int bnum_slot(inode_t *node, int file_bnum, int create, int **slot) {
+    inode_map_t *map = inode_map(node);
+    *slot = NULL;
+    if (file_bnum < INODE_DIRECT) {
+        *slot = &map->block[file_bnum];
+        return 0;
+    }
+
+    int goal = create ? home_goal(node) : 0;
+    int *ptrs;
+    file_bnum -= INODE_DIRECT;
+    if (file_bnum < PTRS_PER_BLOCK) {
+        int rv = pointer_block(node, &map->indirect, create, goal, &ptrs);
+        if (ptrs) *slot = &ptrs[file_bnum];
+        return rv;
+    }
+
+    file_bnum -= PTRS_PER_BLOCK;
+    int *outer;
+    int rv = pointer_block(node, &map->dindirect, create, goal, &outer);
+    if (!outer) return rv;
+    rv = pointer_block(node, &outer[file_bnum / PTRS_PER_BLOCK], create, goal, &ptrs);
+    if (ptrs) *slot = &ptrs[file_bnum % PTRS_PER_BLOCK];
+    return rv;
+}
+
+// Free the block a slot of a node's block map points at, if any, and clear the slot.
+// The node's record must already be journaled.
+static void release_slot(inode_t *node, int *slot) {
+    if (*slot == 0) return;
+    dirty_range(slot, sizeof(int));
+    free_block(*slot);
+    *slot = 0;
+    node->blocks--;
+}
+
+// Map a file block to its disk block
+int inode_get_bnum(inode_t *node, int file_bnum) {
+    if (file_bnum < 0 || file_bnum >= MAX_FILE_BLOCKS) return -EFBIG;
+    int *slot;
+    int rv = bnum_slot(node, file_bnum, 0, &slot);
+    if (rv < 0) return rv;
+    return slot ? *slot : 0;
+}
+
+// Point a file block at a disk block (or at nothing, for a hole)
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum) {
+    if (file_bnum < 0 || file_bnum >= MAX_FILE_BLOCKS) return -EFBIG;
+    int *slot;
+    int rv = bnum_slot(node, file_bnum, bnum != 0, &slot);
+    if (rv < 0) return rv;
+    if (!slot) return 0; // Already a hole
+    dirty_range(slot, sizeof(int));
+    changed(node, 1);
+    if (!*slot != !bnum) {
+        inode_dirty(node);
+        node->blocks += bnum ? 1 : -1;
+    }
+    *slot = bnum;
+    node->version++;
+    return 0;
+}
+
+// Get a private, allocated block for a file block that is about to be written
+int inode_writable_bnum(inode_t *node, int file_bnum) {
+    if (file_bnum < 0 || file_bnum >= MAX_FILE_BLOCKS) return -EFBIG;
+    int *slot;
+    int rv = bnum_slot(node, file_bnum, 1, &slot);
+    if (rv < 0) return rv;
+    node->version++; // The caller is about to change the block
+
+    int old = *slot;
+    if (old > 0 && block_refs(old) == 1) {
+        return old; // Already ours alone
+    }
+    const void *shared = old > 0 ? blocks_get_block(old) : NULL;
+    if (old > 0 && !shared) return -EIO;
+
+    // Right after the file's previous block, so files written in order stay contiguous
+    int prev = file_bnum > 0 ? inode_get_bnum(node, file_bnum - 1) : 0;
+    int bnum = alloc_block_near(prev > 0 ? prev + 1 : home_goal(node));
+    if (bnum < 0) return -ENOSPC;
+
+    if (old > 0) {
+        // Copy-on-write: take a private copy and drop our share of the original
+        memcpy(blocks_overwrite(bnum), shared, BLOCK_SIZE);
+        free_block(old);
+    } else {
+        memset(blocks_overwrite(bnum), 0, BLOCK_SIZE); // Filling a hole
+        inode_dirty(node);
+        node->blocks++;
     }
-    // Extend this to handle additional files or directories
-    return -ENOENT; // Not found
+    dirty_range(slot, sizeof(int));
+    changed(node, 1);
+    *slot = bnum;
+    return bnum;
 }
 
 // Grow an inode to the specified size
@@ -51,13 +546,82 @@ int grow_inode(inode_t *node, int size) {
     if (node->size >= size) {
         return 0; // No need to grow
     }
+    if ((size - 1) / BLOCK_SIZE >= MAX_FILE_BLOCKS) {
+        return -EFBIG; // Beyond what the block map can address
+    }
 
-    int new_block = alloc_block();
-    if (new_block < 0) {
-        return -ENOSPC; // No space left on device
+    // The new range is a hole until it is written
+    inode_dirty(node);
+    changed(node, 1);
+    node->size = size;
+    node->version++;
+    return 0;
+}
+
+// Shrink an inode to the specified size, freeing its blocks from the last one down (and each
+// pointer block once nothing it maps is left). Freeing one block is one step: after the first,
+// a transaction too full for another (see journal_short()) ends the call early, with the inode
+// shortened to the blocks it still maps, for the caller to commit and call again.
+int shrink_inode(inode_t *node, int size) {
+    int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; // File blocks still in use
+    inode_map_t *map = inode_map(node);
+    inode_dirty(node);
+    inode_map_dirty(node);
+
+    const int first_indirect = INODE_DIRECT, first_dindirect = INODE_DIRECT + PTRS_PER_BLOCK;
+    int fb = map->dindirect ? MAX_FILE_BLOCKS - 1 : map->indirect ? first_dindirect - 1 : INODE_DIRECT - 1;
+    int freed = 0;
+    for (; fb >= keep; fb--) {
+        // The slot holding the file block's pointer, and the pointer block it is in (if any)
+        int *slot = NULL, *holder = NULL;
+        int base = 0; // First file block the holder maps
+        if (fb < first_indirect) {
+            slot = &map->block[fb];
+        } else if (fb < first_dindirect) {
+            holder = &map->indirect;
+            base = first_indirect;
+        } else {
+            int *outer = blocks_get_block(map->dindirect);
+            if (!outer) return -EIO;
+            int i = (fb - first_dindirect) / PTRS_PER_BLOCK;
+            holder = &outer[i];
+            base = first_dindirect + i * PTRS_PER_BLOCK;
+        }
+        if (holder) {
+            if (*holder == 0) {
+                fb = base; // A missing pointer block: skip what it would map
+                if (fb == first_dindirect) release_slot(node, &map->dindirect);
+                continue;
+            }
+            int *ptrs = blocks_get_block(*holder);
+            if (!ptrs) return -EIO;
+            slot = ptrs + (fb - base);
+        }
+        int last = holder && fb == base; // Its pointer block goes too
+        if (*slot == 0 && !last) continue;
+
+        if (freed && journal_short(JOURNAL_STEP_BLOCKS)) {
+            if ((long)node->size > (long)(fb + 1) * BLOCK_SIZE) node->size = (fb + 1) * BLOCK_SIZE;
+            node->version++;
+            return 1;
+        }
+        release_slot(node, slot);
+        if (last) release_slot(node, holder);
+        if (last && fb == first_dindirect) release_slot(node, &map->dindirect);
+        freed++;
+    }
+
+    // Bytes past the new end of the last block must read as zeros if the file grows again
+    int tail = size % BLOCK_SIZE;
+    if (tail && size < node->size && inode_get_bnum(node, size / BLOCK_SIZE) > 0) {
+        int bnum = inode_writable_bnum(node, size / BLOCK_SIZE);
+        if (bnum < 0) return bnum;
+        char *data = blocks_get_block(bnum);
+        if (!data) return -EIO;
+        memset(data + tail, 0, BLOCK_SIZE - tail);
     }
 
-    node->block = new_block; // Update inode to point to the new block
-    node->size = size;       // Update the inode size
+    node->size = size; // Journaled by inode_dirty() above, in this same transaction
+    node->version++;
     return 0;
 }
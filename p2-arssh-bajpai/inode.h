@@ -1,26 +1,163 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
-#define INODE_COUNT 128
+#define INODE_COUNT 128    /**< Number of inodes in the smallest images. */
+#define INODE_RATIO 16     /**< Image blocks per inode in larger images. */
+#define INODE_MAX (1 << 20) /**< Most inodes an image has. */
+#define INODE_DIRECT 12   /**< Number of block pointers stored directly in the inode. */
+#define INODE_INLINE_MAX ((INODE_DIRECT + 2) * (int)sizeof(int)) /**< Longest symlink target stored in the inode itself. */
+#define INODE_XATTR_INLINE 64  /**< Bytes of extended attributes packed into the inode itself. */
+
+#define INODE_XATTRS 0x1  /**< Inode flag: the inode has extended attributes (see xattr.h). */
+
+#define INODE_ATIME 0x1   /**< inode_touch(): the last access time. */
+#define INODE_MTIME 0x2   /**< inode_touch(): the last modification time. */
+#define INODE_CTIME 0x4   /**< inode_touch(): the last status change time. */
+#define NSEC_PER_SEC 1000000000LL /**< Nanoseconds per second, the unit of inode_times_t. */
+#define INODE_TIMES_AGE 60  /**< Longest time, in seconds, that inode_touch() leaves a change out of the journal. */
 
 /**
  * @brief Represents a file system inode, which contains metadata about a file or directory.
  *
- * Each inode holds information such as:
- * - Reference count (refs): How many directory entries or references point to this inode.
- * - File mode (mode): Permissions and file type bits (similar to st_mode in struct stat).
- * - File size (size): The size of the file in bytes.
- * - Block pointer (block): A single block pointer, which is sufficient for files up to 4KB in this simplistic design.
+ * The inode table is split by how often each part of an inode is used, into four arrays that
+ * each start on a block boundary of the table:
+ * - inode_t records (32 bytes, two per cache line) with what stat() and scans read: the
+ *   reference count (how many directory entries point to the inode), the mode (permissions and
+ *   file type bits, like st_mode), the size in bytes, flags and version counters.
+ * - inode_map_t records (64 bytes, one cache line) with the block map (see inode_map()).
+ * - INODE_XATTR_INLINE bytes of packed extended attributes per inode (see inode_xattrs()).
+ * - inode_times_t records (32 bytes) with the timestamps (see inode_times()).
+ * A pass over every inode's hot fields therefore streams through 32 bytes per inode instead of
+ * the whole inode, and no record straddles a block, so journaling one touches one block.
+ *
+ * Data blocks may be shared between inodes (see ref_block()); a shared block is copied before
+ * it is written. The inode table is stored in the metadata area of the disk image; its size
+ * grows with the image (one inode per INODE_RATIO blocks, from INODE_COUNT to INODE_MAX).
  */
 typedef struct inode {
-    int refs;   /**< Reference count (how many links to this inode exist) */
-    int mode;   /**< File mode (includes permissions and type, e.g. S_IFREG, S_IFDIR) */
-    int size;   /**< Size of the file in bytes */
-    int block;  /**< Pointer (index) to a single data block that holds file contents */
+    int refs;                 /**< Reference count (how many links to this inode exist) */
+    int mode;                 /**< File mode (includes permissions and type, e.g. S_IFREG, S_IFDIR) */
+    int size;                 /**< Size of the file in bytes */
+    int flags;                /**< INODE_* flags */
+    int generation;           /**< Bumped each time the inode number is reused (see alloc_inode()) */
+    int version;              /**< Bumped whenever the contents or size change (see inode_version()) */
+    int xattr_block;          /**< Block holding the extended attributes that don't fit inline, or 0 */
+    int blocks;               /**< Blocks the block map holds, pointer blocks included (the xattr block is not) */
 } inode_t;
 
+/**
+ * @brief The block map of an inode: the disk blocks holding the file's contents.
+ *
+ * The first INODE_DIRECT file blocks are listed here; later ones are reached through a single
+ * and a double indirect block of pointers. A pointer of 0 is a hole, which reads as zeros.
+ * For directories, block[0] holds the directory's entries (a directory_t). For a symlink whose
+ * target is at most INODE_INLINE_MAX bytes, the map holds the target itself (see
+ * inode_is_inline()); longer targets are stored in a data block like file contents.
+ */
+typedef struct inode_map {
+    union {
+        struct {
+            int block[INODE_DIRECT];  /**< Disk blocks holding the first INODE_DIRECT file blocks */
+            int indirect;             /**< Block of pointers to the following file blocks, or 0 */
+            int dindirect;            /**< Block of pointers to further indirect blocks, or 0 */
+        };
+        char symlink[INODE_INLINE_MAX]; /**< Target of a short symlink (not NUL-terminated) */
+    };
+    int reserved[2];          /**< Zero; pads the record to a cache line */
+} inode_map_t;
+
+/**
+ * @brief The timestamps of an inode, in nanoseconds since the epoch.
+ *
+ * They are kept apart from the inode_t records because they change far more often: every read
+ * may move the access time and every write the modification time. inode_touch() changes them in
+ * memory only, and inode_times_flush() journals the changed blocks later, so those operations
+ * don't add an inode table block to the journal just for a timestamp.
+ */
+typedef struct inode_times {
+    int64_t atime;            /**< Last access (st_atim) */
+    int64_t mtime;            /**< Last change to the contents (st_mtim) */
+    int64_t ctime;            /**< Last change to the contents or the inode (st_ctim) */
+    int64_t reserved;         /**< Zero; pads the record to 32 bytes */
+} inode_times_t;
+
+/**
+ * @brief Computes the size of the inode table for a number of inodes.
+ *
+ * @param count The number of inodes.
+ * @return The number of blocks the four arrays of the table take together.
+ */
+int inode_table_blocks(uint32_t count);
+
+/**
+ * @brief Locates the inode table in the loaded image and indexes which inodes are in use.
+ *
+ * Called by inode_init(); tools that examine an image without changing it call it instead.
+ */
+void inode_load();
+
+/**
+ * @brief Returns the number of inodes in the inode table.
+ *
+ * @return The image's inode count (see superblock_t).
+ */
+int inode_count();
+
+/**
+ * @brief Returns the block map of an inode.
+ *
+ * @param node A pointer to the inode.
+ * @return A pointer to its block map, in the inode table's map array.
+ */
+inode_map_t *inode_map(inode_t *node);
+
+/**
+ * @brief Returns the packed extended attributes stored with an inode (INODE_XATTR_INLINE bytes).
+ *
+ * @param node A pointer to the inode.
+ * @return A pointer to its inline attribute area, in the inode table's attribute array.
+ */
+char *inode_xattrs(inode_t *node);
+
+/**
+ * @brief Returns the timestamps of an inode.
+ *
+ * Changes made directly must be journaled with inode_times_dirty(); inode_touch() is the usual
+ * way to change them.
+ *
+ * @param node A pointer to the inode.
+ * @return A pointer to its timestamps, in the inode table's times array.
+ */
+inode_times_t *inode_times(inode_t *node);
+
+/**
+ * @brief Sets some of an inode's timestamps to the current time, lazily.
+ *
+ * The change is made in memory and the block holding it is noted, not journaled: it reaches the
+ * image when inode_times_flush() next journals the noted blocks, so a crash may lose it (as
+ * with Linux's lazytime). The access time follows relatime: it only moves if it is older than
+ * the modification or status change time, or more than a day old.
+ *
+ * @param node A pointer to the inode.
+ * @param which INODE_ATIME, INODE_MTIME and/or INODE_CTIME.
+ */
+void inode_touch(inode_t *node, int which);
+
+/**
+ * @brief Journals the blocks holding timestamps changed by inode_touch() since the last call.
+ *
+ * Does nothing unless `now` is set or the oldest of those changes is INODE_TIMES_AGE seconds
+ * old, so the timestamps ride along with transactions that write other metadata anyway.
+ *
+ * @param now Whether to journal them whatever their age (e.g., at unmount).
+ * @return The number of blocks journaled.
+ */
+int inode_times_flush(int now);
+
 /**
  * @brief Retrieves a pointer to the inode structure corresponding to a given inode number.
  *
@@ -29,11 +166,33 @@ typedef struct inode {
  */
 inode_t *get_inode(int inum);
 
+/**
+ * @brief Makes a new inode's blocks go near the directory it is created in.
+ *
+ * Until the inode has a first block, its blocks are allocated starting at the directory's first
+ * block (see alloc_block_near()), so a directory's files share its allocation group. The goal
+ * is kept in memory only; after a remount, files without blocks start in the writer's home group.
+ *
+ * @param node A pointer to the new inode.
+ * @param dir A pointer to the directory it is created in.
+ */
+void inode_set_goal(inode_t *node, inode_t *dir);
+
+/**
+ * @brief Returns the inode number of an inode.
+ *
+ * @param node A pointer to an inode in the inode table.
+ * @return Its index, as get_inode() takes it.
+ */
+int inode_num(inode_t *node);
+
 /**
  * @brief Allocates a new, free inode from the inode table.
  *
- * This function searches for an available inode in the inode array. If found, it initializes
- * that inode as needed and returns its index.
+ * This function finds an available inode in an in-memory bitmap of the inodes in use, searching
+ * from where the previous search stopped. If found, it clears the inode (all four parts), gives
+ * it one reference, a new generation number and the current time as all of its timestamps, and
+ * returns its index.
  *
  * @return The inode number of the allocated inode, or a negative value (e.g., -1) if no free inodes are available.
  */
@@ -42,22 +201,127 @@ int alloc_inode();
 /**
  * @brief Frees an inode, making it available for reuse.
  *
- * This function resets the inode fields, effectively marking it as unused. After calling free_inode(),
- * the inode number can be reused by alloc_inode().
+ * This function releases the inode's data blocks and resets the inode fields, effectively marking it
+ * as unused. After calling free_inode(), the inode number can be reused by alloc_inode().
  *
  * @param inum The inode number to free.
  */
 void free_inode(int inum);
 
+/**
+ * @brief Drops one link (directory entry) to an inode, freeing it when none remain.
+ *
+ * @param inum The inode number whose link was removed.
+ * @return The number of links left, or 0 if the inode was freed.
+ */
+int inode_unlink(int inum);
+
+/**
+ * @brief Copies an inode's record and timestamps without taking any lock.
+ *
+ * Each inode has a sequence count, kept in memory only, that is odd from the first change an
+ * operation makes to the inode's record or timestamps (through inode_dirty(),
+ * inode_times_dirty() or inode_touch()) until the operation calls inode_write_end(). A reader
+ * copies the inode between two reads of the count and retries if it changed. While the count
+ * is odd the copy could be half-changed for as long as the operation runs (possibly waiting for
+ * I/O), so the reader is told to go through storage's lock instead.
+ *
+ * @param inum The inode number.
+ * @param node Where to copy its inode_t record.
+ * @param times Where to copy its timestamps.
+ * @return 0 on success, -EAGAIN if the inode is being changed, or -ENOENT if `inum` is out of range.
+ */
+int inode_snapshot(int inum, inode_t *node, inode_times_t *times);
+
+/**
+ * @brief Ends the changes the running operation made to inodes, for inode_snapshot().
+ *
+ * Called as each operation that may change inodes ends, while it still holds storage's lock.
+ */
+void inode_write_end();
+
+/**
+ * @brief Reports whether an inode's contents are stored in the inode itself.
+ *
+ * True for symlinks whose target fits in INODE_INLINE_MAX bytes. Such an inode has no block
+ * map, so it must not be passed to the block map functions below.
+ *
+ * @param node A pointer to the inode.
+ * @return 1 if the contents are inline, 0 otherwise.
+ */
+int inode_is_inline(inode_t *node);
+
+/**
+ * @brief Returns a value that changes whenever an inode's contents may have changed.
+ *
+ * Combines the inode's generation (so a reused inode number never matches a value seen for
+ * the file that had it before) with its version, which the block map and size functions below
+ * bump on every change. Data cached while the value was the same is still current. The
+ * version is not journaled: the value only has to be stable while the image is open.
+ *
+ * @param node A pointer to the inode.
+ * @return The inode's data version.
+ */
+uint64_t inode_version(inode_t *node);
+
+/**
+ * @brief Reports whether a change to an inode still waits for a journal commit.
+ *
+ * The functions below note the transaction (see journal_tid()) each inode was last changed in,
+ * and separately the last one that changed its size or block map, which reading its data back
+ * depends on. Changes to the rest (links, mode, attributes, timestamps) don't matter to
+ * fdatasync(). A timestamp held back by inode_touch() counts as a change of the first kind.
+ *
+ * @param node A pointer to the inode.
+ * @param datasync Nonzero to consider only the size and block map.
+ * @return 1 if journal_commit() (after inode_times_flush(), unless `datasync`) is needed to make
+ *         the inode durable, 0 if everything about it has been committed.
+ */
+int inode_sync_pending(inode_t *node, int datasync);
+
+/**
+ * @brief Adds the inode table block holding an inode's inode_t record to the running journal
+ * transaction.
+ *
+ * Must be called whenever an inode's fields are changed outside this module.
+ *
+ * @param node A pointer to the inode that was (or is about to be) modified.
+ */
+void inode_dirty(inode_t *node);
+
+/**
+ * @brief Like inode_dirty(), for the block holding the inode's block map (see inode_map()).
+ *
+ * @param node A pointer to the inode whose block map was (or is about to be) modified.
+ */
+void inode_map_dirty(inode_t *node);
+
+/**
+ * @brief Like inode_dirty(), for the block holding the inode's inline extended attributes.
+ *
+ * @param node A pointer to the inode whose attributes were (or are about to be) modified.
+ */
+void inode_xattrs_dirty(inode_t *node);
+
+/**
+ * @brief Like inode_dirty(), for the block holding the inode's timestamps.
+ *
+ * For timestamps set explicitly (e.g., by utimensat()), which are journaled at once.
+ *
+ * @param node A pointer to the inode whose timestamps were (or are about to be) modified.
+ */
+void inode_times_dirty(inode_t *node);
+
 /**
  * @brief Expands the file size associated with the given inode.
  *
- * If an inode needs to store more data than currently allocated, this function attempts to
- * grow the inode to accommodate the new size. It may involve allocating additional data blocks.
+ * If an inode needs to store more data than its current size, this function extends the file to
+ * the new size. The new range is left as a hole; blocks are allocated as they are written
+ * (see inode_writable_bnum()).
  *
  * @param node A pointer to the inode to grow.
  * @param size The desired new size of the file.
- * @return 0 on success, or a negative error code if there's not enough space or another error occurs.
+ * @return 0 on success, or -EFBIG if the size exceeds what the block map can address.
  */
 int grow_inode(inode_t *node, int size);
 
@@ -65,11 +329,17 @@ int grow_inode(inode_t *node, int size);
  * @brief Shrinks the file size associated with the given inode.
  *
  * If a file is truncated or data is removed, this function adjusts the inode's size to the
- * specified smaller size. It may also free up no-longer-used blocks.
+ * specified smaller size. References to blocks past the new end are dropped, from the last block
+ * down, and the unused tail of the last block is zeroed (copying it first if it is shared).
+ *
+ * Freeing a large file can dirty more blocks than one journal transaction holds, so once a block
+ * has been freed and the running transaction is short of room (see journal_short()), it stops
+ * early: the inode is left shortened to the blocks it still maps, which is consistent on disk.
+ * The caller commits and calls it again until it returns 0.
  *
  * @param node A pointer to the inode to shrink.
  * @param size The new desired size of the file, which must be less than or equal to the current size.
- * @return 0 on success, or a negative error code if an error occurs.
+ * @return 0 when done, 1 if it stopped early, or a negative error code if an error occurs.
  */
 int shrink_inode(inode_t *node, int size);
 
@@ -77,20 +347,51 @@ int shrink_inode(inode_t *node, int size);
  * @brief Retrieves the block number (on-disk block index) that corresponds to a given file block number.
  *
  * Files can be considered as a sequence of blocks. Given a zero-based block index within the file,
- * this function returns the actual block number on disk. This simple file system uses a single block pointer,
- * so `file_bnum` must be 0 for valid files.
+ * this function returns the actual block number on disk by following the inode's block map.
  *
  * @param node A pointer to the inode.
  * @param file_bnum The file block number (starting from 0).
- * @return The disk block number if valid, or a negative value if the block doesn't exist.
+ * @return The disk block number if valid, 0 if that part of the file is a hole, -EFBIG if
+ *         `file_bnum` is beyond what the block map can address, or -EIO if a pointer block on the
+ *         way failed its checksum.
  */
 int inode_get_bnum(inode_t *node, int file_bnum);
 
+/**
+ * @brief Points a file block at a given disk block.
+ *
+ * Indirect blocks are allocated as needed. The caller is responsible for the reference counts of
+ * the data blocks involved: the reference held by the old pointer (if any) is not dropped.
+ *
+ * @param node A pointer to the inode.
+ * @param file_bnum The file block number (starting from 0).
+ * @param bnum The disk block number to store, or 0 to make the file block a hole.
+ * @return 0 on success, -ENOSPC if an indirect block could not be allocated, -EFBIG if
+ *         `file_bnum` is beyond what the block map can address, or -EIO if a pointer block (or,
+ *         for inode_writable_bnum(), the shared block being copied) failed its checksum.
+ */
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum);
+
+/**
+ * @brief Returns the disk block for a file block, ready to be modified.
+ *
+ * If the file block is a hole, a zeroed block is allocated for it. If its block is shared with
+ * other files (copy-on-write), the contents are copied to a private block first and the shared
+ * reference is dropped. Either way the returned block belongs to this inode alone.
+ *
+ * @param node A pointer to the inode.
+ * @param file_bnum The file block number (starting from 0).
+ * @return The disk block number, or a negative error code (e.g., -ENOSPC, or -EIO as for
+ *         inode_set_bnum()).
+ */
+int inode_writable_bnum(inode_t *node, int file_bnum);
+
 /**
  * @brief Initializes the inode table and related data structures.
  *
- * This function is typically called during file system initialization. It sets up the global inode array,
- * marks all inodes as free or loads their state from a disk image if needed.
+ * This function is typically called during file system initialization, after the image has been loaded.
+ * It points the inode table at its region of the image and, if the image is freshly formatted,
+ * creates the root directory as part of the running journal transaction.
  */
 void inode_init();
 
@@ -101,8 +402,35 @@ void inode_init();
  * the directory structure. If the path is found, the associated inode number is returned.
  *
  * @param path A null-terminated string representing the file system path.
- * @return The inode number if the path exists, or a negative value (e.g., -ENOENT) if it does not exist.
+ * @return The inode number if the path exists, or a negative value (-ENOENT, or -ENOTDIR if a
+ *         non-final component is not a directory) if it does not exist, or -EIO if a directory
+ *         on the way failed its checksum.
  */
 int tree_lookup(const char *path);
 
+/**
+ * @brief Like tree_lookup(), for a path given by its first `len` characters.
+ *
+ * Lets a caller resolve a prefix of a path (e.g., the parent directory) in place, without
+ * copying it. Neither function allocates memory.
+ *
+ * @param path The path (need not be NUL-terminated after `len` characters).
+ * @param len The length of the path.
+ * @return As for tree_lookup().
+ */
+int tree_lookup_n(const char *path, size_t len);
+
+/**
+ * @brief Looks up a path in the name cache (see dcache.h) alone, without taking any lock.
+ *
+ * Paths are added to the cache as tree_lookup() and tree_lookup_n() walk them.
+ *
+ * @param path The absolute path.
+ * @param generation Set to the generation the inode found had when it was cached; the caller
+ *                   checks it against the inode (see inode_snapshot()), which may since have
+ *                   been reused.
+ * @return The inode number, or -EAGAIN if some component of the path isn't cached.
+ */
+int tree_lookup_cached(const char *path, int *generation);
+
 #endif
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE // For fallocate()
+#include "ioengine.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define IOENGINE_HAVE_URING 1
+#endif
+
+// Perform one request synchronously against file 'fd'
+static ssize_t sync_request(int fd, io_request_t *req) {
+    ssize_t rv;
+    switch (req->op) {
+    case IO_READ:
+        rv = pread(fd, req->buf, req->len, req->offset);
+        break;
+    case IO_WRITE:
+        rv = pwrite(fd, req->buf, req->len, req->offset);
+        break;
+    case IO_DISCARD:
+#ifdef FALLOC_FL_PUNCH_HOLE
+        rv = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, req->offset, req->len);
+        if (rv == 0) rv = req->len;
+#else
+        errno = EOPNOTSUPP;
+        rv = -1;
+#endif
+        break;
+    default:
+        rv = fdatasync(fd);
+        break;
+    }
+    return rv < 0 ? -errno : rv;
+}
+
+#ifdef IOENGINE_HAVE_URING
+// The submission and completion rings shared with the kernel, for one backing file.
+// A ring is used by one batch at a time; its lock is held from submission to the last completion.
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    char *buf_base;     // Registered buffer, or NULL
+    size_t buf_len;
+} uring_t;
+#endif
+
+// One backing file of the image. Each has its own ring, and (when the image is striped
+// over several files) its own queue and worker thread, so requests to different files
+// are in flight at the same time.
+typedef struct device {
+    int fd;
+#ifdef IOENGINE_HAVE_URING
+    uring_t ring;
+    pthread_mutex_t ring_lock;
+#endif
+    pthread_t worker;
+    pthread_cond_t wake;         // Signalled when a job is queued or the worker should stop
+    struct io_job *queue, *queue_tail;
+} device_t;
+
+// A batch of requests for one device, queued for its worker
+typedef struct io_job {
+    io_request_t *reqs;
+    int count;
+    int *pending;                // Jobs of the batch not finished yet
+    struct io_job *next;
+} io_job_t;
+
+// Engine state. With no rings set up, every request goes through pread()/pwrite().
+// devices[0 .. device_count) hold the image (striped if there are several); an attached
+// fast tier is devices[device_count].
+static device_t devices[IOENGINE_MAX_DEVICES + 1] = {{.fd = -1}};
+static int device_count = 1;
+static int open_count = 1;   // device_count, plus one for a fast tier
+static size_t stripe_unit = IOENGINE_STRIPE_UNIT;
+static int uring_active = 0;
+static int workers_running = 0;
+static void *registered_base = NULL; // Kept for reopening (see ioengine_set_tier())
+static size_t registered_len = 0;
+
+// The fast tier, if one is attached (tier.fd >= 0), and the bytes read and written on each tier
+static ioengine_tier_t tier = {.fd = -1};
+static atomic_long tier_bytes[2][2]; // [on the fast tier][written]
+
+// Protects the device queues and the pending counts of queued batches
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+
+#ifdef IOENGINE_HAVE_URING
+// Tear down a ring (safe on a partially set up one)
+static void uring_close(uring_t *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Create a ring, register 'file' as a fixed file and, if possible, buf_base as a fixed buffer
+static int uring_open(uring_t *ring, int file, void *buf_base, size_t buf_len) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, IOENGINE_DEPTH, &p);
+    if (ring->fd < 0) return -errno;
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // The backing file is always the first (and only) fixed file
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &file, 1) < 0) {
+        goto fail;
+    }
+
+    // Registering the buffer pins it; if that is not allowed (RLIMIT_MEMLOCK), plain
+    // reads and writes still work, they just pin pages per request.
+    if (buf_base && buf_len) {
+        struct iovec iov = {.iov_base = buf_base, .iov_len = buf_len};
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            ring->buf_base = buf_base;
+            ring->buf_len = buf_len;
+        } else {
+            printf("[INFO] io_uring: could not register buffers (%s), using unregistered I/O\n", strerror(errno));
+        }
+    }
+    return 0;
+
+fail:;
+    int err = -errno;
+    uring_close(ring);
+    return err;
+}
+
+// Fill in a submission queue entry for a request
+static void uring_prep(uring_t *ring, struct io_uring_sqe *sqe, io_request_t *req, int index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = 0; // Index of the backing file in the fixed file table
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = index;
+
+    if (req->op == IO_SYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags |= IOSQE_IO_DRAIN; // Only after everything submitted before it
+        return;
+    }
+    if (req->op == IO_DISCARD) {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = req->offset;
+        sqe->addr = req->len; // fallocate() takes the length here and the mode in len
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        return;
+    }
+
+    char *buf = req->buf;
+    int fixed = ring->buf_base && buf >= ring->buf_base && buf + req->len <= ring->buf_base + ring->buf_len;
+    if (req->op == IO_READ) {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    }
+    sqe->addr = (unsigned long)buf;
+    sqe->len = req->len;
+    sqe->off = req->offset;
+    sqe->buf_index = 0;
+}
+
+// Submit up to IOENGINE_DEPTH requests to a device's ring and wait for all of their completions
+static void uring_batch(device_t *dev, io_request_t *reqs, int count) {
+    uring_t *ring = &dev->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+    for (int i = 0; i < count; i++) {
+        unsigned idx = (tail + i) & mask;
+        uring_prep(ring, &ring->sqes[idx], &reqs[i], i);
+        ring->sq_array[idx] = idx;
+    }
+    __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+    int to_submit = count, reaped = 0;
+    while (reaped < count) {
+        int rv = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rv < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            // The ring is unusable: finish the batch synchronously
+            perror("[ERROR] io_uring_enter failed");
+            for (int i = 0; i < count; i++) {
+                if (reqs[i].result == -EINPROGRESS) reqs[i].result = sync_request(dev->fd, &reqs[i]);
+            }
+            return;
+        }
+        to_submit -= rv;
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            io_request_t *req = &reqs[cqe->user_data];
+            req->result = req->op == IO_DISCARD && cqe->res == 0 ? (ssize_t)req->len : cqe->res;
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+// Perform a batch of requests, with offsets within the device's file, and wait for them
+static void device_run(device_t *dev, io_request_t *reqs, int count) {
+#ifdef IOENGINE_HAVE_URING
+    if (uring_active) {
+        pthread_mutex_lock(&dev->ring_lock);
+        for (int done = 0; done < count; done += IOENGINE_DEPTH) {
+            int n = count - done < IOENGINE_DEPTH ? count - done : IOENGINE_DEPTH;
+            uring_batch(dev, reqs + done, n);
+        }
+        pthread_mutex_unlock(&dev->ring_lock);
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        reqs[i].result = sync_request(dev->fd, &reqs[i]);
+    }
+}
+
+// A device's worker: runs the jobs queued for it, in order, until told to stop
+static void *device_worker(void *arg) {
+    device_t *dev = arg;
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!dev->queue && workers_running) {
+            pthread_cond_wait(&dev->wake, &queue_lock);
+        }
+        io_job_t *job = dev->queue;
+        if (!job) break;
+        dev->queue = job->next;
+        pthread_mutex_unlock(&queue_lock);
+
+        device_run(dev, job->reqs, job->count);
+
+        pthread_mutex_lock(&queue_lock);
+        if (--*job->pending == 0) {
+            pthread_cond_broadcast(&jobs_done);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+// In a child process (e.g. after FUSE daemonizes) the workers don't exist: requests run in
+// the submitting thread until the engine is opened again.
+static void forget_workers() {
+    workers_running = 0;
+    pthread_mutex_init(&queue_lock, NULL);
+}
+
+// Registered once, when the first stripe set starts its workers
+static void register_atfork() {
+    pthread_atfork(NULL, NULL, forget_workers);
+}
+
+// Stop the device workers, after they finish what is queued
+static void stop_workers() {
+    if (!workers_running) return;
+    pthread_mutex_lock(&queue_lock);
+    workers_running = 0;
+    for (int d = 0; d < open_count; d++) {
+        pthread_cond_signal(&devices[d].wake);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    for (int d = 0; d < open_count; d++) {
+        pthread_join(devices[d].worker, NULL);
+    }
+}
+
+// Where the byte at 'offset' is stored. Returns the device, sets *dev_offset to the offset in
+// its file and *run to how many bytes from there on are stored contiguously in that file.
+// Extents of a tiered image that are on the fast tier are found there; the rest of the image
+// is striped across the other files.
+static int route(off_t offset, io_route_t how, off_t *dev_offset, size_t *run) {
+    *run = SIZE_MAX;
+    if (how == IO_ROUTE_FAST) {
+        *dev_offset = offset;
+        return device_count;
+    }
+    if (tier.fd >= 0 && how != IO_ROUTE_CAPACITY && offset / (off_t)tier.extent < tier.extents) {
+        long e = offset / tier.extent;
+        size_t within = offset % tier.extent;
+        if (how == IO_ROUTE_TRACKED && tier.heat[e] < UINT8_MAX) {
+            tier.heat[e]++; // Racy, like any counter that only steers a heuristic
+        }
+        *run = tier.extent - within;
+        int32_t slot = __atomic_load_n(&tier.slot[e], __ATOMIC_ACQUIRE);
+        if (slot >= 0) {
+            *dev_offset = tier.base + (off_t)slot * tier.extent + within;
+            return device_count;
+        }
+    }
+    off_t stripe = offset / stripe_unit;
+    size_t left = stripe_unit - offset % stripe_unit;
+    if (device_count > 1 && left < *run) *run = left;
+    *dev_offset = stripe / device_count * stripe_unit + offset % stripe_unit;
+    return stripe % device_count;
+}
+
+// One piece of a request, bound for one device
+typedef struct piece {
+    io_request_t req;
+    int owner;   // Index of the request it is part of
+    int device;
+} piece_t;
+
+// Perform a batch against an image stored in several files (striped, tiered or both).
+// Each request is cut where its bytes change files (see route()) into pieces for the
+// devices holding them (a sync becomes one per device it applies to), every device's
+// pieces are handed to its worker as one job, and the pieces' results are folded back into
+// the requests. Pieces for one device keep the order of the batch, so a sync still follows
+// the writes before it on every device.
+static void split_submit(io_request_t *reqs, int count, io_route_t how) {
+    size_t min_run = device_count > 1 ? stripe_unit : SIZE_MAX;
+    if (tier.fd >= 0 && tier.extent < min_run) min_run = tier.extent;
+    if (how == IO_ROUTE_FAST) min_run = SIZE_MAX;
+    int bound = 0;
+    for (int i = 0; i < count; i++) {
+        int n = reqs[i].op == IO_SYNC ? open_count : min_run == SIZE_MAX ? 1 : (int)(reqs[i].len / min_run) + 2;
+        bound += reqs[i].op == IO_DISCARD ? 2 * n : n; // Discards on the fast tier go to both tiers
+    }
+
+    piece_t *pieces = malloc(bound * sizeof(piece_t));
+    io_request_t *by_device = malloc(bound * sizeof(io_request_t));
+    int *owner = malloc(bound * sizeof(int));
+    if (!pieces || !by_device || !owner) {
+        free(pieces);
+        free(by_device);
+        free(owner);
+        for (int i = 0; i < count; i++) reqs[i].result = -ENOMEM;
+        return;
+    }
+
+    // Route every request, in batch order
+    int per_device[IOENGINE_MAX_DEVICES + 1] = {0};
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        io_request_t *req = &reqs[i];
+        if (req->op == IO_SYNC) {
+            int first = how == IO_ROUTE_FAST ? device_count : 0;
+            int last = how == IO_ROUTE_CAPACITY ? device_count : open_count;
+            for (int d = first; d < last; d++) {
+                pieces[total++] = (piece_t){{.op = IO_SYNC, .result = -EINPROGRESS}, i, d};
+                per_device[d]++;
+            }
+            req->result = 0;
+            continue;
+        }
+        req->result = req->len;
+        for (off_t pos = req->offset; pos < req->offset + (off_t)req->len;) {
+            off_t dev_offset;
+            size_t len;
+            int d = route(pos, how, &dev_offset, &len);
+            if (len > req->offset + req->len - pos) len = req->offset + req->len - pos;
+            if (d == device_count && tier.fd < 0) {
+                req->result = -ENODEV; // No fast tier to route to
+                break;
+            }
+            if (req->op == IO_DISCARD && d == device_count && how != IO_ROUTE_FAST) {
+                // The extent's place in the image is released too, up to where that changes files
+                off_t capacity_offset;
+                size_t capacity_len;
+                int c = route(pos, IO_ROUTE_CAPACITY, &capacity_offset, &capacity_len);
+                if (len > capacity_len) len = capacity_len;
+                pieces[total++] = (piece_t){{IO_DISCARD, NULL, len, capacity_offset, -EINPROGRESS}, i, c};
+                per_device[c]++;
+            } else if (tier.fd >= 0 && req->op != IO_DISCARD) {
+                atomic_fetch_add_explicit(&tier_bytes[d == device_count][req->op == IO_WRITE], len,
+                                          memory_order_relaxed);
+            }
+            void *buf = req->buf ? (char *)req->buf + (pos - req->offset) : NULL;
+            pieces[total++] = (piece_t){{req->op, buf, len, dev_offset, -EINPROGRESS}, i, d};
+            per_device[d]++;
+            pos += len;
+        }
+    }
+
+    // Lay the pieces out device by device
+    int next[IOENGINE_MAX_DEVICES + 1];
+    for (int d = 0, start = 0; d < open_count; d++) {
+        next[d] = start;
+        start += per_device[d];
+    }
+    for (int p = 0; p < total; p++) {
+        owner[next[pieces[p].device]] = pieces[p].owner;
+        by_device[next[pieces[p].device]++] = pieces[p].req;
+    }
+
+    // One job per device with pieces; this thread waits for them all. Once the engine
+    // is closed there are no workers, and the pieces run here one device at a time.
+    if (!workers_running) {
+        for (int d = 0, start = 0; d < open_count; start += per_device[d++]) {
+            device_run(&devices[d], by_device + start, per_device[d]);
+        }
+    }
+    io_job_t jobs[IOENGINE_MAX_DEVICES + 1];
+    int pending = 0;
+    pthread_mutex_lock(&queue_lock);
+    for (int d = 0, start = 0; workers_running && d < open_count; start += per_device[d++]) {
+        if (!per_device[d]) continue;
+        jobs[d] = (io_job_t){by_device + start, per_device[d], &pending, NULL};
+        if (devices[d].queue) {
+            devices[d].queue_tail->next = &jobs[d];
+        } else {
+            devices[d].queue = &jobs[d];
+        }
+        devices[d].queue_tail = &jobs[d];
+        pending++;
+        pthread_cond_signal(&devices[d].wake);
+    }
+    while (pending > 0) {
+        pthread_cond_wait(&jobs_done, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    // A request fails with the first failed piece; a short read ends at the first byte missing
+    for (int p = 0; p < total; p++) {
+        io_request_t *req = &reqs[owner[p]];
+        if (req->result < 0) continue;
+        if (by_device[p].result < 0) {
+            req->result = by_device[p].result;
+        } else if ((by_device[p].op == IO_READ || by_device[p].op == IO_WRITE) && (size_t)by_device[p].result < by_device[p].len) {
+            ssize_t got = (char *)by_device[p].buf - (char *)req->buf + by_device[p].result;
+            if (got < req->result) req->result = got;
+        }
+    }
+    free(pieces);
+    free(by_device);
+    free(owner);
+}
+
+// Select the engine for all I/O against a single-file image
+int ioengine_open(const char *name, int fd, void *buf_base, size_t buf_len) {
+    return ioengine_open_striped(name, &fd, 1, IOENGINE_STRIPE_UNIT, buf_base, buf_len);
+}
+
+// Select the engine for all I/O against an image striped across 'count' files
+int ioengine_open_striped(const char *name, const int *fds, int count, size_t unit, void *buf_base,
+                          size_t buf_len) {
+    if (strcmp(name, IOENGINE_PREAD) != 0 && strcmp(name, IOENGINE_URING) != 0) {
+        printf("[ERROR] Unknown I/O engine: %s\n", name);
+        return -EINVAL;
+    }
+    if (count < 1 || count > IOENGINE_MAX_DEVICES || unit == 0) {
+        printf("[ERROR] Invalid stripe set: %d files, %zu byte stripe unit\n", count, unit);
+        return -EINVAL;
+    }
+
+    ioengine_close();
+    device_count = count;
+    stripe_unit = unit;
+    for (int d = 0; d < count; d++) {
+        devices[d].fd = fds[d];
+    }
+    open_count = count;
+    if (tier.fd >= 0) {
+        devices[open_count++].fd = tier.fd;
+    }
+    registered_base = buf_base;
+    registered_len = buf_len;
+
+    if (strcmp(name, IOENGINE_URING) == 0) {
+#ifdef IOENGINE_HAVE_URING
+        int rv = 0;
+        for (int d = 0; d < open_count && rv == 0; d++) {
+            devices[d].ring.fd = -1;
+            pthread_mutex_init(&devices[d].ring_lock, NULL);
+            rv = uring_open(&devices[d].ring, devices[d].fd, buf_base, buf_len);
+            if (rv < 0) {
+                while (d-- > 0) uring_close(&devices[d].ring);
+            }
+        }
+        if (rv == 0) {
+            uring_active = 1;
+            printf("[INFO] I/O engine: io_uring (depth %d per file, %s buffers)\n", IOENGINE_DEPTH,
+                   devices[0].ring.buf_base ? "registered" : "unregistered");
+        } else {
+            printf("[INFO] io_uring unavailable (%s), falling back to pread\n", strerror(-rv));
+        }
+#else
+        printf("[INFO] io_uring not supported on this system, falling back to pread\n");
+#endif
+    }
+    if (!uring_active) {
+        printf("[INFO] I/O engine: pread\n");
+    }
+
+    // A single file is driven from the submitting threads; several get one worker per file
+    if (open_count > 1) {
+        static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+        pthread_once(&atfork_once, register_atfork);
+        workers_running = 1;
+        for (int d = 0; d < open_count; d++) {
+            devices[d].queue = NULL;
+            pthread_cond_init(&devices[d].wake, NULL);
+            pthread_create(&devices[d].worker, NULL, device_worker, &devices[d]);
+        }
+    }
+    if (count > 1) {
+        printf("[INFO] Image striped across %d files in %zu KiB units\n", count, unit >> 10);
+    }
+    return 0;
+}
+
+// Name of the engine in use
+const char *ioengine_name() {
+    return uring_active ? IOENGINE_URING : IOENGINE_PREAD;
+}
+
+// Attach a fast tier (or detach it, with NULL), reopening the engine to give it a queue
+int ioengine_set_tier(const ioengine_tier_t *fast) {
+    int fds[IOENGINE_MAX_DEVICES];
+    for (int d = 0; d < device_count; d++) {
+        fds[d] = devices[d].fd;
+    }
+    const char *name = ioengine_name();
+    ioengine_close();
+    tier = fast ? *fast : (ioengine_tier_t){.fd = -1};
+    return ioengine_open_striped(name, fds, device_count, stripe_unit, registered_base, registered_len);
+}
+
+// Bytes read and written on each tier since the fast tier was attached
+void ioengine_tier_io(ioengine_tier_io_t *io) {
+    io->fast_read = atomic_load_explicit(&tier_bytes[1][0], memory_order_relaxed);
+    io->fast_written = atomic_load_explicit(&tier_bytes[1][1], memory_order_relaxed);
+    io->capacity_read = atomic_load_explicit(&tier_bytes[0][0], memory_order_relaxed);
+    io->capacity_written = atomic_load_explicit(&tier_bytes[0][1], memory_order_relaxed);
+}
+
+// Number of files the image is striped across, and the stripe unit
+int ioengine_stripe(size_t *unit) {
+    if (unit) *unit = stripe_unit;
+    return device_count;
+}
+
+// Change the stripe unit of the open stripe set
+void ioengine_set_stripe_unit(size_t unit) {
+    if (unit > 0) stripe_unit = unit;
+}
+
+// Bytes of the first 'image_size' bytes of the image that are stored in file 'device'
+off_t ioengine_device_size(int device, off_t image_size) {
+    off_t row = (off_t)stripe_unit * device_count;
+    off_t size = image_size / row * stripe_unit;
+    off_t rest = image_size % row - (off_t)device * stripe_unit;
+    if (rest > (off_t)stripe_unit) rest = stripe_unit;
+    return size + (rest > 0 ? rest : 0);
+}
+
+// Perform a batch of requests, routed as 'how' says, and wait for them all
+int ioengine_submit_routed(io_request_t *reqs, int count, io_route_t how) {
+    for (int i = 0; i < count; i++) {
+        reqs[i].result = -EINPROGRESS;
+    }
+
+    if (how == IO_ROUTE_FAST && tier.fd < 0) {
+        for (int i = 0; i < count; i++) reqs[i].result = -ENODEV;
+    } else if (open_count > 1) {
+        split_submit(reqs, count, how);
+    } else {
+        device_run(&devices[0], reqs, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].result < 0) return reqs[i].result;
+        if (reqs[i].op == IO_WRITE && (size_t)reqs[i].result != reqs[i].len) return -EIO;
+    }
+    return 0;
+}
+
+// Perform a batch of requests and wait for them all
+int ioengine_submit(io_request_t *reqs, int count) {
+    return ioengine_submit_routed(reqs, count, IO_ROUTE_TRACKED);
+}
+
+// Single read through the current engine
+ssize_t ioengine_pread(void *buf, size_t len, off_t offset) {
+    io_request_t req = {.op = IO_READ, .buf = buf, .len = len, .offset = offset};
+    ioengine_submit(&req, 1);
+    return req.result;
+}
+
+// Single write through the current engine
+ssize_t ioengine_pwrite(const void *buf, size_t len, off_t offset) {
+    io_request_t req = {.op = IO_WRITE, .buf = (void *)buf, .len = len, .offset = offset};
+    ioengine_submit(&req, 1);
+    return req.result;
+}
+
+// Flush the image to stable storage
+int ioengine_sync() {
+    io_request_t req = {.op = IO_SYNC};
+    return ioengine_submit(&req, 1);
+}
+
+// Tear down the current engine, going back to pread on the same files
+void ioengine_close() {
+    stop_workers();
+#ifdef IOENGINE_HAVE_URING
+    if (uring_active) {
+        for (int d = 0; d < open_count; d++) {
+            uring_close(&devices[d].ring);
+        }
+    }
+#endif
+    uring_active = 0;
+}
@@ -0,0 +1,223 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IOENGINE_PREAD "pread"  /**< Synchronous pread()/pwrite(), one request at a time. */
+#define IOENGINE_URING "uring"  /**< io_uring: a whole batch is submitted with one system call. */
+#define IOENGINE_DEPTH 64       /**< Most requests the io_uring engine keeps in flight (per file). */
+#define IOENGINE_MAX_DEVICES 16 /**< Most files an image can be striped across. */
+#define IOENGINE_STRIPE_UNIT (256 << 10) /**< Default bytes stored in one file before the next. */
+
+/**
+ * @brief The kind of operation an io_request_t performs.
+ */
+typedef enum io_op {
+    IO_READ,   /**< Read `len` bytes at `offset` into `buf`. */
+    IO_WRITE,  /**< Write `len` bytes from `buf` at `offset`. */
+    IO_SYNC,   /**< Flush the image (every file of it) to stable storage (fdatasync); runs after the requests before it. */
+    IO_DISCARD, /**< Release the storage behind `len` bytes at `offset` (punch a hole); they read as zeros afterwards. */
+} io_op_t;
+
+/**
+ * @brief One request in a batch passed to ioengine_submit().
+ */
+typedef struct io_request {
+    io_op_t op;      /**< What to do. */
+    void *buf;       /**< Data to write, or where to read into (unused for IO_SYNC and IO_DISCARD). */
+    size_t len;      /**< Number of bytes to transfer. */
+    off_t offset;    /**< Byte offset in the disk image (across all of its files, if striped). */
+    ssize_t result;  /**< Set on completion: bytes transferred, or a negative errno. */
+} io_request_t;
+
+/**
+ * @brief How the offsets of a batch passed to ioengine_submit_routed() are mapped to files.
+ */
+typedef enum io_route {
+    IO_ROUTE_TRACKED,   /**< Image offsets, found on whichever tier holds them; counted as accesses. */
+    IO_ROUTE_UNTRACKED, /**< As IO_ROUTE_TRACKED, without counting (e.g. for the scrubber). */
+    IO_ROUTE_CAPACITY,  /**< Image offsets, always at their place in the image's own file(s). */
+    IO_ROUTE_FAST,      /**< Offsets in the fast tier's file. */
+} io_route_t;
+
+/**
+ * @brief A fast tier attached to the image with ioengine_set_tier().
+ *
+ * The image is divided into extents of `extent` bytes. An extent with a slot is stored in the
+ * fast tier's file at `base` + slot * `extent` instead of at its place in the image; the
+ * engine looks up `slot` on every request and counts accesses in `heat`. Both arrays belong
+ * to the caller (see tier.h), which changes a slot only while no I/O to that extent is in
+ * progress and after the extent's data is in its new place.
+ */
+typedef struct ioengine_tier {
+    int fd;           /**< File descriptor of the fast tier's file. */
+    size_t extent;    /**< Bytes per extent. */
+    off_t base;       /**< Offset of slot 0 in the fast tier's file. */
+    long extents;     /**< Number of extents in the image. */
+    int32_t *slot;    /**< Per extent: the slot holding it on the fast tier, or -1. */
+    uint8_t *heat;    /**< Per extent: accesses counted by requests, saturating at 255. */
+} ioengine_tier_t;
+
+/**
+ * @brief Bytes transferred on each tier since a fast tier was attached (see ioengine_tier_io()).
+ */
+typedef struct ioengine_tier_io {
+    long fast_read;         /**< Bytes read from the fast tier. */
+    long fast_written;      /**< Bytes written to the fast tier. */
+    long capacity_read;     /**< Bytes read from the image's own file(s). */
+    long capacity_written;  /**< Bytes written to the image's own file(s). */
+} ioengine_tier_io_t;
+
+/**
+ * @brief Selects the engine used for all I/O against the disk image.
+ *
+ * The io_uring engine registers `fd` as a fixed file and, if given, the memory region
+ * [`buf_base`, `buf_base` + `buf_len`) as a fixed buffer, so requests whose buffers lie inside it
+ * avoid per-request page pinning. If io_uring is unavailable the pread engine is used instead.
+ * Must not be called while I/O is in progress. Because registered buffers are pinned to the
+ * calling process, io_uring should only be selected after the file system has daemonized.
+ *
+ * @param name IOENGINE_PREAD or IOENGINE_URING.
+ * @param fd The file descriptor of the disk image.
+ * @param buf_base Start of the memory that most requests read into or write from, or NULL.
+ * @param buf_len Length of that memory region in bytes.
+ * @return 0 on success (possibly after falling back to pread), or -EINVAL for an unknown name.
+ */
+int ioengine_open(const char *name, int fd, void *buf_base, size_t buf_len);
+
+/**
+ * @brief Like ioengine_open(), for an image striped across several files.
+ *
+ * The image is cut into `unit`-byte stripes that go to the files in turn: stripe i is stored in
+ * file i % `count`. Every file has its own queue and worker thread (and, with io_uring, its own
+ * ring), so a batch that spans several files keeps all of them busy at once, and IO_SYNC flushes
+ * them in parallel. With a `count` of 1 this is ioengine_open(): requests run in the threads
+ * that submit them.
+ *
+ * @param name IOENGINE_PREAD or IOENGINE_URING.
+ * @param fds The file descriptors of the files, in stripe order.
+ * @param count The number of files (1 to IOENGINE_MAX_DEVICES).
+ * @param unit The stripe unit in bytes; a multiple of the block size keeps blocks in one file.
+ * @param buf_base As for ioengine_open().
+ * @param buf_len As for ioengine_open().
+ * @return 0 on success, or -EINVAL for an unknown name or an invalid stripe set.
+ */
+int ioengine_open_striped(const char *name, const int *fds, int count, size_t unit, void *buf_base,
+                          size_t buf_len);
+
+/**
+ * @brief Attaches a fast tier to the image, or detaches it.
+ *
+ * The engine is reopened (with the same engine, files and buffer) so the fast tier's file gets
+ * a queue, worker and ring like the image's files. Must not be called while I/O is in progress.
+ *
+ * @param fast The fast tier (copied), or NULL to detach it.
+ * @return 0 on success, or a negative errno.
+ */
+int ioengine_set_tier(const ioengine_tier_t *fast);
+
+/**
+ * @brief Reports the bytes transferred on each tier.
+ *
+ * @param io The structure to fill in.
+ */
+void ioengine_tier_io(ioengine_tier_io_t *io);
+
+/**
+ * @brief Reports how the image is striped.
+ *
+ * @param unit If not NULL, set to the stripe unit in bytes.
+ * @return The number of files the image is striped across (1 if it is not striped).
+ */
+int ioengine_stripe(size_t *unit);
+
+/**
+ * @brief Changes the stripe unit, e.g. to the one recorded in an image's superblock.
+ *
+ * The first stripe unit of the first file holds the image's start whatever the unit, so the
+ * superblock can be read before the unit is known. Must not be called while I/O is in progress.
+ *
+ * @param unit The stripe unit in bytes.
+ */
+void ioengine_set_stripe_unit(size_t unit);
+
+/**
+ * @brief Computes how much of an image of a given size is stored in one file of the stripe set.
+ *
+ * @param device The index of the file.
+ * @param image_size The size of the image in bytes.
+ * @return The size the file needs, in bytes.
+ */
+off_t ioengine_device_size(int device, off_t image_size);
+
+/**
+ * @brief Returns the name of the engine in use.
+ *
+ * @return IOENGINE_PREAD or IOENGINE_URING.
+ */
+const char *ioengine_name();
+
+/**
+ * @brief Performs a batch of requests and waits for all of them to complete.
+ *
+ * The io_uring engine submits up to IOENGINE_DEPTH requests with one system call and lets the
+ * kernel run them concurrently; an IO_SYNC request waits for every request before it. The pread
+ * engine performs them in order. On a striped or tiered image, requests are split where their
+ * bytes change files and each file's share runs on that file's worker, in batch order, while the
+ * files proceed in parallel. Extents on a fast tier are found there (IO_ROUTE_TRACKED). An
+ * IO_DISCARD of bytes on the fast tier releases them in the image's own file as well, where the
+ * extent would return to. Where the host file system can't punch holes, IO_DISCARD fails with
+ * -EOPNOTSUPP. Thread-safe.
+ *
+ * @param reqs The requests; each one's `result` is filled in.
+ * @param count The number of requests.
+ * @return 0 if every request succeeded (a short read, e.g. past the end of the image, counts as
+ *         success), or the first error as a negative errno (-EIO for a short write).
+ */
+int ioengine_submit(io_request_t *reqs, int count);
+
+/**
+ * @brief Like ioengine_submit(), with the offsets mapped to files as `how` says.
+ *
+ * IO_ROUTE_CAPACITY and IO_ROUTE_FAST let the caller copy an extent between the tiers; an
+ * IO_SYNC then only flushes the files of that tier.
+ *
+ * @param reqs The requests; each one's `result` is filled in.
+ * @param count The number of requests.
+ * @param how How offsets are mapped (IO_ROUTE_FAST fails with -ENODEV without a fast tier).
+ * @return As for ioengine_submit().
+ */
+int ioengine_submit_routed(io_request_t *reqs, int count, io_route_t how);
+
+/**
+ * @brief Reads from the disk image through the current engine.
+ *
+ * @return The number of bytes read, or a negative errno.
+ */
+ssize_t ioengine_pread(void *buf, size_t len, off_t offset);
+
+/**
+ * @brief Writes to the disk image through the current engine.
+ *
+ * @return The number of bytes written, or a negative errno.
+ */
+ssize_t ioengine_pwrite(const void *buf, size_t len, off_t offset);
+
+/**
+ * @brief Flushes everything written so far to stable storage.
+ *
+ * @return 0 on success, or a negative errno.
+ */
+int ioengine_sync();
+
+/**
+ * @brief Tears down the current engine and returns to the pread engine.
+ *
+ * Stops the per-file workers of a stripe set; requests submitted afterwards run in the
+ * submitting thread, one file at a time.
+ */
+void ioengine_close();
+
+#endif
@@ -0,0 +1,225 @@
+#include "journal.h"
+#include "blocks.h"
+#include "crc32c.h"
+#include "ioengine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Most block copies a single transaction can hold in the largest journal: the
+// descriptor and the commit block take one journal block each, and every copy
+// needs a slot in the descriptor's block list.
+#define JOURNAL_MAX_BLOCKS (JOURNAL_BLOCKS - 2)
+_Static_assert(sizeof(journal_header_t) + JOURNAL_MAX_BLOCKS * sizeof(uint32_t) <= BLOCK_SIZE,
+               "journal descriptor must fit in one block");
+
+static int (*checkpoint_blocks)(const int *block_nums, int count) = NULL;
+static int (*flush_deferred_data)() = NULL;
+static uint64_t next_seq = 1;
+
+// The running transaction: the blocks it has dirtied, in order. Each one stays
+// pinned in memory (see blocks_pin()) until the transaction is committed.
+static int tx_blocks[JOURNAL_MAX_BLOCKS];
+static int tx_count = 0;
+
+// Blocks dirtied after the running transaction filled up: by an operation that outgrew
+// the room it was given (see journal_short()), or by a large batch of timestamps (see
+// inode_times_flush()). They stay pinned and are committed right after the transaction,
+// in as many further transactions as they need.
+static int *overflow = NULL;
+static int overflow_count = 0, overflow_size = 0;
+
+// Staging area for writing a whole transaction with one request (block-aligned for O_DIRECT)
+static char *journal_buf = NULL;
+
+// Most block copies a transaction can hold in the open image's journal
+static int tx_capacity() {
+    superblock_t *sb = get_superblock();
+    return sb->refs_start - sb->journal_start - 2;
+}
+
+// Set up the journal for the open image
+void journal_init(int (*write_blocks)(const int *block_nums, int count), int (*flush_data)()) {
+    checkpoint_blocks = write_blocks;
+    flush_deferred_data = flush_data;
+    tx_count = 0;
+    overflow_count = 0;
+
+    if (!journal_buf) {
+        if (posix_memalign((void **)&journal_buf, BLOCK_SIZE, JOURNAL_BLOCKS * BLOCK_SIZE) != 0) {
+            fprintf(stderr, "[ERROR] Failed to allocate journal buffer\n");
+            exit(1);
+        }
+    }
+}
+
+// Replay the transaction at the start of the journal if it is complete
+int journal_recover() {
+    superblock_t *sb = get_superblock();
+    off_t start = (off_t)sb->journal_start * BLOCK_SIZE;
+    ssize_t len = (ssize_t)(tx_capacity() + 2) * BLOCK_SIZE;
+
+    if (ioengine_pread(journal_buf, len, start) != len) {
+        return 0; // Journal never written
+    }
+
+    journal_header_t *hdr = (journal_header_t *)journal_buf;
+    if (hdr->magic != JOURNAL_MAGIC || hdr->count == 0 || hdr->count > (uint32_t)tx_capacity()) {
+        return 0;
+    }
+
+    journal_commit_t *commit = (journal_commit_t *)(journal_buf + (hdr->count + 1) * BLOCK_SIZE);
+    uint32_t crc = crc32c(0, journal_buf, (hdr->count + 1) * BLOCK_SIZE);
+    if (commit->magic != JOURNAL_COMMIT || commit->seq != hdr->seq || commit->crc != crc) {
+        printf("[INFO] Journal: ignoring incomplete transaction %llu\n", (unsigned long long)hdr->seq);
+        return 0;
+    }
+
+    int replayed[JOURNAL_MAX_BLOCKS];
+    int count = 0;
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        uint32_t bnum = hdr->blocks[i];
+        if (bnum >= sb->block_count) continue;
+        memcpy(blocks_overwrite(bnum), journal_buf + (i + 1) * BLOCK_SIZE, BLOCK_SIZE);
+        replayed[count++] = bnum;
+    }
+    checkpoint_blocks(replayed, count);
+    ioengine_sync();
+
+    next_seq = hdr->seq + 1;
+    printf("[INFO] Journal: replayed transaction %llu (%u blocks)\n", (unsigned long long)hdr->seq, hdr->count);
+    return hdr->count;
+}
+
+// Add a block to the running transaction. Nothing is committed here: an operation that
+// fills the transaction keeps adding to the overflow list until it ends (see journal_commit()).
+void journal_dirty(int block_num) {
+    if (block_num < 0 || block_num >= (int)get_superblock()->block_count) {
+        return;
+    }
+    for (int i = 0; i < tx_count; i++) {
+        if (tx_blocks[i] == block_num) return; // Already part of the transaction
+    }
+    if (tx_count < tx_capacity()) {
+        blocks_pin(block_num); // Its changes live only in memory until the commit
+        tx_blocks[tx_count++] = block_num;
+        return;
+    }
+
+    for (int i = 0; i < overflow_count; i++) {
+        if (overflow[i] == block_num) return;
+    }
+    if (overflow_count == overflow_size) {
+        int size = overflow_size ? overflow_size * 2 : JOURNAL_MAX_BLOCKS;
+        int *grown = realloc(overflow, size * sizeof(int));
+        if (!grown) {
+            fprintf(stderr, "[ERROR] Failed to allocate journal overflow list\n");
+            exit(1);
+        }
+        overflow = grown;
+        overflow_size = size;
+    }
+    if (overflow_count == 0) {
+        printf("[INFO] Journal: transaction full, committing the rest of it separately\n");
+    }
+    blocks_pin(block_num);
+    overflow[overflow_count++] = block_num;
+}
+
+// Percentage of the running transaction's slots in use
+int journal_usage() {
+    return tx_count * 100 / tx_capacity();
+}
+
+// Whether fewer than 'need' slots are left, asking for at most half of a small journal
+int journal_short(int need) {
+    int capacity = tx_capacity();
+    if (need > capacity / 2) need = capacity / 2;
+    return tx_count + overflow_count > 0 && capacity - tx_count < need;
+}
+
+// Number of blocks in the running transaction
+int journal_pending() {
+    return tx_count + overflow_count;
+}
+
+// Sequence number of the running transaction
+uint64_t journal_tid() {
+    return next_seq;
+}
+
+// Write the blocks in tx_blocks to the journal as one transaction, then to their home
+// locations, and unpin them
+static int write_transaction() {
+    // Descriptor, block copies and commit block, laid out as they go on disk
+    memset(journal_buf, 0, BLOCK_SIZE);
+    journal_header_t *hdr = (journal_header_t *)journal_buf;
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->count = tx_count;
+    hdr->seq = next_seq++;
+    for (int i = 0; i < tx_count; i++) {
+        hdr->blocks[i] = tx_blocks[i];
+        memcpy(journal_buf + (i + 1) * BLOCK_SIZE, blocks_get_block(tx_blocks[i]), BLOCK_SIZE);
+    }
+
+    char *commit_block = journal_buf + (tx_count + 1) * BLOCK_SIZE;
+    memset(commit_block, 0, BLOCK_SIZE);
+    journal_commit_t *commit = (journal_commit_t *)commit_block;
+    commit->magic = JOURNAL_COMMIT;
+    commit->seq = hdr->seq;
+    commit->crc = crc32c(0, journal_buf, (tx_count + 1) * BLOCK_SIZE);
+
+    // The transaction must be durable before any home location is overwritten
+    size_t len = (tx_count + 2) * BLOCK_SIZE;
+    off_t start = (off_t)get_superblock()->journal_start * BLOCK_SIZE;
+    int rv = 0;
+    io_request_t write_tx[] = {
+        {IO_WRITE, journal_buf, len, start, 0},
+        {IO_SYNC, NULL, 0, 0, 0},
+    };
+    if (ioengine_submit(write_tx, 2) < 0) {
+        fprintf(stderr, "[ERROR] Failed to write journal\n");
+        rv = -EIO;
+    }
+
+    // Checkpoint, and make it durable before the next transaction reuses the journal
+    if (rv == 0) {
+        if (checkpoint_blocks(tx_blocks, tx_count) < 0) rv = -EIO;
+        if (ioengine_sync() < 0) rv = -EIO;
+    }
+
+    for (int i = 0; i < tx_count; i++) {
+        blocks_unpin(tx_blocks[i]);
+    }
+    tx_count = 0;
+    return rv;
+}
+
+// Write the running transaction to the journal, then to its home locations. Blocks on
+// the overflow list follow in transactions of their own, once no operation is changing
+// them any more; only then may the blocks freed be reused.
+int journal_commit() {
+    // Ordered mode: data first, then the metadata pointing at it
+    int data_rv = flush_deferred_data ? flush_deferred_data() : 0;
+    if (tx_count == 0) {
+        return data_rv < 0 ? -EIO : 0;
+    }
+
+    int rv = write_transaction();
+    int done = 0;
+    while (rv == 0 && done < overflow_count) {
+        while (done < overflow_count && tx_count < tx_capacity()) {
+            tx_blocks[tx_count++] = overflow[done++]; // Still pinned
+        }
+        rv = write_transaction();
+    }
+    for (int i = done; i < overflow_count; i++) {
+        blocks_unpin(overflow[i]); // A failed commit leaves its changes in memory only
+    }
+    overflow_count = 0;
+    if (rv == 0) {
+        blocks_committed();
+    }
+    return rv < 0 || data_rv < 0 ? -EIO : 0;
+}
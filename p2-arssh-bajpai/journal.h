@@ -0,0 +1,133 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_BLOCKS 256         /**< Size of the journal region, in blocks, in images of 64 MiB or more. */
+#define JOURNAL_MIN_BLOCKS 16      /**< Size of the journal region in the smallest images. */
+#define JOURNAL_OP_BLOCKS 16       /**< Room in the running transaction an operation starts with (see journal_short()). */
+#define JOURNAL_STEP_BLOCKS 8      /**< Room one step of a long operation starts with, such as freeing one more block. */
+#define JOURNAL_MAGIC 0x4c4e524a   /**< "JRNL": marks a transaction descriptor block. */
+#define JOURNAL_COMMIT 0x54494d43  /**< "CMIT": marks a transaction commit block. */
+
+/**
+ * @brief The first block of a journaled transaction.
+ *
+ * A transaction occupies the start of the journal region: this descriptor, a copy of each
+ * metadata block it changes (in the order listed in `blocks`), and a journal_commit_t.
+ */
+typedef struct journal_header {
+    uint32_t magic;     /**< JOURNAL_MAGIC. */
+    uint32_t count;     /**< Number of block copies that follow the descriptor. */
+    uint64_t seq;       /**< Transaction sequence number. */
+    uint32_t blocks[];  /**< Home location of each block copy. */
+} journal_header_t;
+
+/**
+ * @brief The block that seals a transaction. A transaction without a valid commit block
+ * (matching sequence number and checksum) is ignored during recovery.
+ */
+typedef struct journal_commit {
+    uint32_t magic;  /**< JOURNAL_COMMIT. */
+    uint32_t crc;    /**< CRC32C of the descriptor and every block copy. */
+    uint64_t seq;    /**< Must match the descriptor's sequence number. */
+} journal_commit_t;
+
+/**
+ * @brief Initializes the journal for an open disk image.
+ *
+ * The journal itself is read and written through the I/O engine (see ioengine.h).
+ *
+ * @param write_blocks A function that writes in-memory blocks to their home locations in the
+ *                     image (updating their checksums), used to checkpoint committed blocks.
+ * @param flush_data A function called at the start of every journal_commit() to write out file
+ *                   data whose writes were deferred, so data reaches the image before the
+ *                   metadata that references it. May be NULL.
+ */
+void journal_init(int (*write_blocks)(const int *block_nums, int count), int (*flush_data)());
+
+/**
+ * @brief Replays the last committed transaction, if any, into the loaded image.
+ *
+ * Called once the image's superblock has been validated and its resident area loaded. Each block in
+ * the transaction is copied into memory and written back to its home location. Replaying a
+ * transaction that was already checkpointed is harmless, because every later metadata change
+ * would have been committed as a newer transaction.
+ *
+ * @return The number of blocks replayed, or 0 if the journal held no valid transaction.
+ */
+int journal_recover();
+
+/**
+ * @brief Adds a metadata block to the running transaction.
+ *
+ * Must be called for every block of metadata (superblock, bitmap, reference counts, inode table,
+ * directory entries, indirect pointers) modified by an operation. File data blocks are not
+ * journaled; they are written before the transaction that references them commits. Nothing is
+ * committed here, so every block an operation changes is in the same transaction: callers keep
+ * the transaction from filling up by committing between operations, or between the steps of a
+ * long one (see journal_short()). Should it fill anyway, further blocks are kept on an overflow
+ * list and committed after it, which loses only the crash atomicity of that operation. The
+ * block stays pinned in memory (see blocks_pin()) until it is committed, since the block cache
+ * never writes back.
+ *
+ * @param block_num The block number that was (or is about to be) modified.
+ */
+void journal_dirty(int block_num);
+
+/**
+ * @brief Returns how full the running transaction is.
+ *
+ * A transaction may span many operations (see storage_set_writeback()); this tells the caller
+ * when to start committing in the background.
+ *
+ * @return The percentage of the transaction's block slots in use.
+ */
+int journal_usage();
+
+/**
+ * @brief Tells whether the running transaction must be committed before more is added to it.
+ *
+ * Called at points where everything on disk is consistent: before an operation starts, with
+ * JOURNAL_OP_BLOCKS, or between the steps of one too long for a single transaction (freeing
+ * or writing a large file), with JOURNAL_STEP_BLOCKS. Committing there keeps every block the
+ * next operation or step dirties in one transaction.
+ *
+ * @param need The room the caller wants; at most half of a small journal is asked for.
+ * @return 1 if the transaction holds blocks and has fewer than 'need' slots left, 0 otherwise.
+ */
+int journal_short(int need);
+
+/**
+ * @brief Returns the number of blocks in the running transaction.
+ *
+ * @return The number of distinct blocks journal_dirty() has added since the last commit
+ *         (including any on the overflow list).
+ */
+int journal_pending();
+
+/**
+ * @brief Returns the sequence number the running transaction will be committed with.
+ *
+ * It changes only when a transaction that holds blocks is committed, so a caller can note it
+ * after journal_dirty() and later tell whether that change has been committed since.
+ *
+ * @return The running transaction's sequence number.
+ */
+uint64_t journal_tid();
+
+/**
+ * @brief Commits the running transaction and checkpoints it.
+ *
+ * The descriptor, the current contents of every dirty block and the commit block are written to
+ * the journal region and synced; only then are the blocks written to their home locations. A
+ * crash at any point leaves either the old or the new version of all of them. Does nothing if
+ * no block is dirty (other than flushing deferred data). Blocks on the overflow list (see
+ * journal_dirty()) are committed next, in further transactions. Once all of them are durable,
+ * the blocks freed may be allocated again (see blocks_committed()).
+ *
+ * @return 0 on success, or -EIO if the journal (or deferred data) could not be written.
+ */
+int journal_commit();
+
+#endif
@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 29
+#define FUSE_USE_VERSION 31
 #include <fuse.h>
 #include <string.h>
 #include <assert.h>
@@ -7,40 +7,184 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include "storage.h"   // Contains functions for interacting with the "disk" and filesystem data structures
 #include "slist.h"     // Linked list structure used for directory listings
+#include "arena.h"     // Per-thread arenas that directory listings are built in
+#include "scrub.h"     // Background checksum scrubber
+#include "flusher.h"   // Background writeback thread
+#include "nufs_ioctl.h" // ioctl commands understood by nufs
+#include "ioengine.h"  // I/O engines for the disk image
+#include "cache.h"     // Block cache counters
+#include "tier.h"      // Fast tier migration thread
+#include "trace.h"     // Operation trace recorder
+#include "trim.h"      // Background trim thread
+#include "blocks.h"    // Discard modes
+
+// Command-line options. Besides FUSE's own options, nufs takes the disk image as its
+// second non-option argument (followed by any further files to stripe it across) and
+// understands `-o ioengine=pread|uring`, `-o direct_image`, `-o cache_size=SIZE`,
+// `-o image_size=SIZE`, `-o stripe_unit=SIZE`, `-o commit=SECONDS`, `-o tier=PATH`,
+// `-o tier_size=SIZE`, `-o tier_rate=SIZE`, `-o trace=PATH`, `-o trace_size=SIZE` and
+// `-o discard=off|free|periodic`.
+static struct nufs_options {
+    const char *mount_point;
+    const char *disk_image;
+    const char *stripe_images[IOENGINE_MAX_DEVICES]; // NULL-terminated
+    int stripe_count;
+    char *stripe_unit;
+    char *ioengine;
+    int direct_image;
+    char *cache_size;
+    char *image_size;
+    int commit;
+    char *tier;
+    char *tier_size;
+    char *tier_rate;
+    char *trace;
+    char *trace_size;
+    char *discard;
+} options;
+
+static const struct fuse_opt nufs_opts[] = {
+    {"ioengine=%s", offsetof(struct nufs_options, ioengine), 0},
+    {"direct_image", offsetof(struct nufs_options, direct_image), 1},
+    {"cache_size=%s", offsetof(struct nufs_options, cache_size), 0},
+    {"image_size=%s", offsetof(struct nufs_options, image_size), 0},
+    {"stripe_unit=%s", offsetof(struct nufs_options, stripe_unit), 0},
+    {"commit=%d", offsetof(struct nufs_options, commit), 0},
+    {"tier=%s", offsetof(struct nufs_options, tier), 0},
+    {"tier_size=%s", offsetof(struct nufs_options, tier_size), 0},
+    {"tier_rate=%s", offsetof(struct nufs_options, tier_rate), 0},
+    {"trace=%s", offsetof(struct nufs_options, trace), 0},
+    {"trace_size=%s", offsetof(struct nufs_options, trace_size), 0},
+    {"discard=%s", offsetof(struct nufs_options, discard), 0},
+    FUSE_OPT_END,
+};
+
+// How long the kernel may trust attributes and names it has looked up, in seconds.
+// Every change made through the kernel updates its caches; changes it can't see
+// (made by ioctls) are pushed to it with invalidate().
+#define NUFS_CACHE_TIMEOUT 60.0
+
+// Paths whose data the kernel may still have cached, with the data version (see
+// storage_data_version()) the file had when it was last opened. Direct-mapped by a
+// hash of the path; losing an entry only costs the kernel a reread.
+#define OPENED_SLOTS 1024
+static struct {
+    uint64_t path_hash;
+    uint64_t version;
+} opened[OPENED_SLOTS];
+static pthread_mutex_t opened_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse a size such as "4096", "512M" or "2G" (binary K/M/G/T suffixes).
+// Returns -1 if the text is not a size.
+static long long parse_size(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    if (end == text || size < 0) return -1;
+    switch (*end) {
+    case 'T': case 't': size <<= 10; // Fall through
+    case 'G': case 'g': size <<= 10; // Fall through
+    case 'M': case 'm': size <<= 10; // Fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Whether 'path' is the control file (see nufs_ioctl.h). It lives only in nufs.c:
+// the storage layer never sees it.
+static int is_control(const char *path) {
+    return strcmp(path, NUFS_CONTROL_PATH) == 0;
+}
+
+// Attributes of the control file: an empty file only its owner can open
+static void control_stat(struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0600;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+}
+
+// FNV-1a hash of a path
+static uint64_t path_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Drop what the kernel has cached (attributes and data) for a path that changed without it
+// knowing. Names are looked up again anyway, since failed lookups are never cached.
+static void invalidate(const char *path) {
+    struct fuse_context *ctx = fuse_get_context();
+    if (ctx && ctx->fuse) {
+        fuse_invalidate_path(ctx->fuse, path); // -ENOENT if the kernel never looked it up
+    }
+}
 
 // The nufs_access function checks if the given path can be accessed with the specified mask (e.g., read/write/execute).
 // It calls storage_stat() to see if the file exists and returns 0 on success or an error code on failure.
 int nufs_access(const char *path, int mask) {
     printf("[DEBUG] nufs_access: path=%s, mask=%04o\n", path, mask);
+    uint64_t t = trace_begin();
     struct stat st;
-    int rv = storage_stat(path, &st);
+    int rv = is_control(path) ? 0 : storage_stat(path, &st);
+    trace_end(t, TRACE_ACCESS, path, NULL, 0, 0, mask, rv < 0 ? rv : 0);
     printf("[INFO] access(%s, %04o) -> %d\n", path, mask, rv);
     return rv < 0 ? rv : 0;
 }
 
 // The nufs_getattr function retrieves file attributes (e.g., size, mode, timestamps) for the given path.
 // It uses storage_stat() to populate a stat structure.
-int nufs_getattr(const char *path, struct stat *st) {
+int nufs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
     printf("[DEBUG] nufs_getattr: path=%s\n", path);
+    if (is_control(path)) {
+        control_stat(st);
+        return 0;
+    }
+    uint64_t t = trace_begin();
     int rv = storage_stat(path, st);
+    trace_end(t, TRACE_GETATTR, path, NULL, 0, 0, 0, rv);
     printf("[INFO] getattr(%s) -> %d\n", path, rv);
     return rv;
 }
 
+// The nufs_statfs function reports the file system's size and free space (e.g., for `df`).
+// The counts come from the superblock, so this is cheap however often it is called.
+int nufs_statfs(const char *path, struct statvfs *st) {
+    uint64_t t = trace_begin();
+    int rv = storage_statfs(st);
+    trace_end(t, TRACE_STATFS, path, NULL, 0, 0, 0, rv);
+    printf("[INFO] statfs(%s) -> %d (%lu of %lu blocks free)\n", path, rv, (unsigned long)st->f_bfree,
+           (unsigned long)st->f_blocks);
+    return rv;
+}
+
 // The nufs_readdir function is called by FUSE when a directory is listed (e.g., via `ls`).
 // It retrieves the directory contents using storage_list() and then uses filler() to pass these entries back to the caller.
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+                 enum fuse_readdir_flags flags) {
     printf("[DEBUG] nufs_readdir: path=%s\n", path);
+    uint64_t t = trace_begin();
 
     // Get a list of entries in the directory specified by 'path'.
-    slist_t *entries = storage_list(path);
-    if (!entries) {
-        // If we can't find the directory, return an error.
-        printf("[ERROR] Directory not found: %s\n", path);
-        return -ENOENT;
+    // It is built in this thread's arena, which is released when we are done.
+    arena_t *arena = arena_thread();
+    if (!arena) return -ENOMEM;
+    arena_mark_t mark = arena_mark(arena);
+    slist_t *entries;
+    int rv = storage_list(path, &entries);
+    if (rv < 0) {
+        // If we can't list the directory, return the error. An empty one lists fine.
+        arena_release(arena, mark);
+        trace_end(t, TRACE_READDIR, path, NULL, 0, 0, 0, rv);
+        printf("[ERROR] Cannot list directory %s: %d\n", path, rv);
+        return rv;
     }
 
     // We set up a stat structure for the directory entries we're going to list.
@@ -50,21 +194,37 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
     st.st_nlink = 2;             // Typical directory link count.
 
     // Add the current directory and parent directory entries: "." and ".."
-    filler(buf, ".", &st, 0);
-    filler(buf, "..", &st, 0);
+    filler(buf, ".", &st, 0, 0);
+    filler(buf, "..", &st, 0, 0);
 
     // Now we iterate over the linked list of directory entries returned by storage_list()
+    // Entries are stat'ed by their full path ("/" has no trailing name to separate).
+    const char *dir = strcmp(path, "/") == 0 ? "" : path;
+    size_t dir_len = strlen(dir);
     slist_t *curr = entries;
+    long count = 0;
     while (curr) {
         memset(&st, 0, sizeof(struct stat));
+        size_t name_len = strlen(curr->data);
+        char *child = arena_alloc(arena, dir_len + name_len + 2);
+        if (!child) {
+            arena_release(arena, mark);
+            trace_end(t, TRACE_READDIR, path, NULL, count, 0, 0, -ENOMEM);
+            return -ENOMEM;
+        }
+        memcpy(child, dir, dir_len);
+        child[dir_len] = '/';
+        memcpy(child + dir_len + 1, curr->data, name_len + 1);
         // For each entry, we retrieve its stat info and pass it along to FUSE.
-        storage_stat(curr->data, &st);
-        filler(buf, curr->data, &st, 0);
+        storage_stat(child, &st);
+        filler(buf, curr->data, &st, 0, 0);
         curr = curr->next;
+        count++;
     }
 
-    // Free the memory for the directory list now that we're done.
-    s_free(entries);
+    // Release the directory list now that we're done.
+    arena_release(arena, mark);
+    trace_end(t, TRACE_READDIR, path, NULL, count, 0, 0, 0);
     printf("[INFO] Directory contents listed for: %s\n", path);
     return 0;
 }
@@ -73,7 +233,9 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
 // It calls storage_mknod() which handles inode allocation and updates the file system structures.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
     printf("[DEBUG] nufs_mknod: path=%s, mode=%04o\n", path, mode);
-    int rv = storage_mknod(path, mode);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? -EEXIST : storage_mknod(path, mode);
+    trace_end(t, TRACE_MKNOD, path, NULL, 0, 0, mode, rv);
     printf("[INFO] mknod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
@@ -82,16 +244,119 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // It calls storage_unlink() to update directory entries and free the associated inode.
 int nufs_unlink(const char *path) {
     printf("[DEBUG] nufs_unlink: path=%s\n", path);
-    int rv = storage_unlink(path);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? -EPERM : storage_unlink(path);
+    trace_end(t, TRACE_UNLINK, path, NULL, 0, 0, 0, rv);
     printf("[INFO] unlink(%s) -> %d\n", path, rv);
     return rv;
 }
 
+// The nufs_link function creates a hard link 'to' for the existing file 'from' (e.g., `ln`).
+// Both names share one inode, so nothing is copied.
+int nufs_link(const char *from, const char *to) {
+    printf("[DEBUG] nufs_link: from=%s, to=%s\n", from, to);
+    uint64_t t = trace_begin();
+    int rv = storage_link(from, to);
+    trace_end(t, TRACE_LINK, from, to, 0, 0, 0, rv);
+    printf("[INFO] link(%s => %s) -> %d\n", from, to, rv);
+    return rv;
+}
+
+// The nufs_symlink function creates a symbolic link at 'path' pointing to 'target' (e.g., `ln -s`).
+int nufs_symlink(const char *target, const char *path) {
+    printf("[DEBUG] nufs_symlink: target=%s, path=%s\n", target, path);
+    uint64_t t = trace_begin();
+    int rv = storage_symlink(target, path);
+    trace_end(t, TRACE_SYMLINK, path, target, 0, 0, 0, rv);
+    printf("[INFO] symlink(%s => %s) -> %d\n", path, target, rv);
+    return rv;
+}
+
+// The nufs_readlink function returns the target of a symbolic link, NUL-terminated, in 'buf'.
+int nufs_readlink(const char *path, char *buf, size_t size) {
+    printf("[DEBUG] nufs_readlink: path=%s\n", path);
+    uint64_t t = trace_begin();
+    int rv = storage_readlink(path, buf, size);
+    trace_end(t, TRACE_READLINK, path, NULL, size, 0, 0, rv);
+    printf("[INFO] readlink(%s) -> %d\n", path, rv);
+    return rv;
+}
+
+// The nufs_getxattr function reads an extended attribute (e.g., `getfattr`, `rsync -X`).
+// With 'size' 0 only the value's length is returned.
+int nufs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    printf("[DEBUG] nufs_getxattr: path=%s, name=%s\n", path, name);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? -ENODATA : storage_getxattr(path, name, value, size);
+    trace_end(t, TRACE_GETXATTR, path, name, size, 0, 0, rv);
+    printf("[INFO] getxattr(%s, %s) -> %d\n", path, name, rv);
+    return rv;
+}
+
+// The nufs_setxattr function creates or replaces an extended attribute (e.g., `setfattr`).
+int nufs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    printf("[DEBUG] nufs_setxattr: path=%s, name=%s, size=%zu\n", path, name, size);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? -EPERM : storage_setxattr(path, name, value, size, flags);
+    trace_end(t, TRACE_SETXATTR, path, name, size, 0, flags, rv);
+    printf("[INFO] setxattr(%s, %s) -> %d\n", path, name, rv);
+    return rv;
+}
+
+// The nufs_listxattr function lists the names of a file's extended attributes.
+int nufs_listxattr(const char *path, char *list, size_t size) {
+    printf("[DEBUG] nufs_listxattr: path=%s\n", path);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? 0 : storage_listxattr(path, list, size);
+    trace_end(t, TRACE_LISTXATTR, path, NULL, size, 0, 0, rv);
+    printf("[INFO] listxattr(%s) -> %d\n", path, rv);
+    return rv;
+}
+
+// The nufs_removexattr function removes an extended attribute.
+int nufs_removexattr(const char *path, const char *name) {
+    printf("[DEBUG] nufs_removexattr: path=%s, name=%s\n", path, name);
+    uint64_t t = trace_begin();
+    int rv = is_control(path) ? -EPERM : storage_removexattr(path, name);
+    trace_end(t, TRACE_REMOVEXATTR, path, name, 0, 0, 0, rv);
+    printf("[INFO] removexattr(%s, %s) -> %d\n", path, name, rv);
+    return rv;
+}
+
+// The nufs_open function is called when a file is opened. Opening always succeeds for files
+// that exist; what it decides is whether the kernel may keep the file's data from earlier opens
+// in its page cache. It may if the data version is unchanged since the path was last opened:
+// the version changes with every write (even through another hard link or an ioctl) and
+// whenever a new file takes over the inode number.
+int nufs_open(const char *path, struct fuse_file_info *fi) {
+    printf("[DEBUG] nufs_open: path=%s\n", path);
+    if (is_control(path)) return 0;
+
+    uint64_t t = trace_begin();
+    uint64_t version;
+    int rv = storage_data_version(path, &version);
+    trace_end(t, TRACE_OPEN, path, NULL, 0, 0, fi->flags, rv);
+    if (rv < 0) return rv;
+
+    uint64_t hash = path_hash(path);
+    int slot = hash % OPENED_SLOTS;
+    pthread_mutex_lock(&opened_lock);
+    fi->keep_cache = opened[slot].path_hash == hash && opened[slot].version == version;
+    opened[slot].path_hash = hash;
+    opened[slot].version = version;
+    pthread_mutex_unlock(&opened_lock);
+
+    printf("[INFO] open(%s) -> keep_cache=%d\n", path, fi->keep_cache);
+    return 0;
+}
+
 // The nufs_read function is called whenever a file is read (e.g., `cat` or `less`).
 // It reads 'size' bytes from 'path' starting at 'offset' into the buffer 'buf', using storage_read().
 int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     printf("[DEBUG] nufs_read: path=%s, size=%zu, offset=%lld\n", path, size, (long long)offset);
+    uint64_t t = trace_begin();
     int rv = storage_read(path, buf, size, offset);
+    trace_end(t, TRACE_READ, path, NULL, size, offset, 0, rv);
     printf("[INFO] read(%s, %zu bytes, @%lld) -> %d\n", path, size, (long long)offset, rv);
     return rv;
 }
@@ -100,15 +365,161 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fus
 // It writes 'size' bytes from 'buf' into the file at 'path' starting at 'offset', via storage_write().
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     printf("[DEBUG] nufs_write: path=%s, size=%zu, offset=%lld\n", path, size, (long long)offset);
+    uint64_t t = trace_begin();
     int rv = storage_write(path, buf, size, offset);
+    trace_end(t, TRACE_WRITE, path, NULL, size, offset, 0, rv);
     printf("[INFO] write(%s, %zu bytes, @%lld) -> %d\n", path, size, (long long)offset, rv);
     return rv;
 }
 
+// The nufs_truncate function changes the size of a file (e.g., when it is opened with O_TRUNC).
+int nufs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    printf("[DEBUG] nufs_truncate: path=%s, size=%lld\n", path, (long long)size);
+    uint64_t t = trace_begin();
+    int rv = storage_truncate(path, size);
+    trace_end(t, TRACE_TRUNCATE, path, NULL, size, 0, 0, rv);
+    printf("[INFO] truncate(%s, %lld) -> %d\n", path, (long long)size, rv);
+    return rv;
+}
+
+// The nufs_copy_file_range function is called for copy_file_range(2), which `cp` uses by default.
+// Instead of reading and writing the data, storage_clone_range() shares the source's blocks.
+ssize_t nufs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                             const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                             size_t size, int flags) {
+    printf("[DEBUG] nufs_copy_file_range: %s@%lld -> %s@%lld, size=%zu\n",
+           path_in, (long long)offset_in, path_out, (long long)offset_out, size);
+    uint64_t t = trace_begin();
+    ssize_t rv = storage_clone_range(path_in, offset_in, path_out, offset_out, size);
+    trace_end(t, TRACE_COPY_RANGE, path_in, path_out, size, offset_in, offset_out, rv);
+    printf("[INFO] copy_file_range(%s, %s, %zu bytes) -> %zd\n", path_in, path_out, size, rv);
+    return rv;
+}
+
+// Most items a NUFS_IOC_BATCH buffer can hold (all with empty paths and data)
+#define BATCH_MAX_ITEMS (NUFS_BATCH_BYTES / sizeof(struct nufs_batch_item))
+
+// Unpack a NUFS_IOC_BATCH buffer, run it with storage_batch() and write each item's
+// result back into the buffer. Items are checked to lie within the buffer first.
+static int nufs_batch(struct nufs_batch *batch) {
+    if (batch->count == 0 || batch->count > BATCH_MAX_ITEMS) return -EINVAL;
+
+    storage_batch_op_t ops[BATCH_MAX_ITEMS];
+    struct nufs_batch_item *items[BATCH_MAX_ITEMS];
+    size_t pos = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (pos + sizeof(struct nufs_batch_item) > NUFS_BATCH_BYTES) return -EINVAL;
+        struct nufs_batch_item *item = (struct nufs_batch_item *)(batch->items + pos);
+        size_t len = NUFS_BATCH_ITEM_SIZE(item->path_len, item->data_len);
+        if (item->path_len == 0 || pos + len > NUFS_BATCH_BYTES) return -EINVAL;
+
+        char *path = (char *)(item + 1);
+        if (path[item->path_len - 1] != '\0' || is_control(path)) return -EINVAL;
+
+        memset(&ops[i], 0, sizeof(storage_batch_op_t));
+        switch (item->op) {
+        case NUFS_BATCH_CREATE: ops[i].kind = STORAGE_BATCH_CREATE; break;
+        case NUFS_BATCH_MKDIR: ops[i].kind = STORAGE_BATCH_MKDIR; break;
+        case NUFS_BATCH_WRITE: ops[i].kind = STORAGE_BATCH_WRITE; break;
+        case NUFS_BATCH_STAT: ops[i].kind = STORAGE_BATCH_STAT; break;
+        default: return -EINVAL;
+        }
+        ops[i].path = path;
+        ops[i].mode = item->mode;
+        ops[i].data = path + item->path_len;
+        ops[i].size = item->data_len;
+        ops[i].offset = item->offset;
+        items[i] = item;
+        pos += len;
+    }
+
+    int rv = storage_batch(ops, batch->count);
+    for (uint32_t i = 0; i < batch->count; i++) {
+        items[i]->result = ops[i].result;
+        if (ops[i].kind == STORAGE_BATCH_WRITE && ops[i].result > 0) {
+            invalidate(ops[i].path);
+        }
+        if (ops[i].kind == STORAGE_BATCH_STAT && ops[i].result == 0) {
+            items[i]->st_size = ops[i].st.st_size;
+            items[i]->st_mode = ops[i].st.st_mode;
+            items[i]->st_ino = ops[i].st.st_ino;
+        }
+    }
+    batch->done = rv < 0 ? 0 : rv;
+    return rv < 0 ? rv : 0;
+}
+
+// Run one of nufs' ioctls (see nufs_ioctl.h).
+// NUFS_IOC_CLONE_RANGE clones a range of another file into this one;
+// NUFS_IOC_CACHE_STATS and NUFS_IOC_TIER_STATS report the block cache's and fast tier's counters;
+// NUFS_IOC_BATCH, on the control file only, runs a batch of metadata operations.
+static int ioctl_dispatch(const char *path, int cmd, unsigned int flags, void *data) {
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+
+    if ((unsigned int)cmd == NUFS_IOC_CLONE_RANGE) {
+        struct nufs_clone_range *range = data;
+        range->src_path[NUFS_PATH_MAX - 1] = '\0';
+        size_t length = range->src_length ? range->src_length : (size_t)-1 / 2;
+        ssize_t rv = storage_clone_range(range->src_path, range->src_offset, path, range->dest_offset, length);
+        if (rv > 0) invalidate(path);
+        printf("[INFO] ioctl(%s, CLONE_RANGE from %s) -> %zd\n", path, range->src_path, rv);
+        return rv < 0 ? rv : 0;
+    }
+    if ((unsigned int)cmd == NUFS_IOC_BATCH) {
+        if (!is_control(path)) return -ENOTTY;
+        int rv = nufs_batch(data);
+        printf("[INFO] ioctl(%s, BATCH) -> %d\n", path, rv);
+        return rv;
+    }
+    if ((unsigned int)cmd == NUFS_IOC_CACHE_STATS) {
+        cache_stats_t cs = cache_get_stats();
+        struct nufs_cache_stats *out = data;
+        out->hits = cs.hits;
+        out->misses = cs.misses;
+        out->ghost_hits = cs.ghost_hits;
+        out->evictions = cs.evictions;
+        out->overflows = cs.overflows;
+        out->frames = cs.frames;
+        out->cached = cs.cached;
+        return 0;
+    }
+    if ((unsigned int)cmd == NUFS_IOC_TIER_STATS) {
+        tier_stats_t ts;
+        tier_get_stats(&ts);
+        struct nufs_tier_stats *out = data;
+        out->slots = ts.slots;
+        out->resident = ts.resident;
+        out->extent_size = ts.extent_size;
+        out->promotions = ts.promotions;
+        out->demotions = ts.demotions;
+        out->landings = ts.landings;
+        out->migrated = ts.migrated;
+        out->fast_read = ts.fast_read;
+        out->fast_written = ts.fast_written;
+        out->capacity_read = ts.capacity_read;
+        out->capacity_written = ts.capacity_written;
+        return 0;
+    }
+    return -ENOTTY;
+}
+
+// The nufs_ioctl function handles nufs-specific ioctls on open files, with ioctl_dispatch().
+int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    printf("[DEBUG] nufs_ioctl: path=%s, cmd=%x\n", path, (unsigned int)cmd);
+    uint64_t t = trace_begin();
+    int rv = ioctl_dispatch(path, cmd, flags, data);
+    trace_end(t, TRACE_IOCTL, path, NULL, 0, 0, (unsigned int)cmd, rv);
+    return rv;
+}
+
 // The nufs_mkdir function creates a new directory at the specified 'path' with 'mode' permissions.
 int nufs_mkdir(const char *path, mode_t mode) {
     printf("[DEBUG] nufs_mkdir: path=%s, mode=%04o\n", path, mode);
+    uint64_t t = trace_begin();
     int rv = storage_mkdir(path, mode);
+    trace_end(t, TRACE_MKDIR, path, NULL, 0, 0, mode, rv);
     printf("[INFO] mkdir(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -117,17 +528,111 @@ int nufs_mkdir(const char *path, mode_t mode) {
 // It ensures the directory is empty before removing it.
 int nufs_rmdir(const char *path) {
     printf("[DEBUG] nufs_rmdir: path=%s\n", path);
+    uint64_t t = trace_begin();
     int rv = storage_rmdir(path);
+    trace_end(t, TRACE_RMDIR, path, NULL, 0, 0, 0, rv);
     printf("[INFO] rmdir(%s) -> %d\n", path, rv);
     return rv;
 }
 
+// The nufs_rename function moves 'from' to 'to' (e.g., `mv`). FUSE passes the renameat2() flags,
+// so RENAME_NOREPLACE and RENAME_EXCHANGE are handled by storage_rename() as well.
+int nufs_rename(const char *from, const char *to, unsigned int flags) {
+    printf("[DEBUG] nufs_rename: from=%s, to=%s, flags=%#x\n", from, to, flags);
+    uint64_t t = trace_begin();
+    int rv = storage_rename(from, to, flags);
+    trace_end(t, TRACE_RENAME, from, to, 0, 0, flags, rv);
+    printf("[INFO] rename(%s => %s) -> %d\n", from, to, rv);
+    return rv;
+}
+
+// Encode a utimens time for the trace
+static uint64_t trace_time(const struct timespec *ts) {
+    if (!ts || ts->tv_nsec == UTIME_NOW) return TRACE_TIME_NOW;
+    if (ts->tv_nsec == UTIME_OMIT) return TRACE_TIME_OMIT;
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// The nufs_utimens function sets a file's access and modification times (e.g., `touch`,
+// or `cp -p` and rsync preserving them). Other operations update the times themselves.
+int nufs_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi) {
+    printf("[DEBUG] nufs_utimens: path=%s\n", path);
+    if (is_control(path)) return 0;
+    uint64_t t = trace_begin();
+    int rv = storage_utimens(path, ts);
+    trace_end(t, TRACE_UTIMENS, path, NULL, trace_time(ts ? &ts[0] : NULL), 0, trace_time(ts ? &ts[1] : NULL), rv);
+    printf("[INFO] utimens(%s) -> %d\n", path, rv);
+    return rv;
+}
+
+// The nufs_flush function is called on every close() of a file. It writes back the file's
+// deferred data, so an error writing it is returned by close().
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+    printf("[DEBUG] nufs_flush: path=%s\n", path);
+    if (is_control(path)) return 0;
+    uint64_t t = trace_begin();
+    int rv = storage_flush(path);
+    trace_end(t, TRACE_FLUSH, path, NULL, 0, 0, 0, rv);
+    printf("[INFO] flush(%s) -> %d\n", path, rv);
+    return rv;
+}
+
+// The nufs_fsync function makes one file durable (fsync(), or fdatasync() if 'datasync' is
+// set), writing only what that file needs (see storage_fsync()).
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    printf("[DEBUG] nufs_fsync: path=%s, datasync=%d\n", path, datasync);
+    if (is_control(path)) return 0;
+    uint64_t t = trace_begin();
+    int rv = storage_fsync(path, datasync);
+    trace_end(t, TRACE_FSYNC, path, NULL, 0, 0, datasync != 0, rv);
+    printf("[INFO] fsync(%s, datasync=%d) -> %d\n", path, datasync, rv);
+    return rv;
+}
+
+// The nufs_fsyncdir function makes a directory's entries durable, e.g. after creating a file
+// in it that must survive a crash.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    return nufs_fsync(path, datasync, fi);
+}
+
+// The nufs_init function is called once FUSE has mounted the file system (and, when running
+// in the background, after it has daemonized), so this is where background threads are started.
+// It also sets up kernel caching: attributes and names are trusted for NUFS_CACHE_TIMEOUT
+// seconds, while failed lookups aren't cached, so files created by NUFS_IOC_BATCH show up at once.
+// File data is cached across opens as nufs_open() allows.
+static void *nufs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    printf("[INFO] File system mounted, starting I/O engine, writeback, scrubber, tier migration and trim\n");
+    cfg->use_ino = 1; // Hard links show the same inode number
+    cfg->attr_timeout = NUFS_CACHE_TIMEOUT;
+    cfg->entry_timeout = NUFS_CACHE_TIMEOUT;
+    cfg->negative_timeout = 0;
+    cfg->kernel_cache = 0; // Decided per open
+    cfg->auto_cache = 0;
+    storage_set_ioengine(options.ioengine);
+    if (options.commit > 0) {
+        flusher_start(options.commit); // Otherwise every operation commits before it returns
+    }
+    scrub_start(SCRUB_RATE);
+    tier_start(options.tier_rate ? parse_size(options.tier_rate) : TIER_RATE); // Only with a fast tier
+    trace_start(); // Only with -o trace
+    if (options.discard && strcmp(options.discard, "periodic") == 0) {
+        trim_start(TRIM_INTERVAL);
+    }
+    return NULL;
+}
+
 // The nufs_destroy function is called when the file system is unmounted.
 // It provides a chance to flush data and perform cleanup operations.
-// Here, we call storage_shutdown() to write any pending changes and close the disk image.
+// Here, we stop tier migration, trimming, the scrubber and the writeback thread (which commits what it hasn't yet),
+// and call storage_shutdown() to close the disk image. Last, the trace (if any) is written out.
 static void nufs_destroy(void *private_data) {
     printf("[INFO] Unmounting file system and flushing data...\n");
+    tier_stop();
+    trim_stop();
+    scrub_stop();
+    flusher_stop();
     storage_shutdown();
+    trace_close();
     printf("[INFO] File system unmounted successfully.\n");
 }
 
@@ -137,51 +642,151 @@ void nufs_init_ops(struct fuse_operations *ops) {
     memset(ops, 0, sizeof(struct fuse_operations));
     ops->access = nufs_access;
     ops->getattr = nufs_getattr;
+    ops->statfs = nufs_statfs;
     ops->readdir = nufs_readdir;
     ops->mknod = nufs_mknod;
     ops->unlink = nufs_unlink;
+    ops->link = nufs_link;
+    ops->symlink = nufs_symlink;
+    ops->readlink = nufs_readlink;
+    ops->getxattr = nufs_getxattr;
+    ops->setxattr = nufs_setxattr;
+    ops->listxattr = nufs_listxattr;
+    ops->removexattr = nufs_removexattr;
+    ops->open = nufs_open;
     ops->read = nufs_read;
     ops->write = nufs_write;
+    ops->truncate = nufs_truncate;
+    ops->copy_file_range = nufs_copy_file_range;
+    ops->ioctl = nufs_ioctl;
     ops->mkdir = nufs_mkdir;
     ops->rmdir = nufs_rmdir;
+    ops->rename = nufs_rename;
+    ops->utimens = nufs_utimens;
+    ops->flush = nufs_flush;
+    ops->fsync = nufs_fsync;
+    ops->fsyncdir = nufs_fsyncdir;
+    ops->init = nufs_init;
     ops->destroy = nufs_destroy;
 }
 
 // This global structure holds all the operations for FUSE to call.
 struct fuse_operations nufs_ops;
 
+// Pick out the mount point and disk image(s); everything else is passed on to FUSE.
+static int nufs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_NONOPT) {
+        if (!options.mount_point) {
+            options.mount_point = arg;
+            return 1; // FUSE needs the mount point too
+        }
+        if (!options.disk_image) {
+            options.disk_image = arg;
+            return 0;
+        }
+        if (options.stripe_count < IOENGINE_MAX_DEVICES - 1) {
+            options.stripe_images[options.stripe_count++] = arg;
+            return 0;
+        }
+        fprintf(stderr, "An image can be striped across at most %d files\n", IOENGINE_MAX_DEVICES);
+        return -1;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
-    // We expect at least 3 arguments: the executable name, the mount point, and the disk image.
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <mount-point> <disk-image> [options]\n", argv[0]);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    options.ioengine = strdup(IOENGINE_PREAD);
+    options.commit = FLUSH_INTERVAL;
+    if (fuse_opt_parse(&args, &options, nufs_opts, nufs_opt_proc) < 0) {
         return 1;
     }
 
-    const char *mount_point = argv[1];
-    const char *disk_image = argv[2];
+    // We expect two arguments besides the options: the mount point and the disk image.
+    if (!options.mount_point || !options.disk_image) {
+        fprintf(stderr, "Usage: %s [options] <mount-point> <disk-image> [<disk-image>...]\n", argv[0]);
+        fprintf(stderr, "  Several disk images make one image striped across them, e.g. one per device.\n");
+        fprintf(stderr, "  -o ioengine=pread|uring   I/O engine for the disk image (default: pread)\n");
+        fprintf(stderr, "  -o direct_image           open the disk image with O_DIRECT\n");
+        fprintf(stderr, "  -o cache_size=SIZE        memory for cached blocks, e.g. 2G (default: 32M)\n");
+        fprintf(stderr, "  -o image_size=SIZE        size of a new disk image, e.g. 500G (default: the file's size)\n");
+        fprintf(stderr, "  -o stripe_unit=SIZE       bytes per file before the next, for a new striped image (default: 256K)\n");
+        fprintf(stderr, "  -o commit=SECONDS         longest delay before changes are committed, 0 to commit\n"
+                        "                            every operation before it returns (default: %d)\n", FLUSH_INTERVAL);
+        fprintf(stderr, "  -o tier=PATH              keep hot extents in PATH, a file on a faster device\n");
+        fprintf(stderr, "  -o tier_size=SIZE         size of a new fast tier (default: the file's size, or 256M)\n");
+        fprintf(stderr, "  -o tier_rate=SIZE         bytes per second moved between the tiers (default: 16M)\n");
+        fprintf(stderr, "  -o trace=PATH             record every operation in PATH, for trace_replay\n");
+        fprintf(stderr, "  -o trace_size=SIZE        size of the trace, which keeps the latest operations (default: 64M)\n");
+        fprintf(stderr, "  -o discard=MODE           give freed blocks' space back to the host: off (default), free\n"
+                        "                            (as they are freed) or periodic (every %d s)\n", TRIM_INTERVAL);
+        return 1;
+    }
+    if (strcmp(options.ioengine, IOENGINE_PREAD) != 0 && strcmp(options.ioengine, IOENGINE_URING) != 0) {
+        fprintf(stderr, "Unknown I/O engine: %s\n", options.ioengine);
+        return 1;
+    }
+
+    int discard = DISCARD_OFF;
+    if (options.discard && strcmp(options.discard, "free") == 0) {
+        discard = DISCARD_ON_FREE;
+    } else if (options.discard && strcmp(options.discard, "periodic") == 0) {
+        discard = DISCARD_PERIODIC;
+    } else if (options.discard && strcmp(options.discard, "off") != 0) {
+        fprintf(stderr, "Unknown discard mode: %s\n", options.discard);
+        return 1;
+    }
+
+    long long cache_size = options.cache_size ? parse_size(options.cache_size) : 0;
+    long long image_size = options.image_size ? parse_size(options.image_size) : 0;
+    long long stripe_unit = options.stripe_unit ? parse_size(options.stripe_unit) : 0;
+    long long tier_size = options.tier_size ? parse_size(options.tier_size) : 0;
+    long long tier_rate = options.tier_rate ? parse_size(options.tier_rate) : 0;
+    long long trace_size = options.trace_size ? parse_size(options.trace_size) : TRACE_SIZE;
+    if (cache_size < 0 || image_size < 0 || stripe_unit < 0 || tier_size < 0 || tier_rate < 0 || trace_size < 0) {
+        fprintf(stderr, "Invalid size: %s\n", cache_size < 0   ? options.cache_size
+                                               : image_size < 0 ? options.image_size
+                                               : stripe_unit < 0 ? options.stripe_unit
+                                               : tier_size < 0  ? options.tier_size
+                                               : tier_rate < 0  ? options.tier_rate
+                                                                : options.trace_size);
+        return 1;
+    }
 
     // Print some basic info about what we're doing.
-    printf("[INFO] Initializing file system with disk image: %s\n", disk_image);
-    printf("[INFO] Mount point: %s\n", mount_point);
-    for (int i = 0; i < argc; i++) {
-        printf("[DEBUG] Arg[%d]: %s\n", i, argv[i]);
+    printf("[INFO] Initializing file system with disk image: %s\n", options.disk_image);
+    printf("[INFO] Mount point: %s\n", options.mount_point);
+    for (int i = 0; i < args.argc; i++) {
+        printf("[DEBUG] Arg[%d]: %s\n", i, args.argv[i]);
     }
 
     // Initialize the storage layer with the given disk image.
     // This sets up in-memory structures, reads metadata, etc.
-    storage_init(disk_image);
+    storage_options_t storage_opts = {
+        .direct = options.direct_image,
+        .cache_size = cache_size,
+        .image_size = image_size,
+        .stripe_images = options.stripe_images,
+        .stripe_unit = stripe_unit,
+        .tier_path = options.tier,
+        .tier_size = tier_size,
+        .discard = discard,
+    };
+    if (options.trace && trace_open(options.trace, trace_size) < 0) {
+        return 1;
+    }
+    uint64_t t = trace_begin();
+    storage_init(options.disk_image, &storage_opts);
+    trace_end(t, TRACE_MOUNT, options.disk_image, NULL, 0, 0, 0, 0);
 
     // Initialize the FUSE operation callbacks.
     // Without this call, the nufs_ops structure would remain uninitialized and FUSE would not know which callbacks to use.
     nufs_init_ops(&nufs_ops);
 
-    // We'll run the filesystem by passing the mount point to FUSE.
-    // Here, we remove the '-f' flag so that the filesystem runs in the background,
-    // which is often the expected behavior for tests and normal usage.
-    char *fuse_argv[] = {argv[0], (char *)mount_point};
-    int fuse_argc = 2;
-
-    printf("[INFO] Mounting file system at: %s\n", mount_point);
+    printf("[INFO] Mounting file system at: %s\n", options.mount_point);
     // fuse_main() will run the FUSE event loop, handling filesystem operations until it is unmounted.
-    return fuse_main(fuse_argc, fuse_argv, &nufs_ops, NULL);
+    // The I/O engine is started from nufs_init(), once FUSE has daemonized (unless -f is given).
+    int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return rv;
 }
@@ -0,0 +1,133 @@
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_PATH_MAX 1024  /**< Longest source path accepted by NUFS_IOC_CLONE_RANGE. */
+
+/**
+ * @brief Argument of NUFS_IOC_CLONE_RANGE.
+ *
+ * The ioctl is issued on the destination file. The source is named by its path within the
+ * mounted file system (e.g., "/artifacts/build.tar"), because FUSE cannot pass a file
+ * descriptor from the caller through to nufs.
+ */
+struct nufs_clone_range {
+    uint64_t src_offset;              /**< Offset in the source file to clone from. */
+    uint64_t src_length;              /**< Number of bytes to clone, or 0 for "to the end of the source". */
+    uint64_t dest_offset;             /**< Offset in the destination file to clone to. */
+    char src_path[NUFS_PATH_MAX];     /**< Source path, relative to the mount point root. */
+};
+
+/**
+ * @brief Clones a range of another file into the file the ioctl is issued on, sharing data
+ * blocks instead of copying them (see storage_clone_range()).
+ *
+ * The generic FICLONE/FICLONERANGE ioctls are handled by the kernel's VFS and never reach a
+ * FUSE file system, so nufs provides its own.
+ */
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 1, struct nufs_clone_range)
+
+/**
+ * @brief Result of NUFS_IOC_CACHE_STATS: the block cache's counters (see cache_stats_t).
+ */
+struct nufs_cache_stats {
+    uint64_t hits;        /**< Block lookups served from memory. */
+    uint64_t misses;      /**< Block lookups that read the image. */
+    uint64_t ghost_hits;  /**< Misses on recently evicted blocks. */
+    uint64_t evictions;   /**< Blocks dropped to make room. */
+    uint64_t overflows;   /**< Frames allocated beyond the budget because every frame was pinned. */
+    uint64_t frames;      /**< Block frames currently allocated. */
+    uint64_t cached;      /**< Blocks currently in memory. */
+};
+
+/**
+ * @brief Reports the block cache's hit and eviction counters. May be issued on any open file.
+ */
+#define NUFS_IOC_CACHE_STATS _IOR('N', 2, struct nufs_cache_stats)
+
+/**
+ * @brief The control file: a file that exists in every mounted nufs (but is not listed in its
+ * root directory) on which file-system-wide ioctls such as NUFS_IOC_BATCH are issued.
+ */
+#define NUFS_CONTROL_PATH "/.nufs"
+
+#define NUFS_BATCH_BYTES 16128  /**< Space for packed items in one NUFS_IOC_BATCH call. */
+
+/**
+ * @brief Operations of a NUFS_IOC_BATCH item (see storage_batch()).
+ */
+enum nufs_batch_op {
+    NUFS_BATCH_CREATE = 1,  /**< Create a file and write the item's data to it. */
+    NUFS_BATCH_MKDIR = 2,   /**< Create a directory. */
+    NUFS_BATCH_WRITE = 3,   /**< Write the item's data at `offset`. */
+    NUFS_BATCH_STAT = 4,    /**< Report the file's size, mode and inode number. */
+};
+
+/**
+ * @brief One operation in a NUFS_IOC_BATCH buffer.
+ *
+ * Each item is followed by its path (`path_len` bytes, including the terminating NUL) and then
+ * its data (`data_len` bytes). The next item starts at the following multiple of 8 bytes (see
+ * NUFS_BATCH_ITEM_SIZE()).
+ */
+struct nufs_batch_item {
+    uint16_t op;        /**< One of enum nufs_batch_op. */
+    uint16_t path_len;  /**< Bytes of path following the item, including the NUL. */
+    uint32_t data_len;  /**< Bytes of data following the path. */
+    uint32_t mode;      /**< Mode for CREATE and MKDIR. */
+    int32_t result;     /**< Output: 0 (or bytes written, for WRITE) on success, or a negative errno. */
+    uint64_t offset;    /**< File offset for WRITE. */
+    uint64_t st_size;   /**< Output of STAT: the file size. */
+    uint32_t st_mode;   /**< Output of STAT: the file mode. */
+    uint32_t st_ino;    /**< Output of STAT: the inode number. */
+};
+
+/** @brief Bytes taken by an item with the given path and data lengths, padding included. */
+#define NUFS_BATCH_ITEM_SIZE(path_len, data_len) \
+    (sizeof(struct nufs_batch_item) + (((path_len) + (data_len) + 7) & ~(size_t)7))
+
+/**
+ * @brief Argument of NUFS_IOC_BATCH: a packed vector of operations.
+ */
+struct nufs_batch {
+    uint32_t count;                  /**< Number of items in `items`. */
+    uint32_t done;                   /**< Output: number of items that succeeded. */
+    char items[NUFS_BATCH_BYTES];    /**< The items, packed as described for struct nufs_batch_item. */
+};
+
+/**
+ * @brief Runs a batch of creates, mkdirs, small writes and stats under one lock acquisition and
+ * one journal transaction, returning each item's result in place. Issued on NUFS_CONTROL_PATH.
+ *
+ * FUSE passes ioctl arguments by value, so items carry their paths and data inline rather than
+ * pointing at them.
+ */
+#define NUFS_IOC_BATCH _IOWR('N', 3, struct nufs_batch)
+
+/**
+ * @brief Result of NUFS_IOC_TIER_STATS: the fast tier's residency and migration counters
+ * (see tier_stats_t). All zero if the image has no fast tier.
+ */
+struct nufs_tier_stats {
+    uint64_t slots;             /**< Extents the fast tier can hold. */
+    uint64_t resident;          /**< Extents on the fast tier now. */
+    uint64_t extent_size;       /**< Bytes per extent. */
+    uint64_t promotions;        /**< Extents copied to the fast tier. */
+    uint64_t demotions;         /**< Extents moved back to the capacity tier. */
+    uint64_t landings;          /**< Free extents given a slot for new writes. */
+    uint64_t migrated;          /**< Bytes copied between the tiers. */
+    uint64_t fast_read;         /**< Bytes read from the fast tier. */
+    uint64_t fast_written;      /**< Bytes written to the fast tier. */
+    uint64_t capacity_read;     /**< Bytes read from the capacity tier. */
+    uint64_t capacity_written;  /**< Bytes written to the capacity tier. */
+};
+
+/**
+ * @brief Reports how much of the image is on the fast tier and how much has moved between the
+ * tiers. May be issued on any open file.
+ */
+#define NUFS_IOC_TIER_STATS _IOR('N', 4, struct nufs_tier_stats)
+
+#endif
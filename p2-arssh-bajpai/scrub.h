@@ -0,0 +1,45 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#define SCRUB_RATE (4 * 1024 * 1024) /**< Default scrubbing bandwidth, in bytes per second. */
+#define SCRUB_INTERVAL 60            /**< Seconds to wait between complete passes. */
+
+/**
+ * @brief Counters describing the scrubber's progress.
+ */
+typedef struct scrub_stats {
+    long passes;  /**< Number of complete passes over the image. */
+    long blocks;  /**< Total number of blocks read and verified. */
+    long errors;  /**< Total number of checksum mismatches or read errors found. */
+} scrub_stats_t;
+
+/**
+ * @brief Starts the background scrubber thread.
+ *
+ * The scrubber repeatedly walks all allocated data blocks, reading each from the disk image
+ * and verifying it against the checksum table via storage_scrub_block(). Reads are paced so
+ * the scrubber never uses more than `rate` bytes per second of I/O bandwidth. Mismatches are
+ * counted and reported in the log at the end of each pass.
+ *
+ * Must be called after storage_init(), from the process that serves requests (i.e., after
+ * FUSE has daemonized).
+ *
+ * @param rate The maximum scrubbing bandwidth in bytes per second (e.g., SCRUB_RATE).
+ */
+void scrub_start(long rate);
+
+/**
+ * @brief Stops the scrubber thread and waits for it to exit.
+ *
+ * Safe to call if the scrubber was never started. Must be called before storage_shutdown().
+ */
+void scrub_stop();
+
+/**
+ * @brief Retrieves a snapshot of the scrubber's counters.
+ *
+ * @param stats A pointer to the structure to fill in.
+ */
+void scrub_get_stats(scrub_stats_t *stats);
+
+#endif
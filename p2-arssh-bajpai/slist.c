@@ -21,6 +21,24 @@ slist_t *s_cons(const char *text, slist_t *rest) {
     return node;
 }
 
+/**
+ * @brief Creates a list node, and a copy of its text, in an arena.
+ *
+ * @param arena The arena to allocate from.
+ * @param text The string to store (need not be NUL-terminated).
+ * @param len The length of `text`.
+ * @param rest The remainder of the list, or NULL.
+ * @return The new node, or NULL if the arena could not grow.
+ */
+slist_t *s_cons_arena(arena_t *arena, const char *text, size_t len, slist_t *rest) {
+    slist_t *node = arena_alloc(arena, sizeof(slist_t));
+    if (!node) return NULL;
+    node->data = arena_strndup(arena, text, len);
+    if (!node->data) return NULL;
+    node->next = rest;
+    return node;
+}
+
 /**
  * @brief Deallocates memory for an entire singly linked list.
  *
@@ -45,12 +63,11 @@ void s_free(slist_t *list) {
  * This function searches through the input string `str` for the delimiter character `delimiter`. 
  * Each substring between occurrences of `delimiter` (or between the start/end of `str` and a `delimiter`) 
  * is added to a new list node. The final result is a linked list containing all these substrings 
- * in reverse order of appearance due to the manner of construction (you can reverse it or process 
- * it as needed afterward).
+ * in the order they appear in `str`, so a path can be walked from its first component.
  *
  * Example:
  * Given `str = "hello:world:test"` and `delimiter = ':'`, the resulting list contains nodes for 
- * "test", "world", and "hello" in that order, because each substring is prepended to the list.
+ * "hello", "world", and "test" in that order.
  *
  * @param str A null-terminated string to split. If `str` is empty, a single node with an empty 
  *            string will be returned.
@@ -60,6 +77,7 @@ void s_free(slist_t *list) {
  */
 slist_t *s_explode(const char *str, char delimiter) {
     slist_t *list = NULL;     // Start with an empty list.
+    slist_t **tail = &list;   // Where the next node is linked, to keep segments in order.
     const char *start = str;  // Points to the beginning of the current segment.
 
     while (1) {
@@ -68,7 +86,7 @@ slist_t *s_explode(const char *str, char delimiter) {
         if (!end) {
             // If no more delimiters are found, this means `start` points to the 
             // last substring or possibly an empty string.
-            list = s_cons(start, list); 
+            *tail = s_cons(start, NULL);
             break;
         }
 
@@ -80,8 +98,9 @@ slist_t *s_explode(const char *str, char delimiter) {
         strncpy(segment, start, length);
         segment[length] = '\0'; // Null-terminate the substring.
 
-        // Add this substring to the front of the list.
-        list = s_cons(segment, list);
+        // Append this substring to the end of the list.
+        *tail = s_cons(segment, NULL);
+        tail = &(*tail)->next;
 
         // Free the temporary segment buffer since s_cons() already duplicated it.
         free(segment);
@@ -92,3 +111,52 @@ slist_t *s_explode(const char *str, char delimiter) {
 
     return list;
 }
+
+/**
+ * @brief Finds the next non-empty token of a NUL-terminated string, in place.
+ *
+ * @param cursor The scanning position, advanced past the token.
+ * @param delimiter The character separating tokens.
+ * @param token Set to point at the token within the string.
+ * @return 1 if a token was found, 0 if only delimiters (or nothing) remained.
+ */
+int s_next_token(const char **cursor, char delimiter, s_view_t *token) {
+    const char *p = *cursor;
+    while (*p == delimiter) {
+        p++; // Skip empty segments
+    }
+    const char *start = p;
+    while (*p && *p != delimiter) {
+        p++;
+    }
+    *cursor = p;
+    token->data = start;
+    token->len = p - start;
+    return token->len > 0;
+}
+
+/**
+ * @brief Finds the next non-empty token within the next `*remaining` characters, in place.
+ *
+ * @param cursor The scanning position, advanced past the token.
+ * @param remaining The characters left to scan, reduced by as many as `cursor` advances.
+ * @param delimiter The character separating tokens.
+ * @param token Set to point at the token within the string.
+ * @return 1 if a token was found, 0 if only delimiters (or nothing) remained.
+ */
+int s_next_token_n(const char **cursor, size_t *remaining, char delimiter, s_view_t *token) {
+    const char *p = *cursor;
+    const char *end = p + *remaining;
+    while (p < end && *p == delimiter) {
+        p++; // Skip empty segments
+    }
+    const char *start = p;
+    while (p < end && *p != delimiter) {
+        p++;
+    }
+    *remaining -= p - *cursor;
+    *cursor = p;
+    token->data = start;
+    token->len = p - start;
+    return token->len > 0;
+}
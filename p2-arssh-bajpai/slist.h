@@ -1,6 +1,9 @@
 #ifndef SLIST_H
 #define SLIST_H
 
+#include <stddef.h>
+#include "arena.h"
+
 /**
  * @brief A singly linked list node that holds a string and a pointer to the next node.
  *
@@ -25,6 +28,21 @@ typedef struct slist {
  */
 slist_t *s_cons(const char *text, slist_t *rest);
 
+/**
+ * @brief Constructs a new list node in an arena.
+ *
+ * Like s_cons(), but the node and its copy of `text` are allocated from `arena`, so building a
+ * list calls malloc() only when the arena needs another chunk. Such a list is released with
+ * the arena (see arena_release()), not with s_free().
+ *
+ * @param arena The arena to allocate from.
+ * @param text The string to store, which need not be NUL-terminated.
+ * @param len The length of `text`.
+ * @param rest The rest of the list (or NULL).
+ * @return The new node, or NULL if the arena ran out of memory.
+ */
+slist_t *s_cons_arena(arena_t *arena, const char *text, size_t len, slist_t *rest);
+
 /**
  * @brief Frees all the nodes in a singly linked list.
  *
@@ -53,4 +71,40 @@ void s_free(slist_t *list);
  */
 slist_t *s_explode(const char *str, char delimiter);
 
+/**
+ * @brief A piece of a string, referred to in place rather than copied.
+ */
+typedef struct s_view {
+    const char *data;  /**< The first character (not NUL-terminated). */
+    size_t len;        /**< The number of characters. */
+} s_view_t;
+
+/**
+ * @brief Finds the next token of a string without copying or allocating anything.
+ *
+ * Tokens are the non-empty runs of characters between delimiters, so doubled, leading and
+ * trailing delimiters produce no empty tokens (unlike s_explode()). Walking a path looks like:
+ *
+ *     const char *cursor = path;
+ *     s_view_t name;
+ *     while (s_next_token(&cursor, '/', &name)) { ... }
+ *
+ * @param cursor Where to continue scanning; advanced past the token found.
+ * @param delimiter The character separating tokens.
+ * @param token Set to the token found, pointing into the scanned string.
+ * @return 1 if a token was found, 0 at the end of the string.
+ */
+int s_next_token(const char **cursor, char delimiter, s_view_t *token);
+
+/**
+ * @brief Like s_next_token(), but stops after the first `*remaining` characters.
+ *
+ * @param cursor Where to continue scanning; advanced past the token found.
+ * @param remaining The number of characters left to scan; decreased as `cursor` advances.
+ * @param delimiter The character separating tokens.
+ * @param token Set to the token found, pointing into the scanned string.
+ * @return 1 if a token was found, 0 at the end of the range.
+ */
+int s_next_token_n(const char **cursor, size_t *remaining, char delimiter, s_view_t *token);
+
 #endif
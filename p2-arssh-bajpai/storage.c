@@ -1,58 +1,730 @@
+#define _GNU_SOURCE // For O_DIRECT
 #include "storage.h"
 #include "slist.h"
 #include "inode.h"
 #include "blocks.h"
 #include "directory.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "ioengine.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "xattr.h"
+#include "tier.h"
+#include "dcache.h"
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include <stdio.h>   // For perror and printf
 #include <stdlib.h>  // For exit
+#ifdef NUFS_DEBUG
+#include <assert.h>
+#endif
 
-// Global file descriptor for the disk image file.
-// This represents the "backend" storage the filesystem uses.
-static int fd = -1; 
+// File descriptors of the disk image: one file, or several that its blocks are
+// striped across (see ioengine_open_striped()), in stripe order.
+// These represent the "backend" storage the filesystem uses.
+static int fds[IOENGINE_MAX_DEVICES];
+static int fd_count = 0;
+static int tier_fd = -1; // The fast tier, if the image has one (see tier.h)
+static uid_t owner;      // The user nufs runs as, who owns every file
 
-// Initialize the storage system with the provided disk image path.
-// This function:
-// 1. Opens (or creates) the disk image file.
-// 2. Reads the entire file system data (all blocks) into memory.
-// 3. Calls blocks_init() and inode_init() to set up in-memory structures
-//    (e.g., free block lists, inode tables).
-void storage_init(const char *path) {
-    printf("[INFO] Initializing storage system with file: %s\n", path);
+// Serializes file system operations, so each one runs as a single journal transaction
+// against a consistent tree. Taken before io_lock when both are needed.
+static pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Serializes writes to the image with checksum updates, so the scrubber never
+// compares a half-written block against its checksum.
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Most blocks flush_blocks() writes with one batch of requests
+#define FLUSH_BATCH (IOENGINE_DEPTH / 2)
+
+// Write in-memory blocks to the image and record their new checksums.
+// The checksum-table blocks holding their entries are written as well, so the
+// on-disk table keeps describing the on-disk data. Each batch of blocks, and
+// the checksum blocks they share, goes to the I/O engine as one submission.
+// Everything in a batch stays pinned until its writes complete, since the
+// block cache never writes a block back on its own.
+static int flush_blocks(const int *block_nums, int count) {
+    int rv = 0;
+    for (int first = 0; first < count; first += FLUSH_BATCH) {
+        int n = count - first < FLUSH_BATCH ? count - first : FLUSH_BATCH;
+        io_request_t reqs[2 * FLUSH_BATCH];
+        int pinned[2 * FLUSH_BATCH];
+        int nreqs = 0;
+
+        pthread_mutex_lock(&io_lock);
+        for (int i = 0; i < n; i++) {
+            int b = block_nums[first + i];
+            pinned[nreqs] = b;
+            reqs[nreqs++] = (io_request_t){IO_WRITE, blocks_pin(b), BLOCK_SIZE, (off_t)b * BLOCK_SIZE, 0};
+        }
+        for (int i = 0; i < n; i++) {
+            int csum_block = blocks_csum_block(block_nums[first + i]);
+            int seen = 0;
+            for (int j = n; j < nreqs && !seen; j++) {
+                seen = pinned[j] == csum_block;
+            }
+            if (!seen) {
+                pinned[nreqs] = csum_block;
+                reqs[nreqs++] = (io_request_t){IO_WRITE, blocks_pin(csum_block), BLOCK_SIZE,
+                                               (off_t)csum_block * BLOCK_SIZE, 0};
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            blocks_csum_update(block_nums[first + i]);
+        }
+        int err = ioengine_submit(reqs, nreqs);
+        for (int i = 0; i < nreqs; i++) {
+            blocks_unpin(pinned[i]);
+        }
+        pthread_mutex_unlock(&io_lock);
+
+        if (err < 0) {
+            fprintf(stderr, "[ERROR] Failed to write blocks to disk: %s\n", strerror(-err));
+            rv = -EIO;
+        }
+    }
+    return rv;
+}
+
+// Send a batch of discards to the I/O engine (see blocks_set_discard_submit()). Like the
+// writes in flush_blocks(), it goes under io_lock, with every other use of the image's files.
+static int submit_discards(io_request_t *reqs, int count) {
+    pthread_mutex_lock(&io_lock);
+    int rv = ioengine_submit_routed(reqs, count, IO_ROUTE_UNTRACKED);
+    pthread_mutex_unlock(&io_lock);
+    return rv;
+}
+
+// Write one in-memory block to the image (see flush_blocks())
+static int flush_block(int block_num) {
+    return flush_blocks(&block_num, 1);
+}
+
+// Data blocks written during a batch (see storage_batch()), or by any operation
+// while a writeback thread is set (see storage_set_writeback()). Instead of being
+// flushed as each write finishes, they are flushed together when the journal
+// commits, or earlier if too many pile up or a file's are asked for (see
+// storage_fsync()). Each entry holds a pin on its block and names the inode
+// that wrote it.
+typedef struct deferred_block {
+    int block;
+    int inum;
+} deferred_block_t;
+static deferred_block_t *deferred = NULL;
+static int *deferred_list = NULL; // The blocks write_deferred() picked, deferred_cap of them
+static int deferred_count = 0, deferred_cap = 0;
+static int deferring = 0;
+
+// The writeback thread's wakeup call, or NULL to commit every operation as it ends
+static void (*writeback_kick)() = NULL;
+
+// Deferred data blocks past which an operation writes them out itself; the
+// writeback thread is asked to commit at half of this. Set from the cache size.
+static int deferred_limit = 0;
+
+// Device flushes. Each is numbered as it starts, and makes durable every write that
+// finished before then; a journal commit that holds blocks counts as one. flushes_done
+// is the highest number finished. Writes of file data note, per inode, the first flush
+// that will cover them, which is what storage_fsync() waits for.
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static uint64_t flushes_started = 0, flushes_done = 0;
+static int flushing = 0;           // Whether wait_flush() has a flush running
+static uint64_t committing = 0;    // The flush commit() is making, or 0
+static storage_sync_stats_t sync_stats;
+
+// What storage_fsync() needs to know about each inode's data
+typedef struct inode_sync {
+    int deferred;    // Entries of the deferred list it has
+    int error;       // Error writing them back on its behalf, reported once
+    uint64_t flush;  // The flush its written data waits for, or 0
+} inode_sync_t;
+static inode_sync_t *syncs = NULL;
+
+// Number the next device flush, which covers every write finished before this call
+static uint64_t flush_begin() {
+    pthread_mutex_lock(&sync_lock);
+    uint64_t flush = ++flushes_started;
+    pthread_mutex_unlock(&sync_lock);
+    return flush;
+}
+
+// Record how a numbered flush went, waking the callers of wait_flush()
+static void flush_end(uint64_t flush, int rv) {
+    pthread_mutex_lock(&sync_lock);
+    if (rv == 0 && flush > flushes_done) flushes_done = flush;
+    pthread_cond_broadcast(&sync_done);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// Note that an inode's data was just written to the image
+static void data_written(int inum) {
+    if (committing) {
+        syncs[inum].flush = committing; // The commit syncs once its data is written
+        return;
+    }
+    pthread_mutex_lock(&sync_lock);
+    syncs[inum].flush = flushes_started + 1;
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// Wait until flush number 'flush' or a later one has finished, running one if
+// none is. Callers arriving while a flush runs share the next one, so any number
+// of concurrent fsync()s cost at most two flushes. Called without storage_lock.
+static int wait_flush(uint64_t flush) {
+    int rv = 0;
+    pthread_mutex_lock(&sync_lock);
+    while (flushes_done < flush && rv == 0) {
+        if (flushing) {
+            pthread_cond_wait(&sync_done, &sync_lock);
+            continue;
+        }
+        flushing = 1;
+        sync_stats.flushes++;
+        uint64_t mine = ++flushes_started;
+        pthread_mutex_unlock(&sync_lock);
+        rv = ioengine_sync() < 0 ? -EIO : 0;
+        flush_end(mine, rv);
+        pthread_mutex_lock(&sync_lock);
+        flushing = 0;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return rv;
+}
+
+// Queue a data block for write_deferred(), or flush it now if memory is short
+static int defer_flush(int block_num, int inum) {
+    if (deferred_count > 0 && deferred[deferred_count - 1].block == block_num) {
+        return 0; // Consecutive small writes to the same block
+    }
+    if (deferred_count == deferred_cap) {
+        int cap = deferred_cap ? deferred_cap * 2 : FLUSH_BATCH;
+        deferred_block_t *grown = realloc(deferred, cap * sizeof(deferred_block_t));
+        if (grown) deferred = grown;
+        int *list = grown ? realloc(deferred_list, cap * sizeof(int)) : NULL;
+        if (!list) {
+            data_written(inum);
+            return flush_block(block_num);
+        }
+        deferred_list = list;
+        deferred_cap = cap;
+    }
+    blocks_pin(block_num); // Keeps the only up-to-date copy in memory
+    deferred[deferred_count++] = (deferred_block_t){block_num, inum};
+    syncs[inum].deferred++;
+    return 0;
+}
+
+static int compare_deferred(const void *a, const void *b) {
+    int x = ((const deferred_block_t *)a)->block, y = ((const deferred_block_t *)b)->block;
+    return (x > y) - (x < y);
+}
+
+// Write out the deferred data blocks of one inode, or all of them if 'inum' is -1.
+// They are sorted first, so each block is written once and in image order. When
+// all are written (before a journal commit), a failure is also kept for each
+// inode's next fsync() or close(), since the operations that wrote them have
+// long returned.
+static int write_deferred(int inum) {
+    if (deferred_count == 0) return 0;
+    qsort(deferred, deferred_count, sizeof(deferred_block_t), compare_deferred);
+    int count = deferred_count, kept = 0, picked = 0;
+    for (int i = 0; i < count; i++) {
+        deferred_block_t d = deferred[i];
+        if (inum >= 0 && d.inum != inum) {
+            deferred[kept++] = d;
+            continue;
+        }
+        syncs[d.inum].deferred--;
+        data_written(d.inum);
+        if (picked > 0 && deferred_list[picked - 1] == d.block) {
+            blocks_unpin(d.block);
+        } else {
+            deferred_list[picked++] = d.block;
+        }
+    }
+    deferred_count = kept;
+
+    int rv = flush_blocks(deferred_list, picked);
+    for (int i = 0; i < picked; i++) {
+        blocks_unpin(deferred_list[i]);
+    }
+    for (int i = 0; rv < 0 && inum < 0 && i < count; i++) {
+        syncs[deferred[i].inum].error = rv; // The list is intact when nothing was kept
+    }
+    return rv;
+}
+
+// Write out every deferred data block; called by the journal before each commit
+static int flush_deferred() {
+    return write_deferred(-1);
+}
+
+// Return the entries block of a directory inode, or NULL if it failed its checksum
+static directory_t *inode_dir(inode_t *node) {
+    return (directory_t *)blocks_get_block(inode_map(node)->block[0]);
+}
+
+// Return the entries block of a directory inode that is about to be modified
+static directory_t *inode_dir_update(inode_t *node) {
+    directory_t *entries = inode_dir(node);
+    if (entries) journal_dirty(inode_map(node)->block[0]);
+    return entries;
+}
+
+// Remove a name from a directory, and from the name cache first
+static int dir_delete(int parent_inum, const char *name) {
+    inode_t *parent = get_inode(parent_inum);
+    dcache_forget(parent_inum, parent->generation, name);
+    return directory_delete(inode_dir_update(parent), name);
+}
+
+// Commit the running transaction. Timestamps changed lazily (see inode_touch()) go
+// with it if it writes other metadata anyway, or once they have waited long enough.
+// A commit that holds blocks syncs the image, so it counts as a device flush.
+static int commit() {
+    inode_times_flush(journal_pending() > 0);
+    if (journal_pending() == 0) return journal_commit();
+    committing = flush_begin();
+    int rv = journal_commit();
+    flush_end(committing, rv);
+    committing = 0;
+    return rv;
+}
+
+// Finish a read-only operation: end the timestamp changes it made (see inode_snapshot()),
+// release the blocks it pinned and drop storage_lock
+static void storage_end_read() {
+    inode_write_end();
+    blocks_release();
+    pthread_mutex_unlock(&storage_lock);
+}
+
+// With a writeback thread, an operation leaves its changes in the running
+// transaction. It commits them itself if the next operation might not fit in
+// the transaction (see journal_short()) or might find only blocks the
+// transaction freed to allocate, since nothing commits in the middle of an
+// operation. It asks for an early commit once the transaction or the deferred
+// data grows large, and writes the deferred data itself if the writeback thread
+// has fallen far behind, so pinned blocks never crowd out the block cache.
+static int writeback_pressure() {
+    int allocatable = blocks_allocatable();
+    if (journal_short(JOURNAL_OP_BLOCKS) ||
+        (allocatable < JOURNAL_OP_BLOCKS && allocatable < (int)get_superblock()->free_blocks)) {
+        return commit();
+    }
+    if (deferred_count >= deferred_limit) {
+        printf("[INFO] Writeback: %d deferred blocks, flushing them now\n", deferred_count);
+        return flush_deferred();
+    }
+    if (journal_usage() >= 75 || deferred_count >= deferred_limit / 2) {
+        writeback_kick();
+    }
+    return 0;
+}
+
+// Finish a mutating operation: commit its journal transaction (or, with a
+// writeback thread, leave it to that thread), release the blocks it pinned and
+// drop storage_lock. A failed commit is reported in place of the operation's
+// own result.
+static int storage_end_op(int rv) {
+    int jrv = writeback_kick ? writeback_pressure() : commit();
+    inode_write_end();
+    blocks_release();
+    pthread_mutex_unlock(&storage_lock);
+    return jrv < 0 ? jrv : rv;
+}
+
+// Shrink a file to 'size', committing between the steps shrink_inode() takes when it
+// frees more blocks than the running transaction has room for. Each commit leaves the
+// file shortened to a block boundary above 'size', which is consistent on disk.
+static int shrink_steps(inode_t *node, int size) {
+    int rv;
+    while ((rv = shrink_inode(node, size)) > 0) {
+        if (commit() < 0) return -EIO;
+    }
+    return rv;
+}
+
+// Empty a file that is about to lose its last link, so freeing the inode afterwards fits in
+// the running transaction. Only a file too large to free in one transaction is committed
+// part of the way (see shrink_steps()): a crash then leaves it in place, shortened.
+static int release_last_link(int inum) {
+    inode_t *node = get_inode(inum);
+    if (node->refs != 1 || S_ISDIR(node->mode) || inode_is_inline(node)) return 0;
+    return shrink_steps(node, 0);
+}
+
+// Copy 'size' bytes starting at 'offset' out of a file; holes read as zeros.
+// The range must lie within the file. Each run of IOENGINE_DEPTH blocks is
+// prefetched into the cache as one batch before it is copied out. Returns 0, or
+// -EIO if a block (or a pointer block mapping it) failed its checksum.
+static int read_inode(inode_t *node, char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    int ahead[IOENGINE_DEPTH];
+    int nahead = 0, next_ahead = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t within = pos % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - within;
+        if (chunk > size - done) chunk = size - done;
+
+        if (next_ahead == nahead) {
+            int first = pos / BLOCK_SIZE;
+            int last = (offset + size - 1) / BLOCK_SIZE;
+            nahead = last - first + 1 < IOENGINE_DEPTH ? last - first + 1 : IOENGINE_DEPTH;
+            for (int i = 0; i < nahead; i++) {
+                ahead[i] = inode_get_bnum(node, first + i);
+                if (ahead[i] < 0) return -EIO;
+            }
+            blocks_prefetch(ahead, nahead);
+            next_ahead = 0;
+        }
+
+        int bnum = ahead[next_ahead++];
+        if (bnum > 0) {
+            const char *data = blocks_pin(bnum);
+            if (!data) return -EIO;
+            memcpy(buf + done, data + within, chunk);
+            blocks_unpin(bnum);
+        } else {
+            memset(buf + done, 0, chunk);
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+// Copy 'size' bytes into a file starting at 'offset', growing it if needed.
+// Holes are allocated and shared blocks are copied before being modified
+// (see inode_writable_bnum()); the blocks touched are flushed to the image
+// in batches, or deferred to the journal commit (see defer_flush()). A write too
+// large for the running transaction commits between blocks, with the file grown to
+// cover what has been written so far; so does one that runs out of space while the
+// transaction holds freed blocks, which the commit makes allocatable. Returns the
+// number of bytes written, which is short only if space ran out.
+static int write_inode(inode_t *node, const char *buf, size_t size, off_t offset) {
+    if (offset + size > INT_MAX) return -EFBIG;
+
+    size_t done = 0;
+    int rv = 0;
+    int pending[FLUSH_BATCH];
+    int npending = 0, flushed = 0, step = 0;
+    while (done < size) {
+        if (step || (done > 0 && journal_short(JOURNAL_STEP_BLOCKS))) {
+            if (npending && flush_blocks(pending, npending) < 0) rv = -EIO;
+            flushed |= npending > 0;
+            npending = 0;
+            grow_inode(node, offset + done);
+            if (commit() < 0) {
+                rv = -EIO;
+                break;
+            }
+            step = 0;
+        }
+
+        off_t pos = offset + done;
+        size_t within = pos % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - within;
+        if (chunk > size - done) chunk = size - done;
+
+        int bnum = inode_writable_bnum(node, pos / BLOCK_SIZE);
+        if (bnum == -ENOSPC && blocks_allocatable() < (int)get_superblock()->free_blocks) {
+            step = 1; // Commit, then try the block again
+            continue;
+        }
+        if (bnum < 0) {
+            rv = bnum;
+            break;
+        }
+        // A whole-block write replaces what the block held, so there is nothing to read first
+        char *data = chunk == BLOCK_SIZE ? blocks_overwrite(bnum) : blocks_get_block(bnum);
+        if (!data) {
+            rv = -EIO;
+            break;
+        }
+        memcpy(data + within, buf + done, chunk);
+        done += chunk;
+
+        if (deferring || writeback_kick) {
+            if (defer_flush(bnum, inode_num(node)) < 0) rv = -EIO;
+            continue;
+        }
+        pending[npending++] = bnum;
+        if (npending == FLUSH_BATCH) {
+            if (flush_blocks(pending, npending) < 0) rv = -EIO;
+            npending = 0;
+            flushed = 1;
+        }
+    }
+    if (npending && flush_blocks(pending, npending) < 0) rv = -EIO;
+    if (npending || flushed) data_written(inode_num(node));
+
+    grow_inode(node, offset + done);
+    if (rv == -EIO) return rv;
+    return done ? (int)done : rv;
+}
 
-    // Open the disk image file with read/write access.
-    // O_CREAT ensures the file is created if it does not exist.
-    // 0666 sets the file's default permissions (modified by umask).
-    fd = open(path, O_RDWR | O_CREAT, 0666);
+// Split 'path' into its parent directory and final component.
+// The final component is copied into 'name'; the parent's inode number is returned.
+static int lookup_parent(const char *path, char *name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0') return -ENOENT;
+    if (strlen(slash + 1) > NAME_MAX) return -ENAMETOOLONG;
+    strcpy(name, slash + 1);
+
+    // The parent is resolved in place: everything before the last slash
+    int inum = tree_lookup_n(path, slash - path);
+    if (inum >= 0 && !S_ISDIR(get_inode(inum)->mode)) return -ENOTDIR;
+    if (inum >= 0 && !inode_dir(get_inode(inum))) return -EIO; // Its entries are about to be used
+    return inum;
+}
+
+// Bytes per request when the resident area is written
+#define IMAGE_CHUNK (32 * BLOCK_SIZE)
+
+// Read or write the resident area of the image (see blocks_resident_count()) in
+// IMAGE_CHUNK pieces, submitted as one batch so the I/O engine can keep many of
+// them in flight. Writes end with a sync.
+static int image_io(io_op_t op) {
+    size_t total = (size_t)blocks_resident_count() * BLOCK_SIZE;
+    int chunks = (total + IMAGE_CHUNK - 1) / IMAGE_CHUNK;
+    io_request_t *reqs = calloc(chunks + 1, sizeof(io_request_t));
+    if (!reqs) return -ENOMEM;
+
+    for (int i = 0; i < chunks; i++) {
+        size_t len = total - (size_t)i * IMAGE_CHUNK;
+        if (len > IMAGE_CHUNK) len = IMAGE_CHUNK;
+        reqs[i] = (io_request_t){op, (char *)blocks_get_block(0) + (size_t)i * IMAGE_CHUNK, len,
+                                 (off_t)i * IMAGE_CHUNK, 0};
+    }
+    int count = chunks;
+    if (op == IO_WRITE) {
+        reqs[count++].op = IO_SYNC;
+    }
+
+    int rv = ioengine_submit(reqs, count);
+    free(reqs);
+    return rv;
+}
+
+// Write the resident area to the disk image file. Everything else is written
+// through as it changes. Caller holds io_lock.
+static int write_image() {
+    if (image_io(IO_WRITE) < 0) {
+        fprintf(stderr, "[ERROR] Failed to write data to disk\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Size of a new image: the size asked for, or that of an existing (unformatted) file
+// (times the number of files striped across) if it is at least the default size, or
+// the default size
+static uint32_t new_image_blocks(const storage_options_t *opts) {
+    off_t size = opts ? opts->image_size : 0;
+    if (size <= 0) {
+        off_t existing = lseek(fds[0], 0, SEEK_END) * fd_count;
+        size = existing >= (off_t)BLOCK_COUNT * BLOCK_SIZE ? existing : (off_t)BLOCK_COUNT * BLOCK_SIZE;
+    }
+    off_t blocks = size / BLOCK_SIZE;
+    return blocks > INT_MAX ? INT_MAX : blocks;
+}
+
+// Open (or create) one file of the disk image.
+// O_CREAT ensures the file is created if it does not exist.
+// 0666 sets the file's default permissions (modified by umask).
+// O_DIRECT (if asked for) makes the block cache the only copy of the image in memory;
+// all buffers used for image I/O are block-aligned (see bufpool.h) to allow it.
+static int open_image_file(const char *path, int direct) {
+    int fd = open(path, O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), 0666);
+    if (fd < 0 && direct && errno == EINVAL) {
+        printf("[INFO] O_DIRECT not supported for %s, using the page cache\n", path);
+        fd = open(path, O_RDWR | O_CREAT, 0666);
+    } else if (fd >= 0 && direct) {
+        printf("[INFO] Opened %s with O_DIRECT\n", path);
+    }
     if (fd < 0) {
         perror("[ERROR] Failed to open data file");
         exit(1); // If we cannot open the storage file, we must exit.
     }
+    return fd;
+}
+
+// Open the fast tier's file, sizing a new one
+static int open_tier_file(const storage_options_t *opts, int direct) {
+    int fd = open_image_file(opts->tier_path, direct);
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size == 0 || (opts->tier_size > 0 && opts->tier_size > size)) {
+        size = opts->tier_size > 0 ? opts->tier_size : TIER_SIZE;
+        if (ftruncate(fd, size) < 0) {
+            perror("[ERROR] Failed to size fast tier");
+            exit(1);
+        }
+    }
+    return fd;
+}
 
-    // block_zero points to the start of our in-memory blocks array.
-    // We read the entire file system (all blocks) into memory.
-    void *block_zero = blocks_get_block(0);
-    if (pread(fd, block_zero, BLOCK_COUNT * BLOCK_SIZE, 0) < 0) {
-        perror("[ERROR] Failed to read data from file");
+// Attach the fast tier named in the superblock, which the image can't be used without
+static void attach_tier(const char *path, const storage_options_t *opts, int direct) {
+    if (!opts || !opts->tier_path) {
+        fprintf(stderr, "[ERROR] %s keeps part of its data on a fast tier; give it with -o tier=PATH\n", path);
         exit(1);
     }
+    tier_fd = open_image_file(opts->tier_path, direct);
+    uint32_t id = get_superblock()->tier_id;
+    int rv = tier_attach(tier_fd, &id);
+    if (rv < 0) {
+        fprintf(stderr, "[ERROR] Failed to attach fast tier %s: %s\n", opts->tier_path, strerror(-rv));
+        exit(1);
+    }
+}
+
+// Initialize the storage system with the provided disk image path.
+// This function:
+// 1. Opens (or creates) the disk image file, and any further files it is striped across.
+// 2. Calls blocks_init() to set up the block cache, then loads the resident
+//    metadata area of an existing image, or formats a new one.
+// 3. Attaches the image's fast tier, creating it if it is given for the first time.
+// 4. Replays the journal and calls inode_init().
+// Data blocks are read (and verified against their checksums) only as they are used.
+void storage_init(const char *path, const storage_options_t *opts) {
+    printf("[INFO] Initializing storage system with file: %s\n", path);
+
+    // Open the disk image file(s) with read/write access.
+    int direct = opts && opts->direct;
+    fds[fd_count++] = open_image_file(path, direct);
+    for (const char *const *more = opts ? opts->stripe_images : NULL; more && *more; more++) {
+        if (fd_count == IOENGINE_MAX_DEVICES) {
+            fprintf(stderr, "[ERROR] An image can be striped across at most %d files\n", IOENGINE_MAX_DEVICES);
+            exit(1);
+        }
+        fds[fd_count++] = open_image_file(*more, direct);
+    }
+    size_t unit = opts && opts->stripe_unit ? opts->stripe_unit : IOENGINE_STRIPE_UNIT;
+    if (unit % BLOCK_SIZE != 0 || unit / BLOCK_SIZE > UINT32_MAX) {
+        fprintf(stderr, "[ERROR] The stripe unit must be a multiple of %d bytes\n", BLOCK_SIZE);
+        exit(1);
+    }
+
+    // Until storage_set_ioengine() is called, I/O is done with pread()/pwrite().
+    // An existing image's own stripe unit replaces the one given (see blocks_load()).
+    ioengine_open_striped(IOENGINE_PREAD, fds, fd_count, unit, NULL, 0);
+    blocks_init(opts ? opts->cache_size : 0);
+    blocks_set_discard(opts ? opts->discard : DISCARD_OFF);
+    blocks_set_discard_submit(submit_discards);
+    journal_init(flush_blocks, flush_deferred);
+
+    int existing = blocks_load();
+    if (existing == -EUCLEAN) {
+        fprintf(stderr, "[ERROR] %s is a damaged nufs image; not mounting it\n", path);
+        exit(1);
+    }
+    if (existing < 0) {
+        fprintf(stderr, "[ERROR] Failed to read data from file: %s\n", strerror(-existing));
+        exit(1);
+    }
+    if (existing && get_superblock()->tier_id != 0) {
+        attach_tier(path, opts, direct); // The journal's blocks may be on the fast tier
+    }
+    if (existing) {
+        // Bring the metadata up to date with the journal
+        journal_recover();
+    } else {
+        // A new image: the block tables read as zeros once the files have been extended
+        // (sparsely) to their sizes, so only the resident area is written. Only empty files
+        // are formatted: one that holds anything but a superblock may be an image whose
+        // first block was lost, or not an image at all, and the first file of a stripe set
+        // without a superblock may just be out of order.
+        if (lseek(fds[0], 0, SEEK_END) > 0) {
+            fprintf(stderr, "[ERROR] %s has no nufs superblock but is not empty; not formatting it "
+                            "(remove it to start a new image)\n", path);
+            exit(1);
+        }
+        for (int i = 1; i < fd_count; i++) {
+            if (lseek(fds[i], 0, SEEK_END) > 0) {
+                fprintf(stderr, "[ERROR] %s has no nufs superblock, but file %d of the stripe set is not empty; "
+                                "not formatting (are the files in stripe order?)\n", path, i + 1);
+                exit(1);
+            }
+        }
+        uint32_t count = new_image_blocks(opts);
+        for (int i = 0; i < fd_count; i++) {
+            off_t size = ioengine_device_size(i, (off_t)count * BLOCK_SIZE);
+            if (ftruncate(fds[i], size) < 0) {
+                perror("[ERROR] Failed to size data file");
+                exit(1);
+            }
+        }
+        if (blocks_format(count) < 0) {
+            fprintf(stderr, "[ERROR] Failed to format an image of %u blocks\n", count);
+            exit(1);
+        }
+        pthread_mutex_lock(&io_lock);
+        int rv = write_image();
+        pthread_mutex_unlock(&io_lock);
+        if (rv < 0) exit(1);
+    }
+
+    superblock_t *sb = get_superblock();
+    if (sb->tier_id == 0 && opts && opts->tier_path) {
+        // A new fast tier, empty until the migration thread moves extents to it. The
+        // superblock names it from the first commit on; until then it is just formatted again.
+        tier_fd = open_tier_file(opts, direct);
+        uint32_t id = 0;
+        int rv = tier_attach(tier_fd, &id);
+        if (rv < 0) {
+            fprintf(stderr, "[ERROR] Failed to create fast tier %s: %s\n", opts->tier_path, strerror(-rv));
+            exit(1);
+        }
+        journal_dirty(0);
+        sb->tier_id = id;
+    } else if (sb->tier_id != 0 && tier_fd < 0) {
+        attach_tier(path, opts, direct); // Named by the journal just replayed; nothing moved yet
+    }
 
-    // Initialize our block and inode management layers.
-    blocks_init(path);
+    // Initialize the inode layer; on a new image the root directory is journaled.
     inode_init();
+    inode_write_end();
+    owner = getuid();
+    free(syncs);
+    syncs = calloc(inode_count(), sizeof(inode_sync_t));
+    if (!syncs) {
+        fprintf(stderr, "[ERROR] Failed to allocate per-inode sync state\n");
+        exit(1);
+    }
+    journal_commit();
+    blocks_release();
 
-    printf("[INFO] Storage initialized from %s.\n", path);
+    printf("[INFO] Storage initialized from %s (%u blocks).\n", path, sb->block_count);
+}
+
+// Fill in a stat structure from an inode
+static void fill_stat(struct stat *st, int inum, const inode_t *node, const inode_times_t *times) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = owner;       // Set the user ID to the current user.
+    st->st_ino = inum;        // Hard links share an inode number.
+    st->st_mode = node->mode; // File mode (permissions, directory/file)
+    st->st_nlink = S_ISDIR(node->mode) ? 2 : node->refs; // Number of hard links
+    st->st_size = node->size; // File size in bytes
+    st->st_atim = (struct timespec){times->atime / NSEC_PER_SEC, times->atime % NSEC_PER_SEC};
+    st->st_mtim = (struct timespec){times->mtime / NSEC_PER_SEC, times->mtime % NSEC_PER_SEC};
+    st->st_ctim = (struct timespec){times->ctime / NSEC_PER_SEC, times->ctime % NSEC_PER_SEC};
 }
 
 // Retrieve file metadata (stat information) for a given path.
 // This uses tree_lookup() to find the inode number, then get_inode()
 // to retrieve inode data. If the file or directory doesn't exist,
 // we return -ENOENT. Otherwise, we fill the stat structure with
-// the file's mode, size, and user ID.
-int storage_stat(const char *path, struct stat *st) {
+// the file's inode number, mode, link count, size, user ID and timestamps.
+static int do_stat(const char *path, struct stat *st) {
     printf("[DEBUG] storage_stat: path=%s\n", path);
 
     int inum = tree_lookup(path);
@@ -67,21 +739,69 @@ int storage_stat(const char *path, struct stat *st) {
         return -EIO;
     }
 
-    memset(st, 0, sizeof(struct stat));
-    st->st_uid = getuid();    // Set the user ID to the current user.
-    st->st_mode = node->mode; // File mode (permissions, directory/file)
-    st->st_size = node->size; // File size in bytes
-
+    fill_stat(st, inum, node, inode_times(node));
     printf("[INFO] Retrieved metadata for %s: size=%d, mode=%o\n", path, node->size, node->mode);
     return 0;
 }
 
+// stat() without storage_lock: the path is resolved in the name cache and the inode
+// copied under its sequence count (see inode_snapshot()). Returns -EAGAIN, sending
+// the caller to do_stat(), if the path isn't cached or the inode is being changed.
+// Doesn't log, since stdout's lock would serialize the callers all the same.
+static int stat_unlocked(const char *path, struct stat *st) {
+    int generation;
+    int inum = tree_lookup_cached(path, &generation);
+    if (inum < 0) return inum;
+
+    inode_t node;
+    inode_times_t times;
+    if (inode_snapshot(inum, &node, &times) < 0) return -EAGAIN;
+    if (node.refs <= 0 || node.generation != generation) return -EAGAIN; // Reused since it was cached
+    fill_stat(st, inum, &node, &times);
+    return 0;
+}
+
+#ifdef NUFS_DEBUG
+// Recount the free blocks and inodes and compare them with the superblock's counts
+static void check_free_counts(const superblock_t *sb) {
+    long free_blocks = sb->block_count - bitmap_count(get_blocks_bitmap(), sb->block_count);
+    long free_inodes = 0;
+    for (int i = 0; i < inode_count(); i++) {
+        if (get_inode(i)->refs <= 0) free_inodes++;
+    }
+    if (free_blocks != sb->free_blocks || free_inodes != sb->free_inodes) {
+        printf("[ERROR] Free counts drifted: %u blocks, %u inodes recorded; %ld, %ld counted\n",
+               sb->free_blocks, sb->free_inodes, free_blocks, free_inodes);
+    }
+    assert(free_blocks == sb->free_blocks && free_inodes == sb->free_inodes);
+}
+#endif
+
+// Fill in 'st' from the superblock's counts
+static int do_statfs(struct statvfs *st) {
+    superblock_t *sb = get_superblock();
+#ifdef NUFS_DEBUG
+    check_free_counts(sb);
+#endif
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = sb->block_count - sb->data_start; // Only data blocks can be used by files
+    st->f_bfree = sb->free_blocks;
+    st->f_bavail = sb->free_blocks;
+    st->f_files = sb->inode_count;
+    st->f_ffree = sb->free_inodes;
+    st->f_favail = sb->free_inodes;
+    st->f_namemax = MAX_NAME_LEN;
+    return 0;
+}
+
 // Read data from the file at the given path into 'buf'.
 // Starts at 'offset' and reads up to 'size' bytes, or until the end of the file.
 // If the path does not exist, returns -ENOENT.
 // Adjusts 'size' to ensure we do not read beyond the file's size.
-// Copies data from our in-memory block into the user buffer.
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+// Copies data from our in-memory blocks into the user buffer.
+static int do_read(const char *path, char *buf, size_t size, off_t offset) {
     printf("[DEBUG] storage_read: path=%s, size=%zu, offset=%lld\n", path, size, (long long)offset);
 
     int inum = tree_lookup(path);
@@ -91,6 +811,7 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
     }
 
     inode_t *node = get_inode(inum);
+    if (S_ISLNK(node->mode)) return -EINVAL; // Targets are read with storage_readlink()
     if (offset >= node->size) {
         // If the offset is beyond the file size, no data can be read.
         return 0;
@@ -101,19 +822,18 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
         size = node->size - offset;
     }
 
-    // Retrieve the block associated with this inode.
-    void *block = blocks_get_block(node->block);
-
-    // Copy data from the filesystem block into buf.
-    memcpy(buf, (char*)block + offset, size);
+    // Copy data from the filesystem blocks into buf.
+    int rv = read_inode(node, buf, size, offset);
+    if (rv < 0) return rv;
+    inode_touch(node, INODE_ATIME);
     printf("[INFO] Read %zu bytes from file: %s\n", size, path);
     return size;
 }
 
 // Write 'size' bytes of data from 'buf' into the file at 'path', starting at 'offset'.
-// If writing beyond the current file size, we try to grow the inode (if possible).
-// Once done, we flush the changes to disk using pwrite() so that the file system is persistent.
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+// If writing beyond the current file size, the inode grows to cover the new data.
+// Each block written is flushed to disk using pwrite() so that the file system is persistent.
+static int do_write(const char *path, const char *buf, size_t size, off_t offset) {
     printf("[DEBUG] storage_write: path=%s, size=%zu, offset=%lld\n", path, size, (long long)offset);
 
     int inum = tree_lookup(path);
@@ -128,106 +848,349 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
         printf("[ERROR] Failed to retrieve inode for path: %s\n", path);
         return -EIO;
     }
+    if (S_ISLNK(node->mode)) return -EINVAL;
 
-    // If we are writing beyond the current file size, we need to grow the file.
-    if (offset + size > node->size) {
-        printf("[INFO] Growing inode: current size=%d, new size=%llu\n", node->size, (unsigned long long)(offset + size));
-        if (grow_inode(node, offset + size) < 0) {
-            printf("[ERROR] Not enough space to grow inode for path: %s\n", path);
-            return -ENOSPC; // Not enough space on the "disk".
-        }
+    int rv = write_inode(node, buf, size, offset);
+    if (rv < 0) {
+        printf("[ERROR] Failed to write %s: %d\n", path, rv);
+        return rv;
     }
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
 
-    // Retrieve the block for this inode and check that it exists.
-    void *block = blocks_get_block(node->block);
-    if (!block) {
-        printf("[ERROR] Failed to retrieve block for inode: %d\n", inum);
-        return -EIO;
+    printf("[INFO] Updated file size for %s: %d bytes\n", path, node->size);
+    return rv;
+}
+
+// Change the size of the file at 'path'.
+// Shrinking drops the blocks past the new end; growing leaves a hole that reads as zeros.
+static int do_truncate(const char *path, off_t size) {
+    printf("[DEBUG] storage_truncate: path=%s, size=%lld\n", path, (long long)size);
+
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) return -EISDIR;
+    if (S_ISLNK(node->mode) || size < 0) return -EINVAL;
+    if (size > INT_MAX) return -EFBIG;
+
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
+    if (size >= node->size) {
+        return grow_inode(node, size);
     }
 
-    // Write data into the in-memory block at the given offset.
-    memcpy((char*)block + offset, buf, size);
-    printf("[DEBUG] Data written to memory block %d: %.*s\n", node->block, (int)size, buf);
+    int rv = shrink_steps(node, size);
+    if (rv < 0) return rv;
 
-    // Write changes to disk using pwrite to ensure persistence.
-    off_t disk_offset = node->block * BLOCK_SIZE + offset;
-    ssize_t written = pwrite(fd, buf, size, disk_offset);
-    if (written < 0) {
-        perror("[ERROR] Failed to write data to disk");
-        return -EIO;
+    // The zeroed tail of the last block has to reach the disk too
+    int bnum = size % BLOCK_SIZE ? inode_get_bnum(node, size / BLOCK_SIZE) : 0;
+    if (bnum > 0 && flush_block(bnum) < 0) return -EIO;
+    if (bnum > 0) data_written(inum);
+    return 0;
+}
+
+// Copy a range of one file into another, sharing blocks instead of copying them.
+// Wherever a whole source block lands on a whole destination block, the destination
+// simply references the source block (copy-on-write protects both files afterwards).
+// Partial blocks at either end, or ranges whose offsets are not block-aligned relative
+// to each other, are copied byte by byte.
+static ssize_t do_clone_range(const char *from, off_t from_offset, const char *to, off_t to_offset, size_t size) {
+    printf("[DEBUG] storage_clone_range: from=%s@%lld, to=%s@%lld, size=%zu\n",
+           from, (long long)from_offset, to, (long long)to_offset, size);
+
+    int src_inum = tree_lookup(from);
+    int dst_inum = tree_lookup(to);
+    if (src_inum < 0 || dst_inum < 0) return -ENOENT;
+    if (from_offset < 0 || to_offset < 0) return -EINVAL;
+
+    inode_t *src = get_inode(src_inum);
+    inode_t *dst = get_inode(dst_inum);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)) return -EISDIR;
+    if (S_ISLNK(src->mode) || S_ISLNK(dst->mode)) return -EINVAL;
+
+    // Only the part of the range that exists in the source is copied.
+    if (from_offset >= src->size) return 0;
+    if (from_offset + size > src->size) size = src->size - from_offset;
+    if (to_offset + size > INT_MAX) return -EFBIG;
+    if (src_inum == dst_inum && from_offset < to_offset + (off_t)size && to_offset < from_offset + (off_t)size) {
+        return -EINVAL; // Overlapping ranges within one file
     }
 
-    printf("[INFO] Persisted %zd bytes to disk at offset %lld\n", written, (long long)disk_offset);
+    size_t done = 0;
+    int shared = 0;
+    char bounce[BLOCK_SIZE];
+    while (done < size) {
+        // A long clone commits between blocks, as a long write does
+        if (done > 0 && journal_short(JOURNAL_STEP_BLOCKS) && commit() < 0) return -EIO;
 
-    // Update the file size to reflect new writes.
-    node->size = offset + size;
-    printf("[INFO] Updated file size for %s: %d bytes\n", path, node->size);
+        off_t src_pos = from_offset + done;
+        off_t dst_pos = to_offset + done;
+        size_t chunk = BLOCK_SIZE - dst_pos % BLOCK_SIZE;
+        if (chunk > size - done) chunk = size - done;
 
-    return size;
+        if (chunk == BLOCK_SIZE && src_pos % BLOCK_SIZE == 0) {
+            // Whole block: point the destination at the source's block
+            int bnum = inode_get_bnum(src, src_pos / BLOCK_SIZE);
+            int old = inode_get_bnum(dst, dst_pos / BLOCK_SIZE);
+            if (bnum < 0 || old < 0) return done ? (ssize_t)done : -EIO;
+            if (bnum != old) {
+                int rv = inode_set_bnum(dst, dst_pos / BLOCK_SIZE, bnum);
+                if (rv < 0) return done ? (ssize_t)done : rv;
+                if (bnum > 0) ref_block(bnum);
+                if (old > 0) free_block(old);
+            }
+            grow_inode(dst, dst_pos + chunk);
+            shared++;
+        } else {
+            // Partial block: copy the bytes
+            int rv = read_inode(src, bounce, chunk, src_pos);
+            if (rv == 0) rv = write_inode(dst, bounce, chunk, dst_pos);
+            if (rv < 0) return done ? (ssize_t)done : rv;
+        }
+        done += chunk;
+    }
+
+    if (done > 0) inode_touch(dst, INODE_MTIME | INODE_CTIME);
+    printf("[INFO] Cloned %zu bytes from %s to %s (%d blocks shared)\n", done, from, to, shared);
+    return done;
 }
 
 // Create a new file at 'path' with the given 'mode'.
 // If the file already exists, return -EEXIST.
-// This involves allocating an inode and adding an entry in the root directory.
-int storage_mknod(const char *path, int mode) {
+// This involves allocating an inode and adding an entry in the parent directory.
+static int do_mknod(const char *path, int mode) {
     printf("[DEBUG] storage_mknod: path=%s, mode=%o\n", path, mode);
 
     // Check if file already exists.
     if (tree_lookup(path) >= 0) return -EEXIST;
 
+    char name[NAME_MAX + 1];
+    int parent_inum = lookup_parent(path, name);
+    if (parent_inum < 0) return parent_inum;
+
     // Allocate a new inode for the file.
     int inum = alloc_inode();
     if (inum < 0) return -ENOSPC;
 
     inode_t *node = get_inode(inum);
-    memset(node, 0, sizeof(inode_t));
-    node->refs = 1;
-    node->mode = mode;
-    node->size = 0;
+    inode_dirty(node);
+    node->mode = mode; // alloc_inode() cleared the rest
+    inode_set_goal(node, get_inode(parent_inum)); // Its data goes near its directory
 
-    // Insert the file into the root directory ("/").
-    return directory_put((directory_t *)get_inode(tree_lookup("/")), path, inum);
+    // Insert the file into its parent directory.
+    int rv = directory_put(inode_dir_update(get_inode(parent_inum)), name, inum);
+    if (rv < 0) {
+        free_inode(inum);
+        return rv;
+    }
+    inode_touch(get_inode(parent_inum), INODE_MTIME | INODE_CTIME);
+    return 0;
 }
 
 // Delete (unlink) a file at 'path'.
-// This removes the directory entry and frees the inode.
-int storage_unlink(const char *path) {
+// This removes the directory entry and drops one link to the inode;
+// the inode and its data are freed along with the last link.
+static int do_unlink(const char *path) {
     printf("[DEBUG] storage_unlink: path=%s\n", path);
 
     int inum = tree_lookup(path);
     if (inum < 0) return -ENOENT;
 
-    free_inode(inum);
-    return directory_delete((directory_t *)get_inode(tree_lookup("/")), path);
+    char name[NAME_MAX + 1];
+    int parent_inum = lookup_parent(path, name);
+    if (parent_inum < 0) return parent_inum;
+
+    int rv = release_last_link(inum);
+    if (rv < 0) return rv;
+    if (inode_unlink(inum) > 0) inode_touch(get_inode(inum), INODE_CTIME);
+    inode_touch(get_inode(parent_inum), INODE_MTIME | INODE_CTIME);
+    return dir_delete(parent_inum, name);
+}
+
+// Create a hard link: a new directory entry 'to' for the inode of 'from'.
+// The data is shared outright, not copied; the inode counts its links in 'refs'.
+static int do_link(const char *from, const char *to) {
+    printf("[DEBUG] storage_link: from=%s, to=%s\n", from, to);
+
+    int inum = tree_lookup(from);
+    if (inum < 0) return -ENOENT;
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) return -EPERM; // No hard links to directories
+
+    if (tree_lookup(to) >= 0) return -EEXIST;
+    char name[NAME_MAX + 1];
+    int parent_inum = lookup_parent(to, name);
+    if (parent_inum < 0) return parent_inum;
+
+    int rv = directory_put(inode_dir_update(get_inode(parent_inum)), name, inum);
+    if (rv < 0) return rv;
+
+    inode_dirty(node);
+    node->refs++;
+    inode_touch(node, INODE_CTIME);
+    inode_touch(get_inode(parent_inum), INODE_MTIME | INODE_CTIME);
+    printf("[INFO] Linked %s to %s (%d links)\n", to, from, node->refs);
+    return 0;
+}
+
+// Create a symlink at 'path' pointing to 'target'.
+// Short targets are kept in the inode itself; longer ones go in a data block.
+static int do_symlink(const char *target, const char *path) {
+    printf("[DEBUG] storage_symlink: target=%s, path=%s\n", target, path);
+
+    size_t len = strlen(target);
+    if (len == 0) return -ENOENT;
+    if (len >= BLOCK_SIZE) return -ENAMETOOLONG;
+
+    int rv = do_mknod(path, S_IFLNK | 0777);
+    if (rv < 0) return rv;
+
+    inode_t *node = get_inode(tree_lookup(path));
+    if (len <= INODE_INLINE_MAX) {
+        memcpy(inode_map(node)->symlink, target, len); // Already journaled by do_mknod()
+        node->size = len;
+        return 0;
+    }
+
+    rv = write_inode(node, target, len, 0);
+    if (rv != (int)len) {
+        do_unlink(path);
+        return rv < 0 ? rv : -ENOSPC;
+    }
+    return 0;
+}
+
+// Copy the target of the symlink at 'path' into 'buf', NUL-terminated and
+// truncated to fit 'size' bytes.
+static int do_readlink(const char *path, char *buf, size_t size) {
+    printf("[DEBUG] storage_readlink: path=%s\n", path);
+
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    inode_t *node = get_inode(inum);
+    if (!S_ISLNK(node->mode)) return -EINVAL;
+    if (size == 0) return -EINVAL;
+
+    size_t len = node->size < size - 1 ? node->size : size - 1;
+    if (inode_is_inline(node)) {
+        memcpy(buf, inode_map(node)->symlink, len);
+    } else {
+        int rv = read_inode(node, buf, len, 0);
+        if (rv < 0) return rv;
+    }
+    buf[len] = '\0';
+    inode_touch(node, INODE_ATIME);
+    return 0;
+}
+
+// Report the data version of the file at 'path' (see inode_version())
+static int do_data_version(const char *path, uint64_t *version) {
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    *version = inode_version(get_inode(inum));
+    return 0;
+}
+
+// Set the access and modification times of 'path' (see storage_utimens()).
+// Unlike inode_touch(), this journals them with the operation.
+static int do_utimens(const char *path, const struct timespec ts[2]) {
+    printf("[DEBUG] storage_utimens: path=%s\n", path);
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec set[2];
+    for (int i = 0; i < 2; i++) {
+        set[i] = !ts || ts[i].tv_nsec == UTIME_NOW ? now : ts[i];
+        if (set[i].tv_nsec != UTIME_OMIT && (set[i].tv_nsec < 0 || set[i].tv_nsec >= NSEC_PER_SEC)) return -EINVAL;
+    }
+
+    inode_t *node = get_inode(inum);
+    inode_times_t *times = inode_times(node);
+    inode_times_dirty(node);
+    if (set[0].tv_nsec != UTIME_OMIT) times->atime = set[0].tv_sec * NSEC_PER_SEC + set[0].tv_nsec;
+    if (set[1].tv_nsec != UTIME_OMIT) times->mtime = set[1].tv_sec * NSEC_PER_SEC + set[1].tv_nsec;
+    times->ctime = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+    return 0;
+}
+
+// Extended attributes: look up the inode and leave the rest to xattr.c.
+// A file without attributes is answered from its inode flag alone.
+static int do_getxattr(const char *path, const char *name, char *value, size_t size) {
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    return xattr_get(get_inode(inum), name, value, size);
+}
+
+static int do_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    printf("[DEBUG] storage_setxattr: path=%s, name=%s, size=%zu\n", path, name, size);
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    int rv = xattr_set(get_inode(inum), name, value, size, flags);
+    if (rv == 0) inode_touch(get_inode(inum), INODE_CTIME);
+    return rv;
+}
+
+static int do_listxattr(const char *path, char *list, size_t size) {
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    return xattr_list(get_inode(inum), list, size);
+}
+
+static int do_removexattr(const char *path, const char *name) {
+    printf("[DEBUG] storage_removexattr: path=%s, name=%s\n", path, name);
+    int inum = tree_lookup(path);
+    if (inum < 0) return -ENOENT;
+    int rv = xattr_remove(get_inode(inum), name);
+    if (rv == 0) inode_touch(get_inode(inum), INODE_CTIME);
+    return rv;
 }
 
 // Create a directory at 'path' with the given 'mode'.
 // Directories are also represented by inodes. This function allocates an inode,
-// marks it as a directory, and adds it to the parent directory ("/").
-int storage_mkdir(const char *path, mode_t mode) {
+// marks it as a directory, gives it a block for its entries, and adds it to the
+// parent directory.
+static int do_mkdir(const char *path, mode_t mode) {
     printf("[DEBUG] storage_mkdir: path=%s, mode=%o\n", path, mode);
 
     if (tree_lookup(path) >= 0) return -EEXIST;
 
+    char name[NAME_MAX + 1];
+    int parent_inum = lookup_parent(path, name);
+    if (parent_inum < 0) return parent_inum;
+
     int inum = alloc_inode();
     if (inum < 0) return -ENOSPC;
 
     inode_t *node = get_inode(inum);
-    memset(node, 0, sizeof(inode_t));
-    node->refs = 1;
-    node->mode = mode | S_IFDIR;
-    node->size = 0;
+    inode_dirty(node);
+    node->mode = mode | S_IFDIR; // alloc_inode() cleared the rest
 
-    int parent_inum = tree_lookup("/");
-    if (parent_inum < 0) return -ENOENT;
+    inode_map_t *map = inode_map(node);
+    map->block[0] = alloc_block(); // In this thread's home group, which its files then share
+    if (map->block[0] < 0) {
+        map->block[0] = 0;
+        free_inode(inum);
+        return -ENOSPC;
+    }
+    node->blocks = 1;
+    journal_dirty(map->block[0]);
+    directory_init(blocks_overwrite(map->block[0])); // New: nothing to read from the image
 
-    return directory_put((directory_t *)get_inode(parent_inum), path, inum);
+    int rv = directory_put(inode_dir_update(get_inode(parent_inum)), name, inum);
+    if (rv < 0) {
+        free_inode(inum);
+        return rv;
+    }
+    inode_touch(get_inode(parent_inum), INODE_MTIME | INODE_CTIME);
+    return 0;
 }
 
 // Remove a directory at 'path'.
 // The directory must be empty before removal. If it's not empty, return -ENOTEMPTY.
 // If it's not a directory, return -ENOTDIR.
-int storage_rmdir(const char *path) {
+static int do_rmdir(const char *path) {
     printf("[DEBUG] storage_rmdir: path=%s\n", path);
 
     int inum = tree_lookup(path);
@@ -236,52 +1199,483 @@ int storage_rmdir(const char *path) {
     inode_t *node = get_inode(inum);
     if (!S_ISDIR(node->mode)) return -ENOTDIR;
 
-    // Check if directory is empty by listing its contents.
-    slist_t *entries = directory_list((directory_t *)node);
-    if (entries) {
-        // If we have any entries, the directory is not empty.
-        s_free(entries);
+    // A directory with any entries is not empty.
+    directory_t *entries = inode_dir(node);
+    if (!entries) return -EIO;
+    if (entries->entry_count > 0) {
         return -ENOTEMPTY;
     }
 
-    int parent_inum = tree_lookup("/");
-    if (parent_inum < 0) return -ENOENT;
+    char name[NAME_MAX + 1];
+    int parent_inum = lookup_parent(path, name);
+    if (parent_inum < 0) return parent_inum;
 
     // Remove the directory entry from the parent and free the inode.
-    directory_delete((directory_t *)get_inode(parent_inum), path);
+    dir_delete(parent_inum, name);
     free_inode(inum);
+    inode_touch(get_inode(parent_inum), INODE_MTIME | INODE_CTIME);
     return 0;
 }
 
-// Return a linked list of entries (filenames) within the directory specified by 'path'.
-// If 'path' is not a directory or doesn't exist, return NULL.
-slist_t *storage_list(const char *path) {
+// Set *list to a linked list of entries (filenames) within the directory specified by 'path',
+// built in the calling thread's arena. An empty directory gives an empty (NULL) list.
+static int do_list(const char *path, slist_t **list) {
     printf("[DEBUG] storage_list: path=%s\n", path);
+    *list = NULL;
 
     int inum = tree_lookup(path);
-    if (inum < 0) return NULL;
+    if (inum < 0) return inum;
 
     inode_t *node = get_inode(inum);
-    if (!S_ISDIR(node->mode)) return NULL;
+    if (!S_ISDIR(node->mode)) return -ENOTDIR;
 
     // Use directory_list() to get a list of the entries in this directory.
-    return directory_list((directory_t *)node);
+    directory_t *entries = inode_dir(node);
+    if (!entries) return -EIO;
+    arena_t *arena = arena_thread();
+    if (!arena) return -ENOMEM;
+    inode_touch(node, INODE_ATIME);
+    *list = directory_list(entries, arena);
+    return 0;
+}
+
+// Whether 'path' names an entry inside the directory 'dir' (at any depth)
+static int path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+// Update the timestamps a rename changes: both directories', and the status change
+// time of the inodes moved (and of a replaced one that still has other links)
+static void touch_renamed(int from_parent, int to_parent, inode_t *src, inode_t *dst) {
+    inode_touch(get_inode(from_parent), INODE_MTIME | INODE_CTIME);
+    inode_touch(get_inode(to_parent), INODE_MTIME | INODE_CTIME);
+    inode_touch(src, INODE_CTIME);
+    if (dst) inode_touch(dst, INODE_CTIME);
+}
+
+// Rename 'from' to 'to', optionally refusing to replace an existing 'to'
+// (RENAME_NOREPLACE) or swapping the two entries (RENAME_EXCHANGE).
+// Only directory entries move: the inodes and their data stay where they are.
+// All checks happen before anything is modified, so the entries change together
+// in one journal transaction or not at all. Only a replaced file too large to free in
+// that transaction is emptied first, in transactions of its own (see release_last_link()).
+static int do_rename(const char *from, const char *to, unsigned int flags) {
+    printf("[DEBUG] storage_rename: from=%s, to=%s, flags=%#x\n", from, to, flags);
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) return -EINVAL;
+    if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) return -EINVAL;
+
+    int src_inum = tree_lookup(from);
+    if (src_inum < 0) return src_inum;
+
+    char from_name[NAME_MAX + 1], to_name[NAME_MAX + 1];
+    int from_parent = lookup_parent(from, from_name);
+    if (from_parent < 0) return from_parent;
+    int to_parent = lookup_parent(to, to_name);
+    if (to_parent < 0) return to_parent;
+
+    int dst_inum = tree_lookup(to);
+    if (dst_inum < 0 && dst_inum != -ENOENT) return dst_inum;
+    if ((flags & RENAME_NOREPLACE) && dst_inum >= 0) return -EEXIST;
+    if ((flags & RENAME_EXCHANGE) && dst_inum < 0) return -ENOENT;
+    if (src_inum == dst_inum) return 0; // Both names already refer to the same file
+
+    inode_t *src = get_inode(src_inum);
+    inode_t *dst = dst_inum >= 0 ? get_inode(dst_inum) : NULL;
+
+    // A directory can't be moved underneath itself
+    if (S_ISDIR(src->mode) && path_within(to, from)) return -EINVAL;
+    if (dst && S_ISDIR(dst->mode) && (flags & RENAME_EXCHANGE) && path_within(from, to)) return -EINVAL;
+
+    directory_t *from_dir = inode_dir(get_inode(from_parent));
+    directory_t *to_dir = inode_dir(get_inode(to_parent));
+    directory_t *dst_dir = dst && S_ISDIR(dst->mode) ? inode_dir(dst) : NULL;
+    if (!from_dir || !to_dir || (dst && S_ISDIR(dst->mode) && !dst_dir)) return -EIO;
+
+    if (flags & RENAME_EXCHANGE) {
+        // Each entry is removed before the other takes its place, so neither directory grows
+        dir_delete(from_parent, from_name);
+        dir_delete(to_parent, to_name);
+        directory_put(from_dir, from_name, dst_inum);
+        directory_put(to_dir, to_name, src_inum);
+        touch_renamed(from_parent, to_parent, src, dst);
+        printf("[INFO] Exchanged %s and %s\n", from, to);
+        return 0;
+    }
+
+    if (dst) {
+        if (S_ISDIR(src->mode) && !S_ISDIR(dst->mode)) return -ENOTDIR;
+        if (!S_ISDIR(src->mode) && S_ISDIR(dst->mode)) return -EISDIR;
+        if (dst_dir && dst_dir->entry_count > 0) return -ENOTEMPTY;
+    } else if (to_dir != from_dir && !directory_fits(to_dir, to_name)) {
+        return -ENOSPC;
+    }
+
+    if (dst) {
+        int rv = release_last_link(dst_inum);
+        if (rv < 0) return rv;
+        dir_delete(to_parent, to_name);
+        if (inode_unlink(dst_inum) == 0) dst = NULL;
+    }
+    dir_delete(from_parent, from_name);
+    if (directory_put(inode_dir_update(get_inode(to_parent)), to_name, src_inum) < 0) {
+        // Only a longer name in the same, full directory: its old entry fits back where it was
+        directory_put(from_dir, from_name, src_inum);
+        return -ENOSPC;
+    }
+    touch_renamed(from_parent, to_parent, src, dst);
+
+    printf("[INFO] Renamed %s to %s\n", from, to);
+    return 0;
+}
+
+// Run one operation of a batch
+static int do_batch_op(storage_batch_op_t *op) {
+    switch (op->kind) {
+    case STORAGE_BATCH_CREATE: {
+        int rv = do_mknod(op->path, (op->mode & S_IFMT) ? op->mode : op->mode | S_IFREG);
+        if (rv < 0 || op->size == 0) return rv;
+        rv = do_write(op->path, op->data, op->size, 0);
+        return rv < 0 ? rv : (rv == (int)op->size ? 0 : -ENOSPC);
+    }
+    case STORAGE_BATCH_MKDIR:
+        return do_mkdir(op->path, op->mode);
+    case STORAGE_BATCH_WRITE:
+        return do_write(op->path, op->data, op->size, op->offset);
+    case STORAGE_BATCH_STAT:
+        return do_stat(op->path, &op->st);
+    }
+    return -EINVAL;
+}
+
+// Run a vector of operations one after another, deferring their data flushes
+// to the shared journal commit. A batch larger than the running transaction is
+// committed between operations, each of which stays whole. Returns the number
+// that succeeded.
+static int do_batch(storage_batch_op_t *ops, int count) {
+    printf("[DEBUG] storage_batch: %d operations\n", count);
+
+    int succeeded = 0, jrv = 0;
+    deferring = 1;
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && journal_short(JOURNAL_OP_BLOCKS) && commit() < 0) jrv = -EIO;
+        ops[i].result = do_batch_op(&ops[i]);
+        if (ops[i].result >= 0) succeeded++;
+    }
+    deferring = 0;
+
+    printf("[INFO] Batch of %d operations: %d succeeded\n", count, succeeded);
+    return jrv < 0 ? jrv : succeeded;
+}
+
+// Public entry points: each operation runs under storage_lock, and each one that
+// modifies the file system commits its changes as one journal transaction.
+
+int storage_stat(const char *path, struct stat *st) {
+    if (stat_unlocked(path, st) == 0) return 0;
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_stat(path, st);
+    storage_end_read();
+    return rv;
+}
+
+int storage_statfs(struct statvfs *st) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_statfs(st);
+    storage_end_read();
+    return rv;
+}
+
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_read(path, buf, size, offset);
+    storage_end_read();
+    return rv;
+}
+
+int storage_list(const char *path, slist_t **list) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_list(path, list);
+    storage_end_read();
+    return rv;
+}
+
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_write(path, buf, size, offset));
+}
+
+int storage_truncate(const char *path, off_t size) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_truncate(path, size));
+}
+
+ssize_t storage_clone_range(const char *from, off_t from_offset, const char *to, off_t to_offset, size_t size) {
+    pthread_mutex_lock(&storage_lock);
+    ssize_t rv = do_clone_range(from, from_offset, to, to_offset, size);
+    int jrv = storage_end_op(0);
+    return jrv < 0 ? jrv : rv;
+}
+
+int storage_mknod(const char *path, int mode) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_mknod(path, mode));
+}
+
+int storage_unlink(const char *path) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_unlink(path));
+}
+
+int storage_link(const char *from, const char *to) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_link(from, to));
+}
+
+int storage_symlink(const char *target, const char *path) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_symlink(target, path));
+}
+
+int storage_readlink(const char *path, char *buf, size_t size) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_readlink(path, buf, size);
+    storage_end_read();
+    return rv;
+}
+
+int storage_data_version(const char *path, uint64_t *version) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_data_version(path, version);
+    storage_end_read();
+    return rv;
+}
+
+int storage_getxattr(const char *path, const char *name, char *value, size_t size) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_getxattr(path, name, value, size);
+    storage_end_read();
+    return rv;
+}
+
+int storage_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_setxattr(path, name, value, size, flags));
+}
+
+int storage_listxattr(const char *path, char *list, size_t size) {
+    pthread_mutex_lock(&storage_lock);
+    int rv = do_listxattr(path, list, size);
+    storage_end_read();
+    return rv;
+}
+
+int storage_removexattr(const char *path, const char *name) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_removexattr(path, name));
+}
+
+int storage_mkdir(const char *path, mode_t mode) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_mkdir(path, mode));
+}
+
+int storage_rmdir(const char *path) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_rmdir(path));
+}
+
+int storage_utimens(const char *path, const struct timespec ts[2]) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_utimens(path, ts));
+}
+
+int storage_rename(const char *from, const char *to, unsigned int flags) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_rename(from, to, flags));
+}
+
+int storage_batch(storage_batch_op_t *ops, int count) {
+    pthread_mutex_lock(&storage_lock);
+    return storage_end_op(do_batch(ops, count));
+}
+
+// Check one block of the disk image against its stored checksum.
+// Only allocated data blocks whose checksum describes their on-disk contents
+// are checked. storage_lock keeps allocation away from the bitmap and stale bits
+// (and a freed block from being reused while it is checked); the read and
+// comparison happen under io_lock so a concurrent flush can't make a healthy
+// block look corrupt.
+int storage_scrub_block(int block_num) {
+    superblock_t *sb = get_superblock();
+    if (block_num < (int)sb->data_start || block_num >= (int)sb->block_count) return 0;
+
+    char *buf = bufpool_get(); // Aligned, in case the image was opened with O_DIRECT
+    if (!buf) return -ENOMEM;
+    int rv = 0;
+
+    pthread_mutex_lock(&storage_lock);
+    pthread_mutex_lock(&io_lock);
+    if (fd_count > 0 && bitmap_get(get_blocks_bitmap(), block_num) && blocks_csum_tracked(block_num)) {
+        // Not counted as an access, so scrubbing doesn't make every extent look hot (see tier.h)
+        io_request_t req = {IO_READ, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE, 0};
+        ioengine_submit_routed(&req, 1, IO_ROUTE_UNTRACKED);
+        if (req.result != BLOCK_SIZE) {
+            perror("[ERROR] Failed to read block for scrubbing");
+            rv = -EIO;
+        } else {
+            rv = blocks_csum_verify(block_num, buf) < 0 ? -EIO : 1;
+        }
+    }
+    pthread_mutex_unlock(&io_lock);
+    pthread_mutex_unlock(&storage_lock);
+    bufpool_put(buf);
+    return rv;
+}
+
+// Trim one allocation group (see blocks_trim_group())
+long storage_trim_group(int group) {
+    pthread_mutex_lock(&storage_lock);
+    long rv = fd_count > 0 ? blocks_trim_group(group) : 0;
+    pthread_mutex_unlock(&storage_lock);
+    return rv;
+}
+
+// Move an extent between the tiers (see tier_move()). Holding both locks keeps every
+// operation, writeback and the scrubber away from the image while the extent moves.
+long storage_tier_move(long extent, int kind) {
+    pthread_mutex_lock(&storage_lock);
+    pthread_mutex_lock(&io_lock);
+    long rv = fd_count > 0 ? tier_move(extent, kind) : -ENODEV;
+    pthread_mutex_unlock(&io_lock);
+    pthread_mutex_unlock(&storage_lock);
+    return rv;
+}
+
+// Commit the running transaction (see storage_set_writeback())
+int storage_checkpoint() {
+    pthread_mutex_lock(&storage_lock);
+    int rv = fd_count > 0 ? commit() : 0;
+    pthread_mutex_unlock(&storage_lock);
+    return rv;
+}
+
+// Make one file durable, writing only what it needs (see storage_fsync() in storage.h)
+int storage_fsync(const char *path, int datasync) {
+    pthread_mutex_lock(&storage_lock);
+    int inum = tree_lookup(path);
+    if (inum < 0 || fd_count == 0) {
+        storage_end_read();
+        return inum < 0 ? inum : -EIO;
+    }
+    inode_t *node = get_inode(inum);
+    if (S_ISDIR(node->mode)) datasync = 0; // Its entries aren't part of its size or block map
+
+    int rv = syncs[inum].error;
+    syncs[inum].error = 0;
+    if (syncs[inum].deferred > 0 && write_deferred(inum) < 0) rv = -EIO;
+    int commits = 0;
+    if (inode_sync_pending(node, datasync)) {
+        if (!datasync) inode_times_flush(1);
+        if (commit() < 0) rv = -EIO;
+        commits = 1;
+    }
+    uint64_t flush = syncs[inum].flush;
+    storage_end_read();
+
+    pthread_mutex_lock(&sync_lock);
+    sync_stats.fsyncs++;
+    sync_stats.commits += commits;
+    pthread_mutex_unlock(&sync_lock);
+    if (wait_flush(flush) < 0) rv = -EIO;
+    return rv;
+}
+
+// Write back one file's deferred data as it is closed
+int storage_flush(const char *path) {
+    pthread_mutex_lock(&storage_lock);
+    int inum = tree_lookup(path);
+    if (inum < 0 || fd_count == 0) {
+        storage_end_read();
+        return inum < 0 ? inum : -EIO;
+    }
+    int rv = syncs[inum].error;
+    syncs[inum].error = 0;
+    if (syncs[inum].deferred > 0 && write_deferred(inum) < 0) rv = -EIO;
+    storage_end_read();
+    return rv;
+}
+
+void storage_get_sync_stats(storage_sync_stats_t *stats) {
+    pthread_mutex_lock(&sync_lock);
+    *stats = sync_stats;
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// Let operations leave their changes to a writeback thread, or commit each one again
+void storage_set_writeback(void (*kick)()) {
+    pthread_mutex_lock(&storage_lock);
+    writeback_kick = kick;
+    deferred_limit = cache_get_stats().frames / 4;
+    if (!kick && fd_count > 0) {
+        commit();
+    }
+    pthread_mutex_unlock(&storage_lock);
+}
+
+// Switch the disk image to another I/O engine (see ioengine.h), keeping its stripe set.
+// The block cache's frames are offered to the engine as its registered buffer.
+int storage_set_ioengine(const char *name) {
+    void *frames;
+    size_t frames_len;
+    cache_region(&frames, &frames_len);
+
+    pthread_mutex_lock(&storage_lock);
+    pthread_mutex_lock(&io_lock);
+    size_t unit;
+    ioengine_stripe(&unit);
+    int rv = ioengine_open_striped(name, fds, fd_count, unit, frames, frames_len);
+    pthread_mutex_unlock(&io_lock);
+    pthread_mutex_unlock(&storage_lock);
+    return rv;
 }
 
 // Shut down the storage system:
-// 1. Writes all in-memory data back to the disk image file using pwrite().
-// 2. Closes the disk image file descriptor.
+// 1. Commits any outstanding journal transaction, with every timestamp still held back by
+//    inode_touch(). Every change reaches the image through the journal, so that is all there
+//    is left to write.
+// 2. Detaches the fast tier, closes the disk image file descriptor(s) and frees the block cache.
 // This function is typically called from the FUSE 'destroy' callback when the file system is unmounted.
 void storage_shutdown() {
     printf("[DEBUG] storage_shutdown: Flushing data to disk\n");
 
-    if (fd >= 0) {
-        // Write all blocks back to disk so that changes are persistent.
-        if (pwrite(fd, blocks_get_block(0), BLOCK_COUNT * BLOCK_SIZE, 0) < 0) {
-            perror("[ERROR] Failed to write data to disk");
+    pthread_mutex_lock(&storage_lock);
+    if (fd_count > 0) {
+        inode_times_flush(1);
+        journal_commit();
+    }
+
+    pthread_mutex_lock(&io_lock);
+    if (fd_count > 0) {
+        tier_detach();
+        ioengine_close();
+        if (tier_fd >= 0) {
+            close(tier_fd);
+            tier_fd = -1;
+        }
+        while (fd_count > 0) {
+            close(fds[--fd_count]);
         }
-        close(fd);
-        fd = -1;
+
+        cache_stats_t cs = cache_get_stats();
+        long lookups = cs.hits + cs.misses;
+        printf("[INFO] Block cache: %ld hits, %ld misses (%.1f%% hit ratio), %ld evictions\n",
+               cs.hits, cs.misses, lookups ? 100.0 * cs.hits / lookups : 0.0, cs.evictions);
+        blocks_free();
+        cache_free();
         printf("[INFO] Storage successfully flushed and closed.\n");
     }
+    pthread_mutex_unlock(&io_lock);
+    pthread_mutex_unlock(&storage_lock);
 }
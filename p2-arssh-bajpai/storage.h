@@ -1,31 +1,90 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
 
 #include "slist.h"
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)  /**< renameat2() flag: fail if the target exists. */
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)   /**< renameat2() flag: atomically swap source and target. */
+#endif
+
+/**
+ * @brief Options for opening the disk image.
+ */
+typedef struct storage_options {
+    int direct;         /**< Open the image with O_DIRECT, so the host page cache doesn't cache it a second time. */
+    size_t cache_size;  /**< Memory budget of the block cache in bytes, or 0 for CACHE_SIZE (see cache.h). */
+    off_t image_size;   /**< Size of a newly formatted image in bytes, or 0 to use the file's size (at least BLOCK_COUNT blocks). */
+    const char *const *stripe_images; /**< Further files to stripe the image across, after the first (NULL-terminated), or NULL. */
+    size_t stripe_unit; /**< Bytes stored in one file before the next, for a new striped image; 0 for IOENGINE_STRIPE_UNIT. */
+    const char *tier_path; /**< File holding the image's fast tier (see tier.h), or NULL. */
+    off_t tier_size;    /**< Size of a new fast tier in bytes, or 0 to use the file's size (or TIER_SIZE if empty). */
+    int discard;        /**< When freed blocks are released from the image file: a discard_mode_t (see blocks_set_discard()), 0 for never. */
+} storage_options_t;
+
 /**
  * @brief Initializes the storage system using the specified disk image.
  *
  * This function sets up internal data structures and loads the file system metadata 
  * from the given disk image file. If the disk image does not exist, it may create one.
  *
- * @param path The path to the disk image file.
+ * Only the superblock, block bitmap, inode table and journal are kept in memory. Every other
+ * block is read on demand into a block cache of `cache_size` bytes, so the image can be far
+ * larger than the host's memory.
+ *
+ * With `direct` set, every transfer uses block-aligned buffers, offsets and lengths as O_DIRECT
+ * requires. If the file system holding the image does not support O_DIRECT, the image is opened
+ * normally instead.
+ *
+ * With `stripe_images`, the image is striped across `path` and those files, which should sit on
+ * different devices: consecutive `stripe_unit`-byte ranges go to the files in turn, and each file
+ * has its own I/O queue (see ioengine_open_striped()). The files must be given in the same order
+ * every time; the superblock (at the start of `path`) records how many there are and the stripe
+ * unit, which `stripe_unit` can only choose for a new image.
+ *
+ * With `tier_path`, extents of the image can also be kept in that (smaller, faster) file, as
+ * the migration thread decides (see tier_start()). The first time, the fast tier is created and
+ * its identifier recorded in the superblock; from then on the image can't be opened without it.
+ *
+ * @param path The path to the disk image file (the first file, if the image is striped).
+ * @param opts Options for the image, or NULL for the defaults.
  */
-void storage_init(const char *path);
+void storage_init(const char *path, const storage_options_t *opts);
 
 /**
  * @brief Retrieves file or directory metadata for the given path.
  *
+ * Usually answered without storage's lock: the path is resolved in the name cache (see
+ * dcache.h) and the inode read under its sequence count (see inode_snapshot()), so any number
+ * of threads can stat files at once, even while other operations run. A path that isn't cached
+ * yet, or an inode an operation is changing, takes the lock as every other operation does.
+ *
  * @param path The file or directory path within the file system.
  * @param st   A pointer to a stat structure where metadata will be stored.
  * @return 0 on success, or a negative value (e.g., -ENOENT) if the path does not exist.
  */
 int storage_stat(const char *path, struct stat *st);
 
+/**
+ * @brief Reports the size of the file system and how much of it is free, as statvfs() does.
+ *
+ * Takes constant time: the free counts are kept up to date as blocks and inodes are allocated
+ * and freed (see superblock_t). Builds with NUFS_DEBUG defined also recount the bitmaps and
+ * abort if the counts have drifted.
+ *
+ * @param st A pointer to a statvfs structure to fill in.
+ * @return 0 (always succeeds once storage_init() has run).
+ */
+int storage_statfs(struct statvfs *st);
+
 /**
  * @brief Reads data from a file at the given path.
  *
@@ -50,6 +109,36 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset);
  */
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 
+/**
+ * @brief Changes the size of the file at the given path.
+ *
+ * Shrinking releases the blocks past the new end; growing extends the file with a hole that
+ * reads as zeros.
+ *
+ * @param path The file path.
+ * @param size The new size of the file in bytes.
+ * @return 0 on success, or a negative error code on failure (e.g., -EISDIR for a directory).
+ */
+int storage_truncate(const char *path, off_t size);
+
+/**
+ * @brief Copies a range of one file into another by sharing data blocks (a reflink clone).
+ *
+ * Whole blocks are not copied: the destination references the source's blocks, and each block
+ * is copied privately only when either file later writes to it. Partial blocks at the ends of
+ * the range, and ranges whose offsets differ modulo BLOCK_SIZE, are copied byte by byte.
+ * The destination grows if the range extends past its end.
+ *
+ * @param from        The source file path.
+ * @param from_offset The offset in the source file to copy from.
+ * @param to          The destination file path.
+ * @param to_offset   The offset in the destination file to copy to.
+ * @param size        The number of bytes to copy; the range is clipped to the end of the source.
+ * @return The number of bytes copied, or a negative error code on failure (e.g., -EINVAL for
+ *         overlapping ranges within one file).
+ */
+ssize_t storage_clone_range(const char *from, off_t from_offset, const char *to, off_t to_offset, size_t size);
+
 /**
  * @brief Creates a new file at the specified path with the given mode.
  *
@@ -62,11 +151,117 @@ int storage_mknod(const char *path, int mode);
 /**
  * @brief Removes (unlinks) a file from the file system.
  *
+ * The file's data is freed once its last link (see storage_link()) is removed.
+ *
  * @param path The path of the file to remove.
  * @return 0 on success, or a negative error code on failure (e.g., -ENOENT if not found).
  */
 int storage_unlink(const char *path);
 
+/**
+ * @brief Creates a hard link: a new name for an existing file.
+ *
+ * Both names refer to the same inode, so no data is copied; the inode's link count is
+ * incremented and the data is only freed once every name has been unlinked.
+ *
+ * @param from The path of the existing file.
+ * @param to The path of the new name.
+ * @return 0 on success, or a negative error code on failure (e.g., -EPERM for a directory,
+ *         -EEXIST if `to` already exists).
+ */
+int storage_link(const char *from, const char *to);
+
+/**
+ * @brief Creates a symbolic link.
+ *
+ * Targets of up to INODE_INLINE_MAX bytes are stored in the inode itself and cost no data
+ * block; longer targets are stored in a data block.
+ *
+ * @param target The path the link points to (stored verbatim, not resolved).
+ * @param path The path of the new symlink.
+ * @return 0 on success, or a negative error code on failure (e.g., -EEXIST if `path` exists).
+ */
+int storage_symlink(const char *target, const char *path);
+
+/**
+ * @brief Reads the target of a symbolic link.
+ *
+ * @param path The path of the symlink.
+ * @param buf The buffer to receive the target, which is always NUL-terminated.
+ * @param size The size of `buf`; longer targets are truncated.
+ * @return 0 on success, or a negative error code on failure (e.g., -EINVAL if `path` is
+ *         not a symlink).
+ */
+int storage_readlink(const char *path, char *buf, size_t size);
+
+/**
+ * @brief Sets the access and modification times of a file, as utimensat() does.
+ *
+ * The status change time becomes the current time. Unlike the timestamp updates other
+ * operations make (see inode_touch()), the new times are committed with the operation.
+ *
+ * @param path The file path.
+ * @param ts The new access and modification times; a `tv_nsec` of UTIME_NOW means the current
+ *           time and UTIME_OMIT leaves that time alone. NULL sets both to the current time.
+ * @return 0 on success, -ENOENT if the path does not exist, or -EINVAL for an invalid time.
+ */
+int storage_utimens(const char *path, const struct timespec ts[2]);
+
+/**
+ * @brief Reports a value that changes whenever the contents of a file may have changed.
+ *
+ * See inode_version(): if the value is the same as when a copy of the file's data was made,
+ * the copy is still current, even if the path now names a different file.
+ *
+ * @param path The file path.
+ * @param version Set to the file's data version.
+ * @return 0 on success, or -ENOENT if the path does not exist.
+ */
+int storage_data_version(const char *path, uint64_t *version);
+
+/**
+ * @brief Reads the value of an extended attribute (see xattr_get()).
+ *
+ * @param path The file path.
+ * @param name The attribute name, with its namespace prefix (e.g. "user.origin").
+ * @param value The buffer to receive the value.
+ * @param size The size of `value`, or 0 to only ask for the value's length.
+ * @return The length of the value, or a negative error code (e.g., -ENODATA if the file has
+ *         no such attribute, -ERANGE if `size` is too small).
+ */
+int storage_getxattr(const char *path, const char *name, char *value, size_t size);
+
+/**
+ * @brief Creates or replaces an extended attribute (see xattr_set()).
+ *
+ * @param path The file path.
+ * @param name The attribute name, with its namespace prefix.
+ * @param value The value.
+ * @param size The length of `value`.
+ * @param flags 0, XATTR_CREATE or XATTR_REPLACE.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int storage_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+
+/**
+ * @brief Lists the names of a file's extended attributes, each NUL-terminated.
+ *
+ * @param path The file path.
+ * @param list The buffer to receive the names.
+ * @param size The size of `list`, or 0 to only ask for the length of the list.
+ * @return The length of the list, or a negative error code on failure.
+ */
+int storage_listxattr(const char *path, char *list, size_t size);
+
+/**
+ * @brief Removes an extended attribute.
+ *
+ * @param path The file path.
+ * @param name The attribute name, with its namespace prefix.
+ * @return 0 on success, or a negative error code (e.g., -ENODATA) on failure.
+ */
+int storage_removexattr(const char *path, const char *name);
+
 /**
  * @brief Creates a new directory at the specified path with the given mode.
  *
@@ -86,20 +281,212 @@ int storage_mkdir(const char *path, mode_t mode);
  */
 int storage_rmdir(const char *path);
 
+/**
+ * @brief Renames (moves) a file or directory.
+ *
+ * Only directory entries change; the inode and its data stay in place. Without flags an
+ * existing target is replaced, as with rename(2). All checks are made before anything is
+ * modified, and the change is committed as a single journal transaction, so after a crash
+ * either the old or the new names are present, never both or neither. A replaced file too
+ * large to free within that transaction is emptied first, in transactions of its own; a crash
+ * during that leaves it in place, shortened.
+ *
+ * @param from The current path.
+ * @param to The new path.
+ * @param flags 0, RENAME_NOREPLACE (fail with -EEXIST if `to` exists) or RENAME_EXCHANGE
+ *              (swap `from` and `to`, which must both exist).
+ * @return 0 on success, or a negative error code on failure (e.g., -EINVAL when moving a
+ *         directory into itself, -ENOTEMPTY when replacing a non-empty directory).
+ */
+int storage_rename(const char *from, const char *to, unsigned int flags);
+
+/**
+ * @brief The kinds of operation storage_batch() can run.
+ */
+typedef enum storage_batch_kind {
+    STORAGE_BATCH_CREATE,  /**< Create a file (as storage_mknod()) and write `data` to it, if any. */
+    STORAGE_BATCH_MKDIR,   /**< Create a directory (as storage_mkdir()). */
+    STORAGE_BATCH_WRITE,   /**< Write `size` bytes of `data` at `offset` (as storage_write()). */
+    STORAGE_BATCH_STAT,    /**< Fill in `st` (as storage_stat()). */
+} storage_batch_kind_t;
+
+/**
+ * @brief One operation of a batch, with its result.
+ */
+typedef struct storage_batch_op {
+    storage_batch_kind_t kind;  /**< What to do. */
+    const char *path;           /**< The path to operate on. */
+    mode_t mode;                /**< Mode of a created file or directory (S_IFREG is implied for files). */
+    const char *data;           /**< Contents for CREATE and WRITE (may be NULL if `size` is 0). */
+    size_t size;                /**< Number of bytes in `data`. */
+    off_t offset;               /**< File offset for WRITE. */
+    struct stat st;             /**< Output of STAT. */
+    int result;                 /**< Output: as the single operation would return (bytes written for WRITE). */
+} storage_batch_op_t;
+
+/**
+ * @brief Runs a vector of metadata operations as one unit.
+ *
+ * All operations run under a single acquisition of the storage lock, in order, and their
+ * metadata changes are committed as one journal transaction. A batch that dirties more blocks
+ * than one transaction holds is committed between operations whenever the transaction runs
+ * short of room (see journal_short()), so after a crash each operation is present or absent as
+ * a whole. File data written by the batch is flushed together, as one set of I/O requests, just
+ * before each commit. A failing operation
+ * does not stop the ones after it; each records its own result.
+ *
+ * @param ops The operations; their `result` (and, for STAT, `st`) fields are filled in.
+ * @param count The number of operations.
+ * @return The number of operations that succeeded, or a negative error code if the batch could
+ *         not be committed.
+ */
+int storage_batch(storage_batch_op_t *ops, int count);
+
 /**
  * @brief Retrieves a list of entries (files and subdirectories) within a directory.
  *
+ * The list is built in the calling thread's arena (see arena_thread()), so listing a directory
+ * does not call malloc() once the arena has grown to size. The caller takes a mark before the
+ * call and releases the arena to it once done with the list; it must not call s_free().
+ *
  * @param path The directory path.
- * @return A linked list of directory entries (slist_t). Returns NULL if the directory does not exist.
- *         Caller is responsible for freeing this list.
+ * @param list Set to a linked list of the directory's entries (slist_t), or to NULL if it has none.
+ * @return 0 on success, or a negative error code on failure (e.g., -ENOENT if the directory
+ *         does not exist, -ENOTDIR if `path` is not a directory).
+ */
+int storage_list(const char *path, slist_t **list);
+
+/**
+ * @brief Verifies one block of the disk image against its stored checksum.
+ *
+ * Reads the block straight from the image (bypassing the in-memory copy) and compares it with
+ * the checksum table. Unallocated blocks, metadata blocks, and blocks that have not been
+ * written since they were allocated are skipped. Used by the background scrubber.
+ *
+ * @param block_num The block number to verify.
+ * @return 1 if the block was checked and matches, 0 if it was skipped, or -EIO on a
+ *         mismatch or read error.
+ */
+int storage_scrub_block(int block_num);
+
+/**
+ * @brief Releases the free blocks of one allocation group from the image file.
+ *
+ * Runs blocks_trim_group() under storage's lock, so the group's free blocks stay free while
+ * their holes are punched. Used by the trim thread (see trim.h).
+ *
+ * @param group The group's number (see blocks_group_count()).
+ * @return The number of blocks released, or 0 if there was nothing to do or the image is closed.
+ */
+long storage_trim_group(int group);
+
+/**
+ * @brief Moves one extent of the image between the fast tier and the capacity tier.
+ *
+ * Runs tier_move() with every file system operation and all other I/O to the image held off,
+ * so the extent can't change while it is copied. Used by the tier migration thread.
+ *
+ * @param extent The extent's number (see tier.h).
+ * @param kind What to do (a tier_move_kind_t).
+ * @return As tier_move(), or -ENODEV once the image is closed.
+ */
+long storage_tier_move(long extent, int kind);
+
+/**
+ * @brief Commits the running journal transaction, writing deferred file data first.
+ *
+ * Called periodically by the writeback thread (see flusher.h). Does nothing if nothing changed
+ * since the last commit.
+ *
+ * @return 0 on success, or -EIO if the image could not be written.
+ */
+int storage_checkpoint();
+
+/**
+ * @brief Makes one file's data, and unless `datasync` its metadata, durable (fsync()).
+ *
+ * Only what the file needs is written: its own deferred data (see storage_set_writeback()),
+ * then, if the running transaction holds a change to the file, the journal is committed (the
+ * transaction is shared, so every change in it commits too). With `datasync`, a commit is
+ * needed only if the file's size or block map changed, so overwriting a file in place and
+ * calling fdatasync() costs its data writes and one device flush. Timestamps held back by
+ * inode_touch() are committed unless `datasync`. A directory is always synced in full.
+ *
+ * The device flush happens without storage's lock held. Concurrent callers share flushes: one
+ * that arrives while a flush runs waits for it and then for one more, which every caller
+ * waiting by then shares, and a commit that syncs the image satisfies them as well.
+ *
+ * @param path The file or directory.
+ * @param datasync Nonzero for fdatasync().
+ * @return 0 on success, -ENOENT if the path does not exist, or -EIO if the file's data or the
+ *         journal could not be written, now or (reported once) when the file's deferred data
+ *         was last written back on its behalf.
+ */
+int storage_fsync(const char *path, int datasync);
+
+/**
+ * @brief Writes back one file's deferred data, as close() does, without waiting for the device.
+ *
+ * Lets a write error surface at close(), and releases the file's pinned blocks before the next
+ * commit would.
+ *
+ * @param path The file.
+ * @return 0 on success, -ENOENT if the path does not exist, or -EIO as storage_fsync() reports it.
+ */
+int storage_flush(const char *path);
+
+/**
+ * @brief Counters describing storage_fsync()'s work.
+ */
+typedef struct storage_sync_stats {
+    long fsyncs;    /**< Calls to storage_fsync(). */
+    long commits;   /**< Calls that had to commit the journal. */
+    long flushes;   /**< Device flushes they ran (concurrent calls share one). */
+} storage_sync_stats_t;
+
+/**
+ * @brief Retrieves a snapshot of storage_fsync()'s counters.
+ *
+ * @param stats A pointer to the structure to fill in.
+ */
+void storage_get_sync_stats(storage_sync_stats_t *stats);
+
+/**
+ * @brief Hands commits over to a writeback thread, or takes them back.
+ *
+ * By default every operation that changes the file system commits its own journal transaction
+ * (two syncs) before returning. With a writeback thread, operations instead add their changes
+ * to one running transaction and defer their data writes, and the thread commits them with
+ * storage_checkpoint(). An operation that finds the transaction or the deferred data growing
+ * large calls `kick` to ask for an early commit; if the deferred data reaches a quarter of the
+ * block cache, the operation writes it out itself. An operation that leaves the transaction
+ * without room for the next one (see journal_short()), or with too few blocks allocatable
+ * until it commits (see blocks_allocatable()), commits it itself before returning. Crash
+ * consistency is unchanged: a crash loses the operations since the last commit, never the image.
+ *
+ * @param kick A function that wakes the writeback thread (called with storage's lock held, so
+ *             it must not block), or NULL to commit every operation again (the running
+ *             transaction is committed first).
+ */
+void storage_set_writeback(void (*kick)());
+
+/**
+ * @brief Selects the I/O engine used for the disk image (see ioengine_open()).
+ *
+ * storage_init() starts with the pread engine. The block cache's frames are registered with the
+ * io_uring engine as a fixed buffer, so this should be called after the process has daemonized.
+ *
+ * @param name IOENGINE_PREAD or IOENGINE_URING.
+ * @return 0 on success, or -EINVAL for an unknown engine name.
  */
-slist_t *storage_list(const char *path);
+int storage_set_ioengine(const char *name);
 
 /**
  * @brief Flushes data to the disk image and shuts down the storage system.
  *
- * This function ensures that all pending changes are written to the disk image, and 
- * closes any open file descriptors. It should be called during unmount or program exit.
+ * This function commits the running journal transaction, which is all that is not yet in the
+ * image, and closes any open file descriptors. It should be called during unmount or program
+ * exit, after the writeback thread has stopped.
  */
 void storage_shutdown();
 
@@ -2,11 +2,15 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 63;
 use IO::Handle;
+use Errno qw(ENOENT);
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts, $stripe) = @_;
+    $opts //= "";
+    $stripe //= "";
+    system("(make mount MOUNT_OPTS='$opts' STRIPE_IMAGES='$stripe' 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -131,6 +135,27 @@ system("mv mnt/tmp/file.txt mnt/foo");
 ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
+write_text("foo/other.txt", "replaced");
+system("mv mnt/foo/file.txt mnt/foo/other.txt");
+ok(!-e "mnt/foo/file.txt" && read_text("foo/other.txt") eq $msg4, "Rename over an existing file");
+ok(link("mnt/foo/other.txt", "mnt/foo/hard.txt") && (stat("mnt/foo/hard.txt"))[3] == 2, "Create a hard link");
+ok(symlink("other.txt", "mnt/foo/sym.txt") && readlink("mnt/foo/sym.txt") eq "other.txt"
+   && read_text("foo/sym.txt") eq $msg4, "Create and follow a symlink");
+system("setfattr -n user.origin -v imported mnt/foo/other.txt");
+my $origin = `getfattr --only-values -n user.origin mnt/foo/hard.txt 2>/dev/null`;
+ok($origin eq "imported", "Set an extended attribute and read it through a hard link");
+
+my $hashed = "0123456789abcdef" x 15;
+write_text("foo/$hashed.dat", $msg4);
+ok(read_text("foo/$hashed.dat") eq $msg4 && !-e "mnt/foo/" . substr($hashed, 0, 27),
+   "Create a file with a 240-character name");
+mkdir("mnt/many");
+write_text("many/entry$_", $_) for 1..100;
+my @many = glob("mnt/many/entry*");
+ok(@many == 100 && read_text("many/entry77") eq "77", "Hold 100 entries in one directory");
+my ($listed_ino) = `ls -i mnt/foo` =~ /^\s*(\d+) other\.txt$/m;
+ok(defined $listed_ino && $listed_ino == (stat "mnt/foo/other.txt")[1],
+   "Listing a subdirectory reports its entries' own inode numbers");
 
 unmount();
 
@@ -171,5 +196,201 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# -> copy (shares blocks with the original)";
+system("cp mnt/larger.txt mnt/copy.txt");
+$back = read_text("copy.txt");
+ok($content eq $back, "Read back data from copied file correctly");
 
+say "# -> remount with a block cache smaller than the file";
+my $big = "0123456789abcdef" x (64 * 1024); # 1 MiB, 256 blocks
+write_text("big.txt", $big);
+unmount();
+mount("-o cache_size=256K");
+$back = read_text("big.txt");
+ok($big eq $back, "Read back data through a 64-block cache");
+
+unmount();
+
+say "#           == Striped Image ==";
+system("rm -f data.nufs data1.nufs data2.nufs");
+mount("-o image_size=8M,stripe_unit=16K", "data1.nufs data2.nufs");
+write_text("big.txt", $big);
+unmount();
+# Each file holds about a third of big.txt; the rest of them is sparse
+ok((stat "data1.nufs")[12] * 512 >= 256 * 1024 && (stat "data2.nufs")[12] * 512 >= 256 * 1024,
+   "Data striped across three files");
+mount("", "data1.nufs data2.nufs");
+$back = read_text("big.txt");
+ok($big eq $back, "Read back data from the striped image");
+unmount();
+mount();
+ok(!-e "mnt/big.txt", "Striped image refused without all of its files");
+unmount();
+system("rm -f data1.nufs data2.nufs");
+
+say "#           == Fast Tier ==";
+system("rm -f data.nufs fast.nufs");
+mount("-o tier=fast.nufs,tier_size=4M");
+sleep 2; # Free extents ahead of the allocator move to the fast tier, so new blocks land there
+write_text("big.txt", $big);
+unmount();
+ok((stat "fast.nufs")[12] * 512 >= 512 * 1024, "New writes landed on the fast tier");
+mount("-o tier=fast.nufs");
+$back = read_text("big.txt");
+ok($big eq $back, "Read back data from the tiered image");
+unmount();
+mount();
+ok(!-e "mnt/big.txt", "Tiered image refused without its fast tier");
+unmount();
+system("rm -f fast.nufs");
+
+say "#           == Trace and Replay ==";
+system("rm -f data.nufs ops.trace; make trace_replay >> test.log 2>&1");
+mount();
+unmount();
+system("cp data.nufs replay.nufs");
+mount("-o trace=ops.trace");
+write_text("traced.txt", $msg0);
+mkdir("mnt/dir");
+rename("mnt/traced.txt", "mnt/dir/traced.txt");
+unmount();
+my $dump = `./trace_replay -d ops.trace`;
+ok($dump =~ m{write +/traced.txt size=\d+ offset=0} && $dump =~ m{rename +/traced.txt /dir/traced.txt},
+   "Trace recorded the writes and renames");
+my $replay = `./trace_replay ops.trace replay.nufs`;
+ok($replay =~ /^write +1 /m && $replay =~ /^Replayed \d+ operations/m, "Replayed the trace on a copy of the image");
+ok($replay !~ /^\S+ +\d+ .* [1-9]\d*$/m, "Replay gave the recorded results");
+system("rm -f ops.trace replay.nufs");
+
+say "#           == Timestamps ==";
+system("rm -f data.nufs");
+mount();
+my $before = time;
+write_text("stamped.txt", $msg0);
+my $mtime = (stat "mnt/stamped.txt")[9];
+ok($mtime >= $before - 1 && $mtime <= time + 1, "New file has the current modification time");
+utime(1000000000, 1234567890, "mnt/stamped.txt");
+unmount();
+mount();
+ok((stat "mnt/stamped.txt")[9] == 1234567890 && (stat "mnt/stamped.txt")[8] == 1000000000,
+   "Times set with utime survive a remount");
+unmount();
+
+say "#           == Fsync ==";
+system("rm -f data.nufs sync.trace");
+mount("-o trace=sync.trace");
+open my $sfh, ">", "mnt/synced.txt";
+$sfh->print($msg0);
+$sfh->flush;
+ok($sfh->sync, "fsync of a file succeeds");
+close $sfh;
+unmount();
+$dump = `./trace_replay -d sync.trace`;
+ok($dump =~ m{fsync +/synced.txt .* -> 0 } && $dump =~ m{flush +/synced.txt .* -> 0 },
+   "fsync and close reached the file system");
+system("rm -f sync.trace");
+
+say "#           == Discard ==";
+system("rm -f data.nufs");
+mount("-o discard=free,image_size=16M");
+write_text("big.txt", "x" x (4 << 20));
+unmount();
+my $full = (stat "data.nufs")[12];
+mount("-o discard=free");
+unlink("mnt/big.txt");
+unmount();
+my $emptied = (stat "data.nufs")[12];
+say "# image used $full blocks, then $emptied";
+ok($full - $emptied >= (3 << 20) / 512, "Deleting a file with discard=free shrinks the image");
+
+say "#           == Fsck ==";
+system("rm -f data.nufs; make fsck.nufs >> test.log 2>&1");
+mount();
+write_text("checked.txt", $long0);
+my $inum = (stat "mnt/checked.txt")[1];
+unmount();
+my $report = `./fsck.nufs data.nufs`;
+ok($? >> 8 == 0 && $report =~ /: 0 errors found/, "fsck finds a freshly written image clean");
+system("./fsck.nufs -y data.nufs >> test.log"); # Replays the journal into the image
+# Damage the block count in the file's inode record (32 bytes each; the count is the last field)
+open my $img, "+<:raw", "data.nufs";
+my $sb;
+sysread $img, $sb, 24;
+my $inode_start = unpack("V", substr($sb, 20, 4));
+sysseek $img, $inode_start * 4096 + $inum * 32 + 28, 0;
+syswrite $img, pack("V", 99);
+close $img;
+$report = `./fsck.nufs data.nufs`;
+ok($? >> 8 == 4 && $report =~ /: 1 errors found, 0 fixed/, "fsck reports a damaged block count");
+$report = `./fsck.nufs -y data.nufs`;
+ok($? >> 8 == 1 && $report =~ /: 1 errors found, 1 fixed/, "fsck -y repairs it");
+$report = `./fsck.nufs data.nufs`;
+ok($? >> 8 == 0 && $report =~ /: 0 errors found/, "The repaired image is clean");
+
+say "#           == Batch ==";
+system("rm -f data.nufs");
+mount();
+# One item of NUFS_IOC_BATCH (struct nufs_batch_item, then the path and data, padded to 8 bytes)
+sub batch_item {
+    my ($op, $path, $data, $offset) = @_;
+    $data //= "";
+    my $item = pack("vvVVl<Q<Q<VV", $op, length($path) + 1, length($data), $op == 2 ? 0755 : 0644, 0,
+                    $offset // 0, 0, 0, 0) . "$path\0$data";
+    return $item . "\0" x (-length($item) % 8);
+}
+my @items = (batch_item(2, "/batch"), batch_item(1, "/batch/one.txt", $msg0),
+             batch_item(3, "/batch/one.txt", "!", length $msg0), batch_item(1, "/missing/two.txt", $msg2),
+             batch_item(4, "/batch/one.txt"));
+my $batch = pack("VV", scalar @items, 0) . join("", @items);
+$batch .= "\0" x (8 + 16128 - length $batch);
+my $NUFS_IOC_BATCH = (3 << 30) | (length($batch) << 16) | (ord("N") << 8) | 3;
+open my $ctl, "<", "mnt/.nufs";
+my $batched = ioctl($ctl, $NUFS_IOC_BATCH, $batch);
+close $ctl;
+my ($count, $done) = unpack("VV", $batch);
+my @results;
+my $pos = 8;
+for (1..$count) {
+    my ($op, $path_len, $data_len, $mode, $result, $offset, $st_size, $st_mode) = unpack("vvVVl<Q<Q<V", substr($batch, $pos, 40));
+    push @results, [$result, $st_size, $st_mode];
+    $pos += 40 + (($path_len + $data_len + 7) & ~7);
+}
+ok($batched && $done == 4, "Batch ran; four of its five items succeeded");
+ok($results[0][0] == 0 && $results[1][0] == 0 && $results[2][0] == 1 && $results[3][0] == -ENOENT
+   && $results[4][0] == 0 && $results[4][1] == length($msg0) + 1 && ($results[4][2] & 0170000) == 0100000,
+   "Each batch item reports its own result");
+unmount();
+mount();
+ok(-d "mnt/batch" && read_text("batch/one.txt") eq "$msg0!" && !-e "mnt/missing",
+   "Batched files survive a remount");
+unmount();
+
+say "#           == Stat after namespace changes ==";
+system("rm -f data.nufs");
+mount();
+write_text("gone.txt", $msg0);
+(stat "mnt/gone.txt") or die "gone.txt was not created";
+unlink("mnt/gone.txt");
+ok(!stat("mnt/gone.txt") && $!{ENOENT}, "stat after unlink fails with ENOENT");
+write_text("target.txt", $msg0);
+write_text("source.txt", $long0);
+my $old_size = -s "mnt/target.txt";
+rename("mnt/source.txt", "mnt/target.txt");
+ok($old_size == length($msg0) + 1 && -s "mnt/target.txt" == length($long0) + 1,
+   "stat after rename over a file shows the new file's size");
+mkdir("mnt/reborn");
+write_text("reborn/child.txt", $msg0);
+(stat "mnt/reborn/child.txt") or die "child.txt was not created";
+unlink("mnt/reborn/child.txt");
+rmdir("mnt/reborn");
+mkdir("mnt/reborn");
+my @reborn;
+if (opendir(my $dh, "mnt/reborn")) {
+    @reborn = grep { $_ ne "." && $_ ne ".." } readdir($dh);
+    closedir($dh);
+} else {
+    @reborn = ("(cannot list: $!)");
+}
+ok(-d "mnt/reborn" && !stat("mnt/reborn/child.txt") && !@reborn,
+   "A recreated directory has no stale children");
+unmount();
@@ -0,0 +1,452 @@
+#include "tier.h"
+#include "blocks.h"
+#include "storage.h"
+#include "ioengine.h"
+#include "bufpool.h"
+#include "worker.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#define TIER_MAGIC "NUFT"
+#define TIER_VERSION 1
+#define EXTENT_BYTES ((size_t)TIER_EXTENT_BLOCKS * BLOCK_SIZE)
+#define TIER_CANDIDATES 64 // Most extents considered for promotion in one round
+
+// Block 0 of the fast tier's file. The slot table starts at block table_start: one
+// int32_t per slot, holding the number of the extent in it plus one (0: the slot is free).
+// Slot s takes blocks data_start + s * extent_blocks onwards.
+typedef struct tier_header {
+    char magic[4];          // TIER_MAGIC
+    uint32_t version;       // TIER_VERSION
+    uint32_t tier_id;       // Matches the superblock of the image it belongs to
+    uint32_t extent_blocks; // TIER_EXTENT_BLOCKS
+    uint32_t slots;
+    uint32_t table_start;
+    uint32_t data_start;
+} tier_header_t;
+
+// The attached fast tier (tier_fd >= 0). slot_of and heat are shared with the I/O engine
+// (see ioengine_tier_t); slot_of and table only change in tier_move().
+static int tier_fd = -1;
+static tier_header_t header;
+static long extent_count;  // Extents in the image
+static long first_extent;  // First extent entirely within the data area
+static int32_t *slot_of;   // Per extent: its slot, or -1
+static uint8_t *heat;      // Per extent: accesses counted by the I/O engine
+static int32_t *table;     // The slot table, as on disk
+static size_t table_len;   // Bytes of whole blocks the table takes
+static long free_slots;
+static long free_cursor;   // Where the search for a free slot starts
+static char *copy_buf;     // One extent, aligned for O_DIRECT
+
+static worker_t mover = WORKER_INIT; // Its lock also guards 'stats'
+static long tier_rate = TIER_RATE;
+static tier_stats_t stats;
+
+// Free everything tier_attach() allocated
+static void tier_free() {
+    free(slot_of);
+    free(heat);
+    bufpool_free_region(table, table_len);
+    bufpool_free_region(copy_buf, EXTENT_BYTES);
+    slot_of = NULL;
+    heat = NULL;
+    table = NULL;
+    copy_buf = NULL;
+    tier_fd = -1;
+}
+
+// Byte offset of slot 's' in the fast tier's file
+static off_t slot_offset(long s) {
+    return ((off_t)header.data_start + (off_t)s * TIER_EXTENT_BLOCKS) * BLOCK_SIZE;
+}
+
+// Read or write 'len' bytes at 'offset' in the fast tier's file, following a write with a sync
+static int fast_io(io_op_t op, void *buf, size_t len, off_t offset) {
+    io_request_t reqs[2] = {{op, buf, len, offset, 0}, {IO_SYNC, NULL, 0, 0, 0}};
+    int rv = ioengine_submit_routed(reqs, op == IO_WRITE ? 2 : 1, IO_ROUTE_FAST);
+    if (rv == 0 && (size_t)reqs[0].result != len) rv = -EIO;
+    return rv;
+}
+
+// Write the table block holding slot 's', making the slot's new owner durable
+static int write_table_entry(long s) {
+    size_t b = s * sizeof(int32_t) / BLOCK_SIZE;
+    return fast_io(IO_WRITE, (char *)table + b * BLOCK_SIZE, BLOCK_SIZE,
+                   (off_t)(header.table_start + b) * BLOCK_SIZE);
+}
+
+// A free slot, or -1
+static long find_free_slot() {
+    if (free_slots == 0) return -1;
+    for (long i = 0; i < (long)header.slots; i++) {
+        long s = (free_cursor + i) % header.slots;
+        if (table[s] == 0) {
+            free_cursor = s + 1;
+            return s;
+        }
+    }
+    return -1;
+}
+
+// Point extent 'e' at slot 's' (or at the capacity tier, with -1), recording it in the table first
+static int set_slot(long e, long s) {
+    long entry = s >= 0 ? s : slot_of[e];
+    int32_t old = table[entry];
+    table[entry] = s >= 0 ? e + 1 : 0;
+    int rv = write_table_entry(entry);
+    if (rv < 0) {
+        table[entry] = old;
+        return rv;
+    }
+    free_slots += s >= 0 ? -1 : 1;
+    // The I/O engine reads the slot without a lock; the copy is durable before it sees it
+    __atomic_store_n(&slot_of[e], (int32_t)s, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Copy extent 'e' from one tier to the other, ending with a sync of the tier written
+static int copy_extent(long e, io_route_t from, off_t from_offset, io_route_t to, off_t to_offset) {
+    io_request_t read = {IO_READ, copy_buf, EXTENT_BYTES, from_offset, 0};
+    int rv = ioengine_submit_routed(&read, 1, from);
+    if (rv == 0 && read.result != (ssize_t)EXTENT_BYTES) rv = -EIO;
+    if (rv == 0) {
+        io_request_t write[2] = {{IO_WRITE, copy_buf, EXTENT_BYTES, to_offset, 0}, {IO_SYNC, NULL, 0, 0, 0}};
+        rv = ioengine_submit_routed(write, 2, to);
+    }
+    if (rv < 0) {
+        printf("[ERROR] Failed to move extent %ld between tiers: %s\n", e, strerror(-rv));
+    }
+    return rv;
+}
+
+// Move one extent between the tiers; the caller holds off all other I/O to the image
+long tier_move(long e, tier_move_kind_t kind) {
+    if (tier_fd < 0) return -ENODEV;
+    if (e < first_extent || e >= extent_count) return -EINVAL;
+
+    off_t home = (off_t)e * EXTENT_BYTES;
+    int empty = blocks_range_free(e * TIER_EXTENT_BLOCKS, TIER_EXTENT_BLOCKS);
+    long copied = 0;
+    int rv;
+    if (kind == TIER_DEMOTE) {
+        if (slot_of[e] < 0) return -EBUSY;
+        if (!empty) {
+            rv = copy_extent(e, IO_ROUTE_FAST, slot_offset(slot_of[e]), IO_ROUTE_CAPACITY, home);
+            if (rv < 0) return rv;
+            copied = EXTENT_BYTES;
+        }
+        rv = set_slot(e, -1);
+    } else {
+        if (slot_of[e] >= 0 || (kind == TIER_LAND && !empty)) return -EBUSY;
+        long s = find_free_slot();
+        if (s < 0) return -ENOSPC;
+        if (kind == TIER_PROMOTE) {
+            rv = copy_extent(e, IO_ROUTE_CAPACITY, home, IO_ROUTE_FAST, slot_offset(s));
+            if (rv < 0) return rv;
+            copied = EXTENT_BYTES;
+        }
+        rv = set_slot(e, s);
+    }
+    if (rv < 0) return rv;
+
+    pthread_mutex_lock(&mover.lock);
+    if (kind == TIER_PROMOTE) stats.promotions++;
+    if (kind == TIER_DEMOTE) stats.demotions++;
+    if (kind == TIER_LAND) stats.landings++;
+    stats.migrated += copied;
+    stats.resident = header.slots - free_slots;
+    pthread_mutex_unlock(&mover.lock);
+    return copied;
+}
+
+// Lay out a new fast tier in a file of 'file_blocks' blocks, or return 0 if it is too small
+static long format_slots(long file_blocks) {
+    long useful = extent_count - first_extent;
+    long slots = (file_blocks - 1) / TIER_EXTENT_BLOCKS;
+    if (slots > useful) slots = useful;
+    while (slots > 0) {
+        long table_blocks = (slots * (long)sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (1 + table_blocks + slots * TIER_EXTENT_BLOCKS <= file_blocks) break;
+        slots--;
+    }
+    return slots;
+}
+
+// Read the table of the tier described by 'header' into memory
+static int read_table() {
+    table_len = ((size_t)header.slots * sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    table = bufpool_alloc_region(table_len);
+    if (!table) return -ENOMEM;
+    return fast_io(IO_READ, table, table_len, (off_t)header.table_start * BLOCK_SIZE);
+}
+
+// Whether the header read from a file describes a fast tier at all
+static int header_valid(const tier_header_t *h, long file_blocks) {
+    return memcmp(h->magic, TIER_MAGIC, 4) == 0 && h->version == TIER_VERSION &&
+           h->extent_blocks == TIER_EXTENT_BLOCKS && h->slots > 0 && h->table_start == 1 &&
+           h->data_start > h->table_start &&
+           (long)h->data_start + (long)h->slots * TIER_EXTENT_BLOCKS <= file_blocks;
+}
+
+// Attach the fast tier in 'fd', formatting it first if *tier_id is 0
+int tier_attach(int fd, uint32_t *tier_id) {
+    superblock_t *sb = get_superblock();
+    extent_count = sb->block_count / TIER_EXTENT_BLOCKS;
+    first_extent = (sb->data_start + TIER_EXTENT_BLOCKS - 1) / TIER_EXTENT_BLOCKS;
+    long file_blocks = lseek(fd, 0, SEEK_END) / BLOCK_SIZE;
+
+    slot_of = malloc(extent_count * sizeof(int32_t));
+    heat = calloc(extent_count, 1);
+    copy_buf = bufpool_alloc_region(EXTENT_BYTES);
+    tier_header_t *h = bufpool_get();
+    if (!slot_of || !heat || !copy_buf || !h) {
+        if (h) bufpool_put(h);
+        tier_free();
+        return -ENOMEM;
+    }
+    memset(slot_of, 0xff, extent_count * sizeof(int32_t)); // Everything on the capacity tier
+
+    // From here on the fast tier's own blocks are read and written through the I/O engine
+    tier_fd = fd;
+    ioengine_tier_t fast = {fd, EXTENT_BYTES, 0, extent_count, slot_of, heat};
+    int rv = ioengine_set_tier(&fast);
+    memset(h, 0, BLOCK_SIZE);
+    if (rv == 0 && file_blocks > 0) rv = fast_io(IO_READ, h, BLOCK_SIZE, 0); // A new file has no header
+    if (rv < 0) goto fail;
+
+    int valid = header_valid(h, file_blocks);
+    if (*tier_id == 0) {
+        // Never format over a fast tier that still holds some image's extents
+        if (valid) {
+            header = *h;
+            if ((rv = read_table()) < 0) goto fail;
+            for (long s = 0; s < (long)header.slots; s++) {
+                if (table[s] != 0) {
+                    printf("[ERROR] The fast tier holds another image's data; not formatting it\n");
+                    rv = -EEXIST;
+                    goto fail;
+                }
+            }
+            bufpool_free_region(table, table_len);
+            table = NULL;
+        }
+        long slots = format_slots(file_blocks);
+        if (slots <= 0) {
+            printf("[ERROR] The fast tier must be larger than %zu bytes\n", EXTENT_BYTES + 2 * BLOCK_SIZE);
+            rv = -ENOSPC;
+            goto fail;
+        }
+        uint32_t id = 0;
+        while (id == 0) {
+            if (getrandom(&id, sizeof(id), 0) != sizeof(id)) id = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+        }
+        header = (tier_header_t){TIER_MAGIC, TIER_VERSION, id, TIER_EXTENT_BLOCKS, slots, 1, 0};
+        header.data_start = 1 + (slots * sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        // An empty table first, so a valid header always comes with a valid table
+        table_len = ((size_t)slots * sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        table = bufpool_alloc_region(table_len);
+        if (!table) {
+            rv = -ENOMEM;
+            goto fail;
+        }
+        memset(table, 0, table_len);
+        memset(h, 0, BLOCK_SIZE);
+        *h = header;
+        if ((rv = fast_io(IO_WRITE, table, table_len, (off_t)header.table_start * BLOCK_SIZE)) < 0 ||
+            (rv = fast_io(IO_WRITE, h, BLOCK_SIZE, 0)) < 0) {
+            goto fail;
+        }
+        *tier_id = id;
+        printf("[INFO] Formatted a fast tier of %u extents (%zu KiB each)\n", header.slots, EXTENT_BYTES >> 10);
+    } else {
+        if (!valid || h->tier_id != *tier_id) {
+            printf("[ERROR] The fast tier given does not belong to this image\n");
+            rv = -EINVAL;
+            goto fail;
+        }
+        header = *h;
+        if ((rv = read_table()) < 0) goto fail;
+        for (long s = 0; s < (long)header.slots; s++) {
+            long e = (long)table[s] - 1;
+            if (e < 0) continue;
+            if (e < first_extent || e >= extent_count || slot_of[e] >= 0) {
+                printf("[ERROR] Fast tier slot %ld holds an invalid extent (%ld)\n", s, e);
+                rv = -EIO;
+                goto fail;
+            }
+            slot_of[e] = s;
+        }
+    }
+    bufpool_put(h);
+    h = NULL;
+
+    // Now that the slots are known, the I/O engine can find the extents in them
+    fast.base = (off_t)header.data_start * BLOCK_SIZE;
+    if ((rv = ioengine_set_tier(&fast)) < 0) goto fail;
+
+    free_slots = 0;
+    for (long s = 0; s < (long)header.slots; s++) {
+        if (table[s] == 0) free_slots++;
+    }
+    free_cursor = 0;
+    pthread_mutex_lock(&mover.lock);
+    memset(&stats, 0, sizeof(stats));
+    stats.slots = header.slots;
+    stats.resident = header.slots - free_slots;
+    stats.extent_size = EXTENT_BYTES;
+    pthread_mutex_unlock(&mover.lock);
+    printf("[INFO] Fast tier attached: %ld of %u extents in use\n", header.slots - free_slots, header.slots);
+    return 0;
+
+fail:
+    if (h) bufpool_put(h);
+    ioengine_set_tier(NULL);
+    tier_free();
+    return rv;
+}
+
+// Detach the fast tier from the I/O engine and free its tables
+void tier_detach() {
+    if (tier_fd < 0) return;
+    ioengine_set_tier(NULL);
+    tier_free();
+}
+
+// Whether a fast tier is attached
+int tier_attached() {
+    return tier_fd >= 0;
+}
+
+// Fill 'out' with up to 'max' of the hottest extents on the capacity tier with at least
+// TIER_HOT accesses, hottest first. Returns how many were found.
+static int hottest_extents(long *out, int max) {
+    int n = 0;
+    if (max <= 0) return 0;
+    for (long e = first_extent; e < extent_count; e++) {
+        uint8_t h = heat[e];
+        if (h < TIER_HOT || slot_of[e] >= 0 || (n == max && h <= heat[out[n - 1]])) continue;
+        int i = n < max ? n++ : n - 1;
+        for (; i > 0 && heat[out[i - 1]] < h; i--) out[i] = out[i - 1];
+        out[i] = e;
+    }
+    return n;
+}
+
+// The coldest extent on the fast tier outside [keep_lo, keep_hi), or -1
+static long coldest_extent(long keep_lo, long keep_hi) {
+    long coldest = -1;
+    for (long s = 0; s < (long)header.slots; s++) {
+        long e = (long)table[s] - 1;
+        if (e < 0 || (e >= keep_lo && e < keep_hi)) continue;
+        if (coldest < 0 || heat[e] < heat[coldest]) coldest = e;
+    }
+    return coldest;
+}
+
+// Free a slot by demoting the coldest extent outside [keep_lo, keep_hi), if it is colder
+// than 'limit' (and the budget allows a copy). Returns 0 once a slot is free.
+static int make_room(long keep_lo, long keep_hi, int limit, long *credit) {
+    long cold = coldest_extent(keep_lo, keep_hi);
+    if (cold < 0 || heat[cold] >= limit) return -1;
+    if (*credit < (long)EXTENT_BYTES && !blocks_range_free(cold * TIER_EXTENT_BLOCKS, TIER_EXTENT_BLOCKS)) {
+        return -1; // Racy, but only decides whether to try now
+    }
+    long rv = storage_tier_move(cold, TIER_DEMOTE);
+    if (rv < 0) return -1;
+    *credit -= rv;
+    return 0;
+}
+
+// One round of migrations, copying no more than the budget in *credit allows
+static void tier_round(long round, long *credit) {
+    if (round % TIER_DECAY == 0) {
+        for (long e = 0; e < extent_count; e++) heat[e] >>= 1;
+    }
+
+    // Keep the first TIER_LANDING free extents the allocator will reach on the fast tier, so
+    // new blocks land there. The search is bounded; a full stretch of image just means waiting.
+    long keep_lo = blocks_alloc_cursor() / TIER_EXTENT_BLOCKS, keep_hi = keep_lo;
+    for (int found = 0; found < TIER_LANDING && keep_hi < extent_count &&
+                        keep_hi < keep_lo + TIER_LANDING * TIER_EXTENT_BLOCKS; keep_hi++) {
+        long e = keep_hi;
+        if (e < first_extent) continue;
+        if (slot_of[e] >= 0) {
+            found++;
+            continue;
+        }
+        if (!blocks_range_free(e * TIER_EXTENT_BLOCKS, TIER_EXTENT_BLOCKS)) continue;
+        if (free_slots == 0 && make_room(keep_lo, keep_hi, TIER_HOT, credit) < 0) break;
+        if (storage_tier_move(e, TIER_LAND) == 0) found++;
+    }
+
+    // Promote the hottest extents, while they are much hotter than what they would replace
+    long hot[TIER_CANDIDATES];
+    int want = *credit / (long)EXTENT_BYTES;
+    int n = hottest_extents(hot, want < TIER_CANDIDATES ? want : TIER_CANDIDATES);
+    for (int i = 0; i < n && *credit >= (long)EXTENT_BYTES; i++) {
+        if (free_slots == 0 && make_room(keep_lo, keep_hi, heat[hot[i]] / 2, credit) < 0) break;
+        if (*credit < (long)EXTENT_BYTES) break;
+        long rv = storage_tier_move(hot[i], TIER_PROMOTE);
+        if (rv < 0) break;
+        *credit -= rv;
+    }
+}
+
+// Migration thread: one round every TIER_INTERVAL seconds. Unused budget carries over
+// for one round, so a rate below one extent per round still moves extents now and then.
+static void *tier_main(void *arg) {
+    (void)arg;
+    long budget = tier_rate * TIER_INTERVAL;
+    long cap = 2 * (budget > (long)EXTENT_BYTES ? budget : (long)EXTENT_BYTES);
+    long credit = 0;
+    for (long round = 1;; round++) {
+        if (!worker_sleep(&mover, TIER_INTERVAL * 1000000000LL)) break;
+
+        credit = credit + budget < cap ? credit + budget : cap;
+        tier_round(round, &credit);
+    }
+    return NULL;
+}
+
+// Start the migration thread
+void tier_start(long rate) {
+    if (tier_fd < 0) return;
+    tier_rate = rate > 0 ? rate : TIER_RATE;
+    int err = worker_start(&mover, tier_main);
+    if (err < 0) {
+        fprintf(stderr, "[ERROR] Failed to start tier migration: %s\n", strerror(-err));
+        return;
+    }
+    printf("[INFO] Tier migration started at %ld bytes/s\n", tier_rate);
+}
+
+// Stop the migration thread and wait for it to finish
+void tier_stop() {
+    if (worker_stop(&mover)) {
+        printf("[INFO] Tier migration stopped: %ld promotions, %ld demotions, %ld landings, %ld bytes moved\n",
+               stats.promotions, stats.demotions, stats.landings, stats.migrated);
+    }
+}
+
+// Copy out the tier's counters, with the bytes the I/O engine moved on each tier
+void tier_get_stats(tier_stats_t *out) {
+    pthread_mutex_lock(&mover.lock);
+    *out = tier_fd >= 0 ? stats : (tier_stats_t){0};
+    pthread_mutex_unlock(&mover.lock);
+    if (out->slots == 0) return;
+
+    ioengine_tier_io_t io;
+    ioengine_tier_io(&io);
+    out->fast_read = io.fast_read;
+    out->fast_written = io.fast_written;
+    out->capacity_read = io.capacity_read;
+    out->capacity_written = io.capacity_written;
+}
@@ -0,0 +1,124 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+
+#define TIER_EXTENT_BLOCKS 64           /**< Blocks per extent, the unit moved between tiers (256 KiB). */
+#define TIER_SIZE (256L << 20)          /**< Default size of a new fast tier's file, in bytes. */
+#define TIER_RATE (16 * 1024 * 1024)    /**< Default migration bandwidth, in bytes per second. */
+#define TIER_INTERVAL 1                 /**< Seconds between migration rounds. */
+#define TIER_HOT 4                      /**< Accesses that make an extent on the capacity tier worth promoting. */
+#define TIER_DECAY 30                   /**< Rounds between halvings of every extent's heat. */
+#define TIER_LANDING 4                  /**< Free extents kept on the fast tier ahead of the block allocator. */
+
+/**
+ * @brief The ways tier_move() can move an extent.
+ */
+typedef enum tier_move_kind {
+    TIER_PROMOTE, /**< Copy the extent to a free slot on the fast tier. */
+    TIER_DEMOTE,  /**< Copy the extent back to its place in the image, freeing its slot. */
+    TIER_LAND,    /**< Give a free extent a slot without copying, so blocks allocated in it are written there. */
+} tier_move_kind_t;
+
+/**
+ * @brief Counters describing the fast tier and the migrations between the tiers.
+ */
+typedef struct tier_stats {
+    long slots;             /**< Extents the fast tier can hold. */
+    long resident;          /**< Extents on the fast tier now. */
+    long extent_size;       /**< Bytes per extent. */
+    long promotions;        /**< Extents copied to the fast tier. */
+    long demotions;         /**< Extents moved back to the capacity tier (copied, unless they were free). */
+    long landings;          /**< Free extents given a slot for new blocks to be written to. */
+    long migrated;          /**< Bytes copied between the tiers by promotions and demotions. */
+    long fast_read;         /**< Bytes read from the fast tier (see ioengine_tier_io()). */
+    long fast_written;      /**< Bytes written to the fast tier. */
+    long capacity_read;     /**< Bytes read from the capacity tier. */
+    long capacity_written;  /**< Bytes written to the capacity tier. */
+} tier_stats_t;
+
+/**
+ * @brief Attaches a fast tier to the open image.
+ *
+ * The data area of the image is divided into extents of TIER_EXTENT_BLOCKS blocks, any of which
+ * may be stored in one of the fast tier's slots instead of in the image's own file(s) (the
+ * capacity tier). The fast tier's file holds a header naming the image it belongs to, a table
+ * of which extent each slot holds, and the slots. The I/O engine is told where every extent is
+ * (see ioengine_set_tier()), so the rest of nufs keeps addressing blocks by their number.
+ *
+ * If `*tier_id` is 0, the file (already sized by the caller) is formatted as a new, empty fast
+ * tier, and `*tier_id` is set to its new identifier for the caller to record in the superblock.
+ * A file still holding extents of some image is never formatted over. Otherwise the file must
+ * be the fast tier with that identifier, and the extents it holds are found there from then on.
+ *
+ * Must be called after blocks_load() and before journal_recover() (whose writes may belong on
+ * the fast tier), with no other I/O in progress.
+ *
+ * @param fd File descriptor of the fast tier's file.
+ * @param tier_id The identifier recorded in the superblock, or 0 to create a fast tier.
+ * @return 0 on success, or a negative errno (e.g., -EINVAL for the wrong file).
+ */
+int tier_attach(int fd, uint32_t *tier_id);
+
+/**
+ * @brief Detaches the fast tier, leaving every extent where it is.
+ *
+ * Safe to call if no fast tier is attached. Must be called with no I/O in progress.
+ */
+void tier_detach();
+
+/**
+ * @brief Reports whether a fast tier is attached.
+ *
+ * @return 1 if tier_attach() succeeded and tier_detach() has not been called, 0 otherwise.
+ */
+int tier_attached();
+
+/**
+ * @brief Moves one extent between the tiers.
+ *
+ * A copy is made durable (data, then the slot table, each followed by a sync) before the I/O
+ * engine is pointed at it, so a crash at any point leaves every extent readable in the place
+ * the table says. Demoting a free extent, and landing one, only changes the table.
+ *
+ * Must be called with every other I/O to the image excluded (see storage_tier_move()).
+ *
+ * @param extent The extent's number (its first block divided by TIER_EXTENT_BLOCKS).
+ * @param kind What to do.
+ * @return The number of bytes copied (0 for a move without a copy), -EBUSY if the extent is not
+ *         in a state the move applies to (e.g. landing an extent that holds data), -ENOSPC if
+ *         no slot is free, or another negative errno on an I/O error.
+ */
+long tier_move(long extent, tier_move_kind_t kind);
+
+/**
+ * @brief Starts the background migration thread.
+ *
+ * Every TIER_INTERVAL seconds, the thread keeps TIER_LANDING free extents ahead of the block
+ * allocator on the fast tier (so new writes land there), then promotes the extents read and
+ * written most often since they were last considered, demoting the coldest extents on the fast
+ * tier to make room when they are much colder. Copies are limited to `rate` bytes per second on
+ * average. Every extent's heat is halved every TIER_DECAY rounds, so old activity fades.
+ *
+ * Does nothing if no fast tier is attached. Must be called after storage_init(), from the
+ * process that serves requests (i.e., after FUSE has daemonized).
+ *
+ * @param rate The maximum migration bandwidth in bytes per second (e.g., TIER_RATE).
+ */
+void tier_start(long rate);
+
+/**
+ * @brief Stops the migration thread and waits for it to exit.
+ *
+ * Safe to call if the thread was never started. Must be called before storage_shutdown().
+ */
+void tier_stop();
+
+/**
+ * @brief Retrieves a snapshot of the fast tier's counters.
+ *
+ * @param stats A pointer to the structure to fill in (all zeros without a fast tier).
+ */
+void tier_get_stats(tier_stats_t *stats);
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE // For gettid()
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC "NUTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 4096
+#define TRACE_NAME_MAX 4095 // Longest name kept in a record
+
+// The start of a trace file. The chunks follow it, TRACE_CHUNK bytes each.
+typedef struct trace_header {
+    char magic[4];       // TRACE_MAGIC
+    uint32_t version;    // TRACE_VERSION
+    uint32_t chunk_size; // TRACE_CHUNK
+    uint32_t chunks;     // Chunks in the ring
+    int64_t started;     // Wall-clock time the trace began, in nanoseconds since the epoch
+} trace_header_t;
+
+// The start of each chunk; its records follow
+typedef struct trace_chunk {
+    uint64_t seq;          // 1 for the first chunk written, and so on; 0 if never written
+    uint32_t bytes;        // Bytes of records in the chunk
+    uint32_t records;      // Records in the chunk
+    uint64_t first_record; // Records written before this chunk's first
+    uint64_t dropped;      // Records dropped before this chunk was sealed
+} trace_chunk_t;
+
+_Static_assert(sizeof(trace_record_t) % 8 == 0, "records stay 8-byte aligned");
+_Static_assert(sizeof(trace_chunk_t) + sizeof(trace_record_t) + 2 * TRACE_NAME_MAX + 8 <= TRACE_CHUNK,
+               "any record fits in a chunk");
+
+// Recorder state. Records are appended to buffers[current]; sealed chunks wait in 'queue'
+// for the writer thread, which writes chunk 'seq' to ring position (seq - 1) % chunk_count.
+enum { BUFFER_FREE, BUFFER_CURRENT, BUFFER_QUEUED };
+static atomic_int tracing = 0;
+static int trace_fd = -1;
+static uint64_t epoch;   // Monotonic time the trace began
+static uint32_t chunk_count;
+static char *buffers[TRACE_BUFFERS];
+static int buffer_state[TRACE_BUFFERS];
+static int current;
+static size_t fill;      // Bytes used in buffers[current], its chunk header included
+static uint32_t fill_records;
+static uint64_t next_seq = 1;
+static int queue[TRACE_BUFFERS];
+static int queue_head = 0, queue_len = 0;
+static trace_stats_t stats;
+
+static pthread_t writer_thread;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+static int writer_running = 0;
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    "mount", "access", "getattr", "statfs", "readdir", "mknod", "unlink", "link",
+    "symlink", "readlink", "getxattr", "setxattr", "listxattr", "removexattr", "open", "read",
+    "write", "truncate", "copy_range", "ioctl", "mkdir", "rmdir", "rename", "utimens",
+    "fsync", "flush",
+};
+
+// Name of an operation
+const char *trace_op_name(int op) {
+    return op >= 0 && op < TRACE_OP_COUNT ? op_names[op] : "?";
+}
+
+// Monotonic time in nanoseconds
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Start filling a free buffer, or return -1 if all of them are waiting to be written.
+// Caller holds trace_lock.
+static int take_buffer() {
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        if (buffer_state[i] == BUFFER_FREE) {
+            buffer_state[i] = BUFFER_CURRENT;
+            current = i;
+            fill = sizeof(trace_chunk_t);
+            fill_records = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Queue the current chunk for writing and start another. Returns -1 (leaving the
+// current chunk as it is) if there is no free buffer. Caller holds trace_lock.
+static int seal_chunk() {
+    int sealed = current;
+    size_t fill_before = fill;
+    uint32_t records_before = fill_records;
+    buffer_state[sealed] = BUFFER_QUEUED;
+    if (take_buffer() < 0) {
+        buffer_state[sealed] = BUFFER_CURRENT;
+        return -1;
+    }
+    trace_chunk_t *chunk = (trace_chunk_t *)buffers[sealed];
+    *chunk = (trace_chunk_t){next_seq++, fill_before - sizeof(trace_chunk_t), records_before,
+                             stats.records - records_before, stats.dropped};
+    queue[(queue_head + queue_len++) % TRACE_BUFFERS] = sealed;
+    pthread_cond_signal(&trace_wake);
+    return 0;
+}
+
+// Write a sealed chunk to its place in the ring
+static int write_chunk(const char *buf) {
+    const trace_chunk_t *chunk = (const trace_chunk_t *)buf;
+    off_t offset = TRACE_HEADER_SIZE + (off_t)((chunk->seq - 1) % chunk_count) * TRACE_CHUNK;
+    size_t len = sizeof(trace_chunk_t) + chunk->bytes;
+    if (pwrite(trace_fd, buf, len, offset) != (ssize_t)len) {
+        perror("[ERROR] Failed to write trace");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Write the queued chunks, dropping trace_lock while writing. Caller holds trace_lock.
+static void drain_queue() {
+    while (queue_len > 0) {
+        int i = queue[queue_head];
+        queue_head = (queue_head + 1) % TRACE_BUFFERS;
+        queue_len--;
+        pthread_mutex_unlock(&trace_lock);
+        write_chunk(buffers[i]);
+        pthread_mutex_lock(&trace_lock);
+        buffer_state[i] = BUFFER_FREE;
+        stats.chunks++;
+    }
+}
+
+// Writer thread: write chunks as they are sealed, until trace_close()
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    while (writer_running) {
+        drain_queue();
+        if (writer_running) pthread_cond_wait(&trace_wake, &trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+// Create the trace file and start recording into memory
+int trace_open(const char *path, size_t size) {
+    chunk_count = size > TRACE_HEADER_SIZE ? (size - TRACE_HEADER_SIZE) / TRACE_CHUNK : 0;
+    if (chunk_count < 2) chunk_count = 2;
+
+    trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+        int err = errno;
+        perror("[ERROR] Failed to open trace file");
+        return -err;
+    }
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        buffers[i] = calloc(1, TRACE_CHUNK);
+        buffer_state[i] = BUFFER_FREE;
+        if (!buffers[i]) {
+            while (i-- > 0) free(buffers[i]);
+            close(trace_fd);
+            trace_fd = -1;
+            return -ENOMEM;
+        }
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    char header[TRACE_HEADER_SIZE] = {0};
+    *(trace_header_t *)header = (trace_header_t){TRACE_MAGIC, TRACE_VERSION, TRACE_CHUNK, chunk_count,
+                                                 (int64_t)wall.tv_sec * 1000000000LL + wall.tv_nsec};
+    if (pwrite(trace_fd, header, sizeof(header), 0) != sizeof(header)) {
+        perror("[ERROR] Failed to write trace header");
+    }
+
+    epoch = now_ns();
+    next_seq = 1;
+    queue_head = queue_len = 0;
+    memset(&stats, 0, sizeof(stats));
+    take_buffer();
+    atomic_store(&tracing, 1);
+    printf("[INFO] Tracing operations to %s (%u chunks of %d KiB)\n", path, chunk_count, TRACE_CHUNK >> 10);
+    return 0;
+}
+
+// Start writing chunks as they fill
+void trace_start() {
+    if (trace_fd < 0) return;
+    pthread_mutex_lock(&trace_lock);
+    writer_running = 1;
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        perror("[ERROR] Failed to start trace writer");
+        writer_running = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Stop recording and write everything out
+void trace_close() {
+    if (trace_fd < 0) return;
+    atomic_store(&tracing, 0);
+
+    pthread_mutex_lock(&trace_lock);
+    int was_running = writer_running;
+    writer_running = 0;
+    pthread_cond_signal(&trace_wake);
+    pthread_mutex_unlock(&trace_lock);
+    if (was_running) pthread_join(writer_thread, NULL);
+
+    // What the writer left (everything, if it never ran), then the last partial chunk
+    pthread_mutex_lock(&trace_lock);
+    drain_queue();
+    if (fill_records > 0 && seal_chunk() == 0) drain_queue();
+    pthread_mutex_unlock(&trace_lock);
+
+    fsync(trace_fd);
+    close(trace_fd);
+    trace_fd = -1;
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        free(buffers[i]);
+        buffers[i] = NULL;
+    }
+    printf("[INFO] Trace closed: %ld operations recorded, %ld dropped\n", stats.records, stats.dropped);
+}
+
+// The time an operation starts, if it is to be recorded
+uint64_t trace_begin() {
+    if (!atomic_load_explicit(&tracing, memory_order_relaxed)) return 0;
+    return now_ns() - epoch + 1; // Never 0
+}
+
+// Append one record to the current chunk
+void trace_end(uint64_t start, trace_op_t op, const char *name, const char *name2, uint64_t size, uint64_t offset,
+               uint64_t arg, int result) {
+    if (!start) return;
+    uint64_t end = now_ns() - epoch + 1;
+    static __thread uint32_t thread_id = 0;
+    if (!thread_id) thread_id = gettid();
+
+    size_t len1 = name ? strnlen(name, TRACE_NAME_MAX) : 0;
+    size_t len2 = name2 ? strnlen(name2, TRACE_NAME_MAX) : 0;
+    size_t len = (sizeof(trace_record_t) + len1 + len2 + 7) & ~(size_t)7;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    if (fill + len > TRACE_CHUNK) {
+        if (seal_chunk() < 0) {
+            stats.dropped++; // The writer is behind; losing records beats blocking the operation
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+    }
+    trace_record_t *r = (trace_record_t *)(buffers[current] + fill);
+    *r = (trace_record_t){len, op, 0, thread_id, start - 1, end - start, offset, size, arg, result, len1, len2};
+    char *names = (char *)(r + 1);
+    memcpy(names, name, len1);
+    memcpy(names + len1, name2, len2);
+    memset(names + len1 + len2, 0, len - sizeof(trace_record_t) - len1 - len2);
+    fill += len;
+    fill_records++;
+    stats.records++;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Copy out the recorder's counters
+void trace_get_stats(trace_stats_t *out) {
+    pthread_mutex_lock(&trace_lock);
+    *out = stats;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Order records by start time, then by the order they were written in
+static int compare_records(const void *a, const void *b) {
+    const trace_record_t *ra = *(trace_record_t *const *)a, *rb = *(trace_record_t *const *)b;
+    if (ra->start != rb->start) return ra->start < rb->start ? -1 : 1;
+    return ra < rb ? -1 : ra > rb;
+}
+
+// Order chunks by sequence number
+static int compare_chunks(const void *a, const void *b) {
+    uint64_t sa = (*(trace_chunk_t *const *)a)->seq, sb = (*(trace_chunk_t *const *)b)->seq;
+    return sa < sb ? -1 : sa > sb;
+}
+
+// Read a trace file: its chunks in the order they were written, and its records in start order
+int trace_load(const char *path, trace_t *trace) {
+    memset(trace, 0, sizeof(trace_t));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -errno;
+    struct stat st;
+    char *file = NULL;
+    int rv = fstat(fd, &st) < 0 ? -errno : 0;
+    if (rv == 0 && st.st_size < TRACE_HEADER_SIZE) rv = -EINVAL;
+    if (rv == 0 && !(file = malloc(st.st_size))) rv = -ENOMEM;
+    if (rv == 0 && read(fd, file, st.st_size) != st.st_size) rv = -EIO;
+    close(fd);
+
+    const trace_header_t *header = (const trace_header_t *)file;
+    if (rv == 0 && (memcmp(header->magic, TRACE_MAGIC, 4) != 0 || header->version != TRACE_VERSION ||
+                    header->chunk_size != TRACE_CHUNK)) {
+        rv = -EINVAL;
+    }
+    long chunks = rv == 0 ? (st.st_size - TRACE_HEADER_SIZE) / TRACE_CHUNK : 0;
+    if (rv == 0 && (st.st_size - TRACE_HEADER_SIZE) % TRACE_CHUNK >= (long)sizeof(trace_chunk_t)) {
+        chunks++; // The last chunk written at the end of the ring is only as long as its records
+    }
+
+    // The chunks that were written, oldest first
+    trace_chunk_t **order = rv == 0 ? calloc(chunks + 1, sizeof(trace_chunk_t *)) : NULL;
+    if (rv == 0 && !order) rv = -ENOMEM;
+    long written = 0;
+    for (long i = 0; rv == 0 && i < chunks; i++) {
+        trace_chunk_t *chunk = (trace_chunk_t *)(file + TRACE_HEADER_SIZE + (size_t)i * TRACE_CHUNK);
+        if (chunk->seq == 0) continue;
+        size_t room = st.st_size - ((char *)(chunk + 1) - file);
+        if (chunk->bytes > room || chunk->bytes > TRACE_CHUNK - sizeof(trace_chunk_t)) {
+            rv = -EINVAL;
+            break;
+        }
+        order[written++] = chunk;
+    }
+    if (rv == 0) qsort(order, written, sizeof(trace_chunk_t *), compare_chunks);
+
+    // Copy them out in order, so records written earlier lie at lower addresses
+    size_t total = 0;
+    for (long i = 0; rv == 0 && i < written; i++) total += order[i]->bytes;
+    if (rv == 0 && !(trace->data = malloc(total + 1))) rv = -ENOMEM;
+    size_t pos = 0;
+    long count = 0;
+    for (long i = 0; rv == 0 && i < written; i++) {
+        memcpy(trace->data + pos, order[i] + 1, order[i]->bytes);
+        pos += order[i]->bytes;
+        count += order[i]->records;
+    }
+    if (rv == 0 && written > 0) {
+        trace->lost = order[0]->first_record + order[written - 1]->dropped;
+    }
+
+    // Index the records, checking each lies within its chunk
+    if (rv == 0 && !(trace->records = malloc((count + 1) * sizeof(trace_record_t *)))) rv = -ENOMEM;
+    for (size_t at = 0; rv == 0 && at < total;) {
+        trace_record_t *r = (trace_record_t *)(trace->data + at);
+        if (total - at < sizeof(trace_record_t) || r->len < sizeof(trace_record_t) || r->len > total - at ||
+            sizeof(trace_record_t) + r->name_len + r->name2_len > r->len || trace->count == count) {
+            rv = -EINVAL;
+            break;
+        }
+        trace->records[trace->count++] = r;
+        at += r->len;
+    }
+    if (rv == 0) {
+        qsort(trace->records, trace->count, sizeof(trace_record_t *), compare_records);
+        trace->started = header->started;
+    }
+
+    free(order);
+    free(file);
+    if (rv < 0) trace_unload(trace);
+    return rv;
+}
+
+// Free a loaded trace
+void trace_unload(trace_t *trace) {
+    free(trace->data);
+    free(trace->records);
+    memset(trace, 0, sizeof(trace_t));
+}
@@ -0,0 +1,176 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_SIZE (64L << 20)   /**< Default size of a trace file, in bytes. */
+#define TRACE_CHUNK (64 << 10)   /**< Bytes of records written to the trace file at a time. */
+#define TRACE_BUFFERS 8          /**< Chunks held in memory while the writer thread catches up. */
+#define TRACE_TIME_NOW UINT64_MAX         /**< A utimens time of UTIME_NOW. */
+#define TRACE_TIME_OMIT (UINT64_MAX - 1)  /**< A utimens time of UTIME_OMIT. */
+
+/**
+ * @brief The operations a trace records: one per FUSE callback, plus the mount itself.
+ */
+typedef enum trace_op {
+    TRACE_MOUNT,       /**< storage_init(): name is the disk image. */
+    TRACE_ACCESS,      /**< arg is the mask. */
+    TRACE_GETATTR,
+    TRACE_STATFS,
+    TRACE_READDIR,     /**< size is the number of entries listed. */
+    TRACE_MKNOD,       /**< arg is the mode. */
+    TRACE_UNLINK,
+    TRACE_LINK,        /**< name2 is the new name. */
+    TRACE_SYMLINK,     /**< name is the link, name2 its target. */
+    TRACE_READLINK,    /**< size is the buffer size. */
+    TRACE_GETXATTR,    /**< name2 is the attribute, size the buffer size. */
+    TRACE_SETXATTR,    /**< name2 is the attribute, size the value's size, arg the flags. */
+    TRACE_LISTXATTR,   /**< size is the buffer size. */
+    TRACE_REMOVEXATTR, /**< name2 is the attribute. */
+    TRACE_OPEN,        /**< arg is the open flags. */
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_TRUNCATE,    /**< size is the new size. */
+    TRACE_COPY_RANGE,  /**< copy_file_range(): name2 is the destination, arg its offset. */
+    TRACE_IOCTL,       /**< arg is the command. */
+    TRACE_MKDIR,       /**< arg is the mode. */
+    TRACE_RMDIR,
+    TRACE_RENAME,      /**< name2 is the new name, arg the flags. */
+    TRACE_UTIMENS,     /**< size is the new access time, arg the modification time (ns since the epoch, or TRACE_TIME_*). */
+    TRACE_FSYNC,       /**< fsync() of a file or directory: arg is 1 for fdatasync(). */
+    TRACE_FLUSH,       /**< close() of a file. */
+    TRACE_OP_COUNT
+} trace_op_t;
+
+/**
+ * @brief One operation in a trace file, followed by its name(s) (not NUL-terminated) and
+ * padding to a multiple of 8 bytes.
+ */
+typedef struct trace_record {
+    uint16_t len;       /**< Bytes in the record, names and padding included. */
+    uint8_t op;         /**< A trace_op_t. */
+    uint8_t reserved;
+    uint32_t thread;    /**< Thread (Linux thread id) that served the operation. */
+    uint64_t start;     /**< When the operation started, in nanoseconds since the trace began. */
+    uint64_t duration;  /**< How long it took, in nanoseconds. */
+    uint64_t offset;    /**< Offset of a read, write or copy (its source), or 0. */
+    uint64_t size;      /**< Bytes asked for, or as described for the operation. */
+    uint64_t arg;       /**< As described for the operation, or 0. */
+    int32_t result;     /**< What the operation returned. */
+    uint16_t name_len;  /**< Bytes of the path (the first name). */
+    uint16_t name2_len; /**< Bytes of the second name, after the first. */
+} trace_record_t;
+
+/**
+ * @brief A trace file loaded by trace_load().
+ */
+typedef struct trace {
+    char *data;                /**< The file's chunks, in the order they were written. */
+    trace_record_t **records;  /**< Every record, in the order the operations started. */
+    long count;                /**< Number of records. */
+    int64_t started;           /**< Wall-clock time the trace began, in nanoseconds since the epoch. */
+    long lost;                 /**< Records dropped while recording, or overwritten when the file wrapped. */
+} trace_t;
+
+/**
+ * @brief Counters describing the recorder's work.
+ */
+typedef struct trace_stats {
+    long records;  /**< Operations recorded. */
+    long dropped;  /**< Operations not recorded because the writer thread fell behind. */
+    long chunks;   /**< Chunks written to the trace file. */
+} trace_stats_t;
+
+/**
+ * @brief Starts recording operations to a trace file.
+ *
+ * The file is a ring of TRACE_CHUNK-byte chunks, `size` bytes in all, so a long-running mount
+ * keeps its most recent operations: once the file is full, each new chunk replaces the oldest.
+ * Records are gathered in memory and written a chunk at a time by a thread started with
+ * trace_start(); until then (e.g. while the image is loaded) they stay in memory.
+ *
+ * @param path The trace file (created, or truncated).
+ * @param size The size of the ring in bytes (e.g., TRACE_SIZE); at least two chunks are kept.
+ * @return 0 on success, or a negative errno.
+ */
+int trace_open(const char *path, size_t size);
+
+/**
+ * @brief Starts the thread that writes full chunks to the trace file.
+ *
+ * Does nothing if no trace file is open. Must be called from the process that serves requests
+ * (i.e., after FUSE has daemonized).
+ */
+void trace_start();
+
+/**
+ * @brief Stops recording, writes what is still in memory, and closes the trace file.
+ *
+ * Safe to call if no trace file is open.
+ */
+void trace_close();
+
+/**
+ * @brief Notes the start of an operation.
+ *
+ * Costs one branch when no trace file is open.
+ *
+ * @return The time to pass to trace_end(), or 0 if nothing is being recorded.
+ */
+uint64_t trace_begin();
+
+/**
+ * @brief Records an operation that started at trace_begin()'s return value. Thread-safe.
+ *
+ * Names longer than fit in a record are cut short. Does nothing if `start` is 0.
+ *
+ * @param start What trace_begin() returned.
+ * @param op The operation.
+ * @param name The path the operation applies to (or NULL).
+ * @param name2 Its second name (or NULL), as described for the operation.
+ * @param size The record's `size`.
+ * @param offset The record's `offset`.
+ * @param arg The record's `arg`.
+ * @param result What the operation returned.
+ */
+void trace_end(uint64_t start, trace_op_t op, const char *name, const char *name2, uint64_t size, uint64_t offset,
+               uint64_t arg, int result);
+
+/**
+ * @brief Retrieves a snapshot of the recorder's counters.
+ *
+ * @param stats A pointer to the structure to fill in.
+ */
+void trace_get_stats(trace_stats_t *stats);
+
+/**
+ * @brief Reads a trace file written by trace_open().
+ *
+ * @param path The trace file.
+ * @param trace Where to load it; release it with trace_unload().
+ * @return 0 on success, -EINVAL if the file is not a trace, or another negative errno.
+ */
+int trace_load(const char *path, trace_t *trace);
+
+/**
+ * @brief Frees a trace loaded by trace_load().
+ *
+ * @param trace The trace.
+ */
+void trace_unload(trace_t *trace);
+
+/**
+ * @brief Returns the name of an operation (e.g., "write"), or "?" for an unknown one.
+ *
+ * @param op A trace_op_t.
+ */
+const char *trace_op_name(int op);
+
+/** @brief A record's first name (its path), of `name_len` bytes. */
+#define TRACE_NAME(r) ((const char *)((const trace_record_t *)(r) + 1))
+
+/** @brief A record's second name, of `name2_len` bytes. */
+#define TRACE_NAME2(r) (TRACE_NAME(r) + (r)->name_len)
+
+#endif
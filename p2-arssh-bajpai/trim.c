@@ -0,0 +1,49 @@
+#include "trim.h"
+#include "blocks.h"
+#include "storage.h"
+#include "worker.h"
+#include <stdio.h>
+#include <string.h>
+
+static worker_t trimmer = WORKER_INIT;
+static int trim_interval = TRIM_INTERVAL;
+
+// Trim every group that needs it. Other operations get the lock between groups.
+static void trim_pass() {
+    long released = 0;
+    int groups = blocks_group_count();
+    for (int g = 0; g < groups && !worker_stopping(&trimmer); g++) {
+        released += storage_trim_group(g);
+    }
+    if (released > 0) {
+        blocks_discard_stats_t stats;
+        blocks_get_discard_stats(&stats);
+        printf("[INFO] Trim pass complete: %ld blocks released (%ld total)\n", released, stats.blocks);
+    }
+}
+
+// Trim thread: a pass at once, then one every trim_interval seconds
+static void *trim_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        trim_pass();
+        if (!worker_sleep(&trimmer, trim_interval * 1000000000LL)) break;
+    }
+    return NULL;
+}
+
+// Start the background trim thread
+void trim_start(int interval) {
+    trim_interval = interval > 0 ? interval : TRIM_INTERVAL;
+    int err = worker_start(&trimmer, trim_main);
+    if (err < 0) {
+        fprintf(stderr, "[ERROR] Failed to start trim thread: %s\n", strerror(-err));
+        return;
+    }
+    printf("[INFO] Trimming free blocks every %d s\n", trim_interval);
+}
+
+// Stop the trim thread and wait for it to finish
+void trim_stop() {
+    worker_stop(&trimmer);
+}
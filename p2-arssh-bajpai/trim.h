@@ -0,0 +1,29 @@
+#ifndef TRIM_H
+#define TRIM_H
+
+#define TRIM_INTERVAL 60  /**< Default number of seconds between trim passes. */
+
+/**
+ * @brief Starts the background trim thread.
+ *
+ * Every `interval` seconds, the thread walks the allocation groups and releases the free
+ * blocks of each one that had blocks freed since its last trim from the image file (see
+ * storage_trim_group()), taking storage's lock for one group at a time. The first pass covers
+ * every group, so an image that was filled and emptied before shrinks too. Used with
+ * DISCARD_PERIODIC (see blocks_set_discard()); with another mode the passes do nothing.
+ *
+ * Must be called after storage_init(), from the process that serves requests (i.e., after
+ * FUSE has daemonized).
+ *
+ * @param interval The time between passes in seconds, or 0 for TRIM_INTERVAL.
+ */
+void trim_start(int interval);
+
+/**
+ * @brief Stops the trim thread and waits for it to exit.
+ *
+ * Safe to call if the thread was never started. Must be called before storage_shutdown().
+ */
+void trim_stop();
+
+#endif
@@ -0,0 +1,68 @@
+#include "worker.h"
+#include <errno.h>
+
+// Add 'ns' nanoseconds to a timespec
+void worker_timespec_add(struct timespec *ts, long long ns) {
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+// Start the worker's thread; its waits are timed against CLOCK_MONOTONIC
+int worker_start(worker_t *w, void *(*main)(void *)) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    w->running = 1;
+    int err = pthread_create(&w->thread, NULL, main, NULL);
+    if (err != 0) {
+        w->running = 0;
+        return -err;
+    }
+    return 0;
+}
+
+// Sleep until 'deadline' or until worker_stop() is called.
+// Returns 0 if the thread should stop.
+int worker_wait(worker_t *w, const struct timespec *deadline) {
+    pthread_mutex_lock(&w->lock);
+    while (w->running) {
+        if (pthread_cond_timedwait(&w->wake, &w->lock, deadline) != 0) {
+            break; // Deadline reached
+        }
+    }
+    int running = w->running;
+    pthread_mutex_unlock(&w->lock);
+    return running;
+}
+
+// Sleep for 'ns' nanoseconds or until worker_stop() is called
+int worker_sleep(worker_t *w, long long ns) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    worker_timespec_add(&deadline, ns);
+    return worker_wait(w, &deadline);
+}
+
+// Whether worker_stop() has been called
+int worker_stopping(worker_t *w) {
+    pthread_mutex_lock(&w->lock);
+    int stopping = !w->running;
+    pthread_mutex_unlock(&w->lock);
+    return stopping;
+}
+
+// Stop the worker's thread and wait for it to finish
+int worker_stop(worker_t *w) {
+    pthread_mutex_lock(&w->lock);
+    int was_running = w->running;
+    w->running = 0;
+    if (was_running) pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+
+    if (was_running) pthread_join(w->thread, NULL);
+    return was_running;
+}
@@ -0,0 +1,75 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * @brief A background thread that sleeps between rounds of work until it is stopped.
+ *
+ * Shared by the scrubber, the tier migration thread and the trim thread. Declare one with
+ * WORKER_INIT; its lock may also guard the owner's own counters.
+ */
+typedef struct worker {
+    pthread_t thread;       /**< The thread, while running. */
+    pthread_mutex_t lock;   /**< Guards `running` (and whatever else the owner puts under it). */
+    pthread_cond_t wake;    /**< Signaled by worker_stop(); waits use CLOCK_MONOTONIC. */
+    int running;            /**< 1 from worker_start() until worker_stop(). */
+} worker_t;
+
+#define WORKER_INIT {.lock = PTHREAD_MUTEX_INITIALIZER} /**< Static initializer for a worker_t. */
+
+/**
+ * @brief Adds a number of nanoseconds to a timespec.
+ *
+ * @param ts The time to advance.
+ * @param ns The nanoseconds to add.
+ */
+void worker_timespec_add(struct timespec *ts, long long ns);
+
+/**
+ * @brief Starts the worker's thread.
+ *
+ * @param w The worker.
+ * @param main The thread's function, called with NULL.
+ * @return 0 on success, or a negative error code if the thread could not be created.
+ */
+int worker_start(worker_t *w, void *(*main)(void *));
+
+/**
+ * @brief Sleeps until a CLOCK_MONOTONIC deadline, or until worker_stop() is called.
+ *
+ * @param w The worker.
+ * @param deadline When to wake up.
+ * @return 1 if the deadline was reached, or 0 if the thread should stop.
+ */
+int worker_wait(worker_t *w, const struct timespec *deadline);
+
+/**
+ * @brief Like worker_wait(), with the deadline `ns` nanoseconds from now.
+ *
+ * @param w The worker.
+ * @param ns How long to sleep.
+ * @return 1 if the time ran out, or 0 if the thread should stop.
+ */
+int worker_sleep(worker_t *w, long long ns);
+
+/**
+ * @brief Tells whether worker_stop() has been called, without waiting.
+ *
+ * @param w The worker.
+ * @return 1 if the thread should stop, 0 otherwise.
+ */
+int worker_stopping(worker_t *w);
+
+/**
+ * @brief Stops the worker's thread and waits for it to exit.
+ *
+ * Safe to call if the thread was never started.
+ *
+ * @param w The worker.
+ * @return 1 if the thread was running (and has now exited), 0 otherwise.
+ */
+int worker_stop(worker_t *w);
+
+#endif
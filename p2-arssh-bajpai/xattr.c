@@ -0,0 +1,365 @@
+#include "xattr.h"
+#include "blocks.h"
+#include "journal.h"
+#include "crc32c.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/xattr.h>
+
+// Header of a packed attribute; the name (without its namespace prefix) and the value follow.
+// A header with name_len 0 ends the list.
+typedef struct xattr_entry {
+    uint8_t prefix;     // Index into prefixes[]
+    uint8_t name_len;
+    uint16_t value_len;
+} xattr_entry_t;
+
+// Namespace prefixes are stored as a one-byte index; 0 means the whole name is stored
+static const char *prefixes[] = {"", "user.", "trusted.", "security.", "system."};
+#define PREFIX_COUNT ((int)(sizeof(prefixes) / sizeof(prefixes[0])))
+
+// Room for entries in an attribute block, after its header
+#define BLOCK_ROOM (BLOCK_SIZE - (int)sizeof(xattr_block_t))
+
+// Most attributes an inode can have (all with one-byte names and empty values)
+#define MAX_ITEMS ((INODE_XATTR_INLINE + BLOCK_ROOM) / ((int)sizeof(xattr_entry_t) + 1))
+
+// One unpacked attribute; name and value point into the packed entry
+typedef struct xattr_item {
+    int prefix;
+    int name_len;
+    int value_len;
+    const char *name;
+    const char *value;
+} xattr_item_t;
+
+// All of an inode's attributes, unpacked from a private copy so they can be repacked in place
+typedef struct xattr_set {
+    char copy[INODE_XATTR_INLINE + BLOCK_ROOM];
+    xattr_item_t items[MAX_ITEMS];
+    int count;
+} xattr_set_t;
+
+// Recently seen attribute blocks, by hash, so identical sets can share one block.
+// Direct-mapped: a new block simply replaces whatever was in its slot. Entries are only
+// hints; a candidate is compared byte for byte before it is shared.
+static struct {
+    uint32_t hash;
+    int bnum;
+} dedup[XATTR_DEDUP_SLOTS];
+
+// Remember that block 'bnum' holds attributes with the given hash
+static void dedup_remember(int bnum, uint32_t hash) {
+    dedup[hash % XATTR_DEDUP_SLOTS].hash = hash;
+    dedup[hash % XATTR_DEDUP_SLOTS].bnum = bnum;
+}
+
+// Forget a block that was freed
+static void dedup_forget(int bnum) {
+    for (int i = 0; i < XATTR_DEDUP_SLOTS; i++) {
+        if (dedup[i].bnum == bnum) dedup[i].bnum = 0;
+    }
+}
+
+// Find a block already holding exactly 'image', or return 0
+static int dedup_find(const char *image) {
+    uint32_t hash = ((const xattr_block_t *)image)->hash;
+    int bnum = dedup[hash % XATTR_DEDUP_SLOTS].bnum;
+    if (bnum == 0 || dedup[hash % XATTR_DEDUP_SLOTS].hash != hash) return 0;
+    const char *data = blocks_get_block(bnum);
+    return data && memcmp(data, image, BLOCK_SIZE) == 0 ? bnum : 0;
+}
+
+// Split a name into its namespace prefix index and the rest.
+// Returns the index, or -EINVAL / -ERANGE for an empty or overlong name.
+static int split_name(const char *name, const char **suffix) {
+    size_t len = strlen(name);
+    if (len == 0) return -EINVAL;
+    if (len > XATTR_NAME_MAX) return -ERANGE;
+
+    for (int i = 1; i < PREFIX_COUNT; i++) {
+        size_t plen = strlen(prefixes[i]);
+        if (strncmp(name, prefixes[i], plen) == 0 && name[plen] != '\0') {
+            *suffix = name + plen;
+            return i;
+        }
+    }
+    *suffix = name;
+    return 0;
+}
+
+// Whether an attribute has the given (split) name
+static int item_is(const xattr_item_t *item, int prefix, const char *suffix) {
+    return item->prefix == prefix && item->name_len == (int)strlen(suffix) &&
+           memcmp(item->name, suffix, item->name_len) == 0;
+}
+
+// Bytes an attribute takes up when packed
+static int item_size(const xattr_item_t *item) {
+    return (int)sizeof(xattr_entry_t) + item->name_len + item->value_len;
+}
+
+// Read the packed entry at *pos of 'area' (of 'len' bytes) and step past it.
+// Returns 0 at the end of the list, or at an entry that runs off the end of the area.
+static int next_entry(const char *area, int len, int *pos, xattr_item_t *item) {
+    xattr_entry_t e;
+    if (*pos + (int)sizeof(e) > len) return 0;
+    memcpy(&e, area + *pos, sizeof(e));
+    if (e.name_len == 0) return 0;
+
+    int next = *pos + (int)sizeof(e) + e.name_len + e.value_len;
+    if (next > len || e.prefix >= PREFIX_COUNT) {
+        printf("[ERROR] Malformed extended attribute entry\n");
+        return 0;
+    }
+    item->prefix = e.prefix;
+    item->name_len = e.name_len;
+    item->value_len = e.value_len;
+    item->name = area + *pos + sizeof(e);
+    item->value = item->name + e.name_len;
+    *pos = next;
+    return 1;
+}
+
+// Append an attribute to 'area' at *pos
+static void pack_entry(char *area, int *pos, const xattr_item_t *item) {
+    xattr_entry_t e = {item->prefix, item->name_len, item->value_len};
+    memcpy(area + *pos, &e, sizeof(e));
+    memcpy(area + *pos + sizeof(e), item->name, item->name_len);
+    memcpy(area + *pos + sizeof(e) + item->name_len, item->value, item->value_len);
+    *pos += item_size(item);
+}
+
+// The packed entries of an inode's attribute block, or NULL if it has none
+static const char *block_entries(inode_t *node) {
+    if (node->xattr_block == 0) return NULL;
+
+    xattr_block_t *header = blocks_get_block(node->xattr_block);
+    if (!header || header->magic != XATTR_MAGIC) {
+        printf("[ERROR] Block %d does not hold extended attributes\n", node->xattr_block);
+        return NULL;
+    }
+    dedup_remember(node->xattr_block, header->hash); // Blocks in use are worth sharing
+    return (const char *)(header + 1);
+}
+
+// Find an attribute, looking in the inode before the attribute block
+static int find_item(inode_t *node, int prefix, const char *suffix, xattr_item_t *item) {
+    int pos = 0;
+    while (next_entry(inode_xattrs(node), INODE_XATTR_INLINE, &pos, item)) {
+        if (item_is(item, prefix, suffix)) return 1;
+    }
+
+    const char *entries = block_entries(node);
+    pos = 0;
+    while (entries && next_entry(entries, BLOCK_ROOM, &pos, item)) {
+        if (item_is(item, prefix, suffix)) return 1;
+    }
+    return 0;
+}
+
+// Unpack all of an inode's attributes into 'set'
+static void load_set(inode_t *node, xattr_set_t *set) {
+    set->count = 0;
+    memcpy(set->copy, inode_xattrs(node), INODE_XATTR_INLINE);
+    const char *entries = block_entries(node);
+    if (entries) {
+        memcpy(set->copy + INODE_XATTR_INLINE, entries, BLOCK_ROOM);
+    }
+
+    int pos = 0;
+    while (set->count < MAX_ITEMS && next_entry(set->copy, INODE_XATTR_INLINE, &pos, &set->items[set->count])) {
+        set->count++;
+    }
+    pos = 0;
+    while (entries && set->count < MAX_ITEMS &&
+           next_entry(set->copy + INODE_XATTR_INLINE, BLOCK_ROOM, &pos, &set->items[set->count])) {
+        set->count++;
+    }
+}
+
+// Order attributes by name (namespace first)
+static int by_name(const void *a, const void *b) {
+    const xattr_item_t *x = a, *y = b;
+    if (x->prefix != y->prefix) return x->prefix - y->prefix;
+    int len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int cmp = memcmp(x->name, y->name, len);
+    return cmp ? cmp : x->name_len - y->name_len;
+}
+
+// Order attributes by packed size, then by name
+static int by_size(const void *a, const void *b) {
+    int cmp = item_size(a) - item_size(b);
+    return cmp ? cmp : by_name(a, b);
+}
+
+// Find a block for a packed attribute block image: an identical block already on disk, the
+// inode's current block if no other inode shares it, or a newly allocated one.
+// Returns the block number, or -ENOSPC.
+static int store_block(int old, char *image) {
+    int bnum = dedup_find(image);
+    if (bnum > 0) {
+        if (bnum != old) ref_block(bnum);
+        return bnum;
+    }
+
+    bnum = old;
+    if (bnum == 0 || block_refs(bnum) != 1) {
+        bnum = alloc_block(); // Shared blocks are never changed in place
+        if (bnum < 0) return -ENOSPC;
+    }
+    memcpy(blocks_overwrite(bnum), image, BLOCK_SIZE);
+    journal_dirty(bnum);
+    dedup_remember(bnum, ((xattr_block_t *)image)->hash);
+    return bnum;
+}
+
+// Drop a reference to an attribute block
+static void release_block(int bnum) {
+    free_block(bnum);
+    if (block_refs(bnum) == 0) dedup_forget(bnum);
+}
+
+// Pack 'set' back into the inode and its attribute block.
+// Nothing is changed if the attributes don't fit.
+static int store_set(inode_t *node, xattr_set_t *set) {
+    // The smallest attributes go in the inode, where reading them costs nothing
+    qsort(set->items, set->count, sizeof(xattr_item_t), by_size);
+    char inline_area[INODE_XATTR_INLINE] = {0};
+    int used = 0, spilled = 0;
+    while (spilled < set->count && used + item_size(&set->items[spilled]) <= INODE_XATTR_INLINE) {
+        pack_entry(inline_area, &used, &set->items[spilled++]);
+    }
+
+    // The rest go in a block, sorted by name so that equal sets give equal blocks
+    int bnum = 0;
+    if (spilled < set->count) {
+        qsort(set->items + spilled, set->count - spilled, sizeof(xattr_item_t), by_name);
+        char image[BLOCK_SIZE] = {0};
+        xattr_block_t *header = (xattr_block_t *)image;
+        char *entries = (char *)(header + 1);
+        int len = 0;
+        for (int i = spilled; i < set->count; i++) {
+            if (len + item_size(&set->items[i]) > BLOCK_ROOM) return -ENOSPC;
+            pack_entry(entries, &len, &set->items[i]);
+        }
+        header->magic = XATTR_MAGIC;
+        header->hash = crc32c(0, entries, BLOCK_ROOM);
+
+        bnum = store_block(node->xattr_block, image);
+        if (bnum < 0) return bnum;
+    }
+
+    if (node->xattr_block && node->xattr_block != bnum) {
+        release_block(node->xattr_block);
+    }
+    inode_dirty(node);
+    inode_xattrs_dirty(node);
+    memcpy(inode_xattrs(node), inline_area, INODE_XATTR_INLINE);
+    node->xattr_block = bnum;
+    if (set->count > 0) {
+        node->flags |= INODE_XATTRS;
+    } else {
+        node->flags &= ~INODE_XATTRS;
+    }
+    return 0;
+}
+
+// Read an attribute's value
+int xattr_get(inode_t *node, const char *name, void *value, size_t size) {
+    if (!(node->flags & INODE_XATTRS)) return -ENODATA; // Most inodes: nothing to search
+
+    const char *suffix;
+    int prefix = split_name(name, &suffix);
+    if (prefix < 0) return prefix;
+
+    xattr_item_t item;
+    if (!find_item(node, prefix, suffix, &item)) return -ENODATA;
+    if (size == 0) return item.value_len;
+    if (size < (size_t)item.value_len) return -ERANGE;
+    memcpy(value, item.value, item.value_len);
+    return item.value_len;
+}
+
+// Create or replace an attribute
+int xattr_set(inode_t *node, const char *name, const void *value, size_t size, int flags) {
+    const char *suffix;
+    int prefix = split_name(name, &suffix);
+    if (prefix < 0) return prefix;
+    if (size > BLOCK_ROOM) return -E2BIG;
+
+    static xattr_set_t set; // Too big for the stack; callers are serialized by the storage lock
+    load_set(node, &set);
+
+    int i = 0;
+    while (i < set.count && !item_is(&set.items[i], prefix, suffix)) i++;
+    if (i < set.count && (flags & XATTR_CREATE)) return -EEXIST;
+    if (i == set.count && (flags & XATTR_REPLACE)) return -ENODATA;
+    if (i == set.count) {
+        if (set.count == MAX_ITEMS) return -ENOSPC;
+        set.count++;
+    }
+
+    set.items[i].prefix = prefix;
+    set.items[i].name_len = strlen(suffix);
+    set.items[i].value_len = size;
+    set.items[i].name = suffix;
+    set.items[i].value = value;
+    return store_set(node, &set);
+}
+
+// List the names of all attributes
+int xattr_list(inode_t *node, char *list, size_t size) {
+    if (!(node->flags & INODE_XATTRS)) return 0;
+
+    const char *areas[] = {inode_xattrs(node), block_entries(node)};
+    const int lens[] = {INODE_XATTR_INLINE, BLOCK_ROOM};
+    size_t total = 0;
+    for (int a = 0; a < 2; a++) {
+        xattr_item_t item;
+        int pos = 0;
+        while (areas[a] && next_entry(areas[a], lens[a], &pos, &item)) {
+            size_t plen = strlen(prefixes[item.prefix]);
+            size_t len = plen + item.name_len + 1;
+            if (size > 0) {
+                if (total + len > size) return -ERANGE;
+                memcpy(list + total, prefixes[item.prefix], plen);
+                memcpy(list + total + plen, item.name, item.name_len);
+                list[total + len - 1] = '\0';
+            }
+            total += len;
+        }
+    }
+    return total;
+}
+
+// Remove an attribute
+int xattr_remove(inode_t *node, const char *name) {
+    if (!(node->flags & INODE_XATTRS)) return -ENODATA;
+
+    const char *suffix;
+    int prefix = split_name(name, &suffix);
+    if (prefix < 0) return prefix;
+
+    static xattr_set_t set; // As in xattr_set()
+    load_set(node, &set);
+
+    int i = 0;
+    while (i < set.count && !item_is(&set.items[i], prefix, suffix)) i++;
+    if (i == set.count) return -ENODATA;
+    set.items[i] = set.items[--set.count];
+    return store_set(node, &set);
+}
+
+// Release an inode's attribute block as the inode is freed
+void xattr_free(inode_t *node) {
+    if (node->xattr_block) {
+        release_block(node->xattr_block);
+    }
+    inode_dirty(node);
+    node->xattr_block = 0;
+    node->flags &= ~INODE_XATTRS;
+}
@@ -0,0 +1,86 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "inode.h"
+
+#define XATTR_MAGIC 0x52544158   /**< "XATR": marks a block of shared extended attributes. */
+#define XATTR_NAME_MAX 255       /**< Longest attribute name, including its namespace prefix. */
+#define XATTR_DEDUP_SLOTS 256    /**< Number of recently seen attribute blocks remembered for sharing. */
+
+/**
+ * @brief Header of a block holding extended attributes that did not fit in an inode.
+ *
+ * The header is followed by packed entries, sorted by name and terminated by an all-zero
+ * entry header; the rest of the block is zero. Identical attribute sets produce identical
+ * blocks, so one block is shared (reference counted, see ref_block()) by every inode with
+ * the same overflow attributes, e.g. files tagged alike by security tooling or rsync -X.
+ */
+typedef struct xattr_block {
+    uint32_t magic;  /**< XATTR_MAGIC. */
+    uint32_t hash;   /**< CRC32C of the rest of the block, used to find identical blocks. */
+} xattr_block_t;
+
+/**
+ * @brief Reads the value of an extended attribute.
+ *
+ * An inode without the INODE_XATTRS flag is answered at once. Attributes stored in the inode
+ * need no block reads; only attributes in the shared block do.
+ *
+ * @param node The inode.
+ * @param name The attribute name, with its namespace prefix (e.g. "user.origin").
+ * @param value The buffer to receive the value (not NUL-terminated).
+ * @param size The size of `value`, or 0 to only ask for the value's length.
+ * @return The length of the value, -ENODATA if the attribute does not exist, or -ERANGE if
+ *         `size` is too small.
+ */
+int xattr_get(inode_t *node, const char *name, void *value, size_t size);
+
+/**
+ * @brief Creates or replaces an extended attribute.
+ *
+ * The inode's attributes are repacked: the smallest go in the inode itself, and the rest in a
+ * shared block. If another inode already has a block with exactly the same contents, that
+ * block is shared instead of a new one being written. Changes are journaled.
+ *
+ * @param node The inode.
+ * @param name The attribute name, with its namespace prefix.
+ * @param value The value (may contain any bytes).
+ * @param size The length of `value`.
+ * @param flags 0, XATTR_CREATE (fail if the attribute exists) or XATTR_REPLACE (fail if it
+ *              does not).
+ * @return 0 on success, -EEXIST or -ENODATA as `flags` demand, -EINVAL or -ERANGE for a bad
+ *         name, or -ENOSPC if the attributes would not fit in the inode and one block.
+ */
+int xattr_set(inode_t *node, const char *name, const void *value, size_t size, int flags);
+
+/**
+ * @brief Lists the names of an inode's extended attributes.
+ *
+ * @param node The inode.
+ * @param list The buffer to receive the names, each NUL-terminated, one after the other.
+ * @param size The size of `list`, or 0 to only ask for the length of the list.
+ * @return The length of the list, or -ERANGE if `size` is too small.
+ */
+int xattr_list(inode_t *node, char *list, size_t size);
+
+/**
+ * @brief Removes an extended attribute.
+ *
+ * @param node The inode.
+ * @param name The attribute name, with its namespace prefix.
+ * @return 0 on success, or -ENODATA if the attribute does not exist.
+ */
+int xattr_remove(inode_t *node, const char *name);
+
+/**
+ * @brief Drops an inode's reference to its shared attribute block, if it has one.
+ *
+ * Called when the inode is freed.
+ *
+ * @param node The inode.
+ */
+void xattr_free(inode_t *node);
+
+#endif